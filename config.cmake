@@ -1,2 +1,2 @@
-HHVM_EXTENSION(mongo src/ext_mongo.cpp src/stringprintf.cpp src/io_stream.cpp src/log.cpp src/mcon/parse.c src/mcon/bson_helpers.c src/mcon/manager.c src/mcon/read_preference.c src/mcon/collection.c src/mcon/mini_bson.c src/mcon/str.c src/mcon/connections.c src/mcon/parse.c src/mcon/utils.c src/mcon/contrib/md5.c src/mcon/contrib/strndup.c)
+HHVM_EXTENSION(mongo src/ext_mongo.cpp src/bson.cpp src/stringprintf.cpp src/io_stream.cpp src/async_event.cpp src/log.cpp src/mcon/parse.c src/mcon/bson_helpers.c src/mcon/manager.c src/mcon/read_preference.c src/mcon/collection.c src/mcon/mini_bson.c src/mcon/intern.c src/mcon/bson_validate.c src/mcon/str.c src/mcon/buffer.c src/mcon/packet.c src/mcon/mux.c src/mcon/async.c src/mcon/multi.c src/mcon/pool.c src/mcon/table.c src/mcon/topology.c src/mcon/monitor.c src/mcon/selection.c src/mcon/io.c src/mcon/connections.c src/mcon/reply.c src/mcon/parse.c src/mcon/utils.c src/mcon/contrib/md5.c src/mcon/contrib/strndup.c)
 HHVM_SYSTEMLIB(mongo src/ext_mongo.php)
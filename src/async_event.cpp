@@ -0,0 +1,178 @@
+/**
+ *  Copyright 2009-2014 MongoDB, Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include "async_event.h"
+#include "ext_mongo.h"
+#include "mcon/async.h"
+#include "mcon/buffer.h"
+#include "mcon/bson_helpers.h"
+
+namespace HPHP {
+
+MongoAsyncEvent::MongoAsyncEvent(MongoReplyHandler handler)
+    : handler_(handler), retval_(0), data_buffer_(nullptr), error_message_(nullptr)
+{
+}
+
+MongoAsyncEvent::~MongoAsyncEvent()
+{
+    /* Only set if the event was abandoned before it was unserialized */
+    if (data_buffer_) {
+        mongo_buffer_free(data_buffer_);
+    }
+    free(error_message_);
+}
+
+/* Runs on an async thread, which mustn't touch PHP values */
+void MongoAsyncEvent::finished(void *context, int retval, char *data_buffer, char *error_message)
+{
+    MongoAsyncEvent *event = (MongoAsyncEvent *)context;
+
+    event->retval_ = retval;
+    event->data_buffer_ = data_buffer;
+    event->error_message_ = error_message;
+    event->markAsFinished();
+}
+
+void MongoAsyncEvent::unserialize(Cell& result)
+{
+    if (!retval_) {
+        Array params = Array::Create();
+        params.append(Variant(String(error_message_)));
+        params.append(Variant(0));
+        Object e = create_object("MongoCursorException", params, true);
+        throw e;
+    }
+
+    Variant value = handler_(data_buffer_);
+    mongo_buffer_free(data_buffer_);
+    data_buffer_ = nullptr;
+    cellDup(*value.asCell(), result);
+}
+
+Object php_mongo_async_submit(mongo_connection *con, mongo_packet *packet, int budget_ms, MongoReplyHandler handler)
+{
+    MongoAsyncEvent *event = new MongoAsyncEvent(handler);
+    char *error_message = nullptr;
+
+    /* The wait handle has to exist before the operation can finish */
+    Object wait_handle(event->getWaitHandle());
+
+    if (!mongo_async_submit(s_mongo_extension.manager_, con, packet, budget_ms, MongoAsyncEvent::finished, event, &error_message)) {
+        mongo_packet_dtor(packet);
+        event->abandon();
+
+        Array params = Array::Create();
+        params.append(Variant(String(error_message)));
+        params.append(Variant(0));
+        free(error_message);
+        Object e = create_object("MongoConnectionException", params, true);
+        throw e;
+    }
+
+    return wait_handle;
+}
+
+Variant php_mongo_reply_first_document(const char *data_buffer)
+{
+    int32_t length;
+
+    /* An empty reply only holds the zero length that ends every reply */
+    memcpy(&length, data_buffer, sizeof(int32_t));
+    if (length == 0) {
+        return init_null();
+    }
+    /* mongo_connection_read_reply() has checked the documents already */
+    return php_mongo_bson_decode(data_buffer, MONGO_32(length), true);
+}
+
+Variant php_mongo_reply_first_lazy_document(const char *data_buffer)
+{
+    int32_t length;
+
+    memcpy(&length, data_buffer, sizeof(int32_t));
+    if (length == 0) {
+        return init_null();
+    }
+    /* The document is copied once, as the reply's buffer goes back to the
+     * pool when the operation is done */
+    return php_mongo_lazy_document(String(data_buffer, MONGO_32(length), CopyString), 0);
+}
+
+Variant php_mongo_reply_documents(const char *data_buffer)
+{
+    Array documents = Array::Create();
+    int32_t length;
+
+    for (;;) {
+        memcpy(&length, data_buffer, sizeof(int32_t));
+        length = MONGO_32(length);
+        if (length == 0) {
+            break;
+        }
+        documents.append(php_mongo_bson_decode(data_buffer, length, true));
+        data_buffer += length;
+    }
+
+    return documents;
+}
+
+Variant php_mongo_reply_lazy_documents(const char *data_buffer)
+{
+    Array documents = Array::Create();
+    int32_t length;
+    int size = 0;
+
+    /* All documents share one copy of the batch */
+    for (;;) {
+        memcpy(&length, data_buffer + size, sizeof(int32_t));
+        length = MONGO_32(length);
+        if (length == 0) {
+            break;
+        }
+        size += length;
+    }
+
+    String batch(data_buffer, size, CopyString);
+    for (int offset = 0; offset < size; offset += length) {
+        memcpy(&length, data_buffer + offset, sizeof(int32_t));
+        length = MONGO_32(length);
+        documents.append(php_mongo_lazy_document(batch, offset));
+    }
+
+    return documents;
+}
+
+const StaticString
+    s_err("err"),
+    s_code("code");
+
+Variant php_mongo_reply_last_error(const char *data_buffer)
+{
+    Variant response = php_mongo_reply_first_document(data_buffer);
+
+    if (response.isArray() && response.toArray().exists(s_err) && !response.toArray()[s_err].isNull()) {
+        Array params = Array::Create();
+        params.append(Variant(response.toArray()[s_err].toString()));
+        params.append(Variant(response.toArray().exists(s_code) ? response.toArray()[s_code].toInt64() : 0));
+        Object e = create_object("MongoCursorException", params, true);
+        throw e;
+    }
+
+    return response;
+}
+
+}
@@ -0,0 +1,78 @@
+/**
+ *  Copyright 2009-2014 MongoDB, Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef MONGO_ASYNC_EVENT_H
+#define MONGO_ASYNC_EVENT_H
+
+#include "hphp/runtime/base/base-includes.h"
+#include "hphp/runtime/ext/asio/asio_external_thread_event.h"
+#include "mcon/types.h"
+#include "mcon/packet.h"
+
+namespace HPHP {
+
+/* Turns a reply into what the awaiting code gets. Called on the request
+ * thread, with the reply's data_buffer, which starts at the first document. */
+typedef Variant (*MongoReplyHandler)(const char *data_buffer);
+
+/* The wait handle behind the gen* methods. The operation runs on one of
+ * mcon's async threads (see mcon/async.c), which only stores the reply and
+ * marks the event finished; PHP values are made in unserialize(), on the
+ * request thread that awaits it. */
+class MongoAsyncEvent : public AsioExternalThreadEvent {
+public:
+    explicit MongoAsyncEvent(MongoReplyHandler handler);
+
+    /* The mongo_async_callback_t for mongo_async_submit() */
+    static void finished(void *context, int retval, char *data_buffer, char *error_message);
+
+protected:
+    virtual ~MongoAsyncEvent();
+    virtual void unserialize(Cell& result);
+
+private:
+    MongoReplyHandler handler_;
+    int retval_;
+    char *data_buffer_;
+    char *error_message_;
+};
+
+/* Runs packet on con's server in the background, and returns the wait handle
+ * that the reply is handed to handler through. budget_ms limits the
+ * operation, see mongo_connection_set_budget(), or is 0. Takes over the
+ * packet. Throws a MongoConnectionException if the operation couldn't be
+ * started. */
+Object php_mongo_async_submit(mongo_connection *con, mongo_packet *packet, int budget_ms, MongoReplyHandler handler);
+
+/* The first document of a reply, for findOne() and commands */
+Variant php_mongo_reply_first_document(const char *data_buffer);
+
+/* The same as a MongoLazyDocument */
+Variant php_mongo_reply_first_lazy_document(const char *data_buffer);
+
+/* Every document of a reply, for the first batch of a query */
+Variant php_mongo_reply_documents(const char *data_buffer);
+
+/* The same as MongoLazyDocuments */
+Variant php_mongo_reply_lazy_documents(const char *data_buffer);
+
+/* The getLastError response that acknowledges a write. Throws a
+ * MongoCursorException if the write failed. */
+Variant php_mongo_reply_last_error(const char *data_buffer);
+
+}
+
+#endif
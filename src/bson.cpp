@@ -0,0 +1,671 @@
+/**
+ *  Copyright 2009-2014 MongoDB, Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include <climits>
+#include "ext_mongo.h"
+#include "hphp/runtime/base/static-string-table.h"
+#include "mcon/mini_bson.h"
+#include "mcon/bson_helpers.h"
+#include "mcon/bson_validate.h"
+#include "mcon/intern.h"
+
+namespace HPHP {
+
+const StaticString
+    s_MongoLazyDocument("MongoLazyDocument"),
+    s_bson("__bson"),
+    s_offset("__offset"),
+    s_index("__index"),
+    s_list("__list"),
+    s_MongoId("MongoId"),
+    s_id("$id"),
+    s_ref("$ref"),
+    s_MongoDate("MongoDate"),
+    s_sec("sec"),
+    s_usec("usec"),
+    s_MongoBinData("MongoBinData"),
+    s_bin("bin"),
+    s_type("type"),
+    s_MongoRegex("MongoRegex"),
+    s_regex("regex"),
+    s_flags("flags"),
+    s_MongoCode("MongoCode"),
+    s_code("code"),
+    s_scope("scope"),
+    s_MongoTimestamp("MongoTimestamp"),
+    s_inc("inc"),
+    s_MongoMinKey("MongoMinKey"),
+    s_MongoMaxKey("MongoMaxKey");
+
+static String php_mongo_lazy_document_bson(ObjectData *doc, int *offset);
+
+/* MongoDB doesn't take documents that are nested deeper than this */
+#define PHP_MONGO_BSON_MAX_DEPTH 100
+
+static void php_mongo_bson_throw(const char *message)
+{
+    Array params = Array::Create();
+    params.append(Variant(String(message)));
+    params.append(Variant(0));
+    Object e = create_object("MongoException", params, true);
+    throw e;
+}
+
+/* Arrays whose keys are 0, 1, 2... in order are written as BSON arrays, any
+ * other array as a document */
+static bool php_mongo_bson_is_list(const ArrayData *ad)
+{
+    return ad->isPacked() || ad->isVectorData();
+}
+
+/* The driver's classes are written as the types that they are decoded from,
+ * any other object as a document of its public properties */
+static int php_mongo_bson_object_type(ObjectData *o)
+{
+    if (o->o_instanceof(s_MongoLazyDocument)) {
+        return o->o_get(s_list, false, s_MongoLazyDocument.get()).toBoolean() ? BSON_ARRAY : BSON_DOCUMENT;
+    }
+    if (o->o_instanceof(s_MongoId)) {
+        return BSON_OBJECT_ID;
+    }
+    if (o->o_instanceof(s_MongoDate)) {
+        return BSON_DATETIME;
+    }
+    if (o->o_instanceof(s_MongoBinData)) {
+        return BSON_BINARY;
+    }
+    if (o->o_instanceof(s_MongoRegex)) {
+        return BSON_REGEXP;
+    }
+    if (o->o_instanceof(s_MongoCode)) {
+        /* Code without a scope has a NULL one, see php_mongo_bson_read_value() */
+        return o->o_get(s_scope, false).isNull() ? BSON_JAVASCRIPT : BSON_JAVASCRIPT_WITH_SCOPE;
+    }
+    if (o->o_instanceof(s_MongoTimestamp)) {
+        return BSON_TIMESTAMP;
+    }
+    if (o->o_instanceof(s_MongoMinKey)) {
+        return BSON_MIN_KEY;
+    }
+    if (o->o_instanceof(s_MongoMaxKey)) {
+        return BSON_MAX_KEY;
+    }
+    return BSON_DOCUMENT;
+}
+
+/* The BSON type that value is written as. Integers that fit in 32 bits are
+ * written as int32s, so that they stay ints for other drivers. */
+static int php_mongo_bson_type(const Variant& value)
+{
+    switch (value.getType()) {
+        case KindOfUninit:
+        case KindOfNull:
+            return BSON_NULL;
+        case KindOfBoolean:
+            return BSON_BOOLEAN;
+        case KindOfInt64: {
+            int64_t i = value.toInt64();
+            return i == (int32_t)i ? BSON_INT32 : BSON_INT64;
+        }
+        case KindOfDouble:
+            return BSON_DOUBLE;
+        case KindOfStaticString:
+        case KindOfString:
+            return BSON_STRING;
+        case KindOfArray:
+            return php_mongo_bson_is_list(value.getArrayData()) ? BSON_ARRAY : BSON_DOCUMENT;
+        case KindOfObject:
+            return php_mongo_bson_object_type(value.getObjectData());
+        default:
+            php_mongo_bson_throw("Unsupported type: resources can't be stored in documents");
+    }
+    return 0;
+}
+
+static void php_mongo_bson_write_value(mcon_str *str, int type, const Variant& value, int depth);
+
+/* The fast path: the keys of lists come from the index key table, and their
+ * elements are read by position */
+static void php_mongo_bson_write_list(mcon_str *str, const ArrayData *ad, int depth)
+{
+    int offset, i = 0;
+
+    offset = bson_begin_document(str);
+    for (ssize_t pos = ad->iter_begin(); pos != ad->iter_end(); pos = ad->iter_advance(pos), i++) {
+        const Variant& item = ad->getValueRef(pos);
+        int type = php_mongo_bson_type(item);
+
+        bson_add_index_key(str, type, i);
+        php_mongo_bson_write_value(str, type, item, depth);
+    }
+    bson_end_document(str, offset);
+}
+
+/* The keys of strings go in as they are, without copying them out of their
+ * StringData */
+static void php_mongo_bson_write_map(mcon_str *str, const Array& arr, int depth)
+{
+    int offset;
+
+    offset = bson_begin_document(str);
+    for (ArrayIter iter(arr); iter; ++iter) {
+        Variant key = iter.first();
+        const Variant& item = iter.secondRef();
+        int type = php_mongo_bson_type(item);
+
+        if (key.isInteger()) {
+            int64_t index = key.toInt64();
+
+            if (index >= 0 && index <= INT_MAX) {
+                bson_add_index_key(str, type, (int)index);
+            } else {
+                String name = key.toString();
+                bson_add_key(str, type, (char *)name.data(), name.size());
+            }
+        } else {
+            StringData *name = key.getStringData();
+
+            if (memchr(name->data(), '\0', name->size())) {
+                php_mongo_bson_throw("Keys can't contain null bytes");
+            }
+            if (!bson_utf8_valid(name->data(), name->size())) {
+                php_mongo_bson_throw("Keys have to be valid UTF-8");
+            }
+            bson_add_key(str, type, (char *)name->data(), name->size());
+        }
+        php_mongo_bson_write_value(str, type, item, depth);
+    }
+    bson_end_document(str, offset);
+}
+
+static int php_mongo_bson_hex_digit(char c)
+{
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    if (c >= 'A' && c <= 'F') {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+static void php_mongo_bson_write_id(mcon_str *str, const String& id)
+{
+    char bytes[12];
+
+    if (id.size() != 24) {
+        php_mongo_bson_throw("MongoIds have to be 24 hexadecimal digits");
+    }
+    for (int i = 0; i < 12; i++) {
+        int high = php_mongo_bson_hex_digit(id[i * 2]), low = php_mongo_bson_hex_digit(id[i * 2 + 1]);
+
+        if (high < 0 || low < 0) {
+            php_mongo_bson_throw("MongoIds have to be 24 hexadecimal digits");
+        }
+        bytes[i] = (high << 4) | low;
+    }
+    mcon_str_addl(str, bytes, 12, 0);
+}
+
+/* Regular expressions and their flags are cstrings */
+static void php_mongo_bson_write_cstring(mcon_str *str, const String& s)
+{
+    if (memchr(s.data(), '\0', s.size())) {
+        php_mongo_bson_throw("Regular expressions can't contain null bytes");
+    }
+    mcon_str_addl(str, (char *)s.data(), s.size() + 1, 0);
+}
+
+/* A lazy document is still the BSON it was made from, which is copied as it
+ * is */
+static void php_mongo_bson_write_lazy_document(mcon_str *str, ObjectData *doc)
+{
+    int offset;
+    int32_t length;
+    String bson = php_mongo_lazy_document_bson(doc, &offset);
+
+    memcpy(&length, bson.data() + offset, sizeof(int32_t));
+    mcon_str_addl(str, (char *)bson.data() + offset, MONGO_32(length), 0);
+}
+
+static void php_mongo_bson_write_value(mcon_str *str, int type, const Variant& value, int depth)
+{
+    char b;
+
+    switch (type) {
+        case BSON_NULL:
+        case BSON_MIN_KEY:
+        case BSON_MAX_KEY:
+            break;
+        case BSON_BOOLEAN:
+            b = value.toBoolean() ? 1 : 0;
+            mcon_str_addl(str, &b, 1, 0);
+            break;
+        case BSON_INT32:
+            mcon_serialize_int32(str, (int32_t)value.toInt64());
+            break;
+        case BSON_INT64:
+            mcon_serialize_int64(str, value.toInt64());
+            break;
+        case BSON_DOUBLE:
+            mcon_serialize_double(str, value.toDouble());
+            break;
+        case BSON_STRING: {
+            StringData *s = value.getStringData();
+            if (!bson_utf8_valid(s->data(), s->size())) {
+                php_mongo_bson_throw("Strings have to be valid UTF-8");
+            }
+            bson_add_string_value(str, (char *)s->data(), s->size());
+            break;
+        }
+        case BSON_ARRAY:
+        case BSON_DOCUMENT:
+            if (depth >= PHP_MONGO_BSON_MAX_DEPTH) {
+                php_mongo_bson_throw("Documents can't be nested more than 100 levels deep");
+            }
+            if (value.isObject() && value.getObjectData()->o_instanceof(s_MongoLazyDocument)) {
+                php_mongo_bson_write_lazy_document(str, value.getObjectData());
+            } else if (value.isObject()) {
+                /* Objects are written as a document of their public
+                 * properties */
+                php_mongo_bson_write_map(str, value.toObject()->o_toIterArray(null_string), depth + 1);
+            } else if (type == BSON_ARRAY) {
+                php_mongo_bson_write_list(str, value.getArrayData(), depth + 1);
+            } else {
+                php_mongo_bson_write_map(str, value.toArray(), depth + 1);
+            }
+            break;
+        case BSON_OBJECT_ID:
+            php_mongo_bson_write_id(str, value.getObjectData()->o_get(s_id, false).toString());
+            break;
+        case BSON_DATETIME: {
+            ObjectData *o = value.getObjectData();
+
+            mcon_serialize_int64(str, o->o_get(s_sec, false).toInt64() * 1000 + o->o_get(s_usec, false).toInt64() / 1000);
+            break;
+        }
+        case BSON_BINARY: {
+            ObjectData *o = value.getObjectData();
+            String bin = o->o_get(s_bin, false).toString();
+            int subtype = o->o_get(s_type, false).toInt32();
+
+            b = subtype;
+            /* The old binary subtype repeats the length */
+            if (subtype == 0x02) {
+                mcon_serialize_int32(str, bin.size() + 4);
+                mcon_str_addl(str, &b, 1, 0);
+                mcon_serialize_int32(str, bin.size());
+            } else {
+                mcon_serialize_int32(str, bin.size());
+                mcon_str_addl(str, &b, 1, 0);
+            }
+            mcon_str_addl(str, (char *)bin.data(), bin.size(), 0);
+            break;
+        }
+        case BSON_REGEXP: {
+            ObjectData *o = value.getObjectData();
+
+            php_mongo_bson_write_cstring(str, o->o_get(s_regex, false).toString());
+            php_mongo_bson_write_cstring(str, o->o_get(s_flags, false).toString());
+            break;
+        }
+        case BSON_JAVASCRIPT: {
+            String code = value.getObjectData()->o_get(s_code, false).toString();
+
+            bson_add_string_value(str, (char *)code.data(), code.size());
+            break;
+        }
+        case BSON_JAVASCRIPT_WITH_SCOPE: {
+            /* The total length, the code as a string, then the scope */
+            ObjectData *o = value.getObjectData();
+            String code = o->o_get(s_code, false).toString();
+            int offset = str->l;
+            int32_t length;
+
+            mcon_serialize_int32(str, 0);
+            bson_add_string_value(str, (char *)code.data(), code.size());
+            php_mongo_bson_write_value(str, BSON_DOCUMENT, o->o_get(s_scope, false), depth);
+
+            length = MONGO_32(str->l - offset);
+            memcpy(str->d + offset, &length, sizeof(int32_t));
+            break;
+        }
+        case BSON_TIMESTAMP: {
+            ObjectData *o = value.getObjectData();
+
+            mcon_serialize_int32(str, (int32_t)o->o_get(s_inc, false).toInt64());
+            mcon_serialize_int32(str, (int32_t)o->o_get(s_sec, false).toInt64());
+            break;
+        }
+    }
+}
+
+void php_mongo_bson_encode(const Variant& value, mcon_str *str)
+{
+    int type = php_mongo_bson_type(value);
+
+    if (type != BSON_DOCUMENT && type != BSON_ARRAY) {
+        php_mongo_bson_throw("Documents have to be arrays or objects");
+    }
+
+    /* A list at the top is the same as a document with keys "0", "1"... */
+    php_mongo_bson_write_value(str, type, value, 0);
+}
+
+void php_mongo_bson_encode_value(const Variant& value, mcon_str *str)
+{
+    php_mongo_bson_write_value(str, php_mongo_bson_type(value), value, 0);
+}
+
+/* Decoding */
+static int32_t php_mongo_bson_int32(const char *data)
+{
+    int32_t i;
+
+    memcpy(&i, data, sizeof(int32_t));
+    return MONGO_32(i);
+}
+
+static int64_t php_mongo_bson_int64(const char *data)
+{
+    int64_t i;
+
+    memcpy(&i, data, sizeof(int64_t));
+    return MONGO_64(i);
+}
+
+/* The driver's classes for the types that PHP doesn't have are made without
+ * calling their constructors, with the properties that they have in the PHP
+ * driver */
+static Object php_mongo_bson_object(const StaticString& class_name)
+{
+    return create_object_only(class_name);
+}
+
+static Object php_mongo_bson_read_id(const char *data)
+{
+    static const char hex[] = "0123456789abcdef";
+    char id[24];
+
+    for (int i = 0; i < 12; i++) {
+        id[i * 2] = hex[(data[i] >> 4) & 0x0f];
+        id[i * 2 + 1] = hex[data[i] & 0x0f];
+    }
+
+    Object o = php_mongo_bson_object(s_MongoId);
+    o->o_set(s_id, String(id, 24, CopyString));
+    return o;
+}
+
+static Array php_mongo_bson_read_document(const char *data, bool list);
+
+/* The value of an element of type, which starts at data. Nested documents
+ * are lazy documents on lazy_bson if it's given, which data is in. */
+static Variant php_mongo_bson_read_value(int type, const char *data, const String *lazy_bson)
+{
+    switch (type) {
+        case BSON_DOUBLE: {
+            double d;
+            memcpy(&d, data, sizeof(double));
+            return d;
+        }
+        case BSON_STRING:
+        case BSON_SYMBOL:
+            return String(data + 4, php_mongo_bson_int32(data) - 1, CopyString);
+        case BSON_DOCUMENT:
+        case BSON_ARRAY:
+            if (lazy_bson) {
+                Object doc = php_mongo_lazy_document(*lazy_bson, data - lazy_bson->data());
+
+                /* So that it's written back as an array */
+                if (type == BSON_ARRAY) {
+                    doc->o_set(s_list, true, s_MongoLazyDocument.get());
+                }
+                return doc;
+            }
+            return php_mongo_bson_read_document(data + 4, type == BSON_ARRAY);
+        case BSON_BINARY: {
+            int32_t length = php_mongo_bson_int32(data);
+            int subtype = (unsigned char)data[4];
+            const char *bin = data + 5;
+
+            /* The old binary subtype repeats the length */
+            if (subtype == 0x02 && length >= 4) {
+                bin += 4;
+                length -= 4;
+            }
+            Object o = php_mongo_bson_object(s_MongoBinData);
+            o->o_set(s_bin, String(bin, length, CopyString));
+            o->o_set(s_type, subtype);
+            return o;
+        }
+        case BSON_OBJECT_ID:
+            return php_mongo_bson_read_id(data);
+        case BSON_BOOLEAN:
+            return data[0] != 0;
+        case BSON_DATETIME: {
+            int64_t ms = php_mongo_bson_int64(data), sec = ms / 1000, msec = ms % 1000;
+
+            if (msec < 0) {
+                sec--;
+                msec += 1000;
+            }
+            Object o = php_mongo_bson_object(s_MongoDate);
+            o->o_set(s_sec, sec);
+            o->o_set(s_usec, msec * 1000);
+            return o;
+        }
+        case BSON_REGEXP: {
+            Object o = php_mongo_bson_object(s_MongoRegex);
+            o->o_set(s_regex, String(data, CopyString));
+            o->o_set(s_flags, String(data + strlen(data) + 1, CopyString));
+            return o;
+        }
+        case BSON_DBPOINTER: {
+            Array ref = Array::Create();
+            int32_t length = php_mongo_bson_int32(data);
+
+            ref.set(s_ref, String(data + 4, length - 1, CopyString));
+            ref.set(s_id, php_mongo_bson_read_id(data + 4 + length));
+            return ref;
+        }
+        case BSON_JAVASCRIPT: {
+            Object o = php_mongo_bson_object(s_MongoCode);
+            o->o_set(s_code, String(data + 4, php_mongo_bson_int32(data) - 1, CopyString));
+            o->o_set(s_scope, init_null());
+            return o;
+        }
+        case BSON_JAVASCRIPT_WITH_SCOPE: {
+            /* The total length, the code as a string, then the scope */
+            int32_t length = php_mongo_bson_int32(data + 4);
+            Object o = php_mongo_bson_object(s_MongoCode);
+            o->o_set(s_code, String(data + 8, length - 1, CopyString));
+            o->o_set(s_scope, php_mongo_bson_read_document(data + 8 + length + 4, false));
+            return o;
+        }
+        case BSON_INT32:
+            return php_mongo_bson_int32(data);
+        case BSON_TIMESTAMP: {
+            Object o = php_mongo_bson_object(s_MongoTimestamp);
+            o->o_set(s_inc, (int64_t)(uint32_t)php_mongo_bson_int32(data));
+            o->o_set(s_sec, (int64_t)(uint32_t)php_mongo_bson_int32(data + 4));
+            return o;
+        }
+        case BSON_INT64:
+            return php_mongo_bson_int64(data);
+        case BSON_MIN_KEY:
+            return php_mongo_bson_object(s_MongoMinKey);
+        case BSON_MAX_KEY:
+            return php_mongo_bson_object(s_MongoMaxKey);
+        case BSON_UNDEFINED:
+        case BSON_NULL:
+        default:
+            return init_null();
+    }
+}
+
+/* The name of a field as a PHP string. Names that come up often get a static
+ * string in the intern table, which every document that has them shares,
+ * see intern.h. */
+static String php_mongo_bson_key(const char *name, int length)
+{
+    mongo_intern_slot *slot = mongo_intern_lookup(name, length);
+    StringData *key;
+
+    if (!slot) {
+        return String(name, length, CopyString);
+    }
+
+    key = (StringData *)mongo_intern_value(slot);
+    if (!key) {
+        key = (StringData *)mongo_intern_set_value(slot, makeStaticString(name, length));
+    }
+    return String(key);
+}
+
+/* Decodes the elements that start at data, right after a document's length.
+ * The elements of BSON arrays are appended, as their keys are 0, 1, 2... */
+static Array php_mongo_bson_read_document(const char *data, bool list)
+{
+    Array arr = Array::Create();
+    char *element = (char *)data, *name;
+    const char *value;
+    int type;
+
+    while ((value = (const char *)bson_get_current(element, &name, &type))) {
+        if (list) {
+            arr.append(php_mongo_bson_read_value(type, value, nullptr));
+        } else {
+            arr.set(php_mongo_bson_key(name, value - name - 1), php_mongo_bson_read_value(type, value, nullptr));
+        }
+        element = bson_next(element);
+    }
+
+    return arr;
+}
+
+/* Checks the document at data, which has to fit in size bytes, with its
+ * strings, before anything reads it */
+static void php_mongo_bson_validate(const char *data, int size)
+{
+    char *error_message = NULL;
+
+    if (!bson_validate_document((char *)data, size, BSON_VALIDATE_STRUCTURE | BSON_VALIDATE_UTF8, &error_message)) {
+        String message(error_message, CopyString);
+        free(error_message);
+        php_mongo_bson_throw(message.data());
+    }
+}
+
+Array php_mongo_bson_decode(const char *data, int size, bool checked)
+{
+    if (!checked) {
+        php_mongo_bson_validate(data, size);
+    }
+    return php_mongo_bson_read_document(data + 4, false);
+}
+
+/* Lazy documents
+ *
+ * A MongoLazyDocument holds on to the string that its BSON is in, and the
+ * offset of the document in it, which may be a nested one: the documents
+ * nested in a lazy document are lazy documents on the same string. The
+ * offsets of its fields are found on the first access, and a field is only
+ * decoded when it's read. */
+Object php_mongo_lazy_document(const String& bson, int offset)
+{
+    Object doc = php_mongo_bson_object(s_MongoLazyDocument);
+
+    doc->o_set(s_bson, bson, s_MongoLazyDocument.get());
+    doc->o_set(s_offset, offset, s_MongoLazyDocument.get());
+    return doc;
+}
+
+void php_mongo_lazy_document_init(ObjectData *doc, const String& bson)
+{
+    php_mongo_bson_validate(bson.data(), bson.size());
+    doc->o_set(s_bson, bson, s_MongoLazyDocument.get());
+    doc->o_set(s_offset, 0, s_MongoLazyDocument.get());
+}
+
+static String php_mongo_lazy_document_bson(ObjectData *doc, int *offset)
+{
+    *offset = doc->o_get(s_offset, true, s_MongoLazyDocument.get()).toInt32();
+    return doc->o_get(s_bson, true, s_MongoLazyDocument.get()).toString();
+}
+
+/* Field name => offset of its element, made in one pass over the names */
+static Array php_mongo_lazy_document_index(ObjectData *doc)
+{
+    Variant cached = doc->o_get(s_index, true, s_MongoLazyDocument.get());
+    int offset;
+
+    if (cached.isArray()) {
+        return cached.toArray();
+    }
+
+    String bson = php_mongo_lazy_document_bson(doc, &offset);
+    Array index = Array::Create();
+    char *element = (char *)bson.data() + offset + 4, *name;
+    int type;
+
+    while (bson_get_current(element, &name, &type)) {
+        index.set(php_mongo_bson_key(name, strlen(name)), (int64_t)(element - bson.data()));
+        element = bson_next(element);
+    }
+
+    doc->o_set(s_index, index, s_MongoLazyDocument.get());
+    return index;
+}
+
+bool php_mongo_lazy_document_exists(ObjectData *doc, const Variant& name)
+{
+    return php_mongo_lazy_document_index(doc).exists(name);
+}
+
+Variant php_mongo_lazy_document_get(ObjectData *doc, const Variant& name)
+{
+    Array index = php_mongo_lazy_document_index(doc);
+    char *field_name;
+    const char *value;
+    int offset, type;
+
+    if (!index.exists(name)) {
+        return init_null();
+    }
+
+    String bson = php_mongo_lazy_document_bson(doc, &offset);
+    value = (const char *)bson_get_current((char *)bson.data() + index[name].toInt32(), &field_name, &type);
+    return php_mongo_bson_read_value(type, value, &bson);
+}
+
+int64_t php_mongo_lazy_document_count(ObjectData *doc)
+{
+    return php_mongo_lazy_document_index(doc).size();
+}
+
+Array php_mongo_lazy_document_to_array(ObjectData *doc)
+{
+    int offset;
+    String bson = php_mongo_lazy_document_bson(doc, &offset);
+
+    return php_mongo_bson_read_document(bson.data() + offset + 4, false);
+}
+
+}
@@ -1,11 +1,23 @@
 // Copyright (c) 2014. All rights reserved.
 
+#include <climits>
+#include <vector>
+
 #include "stringprintf.h"
 #include "mcon/types.h"
 #include "mcon/parse.h"
 #include "mcon/manager.h"
+#include "mcon/connections.h"
+#include "mcon/pool.h"
+#include "mcon/monitor.h"
+#include "mcon/multi.h"
+#include "mcon/buffer.h"
+#include "mcon/bson_helpers.h"
+#include "mcon/read_preference.h"
+#include "mcon/io.h"
 #include "ext_mongo.h"
 #include "io_stream.h"
+#include "async_event.h"
 #include "log.h"
 
 namespace HPHP {
@@ -13,7 +25,50 @@ namespace HPHP {
 const StaticString 
     s_Mongo("Mongo"),
     s_manager("__manager"),
-    s_servers("__servers");
+    s_servers("__servers"),
+    s_in_use("in use"),
+    s_in_pool("in pool"),
+    s_remaining("remaining"),
+    s_total("total"),
+    s_timeout("timeout"),
+    s_waiting("waiting");
+
+/* {{{ Helpers for the connection pool statistics */
+static void php_mongo_pool_info_add(char *hash, mongo_pool_info *info, void *context)
+{
+    Array *pools = (Array *)context;
+    Array pool = Array::Create();
+
+    pool.set(s_in_use, info->in_use);
+    pool.set(s_in_pool, info->in_pool);
+    pool.set(s_remaining, info->remaining);
+    pool.set(s_total, info->total);
+    pool.set(s_timeout, info->timeout);
+    pool.set(s_waiting, info->waiting);
+    pools->set(String(hash), pool);
+}
+
+static Array php_mongo_pool_info()
+{
+    Array pools = Array::Create();
+
+    mongo_manager_pool_info(s_mongo_extension.manager_, php_mongo_pool_info_add, &pools);
+    return pools;
+}
+
+static void php_mongo_throw_exception(const std::string& message, int64_t code);
+
+/* For Mongo::setPoolSize() and MongoPool::setSize(). Only pools created from
+ * now on use the new size. Requests on other threads may be creating pools
+ * right now. */
+static void php_mongo_set_pool_size(int64_t size)
+{
+    if (size <= 0 || size > INT_MAX) {
+        php_mongo_throw_exception(StringPrintf("The pool size has to be between 1 and %d", INT_MAX), 0);
+    }
+    __atomic_store_n(&s_mongo_extension.manager_->pool_size, (int)size, __ATOMIC_RELAXED);
+}
+/* }}} */
 
 //////////////////////////////////////////////////////////////////////////////
 // class Mongo
@@ -23,7 +78,7 @@ static bool HHVM_METHOD(Mongo, connectUtil) {
 }
 
 static int64_t HHVM_STATIC_METHOD(Mongo, getPoolSize) {
-  throw_not_implemented("Mongo::getPoolSize");
+  return __atomic_load_n(&s_mongo_extension.manager_->pool_size, __ATOMIC_RELAXED);
 }
 
 static String HHVM_METHOD(Mongo, getSlave) {
@@ -35,11 +90,12 @@ static bool HHVM_METHOD(Mongo, getSlaveOkay) {
 }
 
 static Array HHVM_METHOD(Mongo, poolDebug) {
-  throw_not_implemented("Mongo::poolDebug");
+  return php_mongo_pool_info();
 }
 
 static bool HHVM_STATIC_METHOD(Mongo, setPoolSize, int64_t size) {
-  throw_not_implemented("Mongo::setPoolSize");
+  php_mongo_set_pool_size(size);
+  return true;
 }
 
 static bool HHVM_METHOD(Mongo, setSlaveOkay, bool ok) {
@@ -244,8 +300,10 @@ static void HHVM_METHOD(MongoClient, __construct,
 
     if (connect) {
         /* Make sure we clear any exceptions thrown if have any usable connection */
-        if (php_mongo_connect(manager, servers, MONGO_CON_FLAG_READ|MONGO_CON_FLAG_DONT_FILTER)) {
+        mongo_connection *con = php_mongo_connect(manager, servers, MONGO_CON_FLAG_READ|MONGO_CON_FLAG_DONT_FILTER);
+        if (con) {
             //zend_clear_exception(TSRMLS_C);
+            mongo_manager_connection_release(manager, con);
         }
     }
 
@@ -293,6 +351,253 @@ static Array HHVM_METHOD(MongoClient, listDBs) {
   throw_not_implemented("MongoClient::listDBs");
 }
 
+const StaticString
+    s_ns("ns"),
+    s_query("query"),
+    s_fields("fields"),
+    s_lazy("lazy"),
+    s_batchSize("batchSize"),
+    s_maxTimeMS("maxTimeMS"),
+    s_query_modifier("$query"),
+    s_maxTimeMS_modifier("$maxTimeMS"),
+    s_getlasterror("getlasterror"),
+    s_w("w"),
+    s_wtimeout("wtimeout"),
+    s_j("j"),
+    s_fsync("fsync"),
+    s_db("__db"),
+    s_client("__client"),
+    s_name("__name");
+
+static mongo_servers *php_mongo_db_servers(ObjectData *db);
+static String php_mongo_db_name(ObjectData *db);
+
+/* Throws a MongoException; throw_invalid_argument() only raises a warning */
+static void php_mongo_throw_exception(const std::string& message, int64_t code)
+{
+    Array params = Array::Create();
+    params.append(Variant(String(message)));
+    params.append(Variant(code));
+    Object e = create_object("MongoException", params, true);
+    throw e;
+}
+
+/* For objects that are used without their constructor having run, f.e.
+ * with a subclass that doesn't call parent::__construct() */
+static void php_mongo_throw_uninitialized(const char *class_name)
+{
+    php_mongo_throw_exception(StringPrintf("The %s object has not been correctly initialized by its constructor", class_name), 0);
+}
+
+/* The servers that the constructor stored on the MongoClient */
+static mongo_servers *php_mongo_client_servers(ObjectData *this_)
+{
+    mongo_servers *servers = (mongo_servers *)this_->o_get(s_servers, true, s_MongoClient.get()).toInt64();
+
+    if (!servers) {
+        php_mongo_throw_uninitialized("MongoClient");
+    }
+    return servers;
+}
+
+/* Adds an OP_QUERY for the documents in ns that match query to packet. A
+ * negative number_to_return makes the server send a single batch of at most
+ * that many documents, and close the cursor. fields is only sent if it's not
+ * null. */
+static void php_mongo_query_add(mongo_packet *packet, int flags, const String& ns, const Variant& query, const Variant& fields, int number_to_return)
+{
+    mcon_serialize_int(packet->str, flags);
+    mcon_str_addl(packet->str, (char *)ns.c_str(), ns.size() + 1, 0);
+    mcon_serialize_int(packet->str, 0); /* Number to skip */
+    mcon_serialize_int(packet->str, number_to_return);
+
+    php_mongo_bson_encode(query, packet->str);
+    if (!fields.isNull()) {
+        php_mongo_bson_encode(fields, packet->str);
+    }
+}
+
+/* A packet with just the query from php_mongo_query_add() */
+static mongo_packet *php_mongo_query_packet(mongo_servers *servers, const String& ns, const Variant& query, const Variant& fields, int number_to_return)
+{
+    mongo_packet *packet;
+
+    packet = mongo_packet_create(2004); /* OP_QUERY */
+    try {
+        php_mongo_query_add(packet, servers->read_pref.type != MONGO_RP_PRIMARY ? 0x04 : 0x00 /* SlaveOk */, ns, query, fields, number_to_return);
+    } catch (...) {
+        mongo_packet_dtor(packet);
+        throw;
+    }
+
+    return packet;
+}
+
+/* The OP_QUERY for the first document in ns that matches query, like
+ * MongoCollection::findOne() and MongoDB::command() send */
+static mongo_packet *php_mongo_find_one_packet(mongo_servers *servers, const String& ns, const Variant& query, const Variant& fields)
+{
+    return php_mongo_query_packet(servers, ns, query, fields, -1);
+}
+
+/* The budget for an operation that the server is given max_time_ms for,
+ * see mongo_connection_set_budget(). Like for the server, 0 means no limit. */
+static int php_mongo_max_time_budget(int64_t max_time_ms)
+{
+    if (max_time_ms < 0 || max_time_ms > INT_MAX - MONGO_CONNECTION_BUDGET_MARGIN) {
+        php_mongo_throw_exception(StringPrintf("'maxTimeMS' has to be between 0 and %d", INT_MAX - MONGO_CONNECTION_BUDGET_MARGIN), 0);
+    }
+    return max_time_ms ? (int)max_time_ms + MONGO_CONNECTION_BUDGET_MARGIN : 0;
+}
+
+/* The query, with the 'maxTimeMS' option as the $maxTimeMS modifier if it
+ * is in options. *budget_ms is set to go with that. */
+static Variant php_mongo_query_max_time(const Array& query, const Array& options, int *budget_ms)
+{
+    *budget_ms = 0;
+    if (!options.exists(s_maxTimeMS)) {
+        return query;
+    }
+
+    int64_t max_time_ms = options[s_maxTimeMS].toInt64();
+    Array modified = Array::Create();
+
+    *budget_ms = php_mongo_max_time_budget(max_time_ms);
+    modified.set(s_query_modifier, query);
+    modified.set(s_maxTimeMS_modifier, max_time_ms);
+    return modified;
+}
+
+/* Sends packet to the server that the read preference and flags select, in
+ * the background, see async_event.h. budget_ms is the operation's budget, or
+ * 0. Takes over the packet. */
+static Object php_mongo_gen_packet(mongo_servers *servers, int flags, mongo_packet *packet, int budget_ms, MongoReplyHandler handler)
+{
+    mongo_con_manager *manager = s_mongo_extension.manager_;
+    mongo_connection *con;
+
+    try {
+        con = php_mongo_connect(manager, servers, flags);
+    } catch (...) {
+        mongo_packet_dtor(packet);
+        throw;
+    }
+
+    /* The operation takes its own reference on the connection */
+    try {
+        Object wait_handle = php_mongo_async_submit(con, packet, budget_ms, handler);
+        mongo_manager_connection_release(manager, con);
+        return wait_handle;
+    } catch (...) {
+        mongo_manager_connection_release(manager, con);
+        throw;
+    }
+}
+
+/* Throws if options has anything that method doesn't support, rather than
+ * ignoring it. supported ends with a NULL. */
+static void php_mongo_check_options(const Array& options, const char *method, const char **supported)
+{
+    for (ArrayIter iter(options); iter; ++iter) {
+        String name = iter.first().toString();
+        int i;
+
+        for (i = 0; supported[i]; i++) {
+            if (name == String(supported[i])) {
+                break;
+            }
+        }
+        if (!supported[i]) {
+            php_mongo_throw_exception(StringPrintf("%s() doesn't support the '%s' option", method, name.c_str()), 0);
+        }
+    }
+}
+
+/* The OP_QUERY for an operation that multiExec() was given */
+static mongo_packet *php_mongo_multi_packet(mongo_servers *servers, const Array& descriptor)
+{
+    if (!descriptor.exists(s_ns)) {
+        php_mongo_throw_exception("Every operation needs an 'ns'", 0);
+    }
+
+    return php_mongo_find_one_packet(
+        servers,
+        descriptor[s_ns].toString(),
+        descriptor.exists(s_query) ? descriptor[s_query] : Variant(Array::Create()),
+        descriptor.exists(s_fields) ? descriptor[s_fields] : Variant()
+    );
+}
+
+/* Frees what mongo_multi_exec() left in ops, except the error message of
+ * the operation at keep */
+static void php_mongo_multi_free(std::vector<mongo_multi_op>& ops, int keep)
+{
+    for (int i = 0; i < (int)ops.size(); i++) {
+        if (ops[i].retval) {
+            mongo_buffer_free(ops[i].data_buffer);
+        } else if (i != keep) {
+            free(ops[i].error_message);
+        }
+        mongo_packet_dtor(ops[i].packet);
+    }
+}
+
+/* Runs the operations, each on the server that the client's read preference
+ * selects for it, and all of them at once, see mcon/multi.c. Every result
+ * is the first matching document, or NULL. If an operation fails, its error
+ * is thrown once all of them are done. */
+static Array HHVM_METHOD(MongoClient, multiExec, const Array& operations) {
+    mongo_servers *servers = php_mongo_client_servers(this_);
+    std::vector<mongo_multi_op> ops(operations.size());
+    std::vector<MongoReplyHandler> handlers(operations.size());
+    Array results = Array::Create();
+    int i = 0, failed = -1;
+
+    memset(ops.data(), 0, ops.size() * sizeof(mongo_multi_op));
+    try {
+        for (ArrayIter iter(operations); iter; ++iter, ++i) {
+            Array descriptor = iter.second().toArray();
+
+            ops[i].servers = servers;
+            ops[i].connection_flags = MONGO_CON_FLAG_READ;
+            ops[i].packet = php_mongo_multi_packet(servers, descriptor);
+            handlers[i] = descriptor.exists(s_lazy) && descriptor[s_lazy].toBoolean() ? php_mongo_reply_first_lazy_document : php_mongo_reply_first_document;
+        }
+    } catch (...) {
+        while (--i >= 0) {
+            mongo_packet_dtor(ops[i].packet);
+        }
+        throw;
+    }
+
+    mongo_multi_exec(s_mongo_extension.manager_, ops.data(), ops.size());
+
+    try {
+        for (i = 0; i < (int)ops.size(); i++) {
+            if (!ops[i].retval) {
+                failed = i;
+                break;
+            }
+            results.append(handlers[i](ops[i].data_buffer));
+        }
+    } catch (...) {
+        php_mongo_multi_free(ops, -1);
+        throw;
+    }
+    php_mongo_multi_free(ops, failed);
+
+    if (failed >= 0) {
+        Array params = Array::Create();
+        params.append(Variant(String(ops[failed].error_message)));
+        params.append(Variant(0));
+        free(ops[failed].error_message);
+        Object e = create_object("MongoCursorException", params, true);
+        throw e;
+    }
+
+    return results;
+}
+
 static Object HHVM_METHOD(MongoClient, selectCollection, const String& db, const String& collection) {
   throw_not_implemented("MongoClient::selectCollection");
 }
@@ -342,7 +647,23 @@ static Variant HHVM_METHOD(MongoCollection, batchInsert, const Array& a, const A
 }
 
 static void HHVM_METHOD(MongoCollection, __construct, const Object& db, const String& name) {
-  throw_not_implemented("MongoCollection::__construct");
+    if (name.empty()) {
+        php_mongo_throw_exception("Collection name cannot be empty", 2);
+    }
+
+    this_->o_set(s_db, db, s_MongoCollection.get());
+    this_->o_set(s_name, name, s_MongoCollection.get());
+}
+
+/* The MongoDB that the collection was created with */
+static Object php_mongo_collection_db(ObjectData *collection)
+{
+    Variant db = collection->o_get(s_db, true, s_MongoCollection.get());
+
+    if (!db.isObject()) {
+        php_mongo_throw_uninitialized("MongoCollection");
+    }
+    return db.toObject();
 }
 
 static int64_t HHVM_METHOD(MongoCollection, count, const Array& query, int64_t limit, int64_t skip) {
@@ -394,6 +715,128 @@ static Object HHVM_METHOD(MongoCollection, __get, const String& name) {
   throw_not_implemented("MongoCollection::__get");
 }
 
+/* The namespace of the collection, in the database db */
+static String php_mongo_collection_ns(ObjectData *collection, ObjectData *db)
+{
+    return php_mongo_db_name(db) + String(".") + collection->o_get(s_name, true, s_MongoCollection.get()).toString();
+}
+
+/* Like find(), but only the first batch is fetched, by one of mcon's async
+ * threads, and the documents in it come back as an array through the
+ * returned wait handle. The server closes the cursor after that batch, so
+ * no more than 'batchSize' documents are returned. With 'lazy' set, they are
+ * MongoLazyDocuments. 'maxTimeMS' limits the query on the server, and the
+ * wait for its reply. */
+static Object HHVM_METHOD(MongoCollection, genFind, const Array& query, const Array& fields, const Array& options) {
+    static const char *supported[] = { "batchSize", "lazy", "maxTimeMS", NULL };
+    Object db = php_mongo_collection_db(this_);
+    mongo_servers *servers = php_mongo_db_servers(db.get());
+    int64_t batch_size = 101; /* What the server sends in a first batch by default */
+    int budget_ms;
+    MongoReplyHandler handler = options.exists(s_lazy) && options[s_lazy].toBoolean() ? php_mongo_reply_lazy_documents : php_mongo_reply_documents;
+
+    php_mongo_check_options(options, "MongoCollection::genFind", supported);
+    if (options.exists(s_batchSize)) {
+        batch_size = options[s_batchSize].toInt64();
+        if (batch_size <= 0 || batch_size > INT_MAX) {
+            php_mongo_throw_exception(StringPrintf("The 'batchSize' option has to be between 1 and %d", INT_MAX), 0);
+        }
+    }
+
+    Variant modified = php_mongo_query_max_time(query, options, &budget_ms);
+
+    mongo_packet *packet = php_mongo_query_packet(servers, php_mongo_collection_ns(this_, db.get()), modified, fields.empty() ? Variant() : Variant(fields), -(int)batch_size);
+    return php_mongo_gen_packet(servers, MONGO_CON_FLAG_READ, packet, budget_ms, handler);
+}
+
+/* Like findOne(), but the query is run by one of mcon's async threads, and
+ * the document comes back through the returned wait handle. Of the options,
+ * only 'lazy' is supported, which returns a MongoLazyDocument, and
+ * 'maxTimeMS', like for genFind(). */
+static Object HHVM_METHOD(MongoCollection, genFindOne, const Array& query, const Array& fields, const Array& options) {
+    static const char *supported[] = { "lazy", "maxTimeMS", NULL };
+    Object db = php_mongo_collection_db(this_);
+    mongo_servers *servers = php_mongo_db_servers(db.get());
+    MongoReplyHandler handler = options.exists(s_lazy) && options[s_lazy].toBoolean() ? php_mongo_reply_first_lazy_document : php_mongo_reply_first_document;
+
+    int budget_ms;
+
+    php_mongo_check_options(options, "MongoCollection::genFindOne", supported);
+    Variant modified = php_mongo_query_max_time(query, options, &budget_ms);
+
+    mongo_packet *packet = php_mongo_find_one_packet(servers, php_mongo_collection_ns(this_, db.get()), modified, fields.empty() ? Variant() : Variant(fields));
+    return php_mongo_gen_packet(servers, MONGO_CON_FLAG_READ, packet, budget_ms, handler);
+}
+
+/* The getLastError command that acknowledges a write, with the write
+ * concern from options, or else the client's default one */
+static Array php_mongo_last_error_command(mongo_servers *servers, const Array& options)
+{
+    Array command = Array::Create();
+    Variant w;
+
+    if (options.exists(s_w)) {
+        w = options[s_w];
+    } else if (servers->options.default_wstring) {
+        w = String(servers->options.default_wstring);
+    } else {
+        w = servers->options.default_w;
+    }
+    if (!w.isString() && w.toInt64() < 1) {
+        php_mongo_throw_exception("Only acknowledged writes can be awaited, so 'w' has to be at least 1", 0);
+    }
+
+    command.set(s_getlasterror, 1);
+    if (w.isString() || w.toInt64() > 1) {
+        command.set(s_w, w);
+    }
+    if (options.exists(s_wtimeout) ? options[s_wtimeout].toInt64() > 0 : servers->options.default_wtimeout > 0) {
+        command.set(s_wtimeout, options.exists(s_wtimeout) ? options[s_wtimeout].toInt64() : (int64_t)servers->options.default_wtimeout);
+    }
+    if (options.exists(s_j) ? options[s_j].toBoolean() : servers->options.default_journal == 1) {
+        command.set(s_j, true);
+    }
+    if (options.exists(s_fsync) ? options[s_fsync].toBoolean() : servers->options.default_fsync == 1) {
+        command.set(s_fsync, true);
+    }
+
+    return command;
+}
+
+/* Like insert(), but the OP_INSERT and the getLastError that acknowledges
+ * it are sent as one packet by one of mcon's async threads, and the
+ * getLastError response comes back through the returned wait handle. Only
+ * acknowledged writes can be awaited. Unlike insert(), no _id is added to
+ * a, so documents without one get theirs from the server. */
+static Object HHVM_METHOD(MongoCollection, genInsert, const Variant& a, const Array& options) {
+    static const char *supported[] = { "w", "wtimeout", "j", "fsync", NULL };
+    Object db = php_mongo_collection_db(this_);
+    mongo_servers *servers = php_mongo_db_servers(db.get());
+    String ns = php_mongo_collection_ns(this_, db.get());
+    mongo_packet *packet;
+
+    php_mongo_check_options(options, "MongoCollection::genInsert", supported);
+    if (!a.isArray() && !a.isObject()) {
+        php_mongo_throw_exception("The document to insert has to be an array or an object", 0);
+    }
+    Array last_error = php_mongo_last_error_command(servers, options);
+
+    packet = mongo_packet_create(2002); /* OP_INSERT */
+    try {
+        mcon_serialize_int(packet->str, 0); /* Flags */
+        mcon_str_addl(packet->str, (char *)ns.c_str(), ns.size() + 1, 0);
+        php_mongo_bson_encode(a, packet->str);
+
+        mongo_packet_next_message(packet, 2004); /* OP_QUERY */
+        php_mongo_query_add(packet, 0, php_mongo_db_name(db.get()) + String(".$cmd"), last_error, Variant(), -1);
+    } catch (...) {
+        mongo_packet_dtor(packet);
+        throw;
+    }
+
+    return php_mongo_gen_packet(servers, MONGO_CON_FLAG_WRITE, packet, 0, php_mongo_reply_last_error);
+}
+
 static Array HHVM_METHOD(MongoCollection, getDBRef, const Array& ref) {
   throw_not_implemented("MongoCollection::getDBRef");
 }
@@ -677,7 +1120,28 @@ static Array HHVM_METHOD(MongoDB, command, const Array& command, const Array& op
 }
 
 static void HHVM_METHOD(MongoDB, __construct, const Object& conn, const String& name) {
-  throw_not_implemented("MongoDB::__construct");
+    if (name.empty()) {
+        php_mongo_throw_exception("Database name cannot be empty", 2);
+    }
+
+    this_->o_set(s_client, conn, s_MongoDB.get());
+    this_->o_set(s_name, name, s_MongoDB.get());
+}
+
+/* The servers of the MongoClient that the database was created with */
+static mongo_servers *php_mongo_db_servers(ObjectData *db)
+{
+    Variant client = db->o_get(s_client, true, s_MongoDB.get());
+
+    if (!client.isObject()) {
+        php_mongo_throw_uninitialized("MongoDB");
+    }
+    return php_mongo_client_servers(client.getObjectData());
+}
+
+static String php_mongo_db_name(ObjectData *db)
+{
+    return db->o_get(s_name, true, s_MongoDB.get()).toString();
 }
 
 static Object HHVM_METHOD(MongoDB, createCollection, const String& name, const Array& options) {
@@ -708,6 +1172,26 @@ static Object HHVM_METHOD(MongoDB, __get, const String& name) {
   throw_not_implemented("MongoDB::__get");
 }
 
+/* Like command(), but the command is run by one of mcon's async threads,
+ * and the response comes back through the returned wait handle. Commands go
+ * to the primary. None of command()'s options are supported yet, and
+ * passing any of them throws. A 'maxTimeMS' in the command also limits the
+ * wait for its response. */
+static Object HHVM_METHOD(MongoDB, genCommand, const Array& command, const Array& options) {
+    static const char *supported[] = { NULL };
+    mongo_servers *servers = php_mongo_db_servers(this_);
+
+    int budget_ms = 0;
+
+    php_mongo_check_options(options, "MongoDB::genCommand", supported);
+    if (command.exists(s_maxTimeMS)) {
+        budget_ms = php_mongo_max_time_budget(command[s_maxTimeMS].toInt64());
+    }
+
+    mongo_packet *packet = php_mongo_find_one_packet(servers, php_mongo_db_name(this_) + String(".$cmd"), command, Variant());
+    return php_mongo_gen_packet(servers, MONGO_CON_FLAG_WRITE, packet, budget_ms, php_mongo_reply_first_document);
+}
+
 static Array HHVM_METHOD(MongoDB, getCollectionNames, bool includeSystemCollections) {
   throw_not_implemented("MongoDB::getCollectionNames");
 }
@@ -972,6 +1456,29 @@ static String HHVM_METHOD(MongoInt64, __toString) {
   throw_not_implemented("MongoInt64::__toString");
 }
 
+//////////////////////////////////////////////////////////////////////////////
+// class MongoLazyDocument
+
+static void HHVM_METHOD(MongoLazyDocument, __construct, const String& bson) {
+    php_mongo_lazy_document_init(this_, bson);
+}
+
+static bool HHVM_METHOD(MongoLazyDocument, offsetExists, const Variant& name) {
+    return php_mongo_lazy_document_exists(this_, name);
+}
+
+static Variant HHVM_METHOD(MongoLazyDocument, offsetGet, const Variant& name) {
+    return php_mongo_lazy_document_get(this_, name);
+}
+
+static int64_t HHVM_METHOD(MongoLazyDocument, count) {
+    return php_mongo_lazy_document_count(this_);
+}
+
+static Array HHVM_METHOD(MongoLazyDocument, toArray) {
+    return php_mongo_lazy_document_to_array(this_);
+}
+
 const StaticString s_MongoLog("MongoLog");
 //////////////////////////////////////////////////////////////////////////////
 // class MongoLog
@@ -1007,15 +1514,16 @@ const StaticString s_MongoPool("MongoPool");
 // class MongoPool
 
 static int64_t HHVM_STATIC_METHOD(MongoPool, getSize) {
-  throw_not_implemented("MongoPool::getSize");
+  return __atomic_load_n(&s_mongo_extension.manager_->pool_size, __ATOMIC_RELAXED);
 }
 
 static Array HHVM_METHOD(MongoPool, info) {
-  throw_not_implemented("MongoPool::info");
+  return php_mongo_pool_info();
 }
 
 static bool HHVM_STATIC_METHOD(MongoPool, setSize, int64_t size) {
-  throw_not_implemented("MongoPool::setSize");
+  php_mongo_set_pool_size(size);
+  return true;
 }
 
 const StaticString s_MongoProtocolException("MongoProtocolException");
@@ -1110,13 +1618,33 @@ static void HHVM_FUNCTION(log_write_batch, const Array& server, const Array& wri
   throw_not_implemented("log_write_batch");
 }
 
-static Array HHVM_FUNCTION(bson_decode, const String& bson) {
-  throw_not_implemented("bson_decode");
+static Variant HHVM_FUNCTION(bson_decode, const String& bson, bool lazy) {
+    if (lazy) {
+        Array params = Array::Create();
+        params.append(bson);
+        return create_object("MongoLazyDocument", params, true);
+    }
+    return php_mongo_bson_decode(bson.data(), bson.size(), false);
 }
 
+/* Encodes into a pooled buffer, which the next one reuses, so that only the
+ * returned string is allocated */
 static String HHVM_FUNCTION(bson_encode, const Variant& anything) 
 {
-  throw_not_implemented("bson_encode");
+    mcon_str *str;
+
+    mcon_str_ptr_init_pooled(str);
+    try {
+        php_mongo_bson_encode_value(anything, str);
+    } catch (...) {
+        mcon_str_ptr_dtor(str);
+        throw;
+    }
+
+    String ret = str->l ? String(str->d, str->l, CopyString) : empty_string;
+    mcon_str_ptr_dtor(str);
+
+    return ret;
 }
 
 void mongoExtension::moduleInit() 
@@ -1128,15 +1656,21 @@ void mongoExtension::moduleInit()
     //TSRMLS_SET_CTX(mongo_globals->manager->log_context);
     manager_->log_function = php_mcon_log_wrapper;
 
-    manager_->connect               = php_mongo_io_stream_connect;
-    manager_->recv_header           = php_mongo_io_stream_read;
-    manager_->recv_data             = php_mongo_io_stream_read;
-    manager_->send                  = php_mongo_io_stream_send;
-    manager_->close                 = php_mongo_io_stream_close;
-    manager_->forget                = php_mongo_io_stream_forget;
+    manager_->connect               = php_mongo_io_connect;
+    manager_->recv_header           = php_mongo_io_read;
+    manager_->recv_data             = php_mongo_io_read;
+    manager_->send                  = php_mongo_io_send;
+    manager_->sendv                 = php_mongo_io_sendv;
+    manager_->close                 = php_mongo_io_close;
+    manager_->forget                = php_mongo_io_forget;
+    manager_->poll_fd               = mongo_io_poll_fd; /* -1 for PHP streams */
     manager_->authenticate          = php_mongo_io_stream_authenticate;
     //manager_->supports_wire_version = php_mongo_api_supports_wire_version;
 
+    /* Servers are checked in the background, backing off to the ping
+     * interval while nothing changes, so that requests don't have to */
+    mongo_monitor_start(manager_, MONGO_MONITOR_DEFAULT_MIN_HEARTBEAT, manager_->ping_interval * 1000);
+
     HHVM_ME(Mongo, connectUtil);
     HHVM_STATIC_ME(Mongo, getPoolSize);
     HHVM_ME(Mongo, getSlave);
@@ -1159,6 +1693,7 @@ void mongoExtension::moduleInit()
     HHVM_ME(MongoClient, getWriteConcern);
     HHVM_ME(MongoClient, killCursor);
     HHVM_ME(MongoClient, listDBs);
+    HHVM_ME(MongoClient, multiExec);
     HHVM_ME(MongoClient, selectCollection);
     HHVM_ME(MongoClient, selectDB);
     HHVM_ME(MongoClient, setReadPreference);
@@ -1184,6 +1719,9 @@ void mongoExtension::moduleInit()
     HHVM_ME(MongoCollection, findAndModify);
     HHVM_ME(MongoCollection, findOne);
     HHVM_ME(MongoCollection, __get);
+    HHVM_ME(MongoCollection, genFind);
+    HHVM_ME(MongoCollection, genFindOne);
+    HHVM_ME(MongoCollection, genInsert);
     HHVM_ME(MongoCollection, getDBRef);
     HHVM_ME(MongoCollection, getIndexInfo);
     HHVM_ME(MongoCollection, getName);
@@ -1262,6 +1800,7 @@ void mongoExtension::moduleInit()
     HHVM_ME(MongoDB, execute);
     HHVM_ME(MongoDB, forceError);
     HHVM_ME(MongoDB, __get);
+    HHVM_ME(MongoDB, genCommand);
     HHVM_ME(MongoDB, getCollectionNames);
     HHVM_ME(MongoDB, getDBRef);
     HHVM_ME(MongoDB, getGridFS);
@@ -1320,6 +1859,11 @@ void mongoExtension::moduleInit()
     HHVM_ME(MongoInt32, __toString);
     HHVM_ME(MongoInt64, __construct);
     HHVM_ME(MongoInt64, __toString);
+    HHVM_ME(MongoLazyDocument, __construct);
+    HHVM_ME(MongoLazyDocument, offsetExists);
+    HHVM_ME(MongoLazyDocument, offsetGet);
+    HHVM_ME(MongoLazyDocument, count);
+    HHVM_ME(MongoLazyDocument, toArray);
     HHVM_STATIC_ME(MongoLog, getCallback);
     HHVM_STATIC_ME(MongoLog, getLevel);
     HHVM_STATIC_ME(MongoLog, getModule);
@@ -1350,6 +1894,16 @@ void mongoExtension::moduleInit()
     loadSystemlib();
 }
 
+void mongoExtension::moduleShutdown()
+{
+    /* mongo_deinit() stops the monitor, and the async threads that run the
+     * gen* operations, before the manager that they use goes away */
+    if (manager_) {
+        mongo_deinit(manager_);
+        manager_ = nullptr;
+    }
+}
+
 mongoExtension s_mongo_extension;
 
 HHVM_GET_MODULE(mongo);
@@ -5,6 +5,7 @@
 
 #include "hphp/runtime/base/base-includes.h"
 #include "mcon/manager.h"
+#include "mcon/str.h"
 
 namespace HPHP {
 
@@ -12,6 +13,7 @@ class mongoExtension : public Extension {
 public:
     mongoExtension() : Extension("mongo"), manager_(nullptr) {}
     virtual void moduleInit();
+    virtual void moduleShutdown();
 
 public:
     /* php.ini options */
@@ -37,6 +39,31 @@ public:
 };
 
 extern mongoExtension s_mongo_extension;
+
+/* Appends value to str as a BSON document. What bson_encode() and the
+ * documents in requests go through. */
+void php_mongo_bson_encode(const Variant& value, mcon_str *str);
+
+/* Appends the BSON value of value to str, without a type or a key. What
+ * bson_encode() does with values that aren't documents. */
+void php_mongo_bson_encode_value(const Variant& value, mcon_str *str);
+
+/* Turns the BSON document of size bytes at data into a PHP array. What
+ * bson_decode() and the replies to operations go through. Unless checked is
+ * set, as for replies that mongo_connection_read_reply() has validated, the
+ * document is validated first, and a MongoException thrown if it's broken. */
+Array php_mongo_bson_decode(const char *data, int size, bool checked);
+
+/* A MongoLazyDocument for the document at offset in bson, which it keeps a
+ * reference to. Its fields are decoded as they are read, see bson.cpp. */
+Object php_mongo_lazy_document(const String& bson, int offset);
+
+/* The natives of MongoLazyDocument */
+void php_mongo_lazy_document_init(ObjectData *doc, const String& bson);
+bool php_mongo_lazy_document_exists(ObjectData *doc, const Variant& name);
+Variant php_mongo_lazy_document_get(ObjectData *doc, const Variant& name);
+int64_t php_mongo_lazy_document_count(ObjectData *doc);
+Array php_mongo_lazy_document_to_array(ObjectData *doc);
 }
 
 #endif // EXT_MONGO_H
@@ -73,8 +73,8 @@ class Mongo {
    * Set the size for future connection pools.
    *
    * @param int $size - The max number of connections future pools will
-   *   be able to create. Negative numbers mean that the pool will spawn an
-   *   infinite number of connections.
+   *   be able to create, at least 1 and at most 2147483647. Other values
+   *   throw a MongoException.
    *
    * @return bool - Returns the former value of pool size.
    */
@@ -296,6 +296,26 @@ class MongoClient {
   <<__Native>>
   public function listDBs(): array;
 
+  /**
+   * Runs several independent queries at once
+   *
+   * Every query is sent to the server that the read preference selects for
+   * it before any reply is waited for, so that the queries take about as
+   * long as the slowest of them.
+   *
+   * @param array $operations - A list of queries, each an array of the
+   *   form array("ns" => "db.collection", "query" => array(...),
+   *   "fields" => array(...)). "query" and "fields" are optional. A
+   *   command is a query on the "db.$cmd" namespace. With "lazy" =>
+   *   TRUE, the result of the query is a MongoLazyDocument.
+   *
+   * @return array - The first document that matches each query, or NULL,
+   *   in the order of the operations. If any of them fails, a
+   *   MongoCursorException is thrown instead.
+   */
+  <<__Native>>
+  public function multiExec(array $operations): array;
+
   /**
    * Gets a database collection
    *
@@ -390,6 +410,10 @@ class MongoCode {
  * create and use a collection with a $ in the name, MongoDB will assert.
  */
 class MongoCollection {
+
+  private ?MongoDB $__db = null;
+  private ?string $__name = null;
+
   /**
    * Perform an aggregation using the aggregation framework
    *
@@ -685,6 +709,61 @@ class MongoCollection {
   <<__Native>>
   public function __get(string $name): MongoCollection;
 
+  /**
+   * Queries this collection without blocking the request
+   *
+   * Only the first batch of results is fetched, and the cursor is closed
+   * after it, so there is no MongoCursor to fetch more with.
+   *
+   * @param array $query - The fields for which to search.
+   * @param array $fields - Fields of the results to return.
+   * @param array $options - "batchSize" is the most records to return
+   *   (101 by default), "lazy" returns them as MongoLazyDocuments, and
+   *   "maxTimeMS" limits how long the query may take, on the server and
+   *   while waiting for its reply. Other options throw a MongoException.
+   *
+   * @return Awaitable<array> - The records of the first batch.
+   */
+  <<__Native>>
+  public function genFind(array $query = array(),
+                          array $fields = array(),
+                          array $options = array()): Awaitable<array>;
+
+  /**
+   * Queries this collection for a single element without blocking the
+   * request
+   *
+   * @param array $query - The fields for which to search.
+   * @param array $fields - Fields of the results to return.
+   * @param array $options - Only 'lazy', which returns the record as a
+   *   MongoLazyDocument, and 'maxTimeMS', as for genFind(), are supported.
+   *   Other options throw a MongoException.
+   *
+   * @return Awaitable<mixed> - The record matching the search, or NULL.
+   */
+  <<__Native>>
+  public function genFindOne(array $query = array(),
+                             array $fields = array(),
+                             array $options = array()): Awaitable<mixed>;
+
+  /**
+   * Inserts a document into the collection without blocking the request
+   *
+   * The insert and the getLastError that acknowledges it are sent
+   * together. Unacknowledged writes ("w" of 0) can't be awaited. No _id is
+   * added to $a, so a document without one gets it from the server.
+   *
+   * @param array|object $a - An array or object to insert.
+   * @param array $options - "w", "wtimeout", "j" and "fsync", as for
+   *   MongoCollection::insert(). Other options throw a MongoException.
+   *
+   * @return Awaitable<array> - The getLastError response. If the insert
+   *   failed, awaiting it throws a MongoCursorException.
+   */
+  <<__Native>>
+  public function genInsert(mixed $a,
+                            array $options = array()): Awaitable<array>;
+
   /**
    * Fetches the document pointed to by a database reference
    *
@@ -1626,6 +1705,10 @@ class MongoDate {
  * database names may contain $.
  */
 class MongoDB {
+
+  private ?MongoClient $__client = null;
+  private ?string $__name = null;
+
   /**
    * Log in to this database
    *
@@ -1760,6 +1843,20 @@ class MongoDB {
   <<__Native>>
   public function __get(string $name): MongoCollection;
 
+  /**
+   * Executes a database command without blocking the request
+   *
+   * @param array $command - The query to send. Its 'maxTimeMS' also limits
+   *   the wait for the response.
+   * @param array $options - Not supported yet; passing any throws a
+   *   MongoException.
+   *
+   * @return Awaitable<array> - The database response.
+   */
+  <<__Native>>
+  public function genCommand(array $command,
+                             array $options = array()): Awaitable<array>;
+
   /**
    * Get all collections from this database
    *
@@ -2540,6 +2637,91 @@ class MongoInt64 {
 
 }
 
+/**
+ * A read-only view of a BSON document that only decodes the fields that are
+ * read. It keeps the BSON that it was made from, and finds where its fields
+ * are on the first access, which is much cheaper than decoding them; after
+ * that, reading a field decodes that field alone. Documents nested in it are
+ * lazy documents on the same BSON. Iterating over it, or toArray(), decodes
+ * the whole document. Lazy documents are returned by bson_decode($bson,
+ * true), and by MongoClient::multiExec() for operations with "lazy" set.
+ */
+class MongoLazyDocument implements ArrayAccess, Countable, IteratorAggregate {
+
+  private string $__bson = '';
+  private int $__offset = 0;
+  private ?array $__index = null;
+  private bool $__list = false;
+
+  /**
+   * Creates a lazy document
+   *
+   * @param string $bson - A BSON document.
+   *
+   * @return  - Returns a new lazy document.
+   */
+  <<__Native>>
+  public function __construct(string $bson): void;
+
+  /**
+   * Checks whether the document has a field
+   *
+   * @param mixed $name - The name of the field.
+   *
+   * @return bool - Returns whether the field is there.
+   */
+  <<__Native>>
+  public function offsetExists(mixed $name): bool;
+
+  /**
+   * Decodes a field
+   *
+   * @param mixed $name - The name of the field.
+   *
+   * @return mixed - Returns the value of the field, or NULL if it isn't
+   *   there.
+   */
+  <<__Native>>
+  public function offsetGet(mixed $name): mixed;
+
+  public function offsetSet(mixed $name, mixed $value): void {
+    throw new MongoException('MongoLazyDocument is read-only');
+  }
+
+  public function offsetUnset(mixed $name): void {
+    throw new MongoException('MongoLazyDocument is read-only');
+  }
+
+  public function __get(string $name): mixed {
+    return $this->offsetGet($name);
+  }
+
+  public function __isset(string $name): bool {
+    return $this->offsetExists($name);
+  }
+
+  /**
+   * Counts the fields of the document
+   *
+   * @return int - Returns the number of fields.
+   */
+  <<__Native>>
+  public function count(): int;
+
+  public function getIterator(): Iterator {
+    return new ArrayIterator($this->toArray());
+  }
+
+  /**
+   * Decodes the whole document
+   *
+   * @return array - Returns the document, as bson_decode() does.
+   */
+  <<__Native>>
+  public function toArray(): array;
+
+}
+
 /**
  * Logging can be used to get detailed information about what the driver is
  * doing. Logging is disabled by default, but this class allows you to
@@ -2682,8 +2864,8 @@ class MongoPool {
    * Set the size for future connection pools.
    *
    * @param int $size - The max number of connections future pools will
-   *   be able to create. Negative numbers mean that the pool will spawn an
-   *   infinite number of connections.
+   *   be able to create, at least 1 and at most 2147483647. Other values
+   *   throw a MongoException.
    *
    * @return bool - Returns the former value of pool size.
    */
@@ -2976,11 +3158,14 @@ function log_write_batch(array $server,
  * Deserializes a BSON object into a PHP array
  *
  * @param string $bson - The BSON to be deserialized.
+ * @param bool $lazy - Whether to return a MongoLazyDocument, which only
+ *   decodes the fields that are read, rather than an array.
  *
- * @return array - Returns the deserialized BSON object.
+ * @return mixed - Returns the deserialized BSON object. Throws a
+ *   MongoException if the BSON is broken, or has strings that aren't UTF-8.
  */
 <<__Native>>
-function bson_decode(string $bson): array;
+function bson_decode(string $bson, bool $lazy = false): mixed;
 
 /**
  * Serializes a PHP variable into a BSON string
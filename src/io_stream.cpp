@@ -21,6 +21,7 @@
 #include "mcon/utils.h"
 #include "mcon/manager.h"
 #include "mcon/connections.h"
+#include "mcon/io.h"
 //#include "php_mongo.h"
 
 //#include <php.h>
@@ -42,6 +43,81 @@
 //extern zend_class_entry *mongo_ce_ConnectionException;
 //ZEND_EXTERN_MODULE_GLOBALS(mongo)
 
+/* Connections that need SSL or a stream context go over PHP streams, and all
+ * others over mcon's native transport (mcon/io.c). Both store a
+ * mongo_io_socket in the connection; for PHP streams it only holds the
+ * stream. */
+#define PHP_MONGO_IO_STREAM(con) ((php_stream *)((mongo_io_socket *)(con)->socket)->stream)
+
+void* php_mongo_io_connect(mongo_con_manager *manager, mongo_server_def *server, mongo_server_options *options, char **error_message)
+{
+	mongo_io_socket *sock;
+	void            *stream;
+
+	if (!options->ssl && !options->ctx) {
+		return mongo_io_connect(manager, server, options, error_message);
+	}
+
+	stream = php_mongo_io_stream_connect(manager, server, options, error_message);
+	if (!stream) {
+		return NULL;
+	}
+
+	sock = (mongo_io_socket *)malloc(sizeof(mongo_io_socket));
+	sock->fd = -1;
+	sock->manager = manager;
+	sock->stream = stream;
+	/* PHP streams buffer reads themselves */
+	sock->buffer = NULL;
+	sock->buffer_start = 0;
+	sock->buffer_end = 0;
+
+	return sock;
+}
+
+int php_mongo_io_read(mongo_connection *con, mongo_server_options *options, int timeout, void *data, int size, char **error_message)
+{
+	if (PHP_MONGO_IO_STREAM(con)) {
+		return php_mongo_io_stream_read(con, options, timeout, data, size, error_message);
+	}
+	return mongo_io_recv_data(con, options, timeout, data, size, error_message);
+}
+
+int php_mongo_io_send(mongo_connection *con, mongo_server_options *options, void *data, int size, char **error_message)
+{
+	if (PHP_MONGO_IO_STREAM(con)) {
+		return php_mongo_io_stream_send(con, options, data, size, error_message);
+	}
+	return mongo_io_send(con, options, data, size, error_message);
+}
+
+int php_mongo_io_sendv(mongo_connection *con, mongo_server_options *options, struct iovec *iov, int count, char **error_message)
+{
+	if (PHP_MONGO_IO_STREAM(con)) {
+		return php_mongo_io_stream_sendv(con, options, iov, count, error_message);
+	}
+	return mongo_io_sendv(con, options, iov, count, error_message);
+}
+
+void php_mongo_io_close(mongo_connection *con, int why)
+{
+	if (con->socket && PHP_MONGO_IO_STREAM(con)) {
+		php_mongo_io_stream_close(con, why);
+		free(con->socket);
+		return;
+	}
+	mongo_io_close(con, why);
+}
+
+void php_mongo_io_forget(mongo_con_manager *manager, mongo_connection *con)
+{
+	if (PHP_MONGO_IO_STREAM(con)) {
+		php_mongo_io_stream_forget(manager, con);
+		return;
+	}
+	mongo_io_forget(manager, con);
+}
+
 void* php_mongo_io_stream_connect(mongo_con_manager *manager, 
                                   mongo_server_def *server, 
                                   mongo_server_options *options, 
@@ -50,7 +126,7 @@ void* php_mongo_io_stream_connect(mongo_con_manager *manager,
 	char *errmsg;
 	int errcode;
 	php_stream *stream;
-	char *hash = mongo_server_create_hash(server);
+	char *hash = mongo_server_def_id(server)->hash;
 	struct timeval ctimeout = {0, 0};
     std::string dsn;
 	int tcp_socket = 1;
@@ -80,11 +156,11 @@ void* php_mongo_io_stream_connect(mongo_con_manager *manager,
 	}
 
 	/* zend_replace_error_handling(EH_THROW, mongo_ce_ConnectionException, &error_handler TSRMLS_CC); */
-	stream = php_stream_xport_create(dsn.c_str(), dsn.size(), 0, STREAM_XPORT_CLIENT | STREAM_XPORT_CONNECT, hash, options->connectTimeoutMS > 0 ? &ctimeout : NULL, (php_stream_context *)options->ctx, &errmsg, &errcode);
+	/* No persistent id: the manager owns the sockets, and a server's pool
+	 * holds several sockets for the same hash */
+	stream = php_stream_xport_create(dsn.c_str(), dsn.size(), 0, STREAM_XPORT_CLIENT | STREAM_XPORT_CONNECT, NULL, options->connectTimeoutMS > 0 ? &ctimeout : NULL, (php_stream_context *)options->ctx, &errmsg, &errcode);
 	/* zend_restore_error_handling(&error_handler TSRMLS_CC); */
 
-	free(hash);
-
 	if (!stream) {
 		/* error_message will be free()d, but errmsg was allocated by PHP and needs efree() */
 		*error_message = strdup(errmsg);
@@ -158,96 +234,82 @@ void* php_mongo_io_stream_connect(mongo_con_manager *manager,
 
 }
 
+static int php_mongo_io_stream_timed_out(mongo_connection *con, int received, int size, char **error_message)
+{
+	*error_message = (char *)malloc(256);
+	snprintf(*error_message, 256, "Read timed out after reading %d of %d bytes", received, size);
+	return mongo_connection_timed_out(HPHP::s_mongo_extension.manager_, con, *error_message);
+}
+
 /* Returns the bytes read on success
  * Returns -31 on unknown failure
  * Returns -80 on timeout
+ * Returns -81 when the operation ran out of its budget
  * Returns -32 when remote server closes the connection
  */
 int php_mongo_io_stream_read(mongo_connection *con, mongo_server_options *options, int timeout, void *data, int size, char **error_message)
 {
-	int num = 1, received = 0, revert_timeout = 0;
-	int socketTimeoutMS = options->socketTimeoutMS;
-	struct timeval rtimeout = {0, 0};
-
-	/* Use default_socket_timeout INI setting if zero */
-	if (socketTimeoutMS == 0) {
-		/* socketTimeoutMS = FG(default_socket_timeout) * 1000; */
-		socketTimeoutMS = 60 * 1000;
+	int num = 1, received = 0;
+	int64_t deadline;
+	struct timeval rtimeout = {-1, 0};
+
+	/* The timeout is what is left until the operation's deadline, see
+	 * mongo_connection_deadline_remaining(). PHP streams only know timeouts
+	 * for each wait for data, so they get what is left before every read;
+	 * that only updates the stream's state, and is never reverted. Negative
+	 * values mean no timeout, and zero default_socket_timeout. */
+	if (timeout == 0) {
+		/* timeout = FG(default_socket_timeout) * 1000; */
+		timeout = MONGO_IO_DEFAULT_TIMEOUT;
 	}
-
-	/* Convert negative values to -1 second, which implies no timeout */
-	socketTimeoutMS = socketTimeoutMS < 0 ? -1000 : socketTimeoutMS;
-	timeout = timeout < 0 ? -1000 : timeout;
-
-	/* Socket timeout behavior varies based on the following:
-	 * - Negative => no timeout (i.e. block indefinitely)
-	 * - Zero => not specified (no changes to existing configuration)
-	 * - Positive => used specified timeout (revert to previous value later) */
-	if (timeout && timeout != socketTimeoutMS) {
-		rtimeout.tv_sec = timeout / 1000;
-		rtimeout.tv_usec = (timeout % 1000) * 1000;
-
-		revert_timeout = 1; /* We'll want to revert to the old timeout later */
-		php_stream_set_option((php_stream*)con->socket, PHP_STREAM_OPTION_READ_TIMEOUT, 0, &rtimeout);
-		// TODO mongo_manager_log(MonGlo(manager), MLOG_CON, MLOG_FINE, "Setting the stream timeout to %d.%06d", rtimeout.tv_sec, rtimeout.tv_usec);
-	} else {
-		/* Calculate this now in case we need it for the "timed_out" error message */
-		rtimeout.tv_sec = socketTimeoutMS / 1000;
-		rtimeout.tv_usec = (socketTimeoutMS % 1000) * 1000;
-
-		// TODO mongo_manager_log(MonGlo(manager), MLOG_CON, MLOG_FINE, "No timeout changes for %s", con->hash);
+	deadline = timeout < 0 ? -1 : mongo_now_ms() + timeout;
+	if (deadline < 0) {
+		php_stream_set_option(PHP_MONGO_IO_STREAM(con), PHP_STREAM_OPTION_READ_TIMEOUT, 0, &rtimeout);
 	}
 
 	//php_mongo_stream_notify_io(options, MONGO_STREAM_NOTIFY_IO_READ, 0, size);
 
-	/* this can return FAILED if there is just no more data from db */
+	/* this can return FAILED if there is just no more data from db. Ask for
+	 * everything that is left, rather than in 4096 byte slices, so that the
+	 * stream can read large replies with large reads. */
 	while (received < size && num > 0) {
-		int len = 4096 < (size - received) ? 4096 : size - received;
+		int len = size - received;
 		/* zend_error_handling error_handler; */
 
+		if (deadline >= 0) {
+			int64_t left = deadline - mongo_now_ms();
+
+			if (left <= 0) {
+				return php_mongo_io_stream_timed_out(con, received, size, error_message);
+			}
+			rtimeout.tv_sec = left / 1000;
+			rtimeout.tv_usec = (left % 1000) * 1000;
+			php_stream_set_option(PHP_MONGO_IO_STREAM(con), PHP_STREAM_OPTION_READ_TIMEOUT, 0, &rtimeout);
+		}
+
 		/* zend_replace_error_handling(EH_THROW, mongo_ce_ConnectionException, &error_handler TSRMLS_CC); */
-		num = php_stream_read((php_stream*)con->socket, (char *) data, len);
+		num = php_stream_read(PHP_MONGO_IO_STREAM(con), (char *) data, len);
+		__sync_add_and_fetch(&HPHP::s_mongo_extension.manager_->io_stats.reads, 1);
 		/* zend_restore_error_handling(&error_handler TSRMLS_CC);; */
 
 		if (num < 0) {
 			/* Doesn't look like this can happen, php_sockop_read overwrites
 			 * the failure from recv() to return 0 */
 			*error_message = strdup("Read from socket failed");
+			mongo_manager_server_failed(HPHP::s_mongo_extension.manager_, con, *error_message);
 			return -31;
 		}
 
 		/* It *may* have failed. It also may simply have no data */
 		if (num == 0) {
-            // TODO 
-#if 0
-           
-			zval *metadata;
-
-			MAKE_STD_ZVAL(metadata);
-			array_init(metadata);
-			if (php_stream_populate_meta_data(con->socket, metadata)) {
-				zval **tmp;
-
-				if (zend_hash_find(Z_ARRVAL_P(metadata), "timed_out", sizeof("timed_out"), (void**)&tmp) == SUCCESS) {
-					convert_to_boolean_ex(tmp);
-					if (Z_BVAL_PP(tmp)) {
-						*error_message = malloc(256);
-						snprintf(*error_message, 256, "Read timed out after reading %d bytes, waited for %d.%06d seconds", num, rtimeout.tv_sec, rtimeout.tv_usec);
-						zval_ptr_dtor(&metadata);
-						return -80;
-					}
-				}
-				if (zend_hash_find(Z_ARRVAL_P(metadata), "eof", sizeof("eof"), (void**)&tmp) == SUCCESS) {
-					convert_to_boolean_ex(tmp);
-					if (Z_BVAL_PP(tmp)) {
-						*error_message = strdup("Remote server has closed the connection");
-						zval_ptr_dtor(&metadata);
-						return -32;
-					}
-				}
+			if (((php_netstream_data_t*)PHP_MONGO_IO_STREAM(con)->abstract)->timeout_event) {
+				return php_mongo_io_stream_timed_out(con, received, size, error_message);
+			}
+			if (php_stream_eof(PHP_MONGO_IO_STREAM(con))) {
+				*error_message = strdup("Remote server has closed the connection");
+				mongo_manager_server_failed(HPHP::s_mongo_extension.manager_, con, *error_message);
+				return -32;
 			}
-			zval_ptr_dtor(&metadata);
-#endif
 		}
 
 		data = (char*)data + num;
@@ -261,21 +323,8 @@ int php_mongo_io_stream_read(mongo_connection *con, mongo_server_options *option
 	 * max-bytes-expected though... */
 	//php_mongo_stream_notify_io(options, MONGO_STREAM_NOTIFY_IO_COMPLETED, received, size);
 
-	/* If the timeout was changed, revert to the previous value now */
-	if (revert_timeout) {
-		/* If socketTimeoutMS was never specified, revert to default_socket_timeout */
-		if (options->socketTimeoutMS == 0) {
-			/* mongo_manager_log(MonGlo(manager), MLOG_CON, MLOG_FINE, "Stream timeout will be reverted to default_socket_timeout (%d)", FG(default_socket_timeout)); */
-			/* mongo_manager_log(MonGlo(manager), MLOG_CON, MLOG_FINE, "Stream timeout will be reverted to default_socket_timeout (%d)", 60); */
-            // TODO 
-		}
-
-		rtimeout.tv_sec = socketTimeoutMS / 1000;
-		rtimeout.tv_usec = (socketTimeoutMS % 1000) * 1000;
-
-		php_stream_set_option((php_stream*)con->socket, PHP_STREAM_OPTION_READ_TIMEOUT, 0, &rtimeout);
-		/* mongo_manager_log(MonGlo(manager), MLOG_CON, MLOG_FINE, "Now setting stream timeout back to %d.%06d", rtimeout.tv_sec, rtimeout.tv_usec); */
-        // TODO
+	if (received == size) {
+		mongo_connection_io_received(con);
 	}
 
 	return received;
@@ -288,9 +337,16 @@ int php_mongo_io_stream_send(mongo_connection *con, mongo_server_options *option
 
 	//php_mongo_stream_notify_io(options, MONGO_STREAM_NOTIFY_IO_WRITE, 0, size);
 
+	mongo_connection_io_sent(con);
+
 	/* zend_replace_error_handling(EH_THROW, mongo_ce_ConnectionException, &error_handler TSRMLS_CC); */
-	retval = php_stream_write((php_stream*)con->socket, (char *) data, size);
+	retval = php_stream_write(PHP_MONGO_IO_STREAM(con), (char *) data, size);
 	/* zend_restore_error_handling(&error_handler TSRMLS_CC);; */
+	if (retval < 0) {
+		*error_message = strdup("Write to socket failed");
+		mongo_manager_server_failed(HPHP::s_mongo_extension.manager_, con, *error_message);
+		return -1;
+	}
 	if (retval >= size) {
 		//php_mongo_stream_notify_io(options, MONGO_STREAM_NOTIFY_IO_COMPLETED, size, size);
 	}
@@ -298,15 +354,34 @@ int php_mongo_io_stream_send(mongo_connection *con, mongo_server_options *option
 	return retval;
 }
 
-void php_mongo_io_stream_close(mongo_connection *con, int why)
+/* PHP streams have no writev(), but write large buffers through without
+ * copying them, and the stream's write buffer coalesces the small ones */
+int php_mongo_io_stream_sendv(mongo_connection *con, mongo_server_options *options, struct iovec *iov, int count, char **error_message)
 {
+	int i, retval, sent = 0;
 
-	if (why == MONGO_CLOSE_BROKEN) {
-		if (con->socket) {
-			php_stream_free((php_stream*)con->socket, PHP_STREAM_FREE_CLOSE_PERSISTENT | PHP_STREAM_FREE_RSRC_DTOR);
+	mongo_connection_io_sent(con);
+
+	for (i = 0; i < count; i++) {
+		retval = php_stream_write(PHP_MONGO_IO_STREAM(con), (char *) iov[i].iov_base, iov[i].iov_len);
+		if (retval < 0) {
+			*error_message = strdup("Write to socket failed");
+			mongo_manager_server_failed(HPHP::s_mongo_extension.manager_, con, *error_message);
+			return -1;
 		}
-	} else if (why == MONGO_CLOSE_SHUTDOWN) {
-		/* No need to do anything, it was freed from the persistent_list */
+		sent += retval;
+	}
+
+	return sent;
+}
+
+void php_mongo_io_stream_close(mongo_connection *con, int why)
+{
+
+	/* The streams are not in the persistent_list, so they need closing on
+	 * shutdown too */
+	if (PHP_MONGO_IO_STREAM(con)) {
+		php_stream_free(PHP_MONGO_IO_STREAM(con), PHP_STREAM_FREE_CLOSE_PERSISTENT | PHP_STREAM_FREE_RSRC_DTOR);
 	}
 }
 
@@ -318,9 +393,9 @@ void php_mongo_io_stream_forget(mongo_con_manager *manager, mongo_connection *co
 	/* When we fork we need to unregister the parents hash so we don't
 	 * accidentally destroy it */
 	if (zend_hash_find(&EG(persistent_list), con->hash, strlen(con->hash) + 1, (void*) &le) == SUCCESS) {
-		((php_stream *)con->socket)->in_free = 1;
+		(PHP_MONGO_IO_STREAM(con))->in_free = 1;
 		zend_hash_del(&EG(persistent_list), con->hash, strlen(con->hash) + 1);
-		((php_stream *)con->socket)->in_free = 0;
+		(PHP_MONGO_IO_STREAM(con))->in_free = 0;
 	}
 #endif
 }
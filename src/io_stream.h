@@ -27,9 +27,20 @@
 extern "C" {
 #endif
 
+/* The manager's IO callbacks, which pick PHP streams or the native transport
+ * for each connection */
+void* php_mongo_io_connect(mongo_con_manager *manager, mongo_server_def *server, mongo_server_options *options, char **error_message);
+int php_mongo_io_read(mongo_connection *con, mongo_server_options *options, int timeout, void *data, int size, char **error_message);
+int php_mongo_io_send(mongo_connection *con, mongo_server_options *options, void *data, int size, char **error_message);
+int php_mongo_io_sendv(mongo_connection *con, mongo_server_options *options, struct iovec *iov, int count, char **error_message);
+void php_mongo_io_close(mongo_connection *con, int why);
+void php_mongo_io_forget(mongo_con_manager *manager, mongo_connection *con);
+
+/* The PHP streams transport */
 void* php_mongo_io_stream_connect(mongo_con_manager *manager, mongo_server_def *server, mongo_server_options *options, char **error_message);
 int php_mongo_io_stream_read(mongo_connection *con, mongo_server_options *options, int timeout, void *data, int size, char **error_message);
 int php_mongo_io_stream_send(mongo_connection *con, mongo_server_options *options, void *data, int size, char **error_message);
+int php_mongo_io_stream_sendv(mongo_connection *con, mongo_server_options *options, struct iovec *iov, int count, char **error_message);
 void php_mongo_io_stream_close(mongo_connection *con, int why);
 void php_mongo_io_stream_forget(mongo_con_manager *manager, mongo_connection *con);
 int php_mongo_io_stream_authenticate(mongo_con_manager *manager, mongo_connection *con, mongo_server_options *options, mongo_server_def *server_def, char **error_message);
@@ -0,0 +1,197 @@
+/**
+ *  Copyright 2009-2014 MongoDB, Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+#include <stdlib.h>
+#include <string.h>
+
+#include "types.h"
+#include "async.h"
+#include "manager.h"
+#include "connections.h"
+#include "packet.h"
+#include "pool.h"
+
+static mongo_async *mongo_async_create(mongo_con_manager *manager)
+{
+	mongo_async *async;
+
+	async = (mongo_async *)calloc(1, sizeof(mongo_async));
+	pthread_mutex_init(&async->lock, NULL);
+	pthread_cond_init(&async->wakeup, NULL);
+	async->threads = (pthread_t *)calloc(manager->async_threads > 0 ? manager->async_threads : 1, sizeof(pthread_t));
+
+	return async;
+}
+
+static void mongo_async_op_free(mongo_con_manager *manager, mongo_async_op *op)
+{
+	mongo_packet_dtor(op->packet);
+	mongo_connection_release(manager, op->con, MONGO_CLOSE_BROKEN);
+	free(op);
+}
+
+static void mongo_async_run(mongo_con_manager *manager, mongo_async_op *op)
+{
+	mongo_connection *pooled;
+	char             *data_buffer = NULL, *error_message = NULL;
+	int               retval = 0;
+
+	pooled = mongo_pool_checkout(manager, op->con, &op->con->pool->options, &error_message);
+	if (pooled) {
+		if (op->budget_ms) {
+			mongo_connection_set_budget(pooled, op->budget_ms);
+		}
+		retval = mongo_connection_send_packet(manager, pooled, &op->con->pool->options, op->packet, &data_buffer, &error_message);
+		mongo_pool_checkin(manager, op->con, pooled, !retval);
+	}
+
+	op->callback(op->context, retval, data_buffer, error_message);
+	mongo_async_op_free(manager, op);
+}
+
+static void *mongo_async_thread(void *arg)
+{
+	mongo_con_manager *manager = (mongo_con_manager *)arg;
+	mongo_async       *async = manager->async;
+	mongo_async_op    *op;
+
+	pthread_mutex_lock(&async->lock);
+	while (!async->stop) {
+		if (!async->head) {
+			async->idle++;
+			pthread_cond_wait(&async->wakeup, &async->lock);
+			async->idle--;
+			continue;
+		}
+
+		op = async->head;
+		async->head = op->next;
+		if (!async->head) {
+			async->tail = NULL;
+		}
+		pthread_mutex_unlock(&async->lock);
+
+		mongo_async_run(manager, op);
+
+		pthread_mutex_lock(&async->lock);
+		async->completed++;
+	}
+	pthread_mutex_unlock(&async->lock);
+
+	return NULL;
+}
+
+int mongo_async_submit(mongo_con_manager *manager, mongo_connection *con, mongo_packet *packet, int budget_ms, mongo_async_callback_t *callback, void *context, char **error_message)
+{
+	mongo_async    *async;
+	mongo_async_op *op;
+
+	if (!con->pool) {
+		*error_message = strdup("Only connections to a server's pool can run operations in the background");
+		return 0;
+	}
+
+	/* The first submitter sets the threads up */
+	if (!manager->async) {
+		async = mongo_async_create(manager);
+		if (!__sync_bool_compare_and_swap(&manager->async, NULL, async)) {
+			pthread_cond_destroy(&async->wakeup);
+			pthread_mutex_destroy(&async->lock);
+			free(async->threads);
+			free(async);
+		}
+	}
+	async = manager->async;
+
+	op = (mongo_async_op *)calloc(1, sizeof(mongo_async_op));
+	mongo_connection_addref(con);
+	op->con = con;
+	op->packet = packet;
+	op->budget_ms = budget_ms;
+	op->callback = callback;
+	op->context = context;
+
+	pthread_mutex_lock(&async->lock);
+	if (async->stop) {
+		pthread_mutex_unlock(&async->lock);
+		mongo_connection_release(manager, con, MONGO_CLOSE_BROKEN);
+		free(op);
+		*error_message = strdup("The connection manager is shutting down");
+		return 0;
+	}
+
+	if (async->tail) {
+		async->tail->next = op;
+	} else {
+		async->head = op;
+	}
+	async->tail = op;
+	async->submitted++;
+
+	/* Start another thread if all of them are busy, until there are as many
+	 * as allowed; after that, operations wait in the queue */
+	if (async->idle == 0 && async->count < (manager->async_threads > 0 ? manager->async_threads : 1)) {
+		if (pthread_create(&async->threads[async->count], NULL, mongo_async_thread, manager) == 0) {
+			async->count++;
+		} else {
+			mongo_manager_log(manager, MLOG_CON, MLOG_WARN, "async: couldn't start a thread, %d are running", async->count);
+		}
+	}
+	pthread_cond_signal(&async->wakeup);
+	pthread_mutex_unlock(&async->lock);
+
+	return 1;
+}
+
+void mongo_async_stop(mongo_con_manager *manager)
+{
+	mongo_async    *async = manager->async;
+	mongo_async_op *op;
+	int             i;
+
+	if (!async) {
+		return;
+	}
+
+	pthread_mutex_lock(&async->lock);
+	async->stop = 1;
+	pthread_cond_broadcast(&async->wakeup);
+	pthread_mutex_unlock(&async->lock);
+
+	for (i = 0; i < async->count; i++) {
+		pthread_join(async->threads[i], NULL);
+	}
+
+	while ((op = async->head)) {
+		async->head = op->next;
+		op->callback(op->context, 0, NULL, strdup("The connection manager is shutting down"));
+		mongo_async_op_free(manager, op);
+	}
+
+	manager->async = NULL;
+	pthread_cond_destroy(&async->wakeup);
+	pthread_mutex_destroy(&async->lock);
+	free(async->threads);
+	free(async);
+}
+
+/*
+ * Local variables:
+ * tab-width: 4
+ * c-basic-offset: 4
+ * End:
+ * vim600: fdm=marker
+ * vim: noet sw=4 ts=4
+ */
@@ -0,0 +1,90 @@
+/**
+ *  Copyright 2009-2014 MongoDB, Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+#ifndef __MCON_ASYNC_H__
+#define __MCON_ASYNC_H__
+
+#include "types.h"
+#include "packet.h"
+#include <pthread.h>
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+#define MONGO_ASYNC_DEFAULT_THREADS 8
+
+/* Called from one of the async threads when an operation has finished.
+ * retval is 1 if it worked, in which case data_buffer holds the reply, and
+ * must be freed with mongo_buffer_free(). Otherwise it is 0, and
+ * error_message is set and must be free()d. */
+typedef void (mongo_async_callback_t)(void *context, int retval, char *data_buffer, char *error_message);
+
+typedef struct _mongo_async_op
+{
+	mongo_connection        *con;      /* Holds a reference */
+	mongo_packet            *packet;   /* Owned by the operation */
+	int                      budget_ms; /* See mongo_connection_set_budget(), or 0 */
+	mongo_async_callback_t  *callback;
+	void                    *context;
+	struct _mongo_async_op  *next;
+} mongo_async_op;
+
+/* Operations that the request threads hand off, so that they don't have to
+ * wait for the round trips themselves. They are run by up to the manager's
+ * async_threads threads, which are started as they are needed, each on a
+ * socket checked out from the server's pool, or on the shared socket of a
+ * multiplexed connection. */
+typedef struct _mongo_async
+{
+	pthread_mutex_t  lock;
+	pthread_cond_t   wakeup;
+	mongo_async_op  *head;      /* Queued operations, oldest first */
+	mongo_async_op  *tail;
+	pthread_t       *threads;
+	int              count;     /* Number of threads started */
+	int              idle;      /* Number of threads waiting for an operation */
+	int              stop;
+	int64_t          submitted;
+	int64_t          completed;
+} mongo_async;
+
+/* Runs the request in packet against con's server in the background, and
+ * calls callback with the reply. The packet is sent with the options that
+ * the connection was made with, and is destroyed afterwards; data that was
+ * added to it with mongo_packet_add_data() has to stay around until the
+ * callback has been called. budget_ms limits the operation like
+ * mongo_connection_set_budget() does, or is 0. Returns 1 if the operation
+ * was queued, and 0 if it wasn't, in which case error_message is set, and
+ * the caller still owns the packet. */
+int mongo_async_submit(mongo_con_manager *manager, mongo_connection *con, mongo_packet *packet, int budget_ms, mongo_async_callback_t *callback, void *context, char **error_message);
+
+/* Waits for the running operations, and fails the ones that are queued */
+void mongo_async_stop(mongo_con_manager *manager);
+
+#if defined(__cplusplus)
+}
+#endif
+
+#endif
+
+/*
+ * Local variables:
+ * tab-width: 4
+ * c-basic-offset: 4
+ * End:
+ * vim600: fdm=marker
+ * vim: noet sw=4 ts=4
+ */
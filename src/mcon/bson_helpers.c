@@ -16,6 +16,7 @@
 #include "types.h"
 #include "bson_helpers.h"
 #include "str.h"
+#include <string.h>
 
 void mcon_serialize_int(struct mcon_str *str, int num)
 {
@@ -38,6 +39,15 @@ void mcon_serialize_int64(struct mcon_str *str, int64_t num)
 	mcon_str_addl(str, (char*) &i, 8, 0);
 }
 
+void mcon_serialize_double(struct mcon_str *str, double num)
+{
+	int64_t i;
+
+	memcpy(&i, &num, 8);
+	i = MONGO_64(i);
+	mcon_str_addl(str, (char*) &i, 8, 0);
+}
+
 /*
  * Local variables:
  * tab-width: 4
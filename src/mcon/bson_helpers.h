@@ -49,6 +49,7 @@ extern "C" {
 void mcon_serialize_int(struct mcon_str *str, int num);
 void mcon_serialize_int32(struct mcon_str *str, int num);
 void mcon_serialize_int64(struct mcon_str *str, int64_t num);
+void mcon_serialize_double(struct mcon_str *str, double num);
 
 #if defined(__cplusplus)
 }
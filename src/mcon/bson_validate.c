@@ -0,0 +1,611 @@
+/**
+ *  Copyright 2009-2014 MongoDB, Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "types.h"
+#include "bson_validate.h"
+#include "bson_helpers.h"
+#include "mini_bson.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+# define BSON_UTF8_SIMD 1
+# include <immintrin.h>
+#endif
+
+/* UTF-8
+ *
+ * The scalar version goes through ASCII eight bytes at a time, and checks
+ * everything else one sequence at a time, rejecting overlong forms,
+ * surrogates and code points past U+10FFFF, as RFC 3629 says. */
+int bson_utf8_valid_scalar(const char *data, int length)
+{
+	const unsigned char *s = (const unsigned char *)data, *end = s + length;
+	uint64_t             word;
+
+	while (s < end) {
+		if (end - s >= 8) {
+			memcpy(&word, s, sizeof(word));
+			if (!(word & 0x8080808080808080ULL)) {
+				s += 8;
+				continue;
+			}
+		}
+
+		if (s[0] < 0x80) {
+			s++;
+		} else if (s[0] < 0xC2) {
+			/* A continuation byte, or an overlong two byte sequence */
+			return 0;
+		} else if (s[0] < 0xE0) {
+			if (end - s < 2 || (s[1] & 0xC0) != 0x80) {
+				return 0;
+			}
+			s += 2;
+		} else if (s[0] < 0xF0) {
+			if (end - s < 3 || (s[1] & 0xC0) != 0x80 || (s[2] & 0xC0) != 0x80) {
+				return 0;
+			}
+			if ((s[0] == 0xE0 && s[1] < 0xA0) || (s[0] == 0xED && s[1] > 0x9F)) {
+				/* Overlong, or a surrogate */
+				return 0;
+			}
+			s += 3;
+		} else if (s[0] < 0xF5) {
+			if (end - s < 4 || (s[1] & 0xC0) != 0x80 || (s[2] & 0xC0) != 0x80 || (s[3] & 0xC0) != 0x80) {
+				return 0;
+			}
+			if ((s[0] == 0xF0 && s[1] < 0x90) || (s[0] == 0xF4 && s[1] > 0x8F)) {
+				/* Overlong, or past U+10FFFF */
+				return 0;
+			}
+			s += 4;
+		} else {
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+#ifdef BSON_UTF8_SIMD
+/* The vectorised versions check a whole block at once, with the lookup
+ * algorithm of Keiser and Lemire ("Validating UTF-8 In Less Than One
+ * Instruction Per Byte", 2021). Every pair of a byte and the one before it
+ * is classified by three table lookups, on the high and low nibble of the
+ * first byte and the high nibble of the second, each of which gives the
+ * errors that the pair could be; the errors that all three agree on are
+ * real. Continuation bytes that belong to three and four byte sequences are
+ * told apart from stray ones by looking two and three bytes back. */
+#define TOO_SHORT      (1 << 0) /* A lead byte not followed by a continuation byte */
+#define TOO_LONG       (1 << 1) /* A continuation byte after ASCII */
+#define OVERLONG_3     (1 << 2)
+#define TOO_LARGE      (1 << 3)
+#define SURROGATE      (1 << 4)
+#define OVERLONG_2     (1 << 5)
+#define TOO_LARGE_1000 (1 << 6)
+#define OVERLONG_4     (1 << 6)
+#define TWO_CONTS      (1 << 7) /* Two continuation bytes, fine in longer sequences */
+#define CARRY          (TOO_SHORT | TOO_LONG | TWO_CONTS)
+
+#define BYTE_1_HIGH \
+	TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, \
+	TWO_CONTS, TWO_CONTS, TWO_CONTS, TWO_CONTS, \
+	TOO_SHORT | OVERLONG_2, \
+	TOO_SHORT, \
+	TOO_SHORT | OVERLONG_3 | SURROGATE, \
+	TOO_SHORT | TOO_LARGE | TOO_LARGE_1000 | OVERLONG_4
+
+#define BYTE_1_LOW \
+	CARRY | OVERLONG_3 | OVERLONG_2 | OVERLONG_4, \
+	CARRY | OVERLONG_2, \
+	CARRY, \
+	CARRY, \
+	CARRY | TOO_LARGE, \
+	CARRY | TOO_LARGE | TOO_LARGE_1000, \
+	CARRY | TOO_LARGE | TOO_LARGE_1000, \
+	CARRY | TOO_LARGE | TOO_LARGE_1000, \
+	CARRY | TOO_LARGE | TOO_LARGE_1000, \
+	CARRY | TOO_LARGE | TOO_LARGE_1000, \
+	CARRY | TOO_LARGE | TOO_LARGE_1000, \
+	CARRY | TOO_LARGE | TOO_LARGE_1000, \
+	CARRY | TOO_LARGE | TOO_LARGE_1000, \
+	CARRY | TOO_LARGE | TOO_LARGE_1000 | SURROGATE, \
+	CARRY | TOO_LARGE | TOO_LARGE_1000, \
+	CARRY | TOO_LARGE | TOO_LARGE_1000
+
+#define BYTE_2_HIGH \
+	TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, \
+	TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE_1000 | OVERLONG_4, \
+	TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE, \
+	TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE, \
+	TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE, \
+	TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT
+
+/* The largest that the last three bytes of a block can be without starting
+ * a sequence that goes on in the next block */
+#define INCOMPLETE_MAX (char)0xFF, (char)0xFF, (char)0xFF, (char)0xFF, (char)0xFF, (char)0xFF, (char)0xFF, (char)0xFF, \
+	(char)0xFF, (char)0xFF, (char)0xFF, (char)0xFF, (char)0xFF, (char)0xEF, (char)0xDF, (char)0xBF
+
+typedef struct _bson_utf8_sse_state {
+	__m128i prev_input;
+	__m128i prev_incomplete;
+	__m128i error;
+} bson_utf8_sse_state;
+
+__attribute__((target("sse4.2")))
+static inline void bson_utf8_check_sse(bson_utf8_sse_state *state, __m128i input)
+{
+	const __m128i table1 = _mm_setr_epi8(BYTE_1_HIGH);
+	const __m128i table2 = _mm_setr_epi8(BYTE_1_LOW);
+	const __m128i table3 = _mm_setr_epi8(BYTE_2_HIGH);
+	const __m128i nibble = _mm_set1_epi8(0x0F);
+	__m128i       prev1, prev2, prev3, special_cases, must_be_continuation;
+
+	if (_mm_movemask_epi8(input) == 0) {
+		/* ASCII only, which is fine unless the last block ended early */
+		state->error = _mm_or_si128(state->error, state->prev_incomplete);
+		state->prev_incomplete = _mm_setzero_si128();
+		state->prev_input = input;
+		return;
+	}
+
+	prev1 = _mm_alignr_epi8(input, state->prev_input, 15);
+	special_cases = _mm_and_si128(
+		_mm_and_si128(
+			_mm_shuffle_epi8(table1, _mm_and_si128(_mm_srli_epi16(prev1, 4), nibble)),
+			_mm_shuffle_epi8(table2, _mm_and_si128(prev1, nibble))
+		),
+		_mm_shuffle_epi8(table3, _mm_and_si128(_mm_srli_epi16(input, 4), nibble))
+	);
+
+	prev2 = _mm_alignr_epi8(input, state->prev_input, 14);
+	prev3 = _mm_alignr_epi8(input, state->prev_input, 13);
+	must_be_continuation = _mm_and_si128(
+		_mm_or_si128(
+			_mm_subs_epu8(prev2, _mm_set1_epi8((char)(0xE0 - 0x80))),
+			_mm_subs_epu8(prev3, _mm_set1_epi8((char)(0xF0 - 0x80)))
+		),
+		_mm_set1_epi8((char)0x80)
+	);
+
+	state->error = _mm_or_si128(state->error, _mm_xor_si128(must_be_continuation, special_cases));
+	state->prev_incomplete = _mm_subs_epu8(input, _mm_setr_epi8(INCOMPLETE_MAX));
+	state->prev_input = input;
+}
+
+__attribute__((target("sse4.2")))
+static int bson_utf8_valid_sse(const char *data, int length)
+{
+	bson_utf8_sse_state state;
+	char                tail[16];
+	int                 i;
+
+	state.prev_input = state.prev_incomplete = state.error = _mm_setzero_si128();
+
+	for (i = 0; i + 16 <= length; i += 16) {
+		bson_utf8_check_sse(&state, _mm_loadu_si128((const __m128i *)(data + i)));
+	}
+	/* The rest is padded with ASCII */
+	if (i < length) {
+		memset(tail, 0, sizeof(tail));
+		memcpy(tail, data + i, length - i);
+		bson_utf8_check_sse(&state, _mm_loadu_si128((const __m128i *)tail));
+	}
+
+	state.error = _mm_or_si128(state.error, state.prev_incomplete);
+	return _mm_testz_si128(state.error, state.error);
+}
+
+typedef struct _bson_utf8_avx2_state {
+	__m256i prev_input;
+	__m256i prev_incomplete;
+	__m256i error;
+} bson_utf8_avx2_state;
+
+/* The bytes of input shifted by n, with the last ones of prev in front */
+#define BSON_AVX2_PREV(input, prev, n) \
+	_mm256_alignr_epi8((input), _mm256_permute2x128_si256((prev), (input), 0x21), 16 - (n))
+
+__attribute__((target("avx2")))
+static inline void bson_utf8_check_avx2(bson_utf8_avx2_state *state, __m256i input)
+{
+	const __m256i table1 = _mm256_setr_epi8(BYTE_1_HIGH, BYTE_1_HIGH);
+	const __m256i table2 = _mm256_setr_epi8(BYTE_1_LOW, BYTE_1_LOW);
+	const __m256i table3 = _mm256_setr_epi8(BYTE_2_HIGH, BYTE_2_HIGH);
+	const __m256i nibble = _mm256_set1_epi8(0x0F);
+	__m256i       prev1, prev2, prev3, special_cases, must_be_continuation;
+
+	if (_mm256_movemask_epi8(input) == 0) {
+		state->error = _mm256_or_si256(state->error, state->prev_incomplete);
+		state->prev_incomplete = _mm256_setzero_si256();
+		state->prev_input = input;
+		return;
+	}
+
+	prev1 = BSON_AVX2_PREV(input, state->prev_input, 1);
+	special_cases = _mm256_and_si256(
+		_mm256_and_si256(
+			_mm256_shuffle_epi8(table1, _mm256_and_si256(_mm256_srli_epi16(prev1, 4), nibble)),
+			_mm256_shuffle_epi8(table2, _mm256_and_si256(prev1, nibble))
+		),
+		_mm256_shuffle_epi8(table3, _mm256_and_si256(_mm256_srli_epi16(input, 4), nibble))
+	);
+
+	prev2 = BSON_AVX2_PREV(input, state->prev_input, 2);
+	prev3 = BSON_AVX2_PREV(input, state->prev_input, 3);
+	must_be_continuation = _mm256_and_si256(
+		_mm256_or_si256(
+			_mm256_subs_epu8(prev2, _mm256_set1_epi8((char)(0xE0 - 0x80))),
+			_mm256_subs_epu8(prev3, _mm256_set1_epi8((char)(0xF0 - 0x80)))
+		),
+		_mm256_set1_epi8((char)0x80)
+	);
+
+	state->error = _mm256_or_si256(state->error, _mm256_xor_si256(must_be_continuation, special_cases));
+	state->prev_incomplete = _mm256_subs_epu8(input, _mm256_setr_epi8(
+		(char)0xFF, (char)0xFF, (char)0xFF, (char)0xFF, (char)0xFF, (char)0xFF, (char)0xFF, (char)0xFF,
+		(char)0xFF, (char)0xFF, (char)0xFF, (char)0xFF, (char)0xFF, (char)0xFF, (char)0xFF, (char)0xFF,
+		INCOMPLETE_MAX
+	));
+	state->prev_input = input;
+}
+
+__attribute__((target("avx2")))
+static int bson_utf8_valid_avx2(const char *data, int length)
+{
+	bson_utf8_avx2_state state;
+	char                 tail[32];
+	int                  i;
+
+	state.prev_input = state.prev_incomplete = state.error = _mm256_setzero_si256();
+
+	for (i = 0; i + 32 <= length; i += 32) {
+		bson_utf8_check_avx2(&state, _mm256_loadu_si256((const __m256i *)(data + i)));
+	}
+	if (i < length) {
+		memset(tail, 0, sizeof(tail));
+		memcpy(tail, data + i, length - i);
+		bson_utf8_check_avx2(&state, _mm256_loadu_si256((const __m256i *)tail));
+	}
+
+	state.error = _mm256_or_si256(state.error, state.prev_incomplete);
+	return _mm256_testz_si256(state.error, state.error);
+}
+#endif
+
+/* Picked once, by what the CPU has */
+static int (*bson_utf8_valid_long)(const char *data, int length) = bson_utf8_valid_scalar;
+static const char     *bson_utf8_name = "scalar";
+static pthread_once_t  bson_utf8_once = PTHREAD_ONCE_INIT;
+
+static void bson_utf8_init(void)
+{
+#ifdef BSON_UTF8_SIMD
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		bson_utf8_valid_long = bson_utf8_valid_avx2;
+		bson_utf8_name = "avx2";
+	} else if (__builtin_cpu_supports("sse4.2")) {
+		bson_utf8_valid_long = bson_utf8_valid_sse;
+		bson_utf8_name = "sse4.2";
+	}
+#endif
+}
+
+/* Short strings, which most names and many values are, aren't worth setting
+ * up the vectors for */
+#define BSON_UTF8_SHORT 16
+
+int bson_utf8_valid(const char *data, int length)
+{
+	if (length < BSON_UTF8_SHORT) {
+		return bson_utf8_valid_scalar(data, length);
+	}
+
+	pthread_once(&bson_utf8_once, bson_utf8_init);
+	return bson_utf8_valid_long(data, length);
+}
+
+const char *bson_utf8_implementation(void)
+{
+	pthread_once(&bson_utf8_once, bson_utf8_init);
+	return bson_utf8_name;
+}
+
+/* Documents
+ *
+ * Every length is checked against what is left of the document that holds
+ * it before it is followed, so that nothing is read past the end of the
+ * buffer, however broken the data is. */
+typedef struct _bson_validator {
+	char  *base;  /* For the offsets in error messages */
+	int    flags;
+	char **error_message;
+	int  (*utf8_valid)(const char *data, int length); /* For the longer strings */
+} bson_validator;
+
+static void bson_validator_init(bson_validator *v, char *data, int flags, char **error_message)
+{
+	pthread_once(&bson_utf8_once, bson_utf8_init);
+
+	v->base = data;
+	v->flags = flags;
+	v->error_message = error_message;
+	v->utf8_valid = bson_utf8_valid_long;
+}
+
+static int bson_validate_error(bson_validator *v, char *at, const char *what)
+{
+	*v->error_message = malloc(256);
+	snprintf(*v->error_message, 256, "invalid BSON at offset %d: %s", (int)(at - v->base), what);
+	return 0;
+}
+
+static int32_t bson_validate_int32(char *data)
+{
+	int32_t i;
+
+	memcpy(&i, data, sizeof(int32_t));
+	return MONGO_32(i);
+}
+
+static int bson_validate_utf8(bson_validator *v, char *data, int length)
+{
+	if (!(v->flags & BSON_VALIDATE_UTF8)) {
+		return 1;
+	}
+	if (!(length < BSON_UTF8_SHORT ? bson_utf8_valid_scalar(data, length) : v->utf8_valid(data, length))) {
+		return bson_validate_error(v, data, "not valid UTF-8");
+	}
+	return 1;
+}
+
+/* A string that has at most left bytes. Returns its size including its
+ * length, or 0 if it isn't valid. */
+static int bson_validate_string(bson_validator *v, char *data, int left)
+{
+	int32_t length;
+
+	if (left < 4) {
+		return bson_validate_error(v, data, "a string's length runs past its document");
+	}
+	length = bson_validate_int32(data);
+	if (length < 1 || length > left - 4) {
+		return bson_validate_error(v, data, "a string's length is out of bounds");
+	}
+	if (data[4 + length - 1] != '\0') {
+		return bson_validate_error(v, data, "a string doesn't end with 0x00");
+	}
+	if (!bson_validate_utf8(v, data + 4, length - 1)) {
+		return 0;
+	}
+	return 4 + length;
+}
+
+/* A name or a regular expression. Returns its size including its trailing
+ * 0x00, or 0 if it isn't valid. */
+static int bson_validate_cstring(bson_validator *v, char *data, int left)
+{
+	unsigned char *ptr = (unsigned char *)data, *end = ptr + left, high = 0;
+
+	/* Names are short, and nearly always ASCII, which is noticed while
+	 * looking for their end */
+	while (ptr < end && *ptr) {
+		high |= *ptr++;
+	}
+	if (ptr == end) {
+		return bson_validate_error(v, data, "a name runs past its document");
+	}
+	if ((high & 0x80) && !bson_validate_utf8(v, data, (char *)ptr - data)) {
+		return 0;
+	}
+	return (char *)ptr - data + 1;
+}
+
+static int bson_validate_element_document(bson_validator *v, char *data, int size, int depth);
+
+/* The value of an element of type at data, which has at most left bytes.
+ * Returns its size, or -1 if it isn't valid. */
+static int bson_validate_value(bson_validator *v, int type, char *data, int left, int depth)
+{
+	int32_t length;
+	int     size, scope;
+
+	switch (type) {
+		case BSON_UNDEFINED:
+		case BSON_NULL:
+		case BSON_MIN_KEY:
+		case BSON_MAX_KEY:
+			return 0;
+
+		case BSON_BOOLEAN:
+			if (left < 1) {
+				break;
+			}
+			if (data[0] != 0 && data[0] != 1) {
+				bson_validate_error(v, data, "a boolean is neither 0 nor 1");
+				return -1;
+			}
+			return 1;
+
+		case BSON_INT32:
+			return left < 4 ? -2 : 4;
+
+		case BSON_DOUBLE:
+		case BSON_DATETIME:
+		case BSON_TIMESTAMP:
+		case BSON_INT64:
+			return left < 8 ? -2 : 8;
+
+		case BSON_OBJECT_ID:
+			return left < 12 ? -2 : 12;
+
+		case BSON_STRING:
+		case BSON_JAVASCRIPT:
+		case BSON_SYMBOL:
+			size = bson_validate_string(v, data, left);
+			return size ? size : -1;
+
+		case BSON_DOCUMENT:
+		case BSON_ARRAY:
+			size = bson_validate_element_document(v, data, left, depth + 1);
+			return size ? size : -1;
+
+		case BSON_BINARY:
+			if (left < 5) {
+				break;
+			}
+			length = bson_validate_int32(data);
+			if (length < 0 || length > left - 5) {
+				bson_validate_error(v, data, "binary data's length is out of bounds");
+				return -1;
+			}
+			/* The old binary subtype repeats the length */
+			if (data[4] == 0x02 && (length < 4 || bson_validate_int32(data + 5) != length - 4)) {
+				bson_validate_error(v, data, "the lengths of old binary data don't match");
+				return -1;
+			}
+			return 5 + length;
+
+		case BSON_REGEXP:
+			if (!(size = bson_validate_cstring(v, data, left))) {
+				return -1;
+			}
+			if (!(length = bson_validate_cstring(v, data + size, left - size))) {
+				return -1;
+			}
+			return size + length;
+
+		case BSON_DBPOINTER:
+			if (!(size = bson_validate_string(v, data, left))) {
+				return -1;
+			}
+			return left - size < 12 ? -2 : size + 12;
+
+		case BSON_JAVASCRIPT_WITH_SCOPE:
+			/* The total length, the code as a string, and the scope */
+			if (left < 4) {
+				break;
+			}
+			length = bson_validate_int32(data);
+			if (length < 4 + 5 + 5 || length > left) {
+				bson_validate_error(v, data, "code with scope's length is out of bounds");
+				return -1;
+			}
+			if (!(size = bson_validate_string(v, data + 4, length - 4))) {
+				return -1;
+			}
+			if (!(scope = bson_validate_element_document(v, data + 4 + size, length - 4 - size, depth + 1))) {
+				return -1;
+			}
+			if (4 + size + scope != length) {
+				bson_validate_error(v, data, "code with scope's length doesn't match its parts");
+				return -1;
+			}
+			return length;
+
+		default:
+			bson_validate_error(v, data - 1, "unknown element type");
+			return -1;
+	}
+
+	bson_validate_error(v, data, "a value runs past its document");
+	return -1;
+}
+
+/* A document with at most size bytes. Returns its length, or 0 if it isn't
+ * valid. */
+static int bson_validate_element_document(bson_validator *v, char *data, int size, int depth)
+{
+	char    *ptr, *end;
+	int32_t  length;
+	int      type, name_size, value_size;
+
+	if (depth > BSON_VALIDATE_MAX_DEPTH) {
+		return bson_validate_error(v, data, "documents are nested too deep");
+	}
+	if (size < 5) {
+		return bson_validate_error(v, data, "a document's length runs past the data");
+	}
+	length = bson_validate_int32(data);
+	if (length < 5 || length > size) {
+		return bson_validate_error(v, data, "a document's length is out of bounds");
+	}
+
+	/* The elements go up to the trailing 0x00 */
+	end = data + length - 1;
+	if (*end != '\0') {
+		return bson_validate_error(v, end, "a document doesn't end with 0x00");
+	}
+
+	ptr = data + 4;
+	while (ptr < end) {
+		type = (unsigned char) *ptr++;
+
+		if (!(name_size = bson_validate_cstring(v, ptr, end - ptr))) {
+			return 0;
+		}
+		ptr += name_size;
+
+		value_size = bson_validate_value(v, type, ptr, end - ptr, depth);
+		if (value_size == -2) {
+			return bson_validate_error(v, ptr, "a value runs past its document");
+		}
+		if (value_size < 0) {
+			return 0;
+		}
+		ptr += value_size;
+	}
+
+	return length;
+}
+
+int bson_validate_document(char *data, int size, int flags, char **error_message)
+{
+	bson_validator v;
+
+	bson_validator_init(&v, data, flags, error_message);
+	return bson_validate_element_document(&v, data, size, 0);
+}
+
+int bson_validate_documents(char *data, int size, int flags, char **error_message)
+{
+	bson_validator v;
+	int            offset = 0, length;
+
+	bson_validator_init(&v, data, flags, error_message);
+
+	while (offset < size) {
+		if (!(length = bson_validate_element_document(&v, data + offset, size - offset, 0))) {
+			return 0;
+		}
+		offset += length;
+	}
+
+	return 1;
+}
+
+/*
+ * Local variables:
+ * tab-width: 4
+ * c-basic-offset: 4
+ * End:
+ * vim600: fdm=marker
+ * vim: noet sw=4 ts=4
+ */
@@ -0,0 +1,66 @@
+/**
+ *  Copyright 2009-2014 MongoDB, Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+#ifndef __MCON_BSON_VALIDATE_H__
+#define __MCON_BSON_VALIDATE_H__
+
+#include "types.h"
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+/* What is checked, for the manager's validate_replies option and for the
+ * flags of bson_validate_document(). The structure is always checked: that
+ * every length stays within its document, that names and strings end where
+ * they should, and that every type is known. */
+#define BSON_VALIDATE_NONE      0x00
+#define BSON_VALIDATE_STRUCTURE 0x01
+#define BSON_VALIDATE_UTF8      0x02 /* Names and strings are valid UTF-8 */
+
+/* Documents that are nested deeper than this are taken to be broken */
+#define BSON_VALIDATE_MAX_DEPTH 200
+
+/* Checks the document at data, which can't go past size bytes. Returns the
+ * length of the document, or 0 if it isn't valid, in which case
+ * *error_message is set and must be free()d. */
+int bson_validate_document(char *data, int size, int flags, char **error_message);
+
+/* Checks the documents of a reply, which fill the size bytes at data. Returns
+ * 1 if they are valid, and 0 otherwise, with *error_message set. */
+int bson_validate_documents(char *data, int size, int flags, char **error_message);
+
+/* Whether the length bytes at data are valid UTF-8. Uses AVX2 or SSE4.2 when
+ * the CPU has them, see bson_utf8_implementation(). */
+int bson_utf8_valid(const char *data, int length);
+int bson_utf8_valid_scalar(const char *data, int length);
+
+/* Which one bson_utf8_valid() uses: "avx2", "sse4.2" or "scalar" */
+const char *bson_utf8_implementation(void);
+
+#if defined(__cplusplus)
+}
+#endif
+
+#endif
+
+/*
+ * Local variables:
+ * tab-width: 4
+ * c-basic-offset: 4
+ * End:
+ * vim600: fdm=marker
+ * vim: noet sw=4 ts=4
+ */
@@ -0,0 +1,167 @@
+/**
+ *  Copyright 2009-2014 MongoDB, Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "buffer.h"
+
+/* Every buffer starts with its size, which keeps the data aligned like
+ * malloc()'s */
+typedef union _mongo_buffer_header
+{
+	int    size;
+	double align[2];
+} mongo_buffer_header;
+
+#define MONGO_BUFFER_HEADER(buffer) ((mongo_buffer_header *)(buffer) - 1)
+
+typedef struct _mongo_buffer_pool
+{
+	int                  count;
+	int                  retained;
+	mongo_buffer_header *buffers[MONGO_BUFFER_POOL_COUNT];
+} mongo_buffer_pool;
+
+/* The pool is only touched by its own thread. The key is there to free the
+ * pooled buffers when the thread exits. */
+static __thread mongo_buffer_pool mongo_buffer_thread_pool;
+static pthread_key_t              mongo_buffer_pool_key;
+static pthread_once_t             mongo_buffer_pool_once = PTHREAD_ONCE_INIT;
+
+static int64_t mongo_buffer_allocated = 0;
+static int64_t mongo_buffer_reused = 0;
+
+static void mongo_buffer_pool_dtor(void *data)
+{
+	mongo_buffer_pool *pool = (mongo_buffer_pool *)data;
+	int                i;
+
+	for (i = 0; i < pool->count; i++) {
+		free(pool->buffers[i]);
+	}
+	pool->count = 0;
+	pool->retained = 0;
+}
+
+static void mongo_buffer_pool_init(void)
+{
+	pthread_key_create(&mongo_buffer_pool_key, mongo_buffer_pool_dtor);
+}
+
+/* Rounds size up to the next power of two */
+static int mongo_buffer_round(int size)
+{
+	int rounded = MONGO_BUFFER_MIN_SIZE;
+
+	while (rounded < size) {
+		rounded *= 2;
+	}
+	return rounded;
+}
+
+void *mongo_buffer_alloc(int size)
+{
+	mongo_buffer_pool   *pool = &mongo_buffer_thread_pool;
+	mongo_buffer_header *header;
+	int                  i, best = -1;
+
+	/* The smallest pooled buffer that is large enough */
+	for (i = 0; i < pool->count; i++) {
+		if (pool->buffers[i]->size >= size && (best < 0 || pool->buffers[i]->size < pool->buffers[best]->size)) {
+			best = i;
+		}
+	}
+
+	if (best >= 0) {
+		header = pool->buffers[best];
+		pool->buffers[best] = pool->buffers[--pool->count];
+		pool->retained -= header->size;
+		__sync_add_and_fetch(&mongo_buffer_reused, 1);
+		return header + 1;
+	}
+
+	size = mongo_buffer_round(size);
+	header = malloc(sizeof(mongo_buffer_header) + size);
+	header->size = size;
+	__sync_add_and_fetch(&mongo_buffer_allocated, 1);
+
+	return header + 1;
+}
+
+void *mongo_buffer_realloc(void *buffer, int size)
+{
+	mongo_buffer_header *header;
+
+	if (!buffer) {
+		return mongo_buffer_alloc(size);
+	}
+
+	header = MONGO_BUFFER_HEADER(buffer);
+	if (header->size >= size) {
+		return buffer;
+	}
+
+	size = mongo_buffer_round(size);
+	header = realloc(header, sizeof(mongo_buffer_header) + size);
+	header->size = size;
+	__sync_add_and_fetch(&mongo_buffer_allocated, 1);
+
+	return header + 1;
+}
+
+void mongo_buffer_free(void *buffer)
+{
+	mongo_buffer_pool   *pool = &mongo_buffer_thread_pool;
+	mongo_buffer_header *header;
+
+	if (!buffer) {
+		return;
+	}
+
+	header = MONGO_BUFFER_HEADER(buffer);
+	if (pool->count == MONGO_BUFFER_POOL_COUNT || pool->retained + header->size > MONGO_BUFFER_POOL_RETAIN) {
+		free(header);
+		return;
+	}
+
+	if (pool->count == 0) {
+		pthread_once(&mongo_buffer_pool_once, mongo_buffer_pool_init);
+		pthread_setspecific(mongo_buffer_pool_key, pool);
+	}
+	pool->buffers[pool->count++] = header;
+	pool->retained += header->size;
+}
+
+int mongo_buffer_size(void *buffer)
+{
+	return MONGO_BUFFER_HEADER(buffer)->size;
+}
+
+void mongo_buffer_stats(int64_t *allocated, int64_t *reused)
+{
+	*allocated = __sync_add_and_fetch(&mongo_buffer_allocated, 0);
+	*reused = __sync_add_and_fetch(&mongo_buffer_reused, 0);
+}
+
+/*
+ * Local variables:
+ * tab-width: 4
+ * c-basic-offset: 4
+ * End:
+ * vim600: fdm=marker
+ * vim: noet sw=4 ts=4
+ */
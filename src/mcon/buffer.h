@@ -0,0 +1,58 @@
+/**
+ *  Copyright 2009-2014 MongoDB, Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+#ifndef __MCON_BUFFER_H__
+#define __MCON_BUFFER_H__
+
+#include <stdint.h>
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+/* Each thread keeps the buffers that packets and replies were built in, and
+ * hands them out again for the next operation. Buffers are sized in powers
+ * of two, starting at MONGO_BUFFER_MIN_SIZE, and a thread keeps at most
+ * MONGO_BUFFER_POOL_COUNT of them, of at most MONGO_BUFFER_POOL_RETAIN bytes
+ * together; anything beyond that is freed. */
+#define MONGO_BUFFER_MIN_SIZE      1024
+#define MONGO_BUFFER_POOL_COUNT    8
+#define MONGO_BUFFER_POOL_RETAIN   (8 * 1024 * 1024)
+
+/* Buffers from mongo_buffer_alloc() can only be resized with
+ * mongo_buffer_realloc() and freed with mongo_buffer_free() */
+void *mongo_buffer_alloc(int size);
+void *mongo_buffer_realloc(void *buffer, int size);
+void mongo_buffer_free(void *buffer);
+int mongo_buffer_size(void *buffer);
+
+/* The number of buffers that had to be malloc()ed, and the number that were
+ * taken from a pool instead, by all threads */
+void mongo_buffer_stats(int64_t *allocated, int64_t *reused);
+
+#if defined(__cplusplus)
+}
+#endif
+
+#endif
+
+/*
+ * Local variables:
+ * tab-width: 4
+ * c-basic-offset: 4
+ * End:
+ * vim600: fdm=marker
+ * vim: noet sw=4 ts=4
+ */
@@ -19,11 +19,18 @@
 #include "parse.h"
 #include "manager.h"
 #include "connections.h"
+#include "pool.h"
 #include "str.h"
 #include "contrib/strndup.h"
 #include "bson_helpers.h"
 #include "contrib/md5.h"
 #include "mini_bson.h"
+#include "bson_validate.h"
+#include "collection.h"
+#include "io.h"
+#include "buffer.h"
+#include "packet.h"
+#include "mux.h"
 
 #include <stdlib.h>
 #include <stdio.h>
@@ -33,16 +40,54 @@
 #define INT_32  4
 #define FLAGS   0
 
-#define MONGO_REPLY_FLAG_QUERY_FAILURE 0x02
-
 /* Helper functions */
 int mongo_connection_get_reqid(mongo_connection *con)
 {
-	con->last_reqid++;
-	return con->last_reqid;
+	/* Several request threads can build packets for the same connection */
+	return __sync_add_and_fetch(&con->last_reqid, 1);
+}
+
+/* Checking out a connection gives the calling thread exclusive use of its
+ * socket, so that the bytes of two requests are never interleaved. The lock
+ * is recursive, so that f.e. a ping can keep the connection checked out while
+ * mongo_connect_send_packet() checks it out again. */
+void mongo_connection_checkout(mongo_connection *con)
+{
+	pthread_mutex_lock(&con->lock);
+}
+
+void mongo_connection_checkin(mongo_connection *con)
+{
+	pthread_mutex_unlock(&con->lock);
+}
+
+/* A connection is destroyed once the manager, and every thread that looked it
+ * up, has given up its reference */
+void mongo_connection_addref(mongo_connection *con)
+{
+	__sync_add_and_fetch(&con->refcount, 1);
 }
 
-mongo_connection *mongo_connection_create(mongo_con_manager *manager, char *hash, mongo_server_def *server_def, mongo_server_options *options, char **error_message)
+void mongo_connection_release(mongo_con_manager *manager, void *data, int why)
+{
+	mongo_connection *con = (mongo_connection *)data;
+
+	if (__sync_sub_and_fetch(&con->refcount, 1) == 0) {
+		mongo_connection_destroy(manager, con, why);
+	}
+}
+
+void mongo_connection_init_lock(mongo_connection *con)
+{
+	pthread_mutexattr_t attr;
+
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init(&con->lock, &attr);
+	pthread_mutexattr_destroy(&attr);
+}
+
+mongo_connection *mongo_connection_create(mongo_con_manager *manager, mongo_server_id *id, mongo_server_def *server_def, mongo_server_options *options, char **error_message)
 {
 	mongo_connection *tmp;
 
@@ -52,6 +97,8 @@ mongo_connection *mongo_connection_create(mongo_con_manager *manager, char *hash
 	tmp->last_reqid = rand();
 	tmp->connection_type = MONGO_NODE_STANDALONE;
 	tmp->connected = 0;
+	tmp->refcount = 1;
+	tmp->last_rtt_us = -1;
 
 	/* Default server options */
 	/* If we don't know the version, assume 1.8.0 */
@@ -65,8 +112,14 @@ mongo_connection *mongo_connection_create(mongo_con_manager *manager, char *hash
 	tmp->min_wire_version = MONGO_CONNECTION_DEFAULT_MIN_WIRE_VERSION;
 	tmp->max_wire_version = MONGO_CONNECTION_DEFAULT_MAX_WIRE_VERSION;
 
-	/* Store hash */
-	tmp->hash = strdup(hash);
+	/* Store identity */
+	tmp->id = id;
+	mongo_server_id_addref(id);
+	tmp->hash = strdup(id->hash);
+	tmp->hash_key = id->key;
+
+	mongo_connection_init_lock(tmp);
+	tmp->created = time(NULL);
 
 	/* Connect */
 	mongo_manager_log(manager, MLOG_CON, MLOG_INFO, "connection_create: creating new connection for %s:%d", server_def->host, server_def->port);
@@ -74,6 +127,8 @@ mongo_connection *mongo_connection_create(mongo_con_manager *manager, char *hash
 	if (!tmp->socket) {
 		mongo_manager_log(manager, MLOG_CON, MLOG_WARN, "connection_create: error while creating connection for %s:%d: %s", server_def->host, server_def->port, *error_message);
 		mongo_manager_blacklist_register(manager, tmp);
+		pthread_mutex_destroy(&tmp->lock);
+		mongo_server_id_release(tmp->id);
 		free(tmp->hash);
 		free(tmp);
 		return NULL;
@@ -82,17 +137,58 @@ mongo_connection *mongo_connection_create(mongo_con_manager *manager, char *hash
 	return tmp;
 }
 
+static void mongo_connection_free_tags(char **tags)
+{
+	int i;
+
+	for (i = 0; tags && tags[i]; i++) {
+		free(tags[i]);
+	}
+	free(tags);
+}
+
+static int mongo_connection_tags_equal(char **a, char **b)
+{
+	int i;
+
+	for (i = 0; a && b && a[i] && b[i]; i++) {
+		if (strcmp(a[i], b[i]) != 0) {
+			return 0;
+		}
+	}
+	return (!a || !a[i]) && (!b || !b[i]);
+}
+
+/* Other threads may be iterating over the connection's tags while the
+ * monitor runs ismaster, so the array is never modified in place. A changed
+ * set of tags replaces the array, and the old one is kept around until the
+ * connection is destroyed. */
+static void mongo_connection_replace_tags(mongo_connection *con, char **tags, int tag_count)
+{
+	if (mongo_connection_tags_equal(con->tags, tags)) {
+		mongo_connection_free_tags(tags);
+		return;
+	}
+
+	if (con->tags) {
+		if (!con->retired_tags) {
+			con->retired_tags = mcon_init_collection(sizeof(char**));
+		}
+		mcon_collection_add((mcon_collection *)con->retired_tags, con->tags);
+	}
+
+	__sync_synchronize();
+	con->tags = tags;
+	con->tag_count = tag_count;
+}
+
 void mongo_connection_destroy(mongo_con_manager *manager, void *data, int why)
 {
-	int current_pid, connection_pid;
 	int i;
 	mongo_connection *con = (mongo_connection *)data;
 
-	current_pid = getpid();
-	connection_pid = mongo_server_hash_to_pid(con->hash);
-
 	/* Only close the connection if it matches the current PID */
-	if (current_pid == connection_pid) {
+	if (con->id->pid == mongo_current_pid()) {
 		mongo_manager_log(manager, MLOG_CON, MLOG_FINE, "mongo_connection_destroy: Destroying connection object for %s", con->hash);
 
 		if (con->socket) {
@@ -100,10 +196,16 @@ void mongo_connection_destroy(mongo_con_manager *manager, void *data, int why)
 			manager->close(con, why);
 			con->socket = NULL;
 
-			for (i = 0; i < con->tag_count; i++) {
-				free(con->tags[i]);
+			mongo_connection_free_tags(con->tags);
+			free(con->nonce);
+			if (con->retired_tags) {
+				mcon_collection *retired = (mcon_collection *)con->retired_tags;
+
+				for (i = 0; i < retired->count; i++) {
+					mongo_connection_free_tags((char **)retired->data[i]);
+				}
+				mcon_collection_free(retired);
 			}
-			free(con->tags);
 
 			if (con->cleanup_list) {
 				mongo_connection_deregister_callback *ptr = con->cleanup_list;
@@ -125,45 +227,169 @@ void mongo_connection_destroy(mongo_con_manager *manager, void *data, int why)
 				} while (1);
 				con->cleanup_list = NULL;
 			}
+			if (con->pool) {
+				mongo_pool_destroy(manager, con->pool);
+			}
+			if (con->mux) {
+				mongo_mux_destroy(con->mux);
+			}
+			pthread_mutex_destroy(&con->lock);
+			mongo_server_id_release(con->id);
 			free(con->hash);
 			free(con);
 		}
 	} else {
-		mongo_manager_log(manager, MLOG_CON, MLOG_INFO, "mongo_connection_destroy: The process pid (%d) for %s doesn't match the connection pid (%d).", current_pid, con->hash, connection_pid);
+		mongo_manager_log(manager, MLOG_CON, MLOG_INFO, "mongo_connection_destroy: The process pid (%d) for %s doesn't match the connection pid (%d).", mongo_current_pid(), con->hash, con->id->pid);
 	}
 }
 
-#define MONGO_REPLY_HEADER_SIZE 36
+/* The deadline for an operation that starts now, and whether the budget set
+ * it, see mongo_connection_deadline() */
+static int64_t mongo_connection_deadline_ex(mongo_connection *con, int timeout, int *budget)
+{
+	int64_t now = mongo_now_ms();
+	int64_t deadline;
 
-/* Returns 1 if it worked, and 0 if it didn't. If 0 is returned, *error_message
- * is set and must be free()d. On success *data_buffer is set and must be free()d */
-static int mongo_connect_send_packet(mongo_con_manager *manager, mongo_connection *con, mongo_server_options *options, mcon_str *packet, char **data_buffer, char **error_message)
+	if (timeout == 0) {
+		timeout = MONGO_IO_DEFAULT_TIMEOUT;
+	}
+	deadline = timeout < 0 ? -1 : now + timeout;
+	*budget = 0;
+
+	if (con->budget_ms > 0) {
+		if (deadline < 0 || now + con->budget_ms < deadline) {
+			deadline = now + con->budget_ms;
+			*budget = 1;
+		}
+		con->budget_ms = 0;
+	}
+
+	return deadline;
+}
+
+/* An operation has one deadline for sending its request and reading the
+ * whole reply, rather than a timeout for each read. timeout is socketTimeoutMS
+ * or connectTimeoutMS: negative for no limit, and 0 for the default. A budget
+ * set with mongo_connection_set_budget() makes it sooner. */
+void mongo_connection_deadline_start(mongo_connection *con, int timeout)
+{
+	con->deadline = mongo_connection_deadline_ex(con, timeout, &con->deadline_budget);
+}
+
+/* The deadline that mongo_connection_deadline_start() would set, for
+ * operations that keep their own, see mux.c */
+int64_t mongo_connection_deadline(mongo_connection *con, int timeout)
+{
+	int budget;
+
+	return mongo_connection_deadline_ex(con, timeout, &budget);
+}
+
+/* Limits the next operation on the connection to budget_ms, if that is
+ * sooner than its socket timeout. For a query with maxTimeMS, that is the
+ * time it has left plus MONGO_CONNECTION_BUDGET_MARGIN, so that the server
+ * gets to report the time out itself.
+ *
+ * Running out of a budget doesn't mean that the server has failed, so it
+ * isn't marked as such, see mongo_connection_timed_out(). The reply still
+ * arrives later though, so only sockets that don't outlive the operation
+ * take a budget: sockets checked out of a pool, which are closed rather than
+ * checked in when the operation fails, and multiplexed connections, which
+ * drop late replies. On other connections, the budget is ignored. */
+void mongo_connection_set_budget(mongo_connection *con, int budget_ms)
+{
+	if (con->pool && !con->mux) {
+		return;
+	}
+	con->budget_ms = budget_ms;
+}
+
+/* For the IO callbacks, when an operation has run out of time reading or
+ * writing. Returns -81 if it ran out of its budget, which only fails the
+ * operation. Otherwise the server is marked as failed, and -80 returned. */
+int mongo_connection_timed_out(mongo_con_manager *manager, mongo_connection *con, char *error_message)
+{
+	if (con->deadline && con->deadline_budget) {
+		mongo_manager_log(manager, MLOG_CON, MLOG_INFO, "io: operation on %s ran out of its budget: %s", con->hash, error_message);
+		return -81;
+	}
+
+	mongo_manager_server_failed(manager, con, error_message);
+	return -80;
+}
+
+/* The time left until the deadline, for the IO callbacks that take a timeout:
+ * -1 for no limit, and at least 1ms otherwise, as 0 means the default */
+int mongo_deadline_remaining(int64_t deadline)
+{
+	int64_t remaining;
+
+	if (deadline < 0) {
+		return -1;
+	}
+	remaining = deadline - mongo_now_ms();
+	return remaining > 0 ? (int)remaining : 1;
+}
+
+int mongo_connection_deadline_remaining(mongo_connection *con)
+{
+	return mongo_deadline_remaining(con->deadline);
+}
+
+/* Makes the error message for a reply that reports a query failure, from
+ * its first document, which starts at document */
+char *mongo_connection_query_failure(char *document)
+{
+	char *ptr = document + sizeof(int32_t); /* Skip the length */
+	char *err, *error_message;
+	int32_t code;
+	bson_field fields[] = {
+		BSON_FIELD("$err", BSON_STRING, &err),
+		BSON_FIELD("code", BSON_INT32, &code),
+	};
+
+	/* Find the error */
+	bson_extract_fields(ptr, fields, 2);
+	if (!fields[0].found) {
+		return strdup("send_package: the query returned an unknown error");
+	}
+
+	error_message = malloc(256 + strlen(err));
+	if (fields[1].found) {
+		snprintf(error_message, 256 + strlen(err), "send_package: the query returned a failure: %s (code: %d)", err, code);
+	} else {
+		snprintf(error_message, 256 + strlen(err), "send_package: the query returned a failure: %s", err);
+	}
+	return error_message;
+}
+
+/* Reads one reply by deadline, and sets *response_to to the request ID that
+ * it answers. Returns 1 if it worked. Returns 0 if the reply was read but
+ * reports a failure, and -1 if the socket can't be used any more; in both
+ * cases *error_message is set and must be free()d. On success *data_buffer
+ * is set and must be freed with mongo_buffer_free() */
+int mongo_connection_read_reply(mongo_con_manager *manager, mongo_connection *con, mongo_server_options *options, int64_t deadline, int32_t *response_to, char **data_buffer, char **error_message)
 {
 	int            read;
 	uint32_t       data_size;
 	char           reply_buffer[MONGO_REPLY_HEADER_SIZE];
 	uint32_t       flags; /* To check for query reply status */
 
-	/* Send and wait for reply */
-	if (manager->send(con, options, packet->d, packet->l, error_message) == -1) {
-		mcon_str_ptr_dtor(packet);
-		return 0;
-	}
-	mcon_str_ptr_dtor(packet);
-	read = manager->recv_header(con, options, con->connected ? options->socketTimeoutMS : options->connectTimeoutMS, reply_buffer, MONGO_REPLY_HEADER_SIZE, error_message);
+	read = manager->recv_header(con, options, mongo_deadline_remaining(deadline), reply_buffer, MONGO_REPLY_HEADER_SIZE, error_message);
 	if (read < 0) {
 		/* Error already populated */
-		return 0;
+		return -1;
 	}
 
 	mongo_manager_log(manager, MLOG_CON, MLOG_FINE, "send_packet: read from header: %d", read);
 	if (read < MONGO_REPLY_HEADER_SIZE) {
 		*error_message = malloc(256);
 		snprintf(*error_message, 256, "send_package: the amount of bytes read (%d) is less than the header size (%d)", read, MONGO_REPLY_HEADER_SIZE);
-		return 0;
+		return -1;
 	}
 
 	/* Read result flags */
+	*response_to = MONGO_32(*(int*)(reply_buffer + sizeof(int32_t) * 2));
 	flags = MONGO_32(*(int*)(reply_buffer + sizeof(int32_t) * 4));
 
 	/* Read the rest of the data */
@@ -174,40 +400,223 @@ static int mongo_connect_send_packet(mongo_con_manager *manager, mongo_connectio
 	if (con->max_bson_size && data_size > (uint32_t)con->max_bson_size) {
 		*error_message = malloc(256);
 		snprintf(*error_message, 256, "send_package: data corruption: the returned size of the reply (%d) is larger than the maximum allowed size (%d)", data_size, con->max_bson_size);
-		return 0;
+		return -1;
 	}
 
-	/* Read data */
-	*data_buffer = malloc(data_size + 1);
-	if (manager->recv_data(con, options, con->connected ? options->socketTimeoutMS : options->connectTimeoutMS, *data_buffer, data_size, error_message) <= 0) {
-		free(*data_buffer);
-		return 0;
+	/* Read data. The documents are followed by a zero length, so that the
+	 * end of a reply can be found without its number of documents, which
+	 * is also how an empty one looks. */
+	*data_buffer = mongo_buffer_alloc(data_size + sizeof(int32_t));
+	memset(*data_buffer + data_size, 0, sizeof(int32_t));
+	if (data_size > 0 && manager->recv_data(con, options, mongo_deadline_remaining(deadline), *data_buffer, data_size, error_message) <= 0) {
+		mongo_buffer_free(*data_buffer);
+		return -1;
+	}
+	__sync_add_and_fetch(&manager->io_stats.replies, 1);
+	__sync_add_and_fetch(&manager->io_stats.bytes, MONGO_REPLY_HEADER_SIZE + data_size);
+
+	/* Check that the documents can be walked, before anything trusts the
+	 * lengths in them */
+	if (manager->validate_replies && data_size > 0) {
+		char *invalid = NULL;
+
+		if (!bson_validate_documents(*data_buffer, data_size, manager->validate_replies, &invalid)) {
+			*error_message = malloc(256 + strlen(invalid));
+			snprintf(*error_message, 256 + strlen(invalid), "send_package: data corruption: %s", invalid);
+			free(invalid);
+			mongo_buffer_free(*data_buffer);
+			return -1;
+		}
 	}
 
 	/* Check for a query error */
 	if (flags & MONGO_REPLY_FLAG_QUERY_FAILURE) {
-		char *ptr = *data_buffer + sizeof(int32_t); /* Skip the length */
-		char *err;
-		int32_t code;
+		*error_message = mongo_connection_query_failure(*data_buffer);
+		mongo_buffer_free(*data_buffer);
+		return 0;
+	}
 
-		/* Find the error */
-		if (bson_find_field_as_string(ptr, "$err", &err)) {
-			*error_message = malloc(256 + strlen(err));
+	return 1;
+}
 
-			if (bson_find_field_as_int32(ptr, "code", &code)) {
-				snprintf(*error_message, 256 + strlen(err), "send_package: the query returned a failure: %s (code: %d)", err, code);
-			} else {
-				snprintf(*error_message, 256 + strlen(err), "send_package: the query returned a failure: %s", err);
-			}
+/* Reads one reply, by the deadline of the operation that sent the request,
+ * or within the socket timeout for replies to pipelined requests. Returns 1
+ * if it worked, and 0 if it didn't. If 0 is returned, *error_message is set
+ * and must be free()d. On success *data_buffer is set and must be freed with mongo_buffer_free() */
+static int mongo_connection_recv_reply_locked(mongo_con_manager *manager, mongo_connection *con, mongo_server_options *options, char **data_buffer, char **error_message)
+{
+	int32_t response_to;
+	int     retval;
+
+	if (!con->deadline) {
+		mongo_connection_deadline_start(con, con->connected ? options->socketTimeoutMS : options->connectTimeoutMS);
+	}
+	retval = mongo_connection_read_reply(manager, con, options, con->deadline, &response_to, data_buffer, error_message);
+	con->deadline = 0;
+
+	return retval == 1;
+}
+
+/* Returns 1 if it worked, and 0 if it didn't. If 0 is returned, *error_message
+ * is set and must be free()d. On success *data_buffer is set and must be freed with mongo_buffer_free() */
+static int mongo_connection_send_locked(mongo_con_manager *manager, mongo_connection *con, mongo_server_options *options, char *packet, int size, char **data_buffer, char **error_message)
+{
+	if (con->mux) {
+		struct iovec iov;
+
+		iov.iov_base = packet;
+		iov.iov_len = size;
+		return mongo_mux_exchange(manager, con, options, &iov, 1, data_buffer, error_message);
+	}
+
+	mongo_connection_deadline_start(con, con->connected ? options->socketTimeoutMS : options->connectTimeoutMS);
+
+	/* Send and wait for reply */
+	if (manager->send(con, options, packet, size, error_message) == -1) {
+		con->deadline = 0;
+		return 0;
+	}
+
+	return mongo_connection_recv_reply_locked(manager, con, options, data_buffer, error_message);
+}
+
+static int mongo_connect_send_packet_locked(mongo_con_manager *manager, mongo_connection *con, mongo_server_options *options, mcon_str *packet, char **data_buffer, char **error_message)
+{
+	int retval;
+
+	retval = mongo_connection_send_locked(manager, con, options, packet->d, packet->l, data_buffer, error_message);
+	mcon_str_ptr_dtor(packet);
+
+	return retval;
+}
+
+/* Sends one of the admin commands from bson_admin_packet(), which are copied
+ * to the stack rather than built */
+static int mongo_connect_send_admin(mongo_con_manager *manager, mongo_connection *con, mongo_server_options *options, int command, char **data_buffer, char **error_message)
+{
+	char packet[MONGO_ADMIN_PACKET_SIZE];
+	int  size, retval;
+
+	size = bson_admin_packet(command, mongo_connection_get_reqid(con), packet);
+	if (con->mux) {
+		/* The socket is shared until the reply arrives, see mux.c */
+		return mongo_connection_send_locked(manager, con, options, packet, size, data_buffer, error_message);
+	}
+
+	mongo_connection_checkout(con);
+	retval = mongo_connection_send_locked(manager, con, options, packet, size, data_buffer, error_message);
+	mongo_connection_checkin(con);
+
+	return retval;
+}
+
+static int mongo_connect_send_packet(mongo_con_manager *manager, mongo_connection *con, mongo_server_options *options, mcon_str *packet, char **data_buffer, char **error_message)
+{
+	int retval;
+
+	if (con->mux) {
+		return mongo_connect_send_packet_locked(manager, con, options, packet, data_buffer, error_message);
+	}
+
+	/* Keep the socket to ourselves until the reply has been read */
+	mongo_connection_checkout(con);
+	retval = mongo_connect_send_packet_locked(manager, con, options, packet, data_buffer, error_message);
+	mongo_connection_checkin(con);
+
+	return retval;
+}
+
+/* Sends a packet that was built from segments, see packet.h, and reads the
+ * reply. The packet gets a new request ID, and is left for the caller to
+ * free, or to send again. Returns 1 if it worked, and 0 if it didn't. If 0
+ * is returned, *error_message is set and must be free()d. On success
+ * *data_buffer is set and must be freed with mongo_buffer_free() */
+int mongo_connection_send_packet(mongo_con_manager *manager, mongo_connection *con, mongo_server_options *options, mongo_packet *packet, char **data_buffer, char **error_message)
+{
+	struct iovec  stack_iov[MONGO_PACKET_STACK_IOVECS], *iov = stack_iov;
+	int           count, retval = 0;
+
+	if (packet->count > MONGO_PACKET_STACK_IOVECS) {
+		iov = malloc(packet->count * sizeof(struct iovec));
+	}
+
+	mongo_packet_finish(packet, mongo_connection_get_reqid(con));
+	count = mongo_packet_iovecs(packet, iov);
+
+	if (con->mux) {
+		retval = mongo_mux_exchange(manager, con, options, iov, count, data_buffer, error_message);
+	} else {
+		mongo_connection_checkout(con);
+		mongo_connection_deadline_start(con, con->connected ? options->socketTimeoutMS : options->connectTimeoutMS);
+
+		if (manager->sendv(con, options, iov, count, error_message) == -1) {
+			con->deadline = 0;
 		} else {
-			*error_message = strdup("send_package: the query returned an unknown error");
+			retval = mongo_connection_recv_reply_locked(manager, con, options, data_buffer, error_message);
 		}
+		mongo_connection_checkin(con);
+	}
 
-		free(*data_buffer);
-		return 0;
+	if (iov != stack_iov) {
+		free(iov);
 	}
+	return retval;
+}
 
-	return 1;
+/* Every new round trip time counts for 1/MONGO_RTT_EWMA_WEIGHT of the
+ * average, so that a server that slows down is noticed within a few
+ * operations, without a single slow one throwing it out */
+#define MONGO_RTT_EWMA_WEIGHT 4
+
+/* Adds a round trip time to the connection's moving average, which ping_ms
+ * follows too. Samples come from heartbeats as well as from operations. Two
+ * threads adding one at the same time might lose one of them, which doesn't
+ * matter for an average. */
+void mongo_connection_rtt_add(mongo_connection *con, int64_t rtt_us)
+{
+	int64_t ewma = con->rtt_ewma_us;
+
+	if (rtt_us < 0) { /* some clocks do weird stuff */
+		rtt_us = 0;
+	}
+	if (con->last_rtt_us < 0) {
+		ewma = rtt_us;
+	} else {
+		ewma += (rtt_us - ewma) / MONGO_RTT_EWMA_WEIGHT;
+	}
+
+	con->rtt_ewma_us = ewma;
+	con->last_rtt_us = rtt_us;
+	con->ping_ms = (int)(ewma / 1000);
+}
+
+/* Called by the send callback just before a request goes out */
+void mongo_connection_io_sent(mongo_connection *con)
+{
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	con->sent_us = now.tv_sec * 1000000LL + now.tv_usec;
+}
+
+/* Called by the receive callbacks after every successful read. The first
+ * read after a request completes its round trip, whether the request was a
+ * query, a command, or one of our own pings. As any reply shows that the
+ * server is alive, a connection that is in use is never pinged, see
+ * mongo_connection_ping(). */
+void mongo_connection_io_received(mongo_connection *con)
+{
+	struct timeval now;
+	int64_t        now_us;
+
+	gettimeofday(&now, NULL);
+	con->last_io = now.tv_sec;
+
+	if (con->sent_us) {
+		now_us = now.tv_sec * 1000000LL + now.tv_usec;
+		mongo_connection_rtt_add(con, now_us - con->sent_us);
+		con->sent_us = 0;
+	}
 }
 
 int mongo_connection_ping_check(mongo_con_manager *manager, int last_ping, struct timeval *start)
@@ -225,29 +634,32 @@ int mongo_connection_ping_check(mongo_con_manager *manager, int last_ping, struc
  * Returns 1 when it worked, and 0 when an error was encountered. */
 int mongo_connection_ping(mongo_con_manager *manager, mongo_connection *con, mongo_server_options *options, char **error_message)
 {
-	mcon_str      *packet;
 	struct timeval start, end;
 	char          *data_buffer;
 
-	/* If we haven't hit the ping_interval yet, then there is no need to do a roundtrip to the server */
-	if (!mongo_connection_ping_check(manager, con->last_ping, &start)) {
+	/* The connection stays checked out until the results are stored, so
+	 * that concurrent requests don't all ping the same server at once */
+	mongo_connection_checkout(con);
+
+	/* If we haven't hit the ping_interval yet, then there is no need to do a
+	 * roundtrip to the server. Neither is there if a reply came in since, as
+	 * that tells us as much as a ping would. */
+	if (!mongo_connection_ping_check(manager, con->last_io > con->last_ping ? con->last_io : con->last_ping, &start)) {
+		mongo_connection_checkin(con);
 		return 1;
 	}
 	mongo_manager_log(manager, MLOG_CON, MLOG_INFO, "is_ping: pinging %s", con->hash);
-	packet = bson_create_ping_packet(con);
-	if (!mongo_connect_send_packet(manager, con, options, packet, &data_buffer, error_message)) {
+	if (!mongo_connect_send_admin(manager, con, options, MONGO_ADMIN_PING, &data_buffer, error_message)) {
+		mongo_connection_checkin(con);
 		return 0;
 	}
 	gettimeofday(&end, NULL);
-	free(data_buffer);
+	mongo_buffer_free(data_buffer);
 
 	con->last_ping = end.tv_sec;
-	con->ping_ms = (end.tv_sec - start.tv_sec) * 1000 + (end.tv_usec - start.tv_usec) / 1000;
-	if (con->ping_ms < 0) { /* some clocks do weird stuff */
-		con->ping_ms = 0;
-	}
 
 	mongo_manager_log(manager, MLOG_CON, MLOG_INFO, "is_ping: last pinged at %ld; time: %dms", con->last_ping, con->ping_ms);
+	mongo_connection_checkin(con);
 
 	return 1;
 }
@@ -263,46 +675,118 @@ int mongo_connection_ping(mongo_con_manager *manager, mongo_connection *con, mon
  *    not being what the server thought it is) - in that case, the server in
  *    the last argument is changed
  * 4: when the call worked, but wasn't within our supported wire version range */
-int mongo_connection_ismaster(mongo_con_manager *manager, mongo_connection *con, mongo_server_options *options, char **repl_set_name, int *nr_hosts, char ***found_hosts, char **error_message, mongo_server_def *server)
+/* Digest of the ismaster fields that make up the topology: when it doesn't
+ * change between two runs, the monitor doesn't need to publish a new
+ * topology snapshot */
+static uint64_t mongo_connection_ismaster_digest(mongo_connection *con, char *strings[2], char *arrays[3], char *tags)
+{
+	uint64_t digest = MONGO_DIGEST_INIT;
+	int32_t  length;
+	int      i;
+
+	digest = mongo_digest_update(digest, &con->connection_type, sizeof(con->connection_type));
+	digest = mongo_digest_update(digest, &con->min_wire_version, sizeof(con->min_wire_version));
+	digest = mongo_digest_update(digest, &con->max_wire_version, sizeof(con->max_wire_version));
+	digest = mongo_digest_update(digest, &con->max_bson_size, sizeof(con->max_bson_size));
+	digest = mongo_digest_update(digest, &con->max_message_size, sizeof(con->max_message_size));
+	digest = mongo_digest_update(digest, &con->max_write_batch_size, sizeof(con->max_write_batch_size));
+
+	for (i = 0; i < 2; i++) {
+		if (strings[i]) {
+			digest = mongo_digest_update(digest, strings[i], strlen(strings[i]) + 1);
+		}
+		digest = mongo_digest_update(digest, "", 1);
+	}
+
+	/* Arrays and documents are hashed including their length prefix */
+	for (i = 0; i < 3; i++) {
+		if (arrays[i]) {
+			memcpy(&length, arrays[i] - 4, sizeof(int32_t));
+			digest = mongo_digest_update(digest, arrays[i] - 4, length);
+		}
+		digest = mongo_digest_update(digest, "", 1);
+	}
+	if (tags) {
+		memcpy(&length, tags - 4, sizeof(int32_t));
+		digest = mongo_digest_update(digest, tags - 4, length);
+	}
+
+	return digest;
+}
+
+static int mongo_connection_ismaster_process(mongo_con_manager *manager, mongo_connection *con, char *data_buffer, char **repl_set_name, int *nr_hosts, char ***found_hosts, char **error_message, mongo_server_def *server, struct timeval *now);
+static char *mongo_connection_getnonce_process(mongo_con_manager *manager, char *data_buffer, char **error_message);
+
+static int mongo_connection_ismaster_locked(mongo_con_manager *manager, mongo_connection *con, mongo_server_options *options, char **repl_set_name, int *nr_hosts, char ***found_hosts, char **error_message, mongo_server_def *server, int force)
 {
-	mcon_str      *packet;
 	char          *data_buffer;
-	int32_t        max_bson_size = 0, max_message_size = 0, max_write_batch_size = 0;
-	int32_t        min_wire_version = 0, max_wire_version = 0;
-	char          *set = NULL;      /* For replicaset in return */
-	char          *hosts, *passives = NULL, *ptr, *string;
-	char          *msg; /* If set and its value is "isdbgrid", it signals we connected to a mongos */
-	unsigned char  ismaster = 0, secondary = 0, arbiter = 0;
-	char          *connected_name, *we_think_we_are;
-	char          *tags;
 	struct timeval now;
-	int            retval = 1;
 
 	gettimeofday(&now, NULL);
-	if (((server ? con->last_replcheck : con->last_ismaster) + manager->ismaster_interval) > now.tv_sec) {
+	if (!force && ((server ? con->last_replcheck : con->last_ismaster) + manager->ismaster_interval) > now.tv_sec) {
 		mongo_manager_log(manager, MLOG_CON, MLOG_FINE, "ismaster: skipping: last ran at %ld, now: %ld, time left: %ld", con->last_ismaster, now.tv_sec, con->last_ismaster + manager->ismaster_interval - now.tv_sec);
 		return 2;
 	}
 
 	mongo_manager_log(manager, MLOG_CON, MLOG_INFO, "ismaster: start");
-	packet = bson_create_ismaster_packet(con);
-
-	if (!mongo_connect_send_packet(manager, con, options, packet, &data_buffer, error_message)) {
+	if (!mongo_connect_send_admin(manager, con, options, MONGO_ADMIN_ISMASTER, &data_buffer, error_message)) {
 		return 0;
 	}
 
+	return mongo_connection_ismaster_process(manager, con, data_buffer, repl_set_name, nr_hosts, found_hosts, error_message, server, &now);
+}
+
+/* Stores the server's properties from an ismaster reply, which it frees.
+ * Returns the same values as mongo_connection_ismaster(), apart from 2. */
+static int mongo_connection_ismaster_process(mongo_con_manager *manager, mongo_connection *con, char *data_buffer, char **repl_set_name, int *nr_hosts, char ***found_hosts, char **error_message, mongo_server_def *server, struct timeval *now)
+{
+	int32_t        max_bson_size = 0, max_message_size = 0, max_write_batch_size = 0;
+	int32_t        min_wire_version = 0, max_wire_version = 0;
+	char          *set = NULL;      /* For replicaset in return */
+	char          *hosts = NULL, *passives = NULL, *arbiters = NULL, *primary = NULL, *ptr, *string;
+	char          *msg = NULL; /* If set and its value is "isdbgrid", it signals we connected to a mongos */
+	unsigned char  ismaster = 0, secondary = 0, arbiter = 0;
+	char          *connected_name = NULL, *we_think_we_are, *errmsg = NULL;
+	char          *tags = NULL;
+	char          *digest_strings[2], *digest_arrays[3];
+	char         **new_tags = NULL;
+	int            new_tag_count = 0;
+	int            retval = 1;
+	/* All of them are found in one pass over the reply, the first five are
+	 * checked for by their index */
+	bson_field     fields[] = {
+		BSON_FIELD("minWireVersion", BSON_INT32, &min_wire_version),
+		BSON_FIELD("maxWireVersion", BSON_INT32, &max_wire_version),
+		BSON_FIELD("maxBsonObjectSize", BSON_INT32, &max_bson_size),
+		BSON_FIELD("maxMessageSizeBytes", BSON_INT32, &max_message_size),
+		BSON_FIELD("maxWriteBatchSize", BSON_INT32, &max_write_batch_size),
+		BSON_FIELD("ismaster", BSON_BOOLEAN, &ismaster),
+		BSON_FIELD("secondary", BSON_BOOLEAN, &secondary),
+		BSON_FIELD("arbiterOnly", BSON_BOOLEAN, &arbiter),
+		BSON_FIELD("setName", BSON_STRING, &set),
+		BSON_FIELD("msg", BSON_STRING, &msg),
+		BSON_FIELD("tags", BSON_DOCUMENT, &tags),
+		BSON_FIELD("me", BSON_STRING, &connected_name),
+		BSON_FIELD("errmsg", BSON_STRING, &errmsg),
+		BSON_FIELD("primary", BSON_STRING, &primary),
+		BSON_FIELD("hosts", BSON_ARRAY, &hosts),
+		BSON_FIELD("passives", BSON_ARRAY, &passives),
+		BSON_FIELD("arbiters", BSON_ARRAY, &arbiters),
+	};
+
 	/* Find data fields */
 	ptr = data_buffer + sizeof(int32_t); /* Skip the length */
+	bson_extract_fields(ptr, fields, sizeof(fields) / sizeof(fields[0]));
 
 	/* Find [min|max]WireVersion */
-	if (bson_find_field_as_int32(ptr, "minWireVersion", &min_wire_version)) {
+	if (fields[0].found) {
 		mongo_manager_log(manager, MLOG_CON, MLOG_FINE, "ismaster: setting minWireVersion to %d", min_wire_version);
 		con->min_wire_version = min_wire_version;
 	} else {
 		mongo_manager_log(manager, MLOG_CON, MLOG_FINE, "ismaster: can't find minWireVersion, defaulting to %d", con->min_wire_version);
 	}
 
-	if (bson_find_field_as_int32(ptr, "maxWireVersion", &max_wire_version)) {
+	if (fields[1].found) {
 		mongo_manager_log(manager, MLOG_CON, MLOG_FINE, "ismaster: setting maxWireVersion to %d", max_wire_version);
 		con->max_wire_version = max_wire_version;
 	} else {
@@ -311,12 +795,12 @@ int mongo_connection_ismaster(mongo_con_manager *manager, mongo_connection *con,
 
 	if (!manager->supports_wire_version(con->min_wire_version, con->max_wire_version, error_message)) {
 		/* Error message set by supports_wire_version */
-		free(data_buffer);
+		mongo_buffer_free(data_buffer);
 		return 4;
 	}
 
 	/* Find max bson size */
-	if (bson_find_field_as_int32(ptr, "maxBsonObjectSize", &max_bson_size)) {
+	if (fields[2].found) {
 		mongo_manager_log(manager, MLOG_CON, MLOG_FINE, "ismaster: setting maxBsonObjectSize to %d", max_bson_size);
 		con->max_bson_size = max_bson_size;
 	} else {
@@ -324,7 +808,7 @@ int mongo_connection_ismaster(mongo_con_manager *manager, mongo_connection *con,
 	}
 
 	/* Find max message size */
-	if (bson_find_field_as_int32(ptr, "maxMessageSizeBytes", &max_message_size)) {
+	if (fields[3].found) {
 		mongo_manager_log(manager, MLOG_CON, MLOG_FINE, "ismaster: setting maxMessageSizeBytes to %d", max_message_size);
 		con->max_message_size = max_message_size;
 	} else {
@@ -332,7 +816,7 @@ int mongo_connection_ismaster(mongo_con_manager *manager, mongo_connection *con,
 	}
 
 	/* Find max batch item size */
-	if (bson_find_field_as_int32(ptr, "maxWriteBatchSize", &max_write_batch_size)) {
+	if (fields[4].found) {
 		mongo_manager_log(manager, MLOG_CON, MLOG_FINE, "ismaster: setting maxWriteBatchSize to %d", max_write_batch_size);
 		con->max_write_batch_size = max_write_batch_size;
 	} else {
@@ -340,18 +824,12 @@ int mongo_connection_ismaster(mongo_con_manager *manager, mongo_connection *con,
 	}
 
 
-	/* Check for flags */
-	bson_find_field_as_bool(ptr, "ismaster", &ismaster);
-	bson_find_field_as_bool(ptr, "secondary", &secondary);
-	bson_find_field_as_bool(ptr, "arbiterOnly", &arbiter);
-	bson_find_field_as_string(ptr, "setName", &set);
-
 	mongo_manager_log(manager, MLOG_CON, MLOG_INFO, "ismaster: set name: %s, ismaster: %d, secondary: %d, is_arbiter: %d", set, ismaster, secondary, arbiter);
 
 	/* Set connection type depending on flags */
 	if (ismaster) {
 		/* Find msg and whether it contains "isdbgrid" */
-		if (bson_find_field_as_string(ptr, "msg", (char**) &msg) && strcmp(msg, "isdbgrid") == 0) {
+		if (msg && strcmp(msg, "isdbgrid") == 0) {
 			mongo_manager_log(manager, MLOG_CON, MLOG_FINE, "ismaster: msg contains 'isdbgrid' - we're connected to a mongos");
 			con->connection_type = MONGO_NODE_MONGOS;
 		} else if(set) {
@@ -372,29 +850,36 @@ int mongo_connection_ismaster(mongo_con_manager *manager, mongo_connection *con,
 
 	if (con->connection_type == MONGO_NODE_INVALID) {
 		*error_message = strdup("ismaster: got unknown node type");
-		free(data_buffer);
+		mongo_buffer_free(data_buffer);
 		return 0;
 	}
 
 	/* Find read preferences tags */
-	con->tag_count = 0;
-	con->tags = NULL;
-	if (bson_find_field_as_document(ptr, "tags", (char**) &tags)) {
+	if (tags) {
 		char *it, *name, *value;
 		int   length;
 
 		it = tags;
 
 		while (bson_array_find_next_string(&it, &name, &value)) {
-			con->tags = realloc(con->tags, (con->tag_count + 1) * sizeof(char*));
+			new_tags = realloc(new_tags, (new_tag_count + 2) * sizeof(char*));
 			length = strlen(name) + strlen(value) + 2;
-			con->tags[con->tag_count] = malloc(length);
-			snprintf(con->tags[con->tag_count], length, "%s:%s", name, value);
+			new_tags[new_tag_count] = malloc(length);
+			snprintf(new_tags[new_tag_count], length, "%s:%s", name, value);
 			free(name);
-			mongo_manager_log(manager, MLOG_CON, MLOG_FINE, "ismaster: added tag %s", con->tags[con->tag_count]);
-			con->tag_count++;
+			mongo_manager_log(manager, MLOG_CON, MLOG_FINE, "ismaster: added tag %s", new_tags[new_tag_count]);
+			new_tag_count++;
+			new_tags[new_tag_count] = NULL;
 		}
 	}
+	mongo_connection_replace_tags(con, new_tags, new_tag_count);
+
+	digest_strings[0] = set;
+	digest_strings[1] = primary;
+	digest_arrays[0] = hosts;
+	digest_arrays[1] = passives;
+	digest_arrays[2] = arbiters;
+	con->ismaster_digest = mongo_connection_ismaster_digest(con, digest_strings, digest_arrays, tags);
 
 	/* If we get passed in a server it means we want to validate this node against it, along with discovery ReplicaSet stuff */
 	if (!server) {
@@ -405,8 +890,8 @@ int mongo_connection_ismaster(mongo_con_manager *manager, mongo_connection *con,
 	 * one we thought we were connecting too */
 	/* MongoDB 1.8.x doesn't have the "me" field.
 	 * The replicaset verification is done next step (setName). */
-	if (bson_find_field_as_string(ptr, "me", &connected_name)) {
-		we_think_we_are = mongo_server_hash_to_server(con->hash);
+	if (connected_name) {
+		we_think_we_are = con->id->address;
 		if (strcmp(connected_name, we_think_we_are) == 0) {
 			mongo_manager_log(manager, MLOG_CON, MLOG_FINE, "ismaster: the server name matches what we thought it'd be (%s).", we_think_we_are);
 		} else {
@@ -416,23 +901,21 @@ int mongo_connection_ismaster(mongo_con_manager *manager, mongo_connection *con,
 			free(server->host);
 			server->host = mcon_strndup(connected_name, strchr(connected_name, ':') - connected_name);
 			server->port = atoi(strchr(connected_name, ':') + 1);
+			mongo_server_def_reset_id(server);
 			retval = 3;
 		}
-		free(we_think_we_are);
 	} else {
-		mongo_manager_log(manager, MLOG_CON, MLOG_WARN, "Can't find 'me' in ismaster response, possibly not a replicaset (%s)", mongo_server_hash_to_server(con->hash));
+		mongo_manager_log(manager, MLOG_CON, MLOG_WARN, "Can't find 'me' in ismaster response, possibly not a replicaset (%s)", con->id->address);
 	}
 
 	/* Do replica set name test */
 	if (!set) {
-		char *errmsg = NULL;
-		bson_find_field_as_string(ptr, "errmsg", &errmsg);
 		if (errmsg) {
 			*error_message = strdup(errmsg);
 		} else {
 			*error_message = strdup("Not a replicaset member");
 		}
-		free(data_buffer);
+		mongo_buffer_free(data_buffer);
 		return 0;
 	} else if (*repl_set_name) {
 		if (strcmp(set, *repl_set_name) != 0) {
@@ -447,7 +930,7 @@ int mongo_connection_ismaster(mongo_con_manager *manager, mongo_connection *con,
 			*error_message = strdup(tmp->d);
 			mcon_str_ptr_dtor(tmp);
 
-			free(data_buffer);
+			mongo_buffer_free(data_buffer);
 			return 0;
 		} else {
 			mongo_manager_log(manager, MLOG_CON, MLOG_FINE, "ismaster: the found replicaset name matches the expected one (%s).", set);
@@ -462,20 +945,21 @@ int mongo_connection_ismaster(mongo_con_manager *manager, mongo_connection *con,
 	/* If the server definition has not set the repl_set_name member yet, set it here */
 	if (!server->repl_set_name) {
 		server->repl_set_name = strdup(set);
+		mongo_server_def_reset_id(server);
 	}
 
 	/* Find all hosts */
-	bson_find_field_as_array(ptr, "hosts", &hosts);
-	bson_find_field_as_array(ptr, "passives", &passives);
 	*nr_hosts = 0;
 
 	/* Iterate over the "hosts" document */
-	ptr = hosts;
-	while (bson_array_find_next_string(&ptr, NULL, &string)) {
-		(*nr_hosts)++;
-		*found_hosts = realloc(*found_hosts, (*nr_hosts) * sizeof(char*));
-		(*found_hosts)[*nr_hosts-1] = strdup(string);
-		mongo_manager_log(manager, MLOG_CON, MLOG_INFO, "found host: %s", string);
+	if (hosts) {
+		ptr = hosts;
+		while (bson_array_find_next_string(&ptr, NULL, &string)) {
+			(*nr_hosts)++;
+			*found_hosts = realloc(*found_hosts, (*nr_hosts) * sizeof(char*));
+			(*found_hosts)[*nr_hosts-1] = strdup(string);
+			mongo_manager_log(manager, MLOG_CON, MLOG_INFO, "found host: %s", string);
+		}
 	}
 
 	/* Iterate over the "passives" document (priority=0) */
@@ -489,31 +973,148 @@ int mongo_connection_ismaster(mongo_con_manager *manager, mongo_connection *con,
 		}
 	}
 
-	con->last_replcheck = now.tv_sec;
+	con->last_replcheck = now->tv_sec;
 
 done:
-	free(data_buffer);
+	mongo_buffer_free(data_buffer);
 
-	con->last_ismaster = now.tv_sec;
+	con->last_ismaster = now->tv_sec;
 	mongo_manager_log(manager, MLOG_CON, MLOG_INFO, "ismaster: last ran at %ld", con->last_ismaster);
 
 	return retval;
 }
 
+int mongo_connection_ismaster(mongo_con_manager *manager, mongo_connection *con, mongo_server_options *options, char **repl_set_name, int *nr_hosts, char ***found_hosts, char **error_message, mongo_server_def *server)
+{
+	int retval;
+
+	/* The monitor keeps the server's state up to date, so request threads
+	 * only need to run ismaster on connections it hasn't seen yet. This is
+	 * checked before the connection is checked out, as the monitor might be
+	 * in the middle of a round trip on it. */
+	if (manager->monitor && (server ? con->last_replcheck : con->last_ismaster)) {
+		mongo_manager_log(manager, MLOG_CON, MLOG_FINE, "ismaster: skipping: the monitor keeps %s up to date", con->hash);
+		return 2;
+	}
+
+	/* ismaster rewrites the server flags and tags, which must not happen
+	 * from two threads at the same time */
+	mongo_connection_checkout(con);
+	retval = mongo_connection_ismaster_locked(manager, con, options, repl_set_name, nr_hosts, found_hosts, error_message, server, 0);
+	mongo_connection_checkin(con);
+
+	return retval;
+}
+
+/* Runs ismaster regardless of the ismaster interval; its round trip time
+ * counts towards the connection's ping time like any other. Used by the
+ * monitor, which replaces the pings and ismaster calls that request threads
+ * would otherwise make. Returns the same values as
+ * mongo_connection_ismaster(). */
+int mongo_connection_heartbeat(mongo_con_manager *manager, mongo_connection *con, mongo_server_options *options, char **repl_set_name, int *nr_hosts, char ***found_hosts, char **error_message, mongo_server_def *server)
+{
+	struct timeval end;
+	int            retval;
+
+	mongo_connection_checkout(con);
+	retval = mongo_connection_ismaster_locked(manager, con, options, repl_set_name, nr_hosts, found_hosts, error_message, server, 1);
+	gettimeofday(&end, NULL);
+
+	if (retval != 0) {
+		con->last_ping = end.tv_sec;
+	}
+	mongo_connection_checkin(con);
+
+	return retval;
+}
+
+/* Fills in the server version from the wire versions that ismaster
+ * reported, which is as much as we need to know about it */
+static void mongo_connection_version_from_wire(mongo_connection *con)
+{
+	con->version.mini = 0;
+	con->version.build = 0;
+
+	if (con->max_wire_version >= 3) {
+		con->version.major = 3;
+		con->version.minor = 0;
+	} else if (con->max_wire_version >= 1) {
+		con->version.major = 2;
+		con->version.minor = 6;
+	} else {
+		con->version.major = 2;
+		con->version.minor = 4;
+	}
+}
+
+/* The handshake on a new connection, in one round trip: ismaster, with the
+ * connection's first ping time and the server version taken from it. If
+ * MongoDB-CR credentials are given, getnonce is sent along with ismaster,
+ * and the nonce is kept for mongo_connection_authenticate(). This replaces
+ * running mongo_connection_ismaster(), mongo_connection_get_server_version()
+ * and mongo_connection_ping() one after the other.
+ *
+ * Returns the same values as mongo_connection_ismaster(), apart from 2 and
+ * 3. */
+int mongo_connection_handshake(mongo_con_manager *manager, mongo_connection *con, mongo_server_options *options, mongo_server_def *server_def, char **error_message)
+{
+	char           packet[MONGO_ADMIN_PACKET_SIZE * 2];
+	char          *data_buffer;
+	struct timeval end;
+	int            size, getnonce = 0, retval;
+
+	mongo_manager_log(manager, MLOG_CON, MLOG_INFO, "handshake: start");
+
+	mongo_connection_checkout(con);
+	size = bson_admin_packet(MONGO_ADMIN_ISMASTER, mongo_connection_get_reqid(con), packet);
+
+	if (server_def && server_def->mechanism == MONGO_AUTH_MECHANISM_MONGODB_CR && server_def->db && server_def->username && server_def->password) {
+		size += bson_admin_packet(MONGO_ADMIN_GETNONCE, mongo_connection_get_reqid(con), packet + size);
+		getnonce = 1;
+	}
+
+	if (!mongo_connection_send_locked(manager, con, options, packet, size, &data_buffer, error_message)) {
+		mongo_connection_checkin(con);
+		return 0;
+	}
+	gettimeofday(&end, NULL);
+
+	con->last_ping = end.tv_sec;
+
+	retval = mongo_connection_ismaster_process(manager, con, data_buffer, NULL, NULL, NULL, error_message, NULL, &end);
+	mongo_connection_version_from_wire(con);
+	mongo_manager_log(manager, MLOG_CON, MLOG_INFO, "handshake: time: %dms, server version: %d.%d (from wire version %d)", con->ping_ms, con->version.major, con->version.minor, con->max_wire_version);
+
+	/* The getnonce reply has to be read in any case, so that it isn't taken
+	 * as the reply to the next request */
+	if (getnonce && retval != 0) {
+		char *nonce_error_message = NULL;
+
+		if (mongo_connection_recv_reply_locked(manager, con, options, &data_buffer, &nonce_error_message)) {
+			con->nonce = mongo_connection_getnonce_process(manager, data_buffer, &nonce_error_message);
+		}
+		if (!con->nonce) {
+			/* Authentication runs getnonce again */
+			mongo_manager_log(manager, MLOG_CON, MLOG_WARN, "handshake: pipelined getnonce failed: %s", nonce_error_message);
+			free(nonce_error_message);
+		}
+	}
+	mongo_connection_checkin(con);
+
+	return retval;
+}
+
 /* Sends an buildInfo command to the server to find server version
  *
  * Returns 1 when it worked, and 0 when an error was encountered. */
 int mongo_connection_get_server_version(mongo_con_manager *manager, mongo_connection *con, mongo_server_options *options, char **error_message)
 {
-	mcon_str      *packet;
 	char          *data_buffer;
 	char          *ptr;
 	char          *version_array;
 
 	mongo_manager_log(manager, MLOG_CON, MLOG_INFO, "get_server_version: start");
-	packet = bson_create_buildinfo_packet(con);
-
-	if (!mongo_connect_send_packet(manager, con, options, packet, &data_buffer, error_message)) {
+	if (!mongo_connect_send_admin(manager, con, options, MONGO_ADMIN_BUILDINFO, &data_buffer, error_message)) {
 		return 0;
 	}
 
@@ -539,7 +1140,7 @@ int mongo_connection_get_server_version(mongo_con_manager *manager, mongo_connec
 		mongo_manager_log(manager, MLOG_CON, MLOG_WARN, "get_server_flags: can't find version information, defaulting to %d.%d.%d (%d)", con->version.major, con->version.minor, con->version.mini, con->version.build);
 	}
 
-	free(data_buffer);
+	mongo_buffer_free(data_buffer);
 
 	return 1;
 }
@@ -549,19 +1150,23 @@ int mongo_connection_get_server_version(mongo_con_manager *manager, mongo_connec
  * Returns the nonsense when it worked, or NULL if it didn't. */
 char *mongo_connection_getnonce(mongo_con_manager *manager, mongo_connection *con, mongo_server_options *options, char **error_message)
 {
-	mcon_str      *packet;
 	char          *data_buffer;
-	char          *ptr;
-	char          *nonce;
-	char          *retval = NULL;
 
 	mongo_manager_log(manager, MLOG_CON, MLOG_INFO, "getnonce: start");
-	packet = bson_create_getnonce_packet(con);
-
-	if (!mongo_connect_send_packet(manager, con, options, packet, &data_buffer, error_message)) {
+	if (!mongo_connect_send_admin(manager, con, options, MONGO_ADMIN_GETNONCE, &data_buffer, error_message)) {
 		return NULL;
 	}
 
+	return mongo_connection_getnonce_process(manager, data_buffer, error_message);
+}
+
+/* Returns the nonce from a getnonce reply, which it frees */
+static char *mongo_connection_getnonce_process(mongo_con_manager *manager, char *data_buffer, char **error_message)
+{
+	char          *ptr;
+	char          *nonce;
+	char          *retval = NULL;
+
 	/* Find data fields */
 	ptr = data_buffer + sizeof(int32_t); /* Skip the length */
 
@@ -570,13 +1175,13 @@ char *mongo_connection_getnonce(mongo_con_manager *manager, mongo_connection *co
 		mongo_manager_log(manager, MLOG_CON, MLOG_FINE, "getnonce: found nonce '%s'", nonce);
 	} else {
 		*error_message = strdup("Couldn't find the nonce field");
-		free(data_buffer);
+		mongo_buffer_free(data_buffer);
 		return NULL;
 	}
 
 	retval = strdup(nonce);
 
-	free(data_buffer);
+	mongo_buffer_free(data_buffer);
 
 	return retval;
 }
@@ -600,9 +1205,15 @@ int mongo_connection_authenticate(mongo_con_manager *manager, mongo_connection *
 				return 2;
 			}
 
-			nonce = mongo_connection_getnonce(manager, con, options, error_message);
-			if (!nonce) {
-				return 0;
+			/* The handshake might have fetched a nonce for us already */
+			if (con->nonce) {
+				nonce = con->nonce;
+				con->nonce = NULL;
+			} else {
+				nonce = mongo_connection_getnonce(manager, con, options, error_message);
+				if (!nonce) {
+					return 0;
+				}
 			}
 
 			retval = mongo_connection_authenticate_mongodb_cr(manager, con, options, server_def->authdb ? server_def->authdb : server_def->db, server_def->username, server_def->password, nonce, error_message);
@@ -700,9 +1311,13 @@ int mongo_connection_authenticate_mongodb_x509(mongo_con_manager *manager, mongo
  */
 int mongo_connection_authenticate_cmd(mongo_con_manager *manager, mongo_connection *con, mongo_server_options *options, char *database, char *username, mcon_str *packet, char **error_message)
 {
-	char          *data_buffer, *errmsg;
+	char          *data_buffer, *errmsg = NULL;
 	double         ok;
 	char          *ptr;
+	bson_field     fields[] = {
+		BSON_FIELD("ok", BSON_DOUBLE, &ok),
+		BSON_FIELD("errmsg", BSON_STRING, &errmsg),
+	};
 
 	if (!mongo_connect_send_packet(manager, con, options, packet, &data_buffer, error_message)) {
 		return 0;
@@ -710,35 +1325,53 @@ int mongo_connection_authenticate_cmd(mongo_con_manager *manager, mongo_connecti
 
 	/* Find data fields */
 	ptr = data_buffer + sizeof(int32_t); /* Skip the length */
+	bson_extract_fields(ptr, fields, 2);
 
 	/* Find errmsg */
-	if (bson_find_field_as_double(ptr, "ok", &ok)) {
+	if (fields[0].found) {
 		if (ok > 0) {
 			mongo_manager_log(manager, MLOG_CON, MLOG_INFO, "authentication successful");
 		} else {
 			mongo_manager_log(manager, MLOG_CON, MLOG_WARN, "authentication failed");
 		}
 	}
-	if (bson_find_field_as_string(ptr, "errmsg", &errmsg)) {
+	if (errmsg) {
 		*error_message = malloc(256);
 		snprintf(*error_message, 256, "Authentication failed on database '%s' with username '%s': %s", database, username, errmsg);
-		free(data_buffer);
+		mongo_buffer_free(data_buffer);
 		return 0;
 	}
 
-	free(data_buffer);
+	mongo_buffer_free(data_buffer);
 
 	return 1;
 }
 
+/* Copies the payload of a SASL reply that was extracted with field, as the
+ * reply buffer is freed before the caller gets to it */
+static void mongo_connection_copy_payload(bson_field *field, char **out_payload, int *out_payload_len)
+{
+	*out_payload = malloc(field->length);
+	memcpy(*out_payload, *(char **)field->out, field->length);
+	*out_payload_len = field->length;
+}
+
 int mongo_connection_authenticate_saslstart(mongo_con_manager *manager, mongo_connection *con, mongo_server_options *options, mongo_server_def *server_def, char *mechanism, char *payload, unsigned int payload_len, char **out_payload, int *out_payload_len, int32_t *out_conversation_id, char **error_message)
 {
 	mcon_str      *packet;
 	char          *data_buffer;
 	char          *ptr;
-	char          *smechanism;
+	char          *smechanism = NULL;
 	double         ok;
-	char          *errmsg;
+	char          *errmsg = NULL;
+	char          *reply_payload = NULL;
+	bson_field     fields[] = {
+		BSON_FIELD("ok", BSON_DOUBLE, &ok),
+		BSON_FIELD("errmsg", BSON_STRING, &errmsg),
+		BSON_FIELD("supportedMechanisms", BSON_DOCUMENT, &smechanism),
+		BSON_FIELD("conversationId", BSON_INT32, out_conversation_id),
+		BSON_FIELD("payload", BSON_STRING, &reply_payload),
+	};
 
 	mongo_manager_log(manager, MLOG_CON, MLOG_INFO, "connection_authenticate_sasl: Starting SASL authentication process to '%s'", con->hash);
 
@@ -755,31 +1388,32 @@ int mongo_connection_authenticate_saslstart(mongo_con_manager *manager, mongo_co
 
 	/* Find data fields */
 	ptr = data_buffer + sizeof(int32_t); /* Skip the length */
+	bson_extract_fields(ptr, fields, 5);
 
-	if (bson_find_field_as_double(ptr, "ok", &ok)) {
+	if (fields[0].found) {
 		if (ok > 0) {
 			mongo_manager_log(manager, MLOG_CON, MLOG_INFO, "SASL request successful");
 		} else {
 			mongo_manager_log(manager, MLOG_CON, MLOG_WARN, "SASL request failed");
-			if (bson_find_field_as_string(ptr, "errmsg", &errmsg)) {
+			if (errmsg) {
 				*error_message = malloc(256);
 				snprintf(*error_message, 256, "SASL Authentication failed on database '%s': %s", server_def->db, errmsg);
 			} else {
 				*error_message = "SASL Authentication failed";
 			}
-			if (bson_find_field_as_document(ptr, "supportedMechanisms", (char**) &smechanism)) {
+			if (smechanism) {
 				/* TODO: Retrieve a list of supportedMechanisms and return it somehow */
 			}
 
-			free(data_buffer);
+			mongo_buffer_free(data_buffer);
 			return 0;
 		}
 	}
 
-	if (bson_find_field_as_int32(ptr, "conversationId", out_conversation_id)) {
-		bson_find_field_as_stringl(ptr, "payload", out_payload, out_payload_len, 1);
+	if (fields[3].found && fields[4].found) {
+		mongo_connection_copy_payload(&fields[4], out_payload, out_payload_len);
 	}
-	free(data_buffer);
+	mongo_buffer_free(data_buffer);
 
 	return 1;
 }
@@ -790,8 +1424,16 @@ int mongo_connection_authenticate_saslcontinue(mongo_con_manager *manager, mongo
 	char          *data_buffer;
 	char          *ptr;
 	double         ok;
-	char          *errmsg;
+	char          *errmsg = NULL;
 	int32_t       out_conversation_id;
+	char          *reply_payload = NULL;
+	bson_field     fields[] = {
+		BSON_FIELD("ok", BSON_DOUBLE, &ok),
+		BSON_FIELD("errmsg", BSON_STRING, &errmsg),
+		BSON_FIELD("conversationId", BSON_INT32, &out_conversation_id),
+		BSON_FIELD("done", BSON_BOOLEAN, done),
+		BSON_FIELD("payload", BSON_STRING, &reply_payload),
+	};
 
 	mongo_manager_log(manager, MLOG_CON, MLOG_INFO, "connection_authenticate_saslcontinue: continuing SASL authentication to '%s'", con->hash);
 
@@ -804,13 +1446,14 @@ int mongo_connection_authenticate_saslcontinue(mongo_con_manager *manager, mongo
 
 	/* Find data fields */
 	ptr = data_buffer + sizeof(int32_t); /* Skip the length */
+	bson_extract_fields(ptr, fields, 5);
 
-	if (bson_find_field_as_double(ptr, "ok", &ok)) {
+	if (fields[0].found) {
 		if (ok > 0) {
 			mongo_manager_log(manager, MLOG_CON, MLOG_INFO, "SASL continue successful");
 		} else {
 			mongo_manager_log(manager, MLOG_CON, MLOG_WARN, "SASL continue failed");
-			if (bson_find_field_as_string(ptr, "errmsg", &errmsg)) {
+			if (errmsg) {
 				int errlen = strlen("SASL Authentication failed on database '': ") + strlen(server_def->db) + strlen(errmsg);
 				*error_message = malloc(errlen);
 				snprintf(*error_message, errlen, "SASL Authentication failed on database '%s': %s", server_def->db, errmsg);
@@ -820,21 +1463,22 @@ int mongo_connection_authenticate_saslcontinue(mongo_con_manager *manager, mongo
 				snprintf(*error_message, errlen, "SASL Authentication failed on database '%s'", server_def->db);
 			}
 
-			free(data_buffer);
+			mongo_buffer_free(data_buffer);
 			return 0;
 		}
 	}
 
-	if (bson_find_field_as_int32(ptr, "conversationId", &out_conversation_id)) {
+	if (fields[2].found) {
 		if (out_conversation_id != conversation_id) {
 			mongo_manager_log(manager, MLOG_CON, MLOG_WARN, "SASL continue failed: Got wrong conversation_id back! Expected %d but got %d", conversation_id, out_conversation_id);
-			free(data_buffer);
+			mongo_buffer_free(data_buffer);
 			return 0;
 		}
-		bson_find_field_as_stringl(ptr, "payload", out_payload, out_payload_len, 1);
-		bson_find_field_as_bool(ptr, "done", done);
+		if (fields[4].found) {
+			mongo_connection_copy_payload(&fields[4], out_payload, out_payload_len);
+		}
 	}
-	free(data_buffer);
+	mongo_buffer_free(data_buffer);
 
 	return (int)ok;
 }
@@ -18,6 +18,7 @@
 
 #include "types.h"
 #include "str.h"
+#include "packet.h"
 #ifndef WIN32
 # include <sys/time.h>
 #endif
@@ -29,12 +30,45 @@ extern "C" {
 char *mongo_authenticate_hash_user_password(char *username, char *password);
 void mongo_connection_close(mongo_connection *con, int why);
 void* mongo_connection_connect(mongo_con_manager *manager, mongo_server_def *server, mongo_server_options *options, char **error_message);
-mongo_connection *mongo_connection_create(mongo_con_manager *manager, char *hash, mongo_server_def *server_def, mongo_server_options *options, char **error_message);
+mongo_connection *mongo_connection_create(mongo_con_manager *manager, mongo_server_id *id, mongo_server_def *server_def, mongo_server_options *options, char **error_message);
 
 int mongo_connection_get_reqid(mongo_connection *con);
+void mongo_connection_init_lock(mongo_connection *con);
+void mongo_connection_checkout(mongo_connection *con);
+void mongo_connection_checkin(mongo_connection *con);
+
+/* Time added to the time a query has left of its maxTimeMS, for its budget */
+#define MONGO_CONNECTION_BUDGET_MARGIN 500
+
+/* Packets with up to this many segments are sent without allocating */
+#define MONGO_PACKET_STACK_IOVECS 16
+
+/* An OP_REPLY's message header, flags, cursor ID, starting from, and number
+ * returned, before its documents */
+#define MONGO_REPLY_HEADER_SIZE 36
+
+#define MONGO_REPLY_FLAG_QUERY_FAILURE 0x02
+
+int mongo_connection_read_reply(mongo_con_manager *manager, mongo_connection *con, mongo_server_options *options, int64_t deadline, int32_t *response_to, char **data_buffer, char **error_message);
+char *mongo_connection_query_failure(char *document);
+int mongo_connection_send_packet(mongo_con_manager *manager, mongo_connection *con, mongo_server_options *options, mongo_packet *packet, char **data_buffer, char **error_message);
+
+void mongo_connection_deadline_start(mongo_connection *con, int timeout);
+int64_t mongo_connection_deadline(mongo_connection *con, int timeout);
+void mongo_connection_set_budget(mongo_connection *con, int budget_ms);
+int mongo_connection_timed_out(mongo_con_manager *manager, mongo_connection *con, char *error_message);
+int mongo_deadline_remaining(int64_t deadline);
+int mongo_connection_deadline_remaining(mongo_connection *con);
+void mongo_connection_rtt_add(mongo_connection *con, int64_t rtt_us);
+void mongo_connection_io_sent(mongo_connection *con);
+void mongo_connection_io_received(mongo_connection *con);
+void mongo_connection_addref(mongo_connection *con);
+void mongo_connection_release(mongo_con_manager *manager, void *con, int why);
 int mongo_connection_ping_check(mongo_con_manager *manager, int last_ping, struct timeval *start);
 int mongo_connection_ping(mongo_con_manager *manager, mongo_connection *con, mongo_server_options *options, char **error_message);
 int mongo_connection_ismaster(mongo_con_manager *manager, mongo_connection *con, mongo_server_options *options, char **repl_set_name, int *nr_hosts, char ***found_hosts, char **error_message, mongo_server_def *server);
+int mongo_connection_heartbeat(mongo_con_manager *manager, mongo_connection *con, mongo_server_options *options, char **repl_set_name, int *nr_hosts, char ***found_hosts, char **error_message, mongo_server_def *server);
+int mongo_connection_handshake(mongo_con_manager *manager, mongo_connection *con, mongo_server_options *options, mongo_server_def *server_def, char **error_message);
 int mongo_connection_get_server_flags(mongo_con_manager *manager, mongo_connection *con, mongo_server_options *options, char **error_message);
 int mongo_connection_get_server_version(mongo_con_manager *manager, mongo_connection *con, mongo_server_options *options, char **error_message);
 char *mongo_connection_getnonce(mongo_con_manager *manager, mongo_connection *con, mongo_server_options *options, char **error_message);
@@ -0,0 +1,101 @@
+/**
+ *  Copyright 2009-2014 MongoDB, Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+#include <string.h>
+
+#include "intern.h"
+
+#define MONGO_INTERN_FREE    0
+#define MONGO_INTERN_CLAIMED 1
+#define MONGO_INTERN_READY   2
+
+static mongo_intern_slot mongo_intern_table[MONGO_INTERN_SLOTS];
+static int               mongo_intern_names;
+
+/* FNV-1a, never 0, as that marks a slot that nobody wanted yet */
+static unsigned int mongo_intern_hash(const char *name, int length)
+{
+	unsigned int hash = 2166136261U;
+	int          i;
+
+	for (i = 0; i < length; i++) {
+		hash = (hash ^ (unsigned char)name[i]) * 16777619U;
+	}
+	return hash ? hash : 1;
+}
+
+mongo_intern_slot *mongo_intern_lookup(const char *name, int length)
+{
+	mongo_intern_slot *slot;
+	unsigned int       hash;
+	int                i, state;
+
+	if (length > MONGO_INTERN_MAX_LENGTH) {
+		return NULL;
+	}
+
+	hash = mongo_intern_hash(name, length);
+	for (i = 0; i < MONGO_INTERN_PROBES; i++) {
+		slot = &mongo_intern_table[(hash + i) & (MONGO_INTERN_SLOTS - 1)];
+
+		state = __atomic_load_n(&slot->state, __ATOMIC_ACQUIRE);
+		if (state == MONGO_INTERN_READY) {
+			if (slot->length == length && memcmp(slot->name, name, length) == 0) {
+				return slot;
+			}
+			continue;
+		}
+
+		/* The first slot that isn't taken decides whether the name gets it now */
+		if (state == MONGO_INTERN_FREE && __atomic_load_n(&slot->candidate, __ATOMIC_RELAXED) == hash && __sync_bool_compare_and_swap(&slot->state, MONGO_INTERN_FREE, MONGO_INTERN_CLAIMED)) {
+			memcpy(slot->name, name, length);
+			slot->length = length;
+			__atomic_store_n(&slot->state, MONGO_INTERN_READY, __ATOMIC_RELEASE);
+			__sync_add_and_fetch(&mongo_intern_names, 1);
+			return slot;
+		}
+		__atomic_store_n(&slot->candidate, hash, __ATOMIC_RELAXED);
+		break;
+	}
+
+	return NULL;
+}
+
+void *mongo_intern_value(mongo_intern_slot *slot)
+{
+	return __atomic_load_n(&slot->value, __ATOMIC_ACQUIRE);
+}
+
+void *mongo_intern_set_value(mongo_intern_slot *slot, void *value)
+{
+	if (__sync_bool_compare_and_swap(&slot->value, NULL, value)) {
+		return value;
+	}
+	return mongo_intern_value(slot);
+}
+
+int mongo_intern_count(void)
+{
+	return __atomic_load_n(&mongo_intern_names, __ATOMIC_RELAXED);
+}
+
+/*
+ * Local variables:
+ * tab-width: 4
+ * c-basic-offset: 4
+ * End:
+ * vim600: fdm=marker
+ * vim: noet sw=4 ts=4
+ */
@@ -0,0 +1,73 @@
+/**
+ *  Copyright 2009-2014 MongoDB, Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+#ifndef __MCON_INTERN_H__
+#define __MCON_INTERN_H__
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+/* A per process table of the field names that come up again and again in
+ * decoded documents ("_id", "created_at", ...), so that the extension can
+ * make one string for each of them, rather than a new one for every
+ * document. The table has MONGO_INTERN_SLOTS slots, and only names of up to
+ * MONGO_INTERN_MAX_LENGTH bytes are kept, so it never takes up more than a
+ * few hundred KB, however many different names go past.
+ *
+ * A name only gets a slot when it's seen twice in a row for the same slot,
+ * so that the keys of documents that are used as maps (user IDs, dates...)
+ * don't fill it up with names that won't come back. Slots are never given
+ * up again. */
+#define MONGO_INTERN_SLOTS      1024
+#define MONGO_INTERN_MAX_LENGTH 32
+#define MONGO_INTERN_PROBES     4
+
+typedef struct _mongo_intern_slot
+{
+	unsigned int  candidate; /* The hash of the last name that wanted this slot */
+	int           state;     /* MONGO_INTERN_FREE, _CLAIMED (name being set) or _READY */
+	int           length;
+	char          name[MONGO_INTERN_MAX_LENGTH];
+	void         *value;     /* The caller's string for the name, or NULL */
+} mongo_intern_slot;
+
+/* Returns the slot of the name of length bytes, which may be one that it
+ * has just been given, or NULL if it doesn't have one (yet) */
+mongo_intern_slot *mongo_intern_lookup(const char *name, int length);
+
+/* The value of a slot, which starts out as NULL. Several threads may make
+ * one at once: mongo_intern_set_value() returns the one that was set first,
+ * which the others should use instead of theirs. */
+void *mongo_intern_value(mongo_intern_slot *slot);
+void *mongo_intern_set_value(mongo_intern_slot *slot, void *value);
+
+/* The number of names that have a slot */
+int mongo_intern_count(void);
+
+#if defined(__cplusplus)
+}
+#endif
+
+#endif
+
+/*
+ * Local variables:
+ * tab-width: 4
+ * c-basic-offset: 4
+ * End:
+ * vim600: fdm=marker
+ * vim: noet sw=4 ts=4
+ */
@@ -0,0 +1,401 @@
+/**
+ *  Copyright 2009-2014 MongoDB, Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <netdb.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "types.h"
+#include "io.h"
+#include "manager.h"
+#include "connections.h"
+#include "utils.h"
+
+/* Linux's UIO_MAXIOV, which limits.h only defines as IOV_MAX for XOPEN */
+#ifndef IOV_MAX
+# define IOV_MAX 1024
+#endif
+
+/* The native transport owns the socket, which is non-blocking: reads and
+ * writes only wait in poll() when the kernel has nothing to read or no room
+ * to write, and timeouts are not socket options that need setting and
+ * resetting around every read. Small reads go through a read-ahead buffer,
+ * so that a reply's header and body come in with one recv(); large ones go
+ * straight to the caller's buffer. */
+
+/* Negative timeouts mean no timeout, zero means the default */
+static int mongo_io_timeout(int timeout)
+{
+	if (timeout < 0) {
+		return -1;
+	}
+	return timeout ? timeout : MONGO_IO_DEFAULT_TIMEOUT;
+}
+
+/* Operations that mcon runs have one deadline for sending the request and
+ * reading the whole reply, see mongo_connection_deadline_start(). Otherwise,
+ * the timeout counts from now. */
+static int64_t mongo_io_deadline(mongo_connection *con, int timeout)
+{
+	if (con->deadline) {
+		return con->deadline;
+	}
+	timeout = mongo_io_timeout(timeout);
+	return timeout < 0 ? -1 : mongo_now_ms() + timeout;
+}
+
+/* Waits until fd is ready for events, or until the deadline (in ms, or -1 for
+ * none) has passed. Returns 1 when ready, 0 on a timeout and -1 on errors. */
+static int mongo_io_wait(int fd, short events, int64_t deadline)
+{
+	struct pollfd pfd;
+	int           wait_ms, retval;
+
+	pfd.fd = fd;
+	pfd.events = events;
+
+	while (1) {
+		wait_ms = -1;
+		if (deadline >= 0) {
+			wait_ms = (int)(deadline - mongo_now_ms());
+			if (wait_ms <= 0) {
+				return 0;
+			}
+		}
+
+		retval = poll(&pfd, 1, wait_ms);
+		if (retval >= 0) {
+			return retval > 0;
+		}
+		if (errno != EINTR) {
+			return -1;
+		}
+	}
+}
+
+static int mongo_io_connect_addr(int family, struct sockaddr *addr, socklen_t addr_len, int timeout, char **error_message)
+{
+	int       fd, error = 0, flag = 1;
+	socklen_t error_len = sizeof(error);
+
+	fd = socket(family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		*error_message = malloc(256);
+		snprintf(*error_message, 256, "Can't create socket: %s", strerror(errno));
+		return -1;
+	}
+
+	if (connect(fd, addr, addr_len) != 0) {
+		if (errno != EINPROGRESS) {
+			error = errno;
+		} else {
+			switch (mongo_io_wait(fd, POLLOUT, timeout < 0 ? -1 : mongo_now_ms() + timeout)) {
+				case 0:
+					*error_message = malloc(256);
+					snprintf(*error_message, 256, "Timed out after %dms while connecting", timeout);
+					close(fd);
+					return -1;
+
+				case -1:
+					error = errno;
+					break;
+
+				default:
+					getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &error_len);
+			}
+		}
+	}
+
+	if (error) {
+		*error_message = malloc(256);
+		snprintf(*error_message, 256, "Can't connect: %s", strerror(error));
+		close(fd);
+		return -1;
+	}
+
+	if (family != AF_UNIX) {
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+		setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &flag, sizeof(flag));
+	}
+
+	return fd;
+}
+
+void* mongo_io_connect(mongo_con_manager *manager, mongo_server_def *server, mongo_server_options *options, char **error_message)
+{
+	mongo_io_socket *sock;
+	char            *last_error = NULL;
+	int              fd = -1, timeout;
+
+	timeout = mongo_io_timeout(options->connectTimeoutMS);
+
+	if (server->host[0] == '/') {
+		struct sockaddr_un addr;
+
+		memset(&addr, 0, sizeof(addr));
+		addr.sun_family = AF_UNIX;
+		strncpy(addr.sun_path, server->host, sizeof(addr.sun_path) - 1);
+		fd = mongo_io_connect_addr(AF_UNIX, (struct sockaddr *)&addr, sizeof(addr), timeout, &last_error);
+	} else {
+		struct addrinfo  hints, *result, *ai;
+		char             port[8];
+		int              status;
+
+		memset(&hints, 0, sizeof(hints));
+		hints.ai_family = AF_UNSPEC;
+		hints.ai_socktype = SOCK_STREAM;
+		snprintf(port, sizeof(port), "%d", server->port);
+
+		status = getaddrinfo(server->host, port, &hints, &result);
+		if (status != 0) {
+			last_error = malloc(256);
+			snprintf(last_error, 256, "Can't resolve %s: %s", server->host, gai_strerror(status));
+		} else {
+			/* Try every address, and report the error of the last one */
+			for (ai = result; ai && fd < 0; ai = ai->ai_next) {
+				free(last_error);
+				last_error = NULL;
+				fd = mongo_io_connect_addr(ai->ai_family, ai->ai_addr, ai->ai_addrlen, timeout, &last_error);
+			}
+			freeaddrinfo(result);
+		}
+	}
+
+	if (fd < 0) {
+		*error_message = last_error;
+		return NULL;
+	}
+
+	mongo_manager_log(manager, MLOG_IO, MLOG_FINE, "io_connect: connected to %s:%d", server->host, server->port);
+
+	sock = malloc(sizeof(mongo_io_socket));
+	sock->fd = fd;
+	sock->manager = manager;
+	sock->stream = NULL;
+	sock->buffer = malloc(MONGO_IO_READ_AHEAD);
+	sock->buffer_start = 0;
+	sock->buffer_end = 0;
+
+	return sock;
+}
+
+/* Reads exactly size bytes into data. What is left in the read-ahead buffer
+ * comes first. Then, anything smaller than the buffer is read by filling the
+ * buffer with as much as the kernel has, which for the header of a reply
+ * usually includes the whole body too. Anything larger is read into data
+ * directly, with as few recv() calls as the kernel allows. Data that was
+ * read ahead belongs to the next reply (with exhaust cursors), so the
+ * buffer lives as long as the socket. */
+static int mongo_io_recv(mongo_connection *con, int timeout, char *data, int size, char **error_message)
+{
+	mongo_io_socket *sock = (mongo_io_socket *)con->socket;
+	int64_t          deadline = 0;
+	int              received = 0, num;
+
+	while (received < size) {
+		if (sock->buffer_start < sock->buffer_end) {
+			num = sock->buffer_end - sock->buffer_start;
+			if (num > size - received) {
+				num = size - received;
+			}
+			memcpy(data + received, sock->buffer + sock->buffer_start, num);
+			sock->buffer_start += num;
+			received += num;
+			continue;
+		}
+
+		__sync_add_and_fetch(&sock->manager->io_stats.reads, 1);
+		if (size - received >= MONGO_IO_READ_AHEAD) {
+			num = recv(sock->fd, data + received, size - received, 0);
+			if (num > 0) {
+				received += num;
+				continue;
+			}
+		} else {
+			num = recv(sock->fd, sock->buffer, MONGO_IO_READ_AHEAD, 0);
+			if (num > 0) {
+				sock->buffer_start = 0;
+				sock->buffer_end = num;
+				continue;
+			}
+		}
+
+		if (num == 0) {
+			*error_message = strdup("Remote server has closed the connection");
+			mongo_manager_server_failed(sock->manager, con, *error_message);
+			return -32;
+		}
+
+		if (errno == EINTR) {
+			continue;
+		}
+		if (errno != EAGAIN && errno != EWOULDBLOCK) {
+			*error_message = malloc(256);
+			snprintf(*error_message, 256, "Read from socket failed: %s", strerror(errno));
+			mongo_manager_server_failed(sock->manager, con, *error_message);
+			return -31;
+		}
+
+		/* Nothing has arrived yet */
+		__sync_add_and_fetch(&sock->manager->io_stats.waits, 1);
+		if (!deadline) {
+			deadline = mongo_io_deadline(con, timeout);
+		}
+		switch (mongo_io_wait(sock->fd, POLLIN, deadline)) {
+			case 0:
+				*error_message = malloc(256);
+				snprintf(*error_message, 256, "Read timed out after reading %d of %d bytes", received, size);
+				return mongo_connection_timed_out(sock->manager, con, *error_message);
+
+			case -1:
+				*error_message = malloc(256);
+				snprintf(*error_message, 256, "Waiting for the socket failed: %s", strerror(errno));
+				mongo_manager_server_failed(sock->manager, con, *error_message);
+				return -31;
+		}
+	}
+
+	mongo_connection_io_received(con);
+	return received;
+}
+
+int mongo_io_recv_header(mongo_connection *con, mongo_server_options *options, int timeout, void *data, int size, char **error_message)
+{
+	return mongo_io_recv(con, timeout, (char *)data, size, error_message);
+}
+
+int mongo_io_recv_data(mongo_connection *con, mongo_server_options *options, int timeout, void *data, int size, char **error_message)
+{
+	return mongo_io_recv(con, timeout, (char *)data, size, error_message);
+}
+
+/* Writes all count buffers with as few system calls as the kernel allows.
+ * The iovecs are advanced past what has been written. Returns the number of
+ * bytes written, or -1 on errors. */
+int mongo_io_sendv(mongo_connection *con, mongo_server_options *options, struct iovec *iov, int count, char **error_message)
+{
+	mongo_io_socket *sock = (mongo_io_socket *)con->socket;
+	struct msghdr    msg;
+	int64_t          deadline = 0;
+	int              sent = 0, num;
+
+	mongo_connection_io_sent(con);
+
+	while (count > 0) {
+		/* sendmsg() rather than writev(), so that a closed connection
+		 * doesn't raise SIGPIPE. A message with more segments than one call
+		 * takes is sent with MSG_MORE, so that TCP_NODELAY doesn't push the
+		 * first part out as a short segment on its own. */
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = iov;
+		msg.msg_iovlen = count < IOV_MAX ? count : IOV_MAX;
+
+		num = sendmsg(sock->fd, &msg, MSG_NOSIGNAL | (count > IOV_MAX ? MSG_MORE : 0));
+		if (num < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if (errno != EAGAIN && errno != EWOULDBLOCK) {
+				*error_message = malloc(256);
+				snprintf(*error_message, 256, "Write to socket failed: %s", strerror(errno));
+				mongo_manager_server_failed(sock->manager, con, *error_message);
+				return -1;
+			}
+
+			if (!deadline) {
+				deadline = mongo_io_deadline(con, options->socketTimeoutMS);
+			}
+			if (mongo_io_wait(sock->fd, POLLOUT, deadline) <= 0) {
+				*error_message = malloc(256);
+				snprintf(*error_message, 256, "Write timed out after writing %d bytes", sent);
+				mongo_connection_timed_out(sock->manager, con, *error_message);
+				return -1;
+			}
+			continue;
+		}
+
+		sent += num;
+		while (count > 0 && (size_t)num >= iov->iov_len) {
+			num -= iov->iov_len;
+			iov++;
+			count--;
+		}
+		if (count > 0) {
+			iov->iov_base = (char *)iov->iov_base + num;
+			iov->iov_len -= num;
+		}
+	}
+
+	return sent;
+}
+
+int mongo_io_send(mongo_connection *con, mongo_server_options *options, void *data, int size, char **error_message)
+{
+	struct iovec iov;
+
+	iov.iov_base = data;
+	iov.iov_len = size;
+
+	return mongo_io_sendv(con, options, &iov, 1, error_message);
+}
+
+void mongo_io_close(mongo_connection *con, int why)
+{
+	mongo_io_socket *sock = (mongo_io_socket *)con->socket;
+
+	if (sock) {
+		close(sock->fd);
+		free(sock->buffer);
+		free(sock);
+	}
+}
+
+/* The sockets are only known to their connections, so there is nothing to
+ * unregister after a fork */
+void mongo_io_forget(mongo_con_manager *manager, mongo_connection *con)
+{
+}
+
+/* Sockets of the PHP streams transport have no descriptor of their own */
+int mongo_io_poll_fd(mongo_connection *con)
+{
+	mongo_io_socket *sock = (mongo_io_socket *)con->socket;
+
+	if (sock->fd < 0 || sock->buffer_start < sock->buffer_end) {
+		return -1;
+	}
+	return sock->fd;
+}
+
+/*
+ * Local variables:
+ * tab-width: 4
+ * c-basic-offset: 4
+ * End:
+ * vim600: fdm=marker
+ * vim: noet sw=4 ts=4
+ */
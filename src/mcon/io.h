@@ -0,0 +1,75 @@
+/**
+ *  Copyright 2009-2014 MongoDB, Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+#ifndef __MCON_IO_H__
+#define __MCON_IO_H__
+
+#include "types.h"
+#include <sys/uio.h>
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+/* Used when a read is done without a timeout (0), like PHP's
+ * default_socket_timeout */
+#define MONGO_IO_DEFAULT_TIMEOUT 60000
+
+/* The size of each native socket's read-ahead buffer. Replies that fit are
+ * read with one recv(), header and all; the rest of larger ones is read
+ * straight into the caller's buffer. */
+#define MONGO_IO_READ_AHEAD 16384
+
+/* What the native IO callbacks store in mongo_connection's socket */
+typedef struct _mongo_io_socket
+{
+	int                fd;      /* Non-blocking, or -1 if stream is set */
+	mongo_con_manager *manager; /* To report failures to, see mongo_manager_server_failed() */
+	void              *stream;  /* Set instead of fd when another transport handles the connection, see io_stream.cpp */
+
+	/* Data that has been received but not read yet, see mongo_io_recv() */
+	char              *buffer;  /* MONGO_IO_READ_AHEAD bytes, or NULL */
+	int                buffer_start;
+	int                buffer_end;
+} mongo_io_socket;
+
+/* The native IO callbacks, which talk to the socket directly. They are the
+ * manager's defaults, see mongo_init(). Reads and writes return the same
+ * error codes as the PHP stream callbacks: -31 on failure, -32 when the
+ * server closed the connection, -80 on a timeout, and -81 when the operation
+ * ran out of its budget, see mongo_connection_timed_out(). */
+void* mongo_io_connect(mongo_con_manager *manager, mongo_server_def *server, mongo_server_options *options, char **error_message);
+int mongo_io_recv_header(mongo_connection *con, mongo_server_options *options, int timeout, void *data, int size, char **error_message);
+int mongo_io_recv_data(mongo_connection *con, mongo_server_options *options, int timeout, void *data, int size, char **error_message);
+int mongo_io_send(mongo_connection *con, mongo_server_options *options, void *data, int size, char **error_message);
+int mongo_io_sendv(mongo_connection *con, mongo_server_options *options, struct iovec *iov, int count, char **error_message);
+void mongo_io_close(mongo_connection *con, int why);
+void mongo_io_forget(mongo_con_manager *manager, mongo_connection *con);
+int mongo_io_poll_fd(mongo_connection *con);
+
+#if defined(__cplusplus)
+}
+#endif
+
+#endif
+
+/*
+ * Local variables:
+ * tab-width: 4
+ * c-basic-offset: 4
+ * End:
+ * vim600: fdm=marker
+ * vim: noet sw=4 ts=4
+ */
@@ -17,6 +17,8 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdarg.h>
+#include <errno.h>
+#include <pthread.h>
 #ifdef WIN32
 #define va_copy(s,d) ((void)((d) = (s)))
 #else
@@ -28,57 +30,109 @@
 #include "manager.h"
 #include "connections.h"
 #include "collection.h"
+#include "table.h"
+#include "pool.h"
 #include "parse.h"
 #include "read_preference.h"
+#include "topology.h"
+#include "monitor.h"
+#include "selection.h"
+#include "io.h"
+#include "mux.h"
+#include "async.h"
+#include "bson_validate.h"
 #include "contrib/strndup.h"
 
 /* Forwards declarations */
 static void mongo_blacklist_destroy(mongo_con_manager *manager, void *data, int why);
 
+/* Every connection that the current thread looks up while it is inside
+ * mongo_get_read_write_connection() is pinned: it holds a reference on it, so
+ * that another thread deregistering the connection can't free it from under
+ * us. The pins are released when the outermost call returns. */
+static __thread mcon_collection *mongo_manager_pins = NULL;
+static __thread int              mongo_manager_pin_depth = 0;
+
+void mongo_manager_pin_enter(void)
+{
+	if (mongo_manager_pin_depth++ == 0) {
+		mongo_manager_pins = mcon_init_collection(sizeof(mongo_connection*));
+	}
+}
+
+void mongo_manager_pin_leave(mongo_con_manager *manager)
+{
+	int i;
+
+	if (--mongo_manager_pin_depth > 0) {
+		return;
+	}
+
+	for (i = 0; i < mongo_manager_pins->count; i++) {
+		mongo_connection_release(manager, mongo_manager_pins->data[i], MONGO_CLOSE_BROKEN);
+	}
+	mcon_collection_free(mongo_manager_pins);
+	mongo_manager_pins = NULL;
+}
+
+/* Called with the registry shard locked, so that the connection can't be
+ * removed and released before we hold our reference */
+static void mongo_manager_pin(char *hash, void *data, void *context)
+{
+	if (mongo_manager_pin_depth) {
+		mongo_connection_addref((mongo_connection *)data);
+		mcon_collection_add(mongo_manager_pins, data);
+	}
+}
+
+/* Pins a connection that the caller holds a reference on */
+void mongo_manager_pin_connection(mongo_connection *con)
+{
+	mongo_manager_pin(NULL, con, NULL);
+}
+
 /* Helpers */
 static mongo_connection *mongo_get_connection_single(mongo_con_manager *manager, mongo_server_def *server, mongo_server_options *options, int connection_flags, char **error_message)
 {
-	char *hash;
+	mongo_server_id *id;
 	mongo_connection *con = NULL;
-	mongo_connection_blacklist *blacklist = NULL;
+	int last_ping;
 
-	hash = mongo_server_create_hash(server);
+	id = mongo_server_def_id(server);
 
 	/* See if a connection is in our blacklist to short-circut trying to
 	 * connect to a node that is known to be down. This is done so we don't
 	 * waste precious time in connecting to unreachable nodes */
-	blacklist = mongo_manager_blacklist_find_by_hash(manager, hash);
-	if (blacklist) {
+	if (mongo_manager_blacklist_last_ping(manager, id, &last_ping)) {
 		struct timeval start;
 		/* It is blacklisted, but it may have been a long time again and
 		 * chances are we should give it another try */
-		if (mongo_connection_ping_check(manager, blacklist->last_ping, &start)) {
+		if (mongo_connection_ping_check(manager, last_ping, &start)) {
 			/* The connection is blacklisted, but we've reached our ping
 			 * interval so lets remove the blacklisting and pretend we didn't
 			 * know about it */
-			mongo_manager_blacklist_deregister(manager, blacklist, hash);
+			mongo_manager_blacklist_deregister(manager, NULL, id->hash);
 		} else {
 			/* Otherwise short-circut the connection attempt, and say we failed
 			 * right away */
-			free(hash);
 			*error_message = strdup("Previous connection attempts failed, server blacklisted");
 			return NULL;
 		}
 	}
 
-	con = mongo_manager_connection_find_by_hash(manager, hash);
+	con = mongo_manager_connection_find_by_id(manager, id);
 
 	/* If we aren't about to (re-)connect then all we care about if it was a
 	 * known connection or not */
 	if (connection_flags & MONGO_CON_FLAG_DONT_CONNECT) {
-		free(hash);
 		return con;
 	}
 
-	/* If we found a valid connection check if we need to ping it */
+	/* If we found a valid connection check if we need to ping it. When the
+	 * monitor runs, it checks the connection in the background instead. */
 	if (con) {
 		/* Do the ping, if needed */
-		if (!mongo_connection_ping(manager,  con, options, error_message)) {
+		if (!manager->monitor && !mongo_connection_ping(manager,  con, options, error_message)) {
 			/* If the ping failed, deregister the connection */
 			mongo_manager_connection_deregister(manager, con);
 			/* Set the return value to NULL, as the connection is broken and
@@ -86,28 +140,36 @@ static mongo_connection *mongo_get_connection_single(mongo_con_manager *manager,
 			con = NULL;
 		}
 
-		free(hash);
 		return con;
 	}
 
 	/* Since we didn't find an existing connection, lets make one! */
-	con = mongo_connection_create(manager, hash, server, options, error_message);
+	con = mongo_connection_create(manager, id, server, options, error_message);
 	if (con) {
+		con->pool = mongo_pool_create(manager, server, options);
+
 		/* isMaster() _must_ be the first command on all new connections.
 		 * This is for node discovery so we don't issue f.e. authentication to nodes in STARTUP
 		 * state, or arbiters */
-		if (!mongo_connection_ismaster(manager, con, options, NULL, 0, NULL, error_message, NULL)) {
+		if (manager->fast_handshake) {
+			/* Also takes the latency and server version from the ismaster
+			 * round trip, and fetches the nonce for authentication along
+			 * with it */
+			if (!mongo_connection_handshake(manager, con, options, server, error_message)) {
+				mongo_manager_log(manager, MLOG_CON, MLOG_WARN, "ismaster: error running ismaster: %s",  *error_message);
+				mongo_connection_destroy(manager, con, MONGO_CLOSE_BROKEN);
+				return NULL;
+			}
+		} else if (!mongo_connection_ismaster(manager, con, options, NULL, 0, NULL, error_message, NULL)) {
 			mongo_manager_log(manager, MLOG_CON, MLOG_WARN, "ismaster: error running ismaster: %s",  *error_message);
 			mongo_connection_destroy(manager, con, MONGO_CLOSE_BROKEN);
-			free(hash);
 			return NULL;
 		}
 
 		/* When we make a connection, we need to figure out the server version it is */
-		if (!mongo_connection_get_server_version(manager, con, options, error_message)) {
+		if (!manager->fast_handshake && !mongo_connection_get_server_version(manager, con, options, error_message)) {
 			mongo_manager_log(manager, MLOG_CON, MLOG_WARN, "server_version: error while getting the server version %s:%d: %s", server->host, server->port, *error_message);
 			mongo_connection_destroy(manager, con, MONGO_CLOSE_BROKEN);
-			free(hash);
 			return NULL;
 		}
 
@@ -116,15 +178,36 @@ static mongo_connection *mongo_get_connection_single(mongo_con_manager *manager,
 		if (con->connection_type != MONGO_NODE_ARBITER) {
 			if (!manager->authenticate(manager, con, options, server, error_message)) {
 				mongo_connection_destroy(manager, con, MONGO_CLOSE_BROKEN);
-				free(hash);
 				return NULL;
 			}
 		}
 
-		/* Do the first-time ping to record the latency of the connection */
-		if (mongo_connection_ping(manager, con, options, error_message)) {
-			/* Register the connection on successful pinging */
+		/* Do the first-time ping to record the latency of the connection,
+		 * unless the handshake did so already */
+		if (manager->fast_handshake || mongo_connection_ping(manager, con, options, error_message)) {
+			/* From now on, the socket is shared, and operations on it have
+			 * to go through the multiplexer */
+			if (manager->multiplex) {
+				con->mux = mongo_mux_create();
+			}
+
+			/* Register the connection on successful pinging. The manager
+			 * takes over our reference, so we pin it like any other
+			 * connection that we found in the registry. */
+			mongo_manager_pin(id->hash, con, NULL);
 			mongo_manager_connection_register(manager, con);
+
+			/* Open the pool's minimum number of sockets. Not being able to
+			 * is not fatal, as the pool opens more sockets on demand. A
+			 * multiplexed connection doesn't need any. */
+			if (con->pool->min_size > 0 && !con->mux) {
+				char *pool_error_message = NULL;
+
+				if (!mongo_pool_fill(manager, con, options, &pool_error_message)) {
+					mongo_manager_log(manager, MLOG_CON, MLOG_WARN, "pool: couldn't open the minimum of %d sockets to %s:%d: %s", con->pool->min_size, server->host, server->port, pool_error_message);
+					free(pool_error_message);
+				}
+			}
 		} else {
 			/* Or kill it and reset the return value if the ping somehow failed */
 			mongo_connection_destroy(manager, con, MONGO_CLOSE_BROKEN);
@@ -132,8 +215,6 @@ static mongo_connection *mongo_get_connection_single(mongo_con_manager *manager,
 		}
 	}
 
-	free(hash);
-
 	if (con) {
 		con->connected = 1;
 	}
@@ -141,6 +222,13 @@ static mongo_connection *mongo_get_connection_single(mongo_con_manager *manager,
 	return con;
 }
 
+/* Connects to, and registers, the server if we don't know it yet. Must be
+ * called inside a pin scope (see mongo_manager_pin_enter()). */
+mongo_connection *mongo_manager_connection_connect(mongo_con_manager *manager, mongo_server_def *server, mongo_server_options *options, char **error_message)
+{
+	return mongo_get_connection_single(manager, server, options, MONGO_CON_FLAG_WRITE, error_message);
+}
+
 static int mongo_strings_equal_or_null(const char *s1, const char *s2)
 {
 	return (
@@ -176,143 +264,447 @@ static int mongo_servers_contains(const mongo_servers *servers, const mongo_serv
 
 /* Topology discovery */
 
-/* - Helpers */
-/* Returns:
- * 1 on success
- * 0 on total failure (e.g. unsupported wire version) */
-static int mongo_discover_topology(mongo_con_manager *manager, mongo_servers *servers)
+/* Every server that discovery has to check is a job. Jobs for servers we
+ * have no connection to yet run in their own thread, so that connecting to
+ * all of them (and the full handshake on each) happens at the same time, and
+ * discovery takes about as long as the slowest server rather than the sum of
+ * all of them. The other jobs run inline, as they normally don't need to go
+ * over the wire.
+ *
+ * Discovery runs in waves: the first one checks the seeds, and every next one
+ * the hosts that the previous wave's ismaster replies told us about. All
+ * waves together have to finish within connectTimeoutMS. Threads of jobs
+ * that didn't make the deadline finish in the background, and free their
+ * job themselves. No wave is started after one missed the deadline. */
+typedef struct _mongo_discovery
 {
-	int i, j;
-	char *hash;
-	mongo_connection *con;
-	char *error_message;
-	char *repl_set_name = servers->options.repl_set_name ? strdup(servers->options.repl_set_name) : NULL;
-	int nr_hosts;
-	char **found_hosts = NULL;
-	char *tmp_hash;
-	int   res;
-	int found_supported_wire_version = 1; /* Innocent unless proven guilty */
+	mongo_con_manager    *manager;
+	mongo_server_options  options;   /* Copy, as threads can outlive the request */
+	pthread_mutex_t       lock;
+	pthread_cond_t        finished;
+	int                   pending;   /* Jobs that are queued for a thread, or still running in one */
+	int                   refcount;  /* The request, plus one for every thread */
+	int                   threads;   /* Threads that take jobs from the queue */
+	int                   queued;    /* Jobs in the queue of the current wave */
+	int                   taken;     /* Jobs that a thread has taken from the queue */
+	struct _mongo_discovery_job *queue[MAX_SERVERS_LIMIT];
+} mongo_discovery;
+
+typedef struct _mongo_discovery_job
+{
+	mongo_discovery   *discovery;
+	mongo_server_def  *server;        /* Copy; ismaster changes it when the server's name is different */
+	int                seed;          /* Index of the server in "servers" that the credentials come from */
+	int                connection_flags;
+	int                done;
+	int                abandoned;     /* Set when the request stopped waiting for it; protected by the discovery's lock */
+	int                connected;
+	int                ismaster;      /* Result of mongo_connection_ismaster() */
+	char              *repl_set_name;
+	int                nr_hosts;
+	char             **found_hosts;
+	char              *error_message;
+} mongo_discovery_job;
+
+static void mongo_discovery_release(mongo_discovery *discovery)
+{
+	if (__sync_sub_and_fetch(&discovery->refcount, 1) > 0) {
+		return;
+	}
+
+	mongo_server_options_dtor(&discovery->options);
+	pthread_cond_destroy(&discovery->finished);
+	pthread_mutex_destroy(&discovery->lock);
+	free(discovery);
+}
+
+static mongo_discovery_job *mongo_discovery_job_create(mongo_discovery *discovery, mongo_server_def *server, int seed, int connection_flags)
+{
+	mongo_discovery_job *job;
+
+	job = (mongo_discovery_job *)calloc(1, sizeof(mongo_discovery_job));
+	job->discovery = discovery;
+	job->server = (mongo_server_def *)calloc(1, sizeof(mongo_server_def));
+	mongo_server_def_copy(job->server, server, MONGO_SERVER_COPY_CREDENTIALS);
+	job->seed = seed;
+	job->connection_flags = connection_flags;
+	if (discovery->options.repl_set_name) {
+		job->repl_set_name = strdup(discovery->options.repl_set_name);
+	}
+
+	return job;
+}
+
+static void mongo_discovery_job_free(mongo_discovery_job *job)
+{
+	int i;
+
+	for (i = 0; i < job->nr_hosts; i++) {
+		free(job->found_hosts[i]);
+	}
+	free(job->found_hosts);
+	free(job->repl_set_name);
+	free(job->error_message);
+	mongo_server_def_dtor(job->server);
+	free(job);
+}
+
+/* Connects to the server if needed, and runs ismaster on it to validate it
+ * and to find the other members of the set */
+static void mongo_discovery_job_run(mongo_discovery_job *job)
+{
+	mongo_con_manager *manager = job->discovery->manager;
+	mongo_connection  *con;
+
+	mongo_manager_pin_enter();
+
+	con = mongo_get_connection_single(manager, job->server, &job->discovery->options, job->connection_flags, &job->error_message);
+	if (con) {
+		job->connected = 1;
 
-	for (i = 0; i < servers->count; i++) {
-		hash = mongo_server_create_hash(servers->server[i]);
-		mongo_manager_log(manager, MLOG_CON, MLOG_FINE, "discover_topology: checking ismaster for %s", hash);
-		con = mongo_manager_connection_find_by_hash(manager, hash);
-
-		if (!con) {
-			mongo_manager_log(manager, MLOG_CON, MLOG_WARN, "discover_topology: couldn't create a connection for %s", hash);
-			free(hash);
-			continue;
-		}
-		
 		/* Run ismaster, if needed, to extract server flags - and fetch the other known hosts */
-		res = mongo_connection_ismaster(manager, con, &servers->options, (char**) &repl_set_name, (int*) &nr_hosts, (char***) &found_hosts, (char**) &error_message, servers->server[i]);
-		switch (res) {
-			case 4:
-				/* The server is running unsupported wire versions */
-				found_supported_wire_version = 0;
-				/* break omitted intentionally */
-			case 0:
-				/* Something is wrong with the connection, we need to remove
-				 * this from our list */
-				mongo_manager_log(manager, MLOG_CON, MLOG_WARN, "discover_topology: ismaster return with an error for %s:%d: [%s]", servers->server[i]->host, servers->server[i]->port, error_message);
-				free(error_message);
+		job->ismaster = mongo_connection_ismaster(manager, con, &job->discovery->options, &job->repl_set_name, &job->nr_hosts, &job->found_hosts, &job->error_message, job->server);
+		switch (job->ismaster) {
+			case 0: /* Something is wrong with the connection */
+			case 4: /* The server is running unsupported wire versions */
+				mongo_manager_log(manager, MLOG_CON, MLOG_WARN, "discover_topology: ismaster return with an error for %s:%d: [%s]", job->server->host, job->server->port, job->error_message);
 				mongo_manager_connection_deregister(manager, con);
 				break;
 
 			case 3:
 				mongo_manager_log(manager, MLOG_CON, MLOG_WARN, "discover_topology: ismaster worked, but we need to remove the seed host's connection");
 				mongo_manager_connection_deregister(manager, con);
-				/* Break intentionally missing */
+				break;
 
 			case 1:
 				mongo_manager_log(manager, MLOG_CON, MLOG_FINE, "discover_topology: ismaster worked");
-				/* Update the replica set name in the parsed "servers" struct
-				 * so that we can consistently compare it to the information
-				 * that is stored in the connection hashes. */
-				if (!servers->options.repl_set_name && repl_set_name) {
-					servers->options.repl_set_name = strdup(repl_set_name);
-				}
-
-				/* Now loop over all the hosts that were found */
-				for (j = 0; j < nr_hosts; j++) {
-					mongo_server_def *tmp_def;
-					mongo_connection *new_con;
-					char *con_error_message = NULL;
-
-					/* Create a temp server definition to create a new
-					 * connection on-demand if we didn't have one already */
-					tmp_def = (mongo_server_def *)calloc(1, sizeof(mongo_server_def));
-					tmp_def->username = servers->server[i]->username ? strdup(servers->server[i]->username) : NULL;
-					tmp_def->password = servers->server[i]->password ? strdup(servers->server[i]->password) : NULL;
-					tmp_def->repl_set_name = servers->server[i]->repl_set_name ? strdup(servers->server[i]->repl_set_name) : NULL;
-					tmp_def->db = servers->server[i]->db ? strdup(servers->server[i]->db) : NULL;
-					tmp_def->authdb = servers->server[i]->authdb ? strdup(servers->server[i]->authdb) : NULL;
-					tmp_def->host = mcon_strndup(found_hosts[j], strchr(found_hosts[j], ':') - found_hosts[j]);
-					tmp_def->port = atoi(strchr(found_hosts[j], ':') + 1);
-					tmp_def->mechanism = servers->server[i]->mechanism;
-					
-					/* Create a hash so that we can check whether we already have a
-					 * connection for this server definition. If we don't create
-					 * the connection, register it (done in
-					 * mongo_get_connection_single) and add it to the list of
-					 * servers that we're processing so we might use this host to
-					 * find more servers. */
-					tmp_hash = mongo_server_create_hash(tmp_def);
-					if (!mongo_manager_connection_find_by_hash(manager, tmp_hash)) {
-						mongo_manager_log(manager, MLOG_CON, MLOG_INFO, "discover_topology: found new host: %s:%d", tmp_def->host, tmp_def->port);
-						new_con = mongo_get_connection_single(manager, tmp_def, &servers->options, MONGO_CON_FLAG_WRITE, (char **) &con_error_message);
-
-						if (new_con) {
-							int ismaster_error = mongo_connection_ismaster(manager, new_con, &servers->options, NULL, NULL, NULL, &con_error_message, NULL);
-
-							switch (ismaster_error) {
-								case 1: /* Run just fine */
-								case 2: /* ismaster() skipped due to interval */
-									break;
-
-								case 4: /* Danger danger, reported wire version does not overlap what we support */
-									found_supported_wire_version = 0;
-									/* break omitted intentionally */
-
-								case 0: /* Some error */
-								case 3: /* Run just fine, but hostname didn't match what we expected */
-								default:
-
-									mongo_manager_log(manager, MLOG_CON, MLOG_WARN, "server_flags: error while getting the server configuration %s:%d: %s", servers->server[i]->host, servers->server[i]->port, con_error_message);
-									mongo_manager_connection_deregister(manager, new_con);
-									new_con = NULL;
-							}
-						} else {
-							mongo_manager_log(manager, MLOG_CON, MLOG_WARN, "discover_topology: could not connect to new host: %s:%d: %s", tmp_def->host, tmp_def->port, con_error_message);
-							free(con_error_message);
-						}
-					}
-
-					if (!mongo_servers_contains(servers, tmp_def)) {
-						servers->server[servers->count] = tmp_def;
-						servers->count++;
-					} else {
-						mongo_server_def_dtor(tmp_def);
-					}
-					free(tmp_hash);
-
-					/* Cleanup */
-					free(found_hosts[j]);
-				}
-				free(found_hosts);
-				found_hosts = NULL;
 				break;
 
 			case 2:
 				mongo_manager_log(manager, MLOG_CON, MLOG_FINE, "discover_topology: ismaster got skipped");
 				break;
 		}
+	}
+
+	mongo_manager_pin_leave(manager);
+}
+
+/* Runs the queued jobs until there are none left. Jobs that the request has
+ * stopped waiting for are freed here, and the ones that hadn't been started
+ * yet aren't run at all. Abandoning is tracked per job, so that a thread
+ * that is still busy with a job from a wave that missed the deadline can't
+ * mistake the jobs of another wave for its own. A thread stops counting as one that takes
+ * jobs as soon as it finds the queue empty, under the same lock, so that a
+ * next wave starts new ones as needed. */
+static void mongo_discovery_work(mongo_discovery *discovery, int is_thread)
+{
+	mongo_discovery_job *job;
+	int                  abandoned;
+
+	pthread_mutex_lock(&discovery->lock);
+	while (discovery->taken < discovery->queued) {
+		job = discovery->queue[discovery->taken++];
+		abandoned = job->abandoned;
+		pthread_mutex_unlock(&discovery->lock);
+
+		if (!abandoned) {
+			mongo_discovery_job_run(job);
+		}
+
+		pthread_mutex_lock(&discovery->lock);
+		job->done = 1;
+		discovery->pending--;
+		abandoned = job->abandoned;
+		pthread_cond_signal(&discovery->finished);
+
+		if (abandoned) {
+			pthread_mutex_unlock(&discovery->lock);
+			mongo_discovery_job_free(job);
+			pthread_mutex_lock(&discovery->lock);
+		}
+	}
+	if (is_thread) {
+		discovery->threads--;
+	}
+	pthread_mutex_unlock(&discovery->lock);
+}
+
+static void *mongo_discovery_thread(void *arg)
+{
+	mongo_discovery   *discovery = (mongo_discovery *)arg;
+	mongo_con_manager *manager = discovery->manager;
+
+	mongo_discovery_work(discovery, 1);
+	mongo_discovery_release(discovery);
+
+	/* The manager can be gone as soon as it's told */
+	pthread_mutex_lock(&manager->discovery_lock);
+	if (--manager->discovery_running == 0) {
+		pthread_cond_broadcast(&manager->discovery_done);
+	}
+	pthread_mutex_unlock(&manager->discovery_lock);
+
+	return NULL;
+}
+
+/* Whether the job needs to connect to the server, and is therefore worth
+ * running in a thread of its own */
+static int mongo_discovery_job_is_cold(mongo_con_manager *manager, mongo_discovery_job *job)
+{
+	if (job->connection_flags & MONGO_CON_FLAG_DONT_CONNECT) {
+		return 0;
+	}
+
+	return !mongo_manager_connection_find_by_id(manager, mongo_server_def_id(job->server));
+}
+
+/* Runs all jobs, and waits for them until the deadline. Returns 0 if it
+ * passed before all jobs were done, in which case the unfinished jobs are
+ * no longer ours, and are set to NULL in "jobs". */
+static int mongo_discovery_run_wave(mongo_discovery *discovery, mongo_discovery_job **jobs, int count, struct timespec *deadline)
+{
+	mongo_con_manager *manager = discovery->manager;
+	pthread_t          thread;
+	int               *cold;
+	int                i, nr_cold = 0, nr_threads = 0, all_done = 1;
+
+	cold = (int *)calloc(count, sizeof(int));
+	for (i = 0; i < count; i++) {
+		cold[i] = mongo_discovery_job_is_cold(manager, jobs[i]);
+		nr_cold += cold[i];
+	}
+
+	/* Starting threads only pays off if there is more than one server to
+	 * connect to. The servers that need a connection are queued for at most
+	 * discovery_threads threads, rather than getting a thread each. */
+	if (nr_cold > 1) {
+		pthread_mutex_lock(&discovery->lock);
+		discovery->queued = discovery->taken = 0;
+		for (i = 0; i < count; i++) {
+			if (cold[i]) {
+				discovery->queue[discovery->queued++] = jobs[i];
+				discovery->pending++;
+			}
+		}
+		nr_threads = manager->discovery_threads > 0 ? manager->discovery_threads : 1;
+		if (nr_threads > nr_cold) {
+			nr_threads = nr_cold;
+		}
+		nr_threads -= discovery->threads;
+		pthread_mutex_unlock(&discovery->lock);
+	}
+
+	for (i = 0; i < nr_threads; i++) {
+		__sync_add_and_fetch(&discovery->refcount, 1);
+		pthread_mutex_lock(&discovery->lock);
+		discovery->threads++;
+		pthread_mutex_unlock(&discovery->lock);
+		pthread_mutex_lock(&manager->discovery_lock);
+		manager->discovery_running++;
+		pthread_mutex_unlock(&manager->discovery_lock);
+
+		if (pthread_create(&thread, NULL, mongo_discovery_thread, discovery) == 0) {
+			pthread_detach(thread);
+		} else {
+			pthread_mutex_lock(&manager->discovery_lock);
+			manager->discovery_running--;
+			pthread_mutex_unlock(&manager->discovery_lock);
+			pthread_mutex_lock(&discovery->lock);
+			discovery->threads--;
+			pthread_mutex_unlock(&discovery->lock);
+			__sync_sub_and_fetch(&discovery->refcount, 1);
+		}
+	}
+
+	for (i = 0; i < count; i++) {
+		if (!cold[i] || nr_cold < 2) {
+			mongo_discovery_job_run(jobs[i]);
+			jobs[i]->done = 1;
+		}
+	}
+	free(cold);
+
+	/* If no thread could be started, the queue is ours to run */
+	pthread_mutex_lock(&discovery->lock);
+	if (discovery->threads == 0 && discovery->taken < discovery->queued) {
+		pthread_mutex_unlock(&discovery->lock);
+		mongo_discovery_work(discovery, 0);
+	} else {
+		pthread_mutex_unlock(&discovery->lock);
+	}
 
-		free(hash);
+	pthread_mutex_lock(&discovery->lock);
+	while (discovery->pending > 0) {
+		if (deadline) {
+			if (pthread_cond_timedwait(&discovery->finished, &discovery->lock, deadline) == ETIMEDOUT) {
+				break;
+			}
+		} else {
+			pthread_cond_wait(&discovery->finished, &discovery->lock);
+		}
 	}
-	if (repl_set_name) {
-		free(repl_set_name);
+	if (discovery->pending > 0) {
+		/* The threads that are still running free their jobs themselves */
+		for (i = 0; i < count; i++) {
+			if (!jobs[i]->done) {
+				jobs[i]->abandoned = 1;
+				jobs[i] = NULL;
+			}
+		}
+		all_done = 0;
+	}
+	pthread_mutex_unlock(&discovery->lock);
+
+	if (!all_done) {
+		mongo_manager_log(manager, MLOG_CON, MLOG_WARN, "discover_topology: not all servers responded within the connection timeout");
 	}
+	return all_done;
+}
+
+/* Returns:
+ * 1 on success
+ * 0 on total failure (e.g. unsupported wire version)
+ *
+ * *connected is set to the number of seeds that we have a connection to. */
+static int mongo_discover_topology(mongo_con_manager *manager, mongo_servers *servers, int connection_flags, int *connected)
+{
+	mongo_discovery      *discovery;
+	mongo_discovery_job **jobs, **next_jobs;
+	struct timespec       deadline, *deadline_ptr = NULL;
+	struct timeval        now;
+	int                   count, next_count, i, j, wave;
+	int                   all_done = 1;
+	int                   found_supported_wire_version = 1; /* Innocent unless proven guilty */
+
+	discovery = (mongo_discovery *)calloc(1, sizeof(mongo_discovery));
+	discovery->manager = manager;
+	mongo_server_options_copy(&discovery->options, &servers->options);
+	pthread_mutex_init(&discovery->lock, NULL);
+	pthread_cond_init(&discovery->finished, NULL);
+	discovery->refcount = 1;
+
+	if (servers->options.connectTimeoutMS > 0) {
+		gettimeofday(&now, NULL);
+		deadline.tv_sec = now.tv_sec + servers->options.connectTimeoutMS / 1000;
+		deadline.tv_nsec = now.tv_usec * 1000 + (long) (servers->options.connectTimeoutMS % 1000) * 1000000;
+		if (deadline.tv_nsec >= 1000000000) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000;
+		}
+		deadline_ptr = &deadline;
+	}
+
+	/* The first wave checks the seeds */
+	count = servers->count;
+	jobs = (mongo_discovery_job **)calloc(count, sizeof(mongo_discovery_job *));
+	for (i = 0; i < count; i++) {
+		jobs[i] = mongo_discovery_job_create(discovery, servers->server[i], i, connection_flags);
+	}
+	*connected = 0;
+
+	for (wave = 0; count > 0; wave++) {
+		mongo_manager_log(manager, MLOG_CON, MLOG_FINE, "discover_topology: checking %d servers", count);
+		all_done = all_done && mongo_discovery_run_wave(discovery, jobs, count, deadline_ptr);
+
+		next_jobs = (mongo_discovery_job **)calloc(MAX_SERVERS_LIMIT, sizeof(mongo_discovery_job *));
+		next_count = 0;
+
+		for (i = 0; i < count; i++) {
+			mongo_discovery_job *job = jobs[i];
+
+			if (!job) {
+				/* Didn't finish in time, and belongs to its thread now */
+				continue;
+			}
+
+			if (!job->connected) {
+				if (!(job->connection_flags & MONGO_CON_FLAG_DONT_CONNECT)) {
+					mongo_manager_log(manager, MLOG_CON, MLOG_WARN, "Couldn't connect to '%s:%d': %s", job->server->host, job->server->port, job->error_message);
+				}
+				mongo_discovery_job_free(job);
+				continue;
+			}
+			if (wave == 0) {
+				(*connected)++;
+			}
+			if (job->ismaster == 4) {
+				found_supported_wire_version = 0;
+			}
+			if (job->ismaster != 1 && job->ismaster != 3) {
+				mongo_discovery_job_free(job);
+				continue;
+			}
+
+			/* ismaster fills in the replica set name, and the server's name
+			 * if it's not what we thought it was, on the job's copy of the
+			 * server definition */
+			if (!servers->server[job->seed]->repl_set_name && job->server->repl_set_name) {
+				servers->server[job->seed]->repl_set_name = strdup(job->server->repl_set_name);
+				mongo_server_def_reset_id(servers->server[job->seed]);
+			}
+			if (job->ismaster == 3) {
+				mongo_server_def *seed = servers->server[job->seed];
+
+				free(seed->host);
+				seed->host = strdup(job->server->host);
+				seed->port = job->server->port;
+				mongo_server_def_reset_id(seed);
+			}
+
+			/* Update the replica set name in the parsed "servers" struct
+			 * so that we can consistently compare it to the information
+			 * that is stored in the connection hashes. */
+			if (!servers->options.repl_set_name && job->repl_set_name) {
+				servers->options.repl_set_name = strdup(job->repl_set_name);
+			}
+
+			/* Now loop over all the hosts that were found */
+			for (j = 0; j < job->nr_hosts; j++) {
+				mongo_server_def *seed = servers->server[job->seed];
+				mongo_server_def *tmp_def;
+
+				/* Create a temp server definition with the credentials of
+				 * the server that told us about the host */
+				tmp_def = (mongo_server_def *)calloc(1, sizeof(mongo_server_def));
+				tmp_def->username = seed->username ? strdup(seed->username) : NULL;
+				tmp_def->password = seed->password ? strdup(seed->password) : NULL;
+				tmp_def->repl_set_name = seed->repl_set_name ? strdup(seed->repl_set_name) : NULL;
+				tmp_def->db = seed->db ? strdup(seed->db) : NULL;
+				tmp_def->authdb = seed->authdb ? strdup(seed->authdb) : NULL;
+				tmp_def->host = mcon_strndup(job->found_hosts[j], strchr(job->found_hosts[j], ':') - job->found_hosts[j]);
+				tmp_def->port = atoi(strchr(job->found_hosts[j], ':') + 1);
+				tmp_def->mechanism = seed->mechanism;
+
+				/* Add it to the list of servers that we're processing, and
+				 * check it in the next wave, so we might use this host to find
+				 * more servers. */
+				if (!mongo_servers_contains(servers, tmp_def) && servers->count < MAX_SERVERS_LIMIT) {
+					mongo_manager_log(manager, MLOG_CON, MLOG_INFO, "discover_topology: found new host: %s:%d", tmp_def->host, tmp_def->port);
+					servers->server[servers->count] = tmp_def;
+					next_jobs[next_count++] = mongo_discovery_job_create(discovery, tmp_def, servers->count, MONGO_CON_FLAG_WRITE);
+					servers->count++;
+				} else {
+					mongo_server_def_dtor(tmp_def);
+				}
+			}
+			mongo_discovery_job_free(job);
+		}
+
+		free(jobs);
+		jobs = next_jobs;
+		count = next_count;
+
+		if (!all_done) {
+			/* Out of time, the remaining servers are not checked */
+			for (i = 0; i < count; i++) {
+				mongo_discovery_job_free(jobs[i]);
+			}
+			count = 0;
+		}
+	}
+	free(jobs);
+
+	mongo_discovery_release(discovery);
 
 	return found_supported_wire_version;
 }
@@ -320,30 +712,18 @@ static int mongo_discover_topology(mongo_con_manager *manager, mongo_servers *se
 static mongo_connection *mongo_get_read_write_connection_replicaset(mongo_con_manager *manager, mongo_servers *servers, int connection_flags, char **error_message)
 {
 	mongo_connection *con = NULL;
-	mongo_connection *tmp;
-	mcon_collection  *collection;
-	char             *con_error_message = NULL;
-	int i;
 	int found_connected_server = 0;
+	int found_supported_wire_version;
+	int candidate_count;
 
-	/* Create a connection to all of the servers in the seed list */
-	for (i = 0; i < servers->count; i++) {
-		tmp = mongo_get_connection_single(manager, servers->server[i], &servers->options, connection_flags, (char **) &con_error_message);
-
-		if (tmp) {
-			found_connected_server++;
-		} else if (!(connection_flags & MONGO_CON_FLAG_DONT_CONNECT)) {
-			mongo_manager_log(manager, MLOG_CON, MLOG_WARN, "Couldn't connect to '%s:%d': %s", servers->server[i]->host, servers->server[i]->port, con_error_message);
-			free(con_error_message);
-		}
-	}
+	/* Connect to all of the servers in the seed list, and discover more
+	 * nodes. This also adds a connection to "servers" for each new node */
+	found_supported_wire_version = mongo_discover_topology(manager, servers, connection_flags, &found_connected_server);
 	if (!found_connected_server && (connection_flags & MONGO_CON_FLAG_DONT_CONNECT)) {
 		return NULL;
 	}
 
-	/* Discover more nodes. This also adds a connection to "servers" for each
-	 * new node */
-	if (!mongo_discover_topology(manager, servers)) {
+	if (!found_supported_wire_version) {
 		/* Total failure, we cannot proceed */
 		*error_message = strdup("Incompatible server detected. This driver release is not compatible with one of the connected servers");
 		return NULL;
@@ -357,8 +737,7 @@ static mongo_connection *mongo_get_read_write_connection_replicaset(mongo_con_ma
 		tmp_rp.tagsets = NULL;
 		tmp_rp.tagset_count = 0;
 
-		collection = mongo_find_candidate_servers(manager, &tmp_rp, servers);
-		mongo_read_preference_dtor(&tmp_rp);
+		con = mongo_select_server(manager, servers, &tmp_rp, &candidate_count);
 	} else if (connection_flags & MONGO_CON_FLAG_DONT_FILTER) {
 		/* We just want to know if we have something to talk to, irregardless of RP */
 		mongo_read_preference tmp_rp;
@@ -367,26 +746,14 @@ static mongo_connection *mongo_get_read_write_connection_replicaset(mongo_con_ma
 		tmp_rp.tagsets = NULL;
 		tmp_rp.tagset_count = 0;
 
-		collection = mongo_find_candidate_servers(manager, &tmp_rp, servers);
-		mongo_read_preference_dtor(&tmp_rp);
+		con = mongo_select_server(manager, servers, &tmp_rp, &candidate_count);
 	} else {
-		collection = mongo_find_candidate_servers(manager, &servers->read_pref, servers);
-	}
-	if (!collection) {
-		*error_message = strdup("No candidate servers found");
-		return NULL;
+		con = mongo_select_server(manager, servers, &servers->read_pref, &candidate_count);
 	}
-	if (collection->count == 0) {
+	if (!con) {
 		*error_message = strdup("No candidate servers found");
-		mcon_collection_free(collection);	
-		return NULL;
 	}
-	collection = mongo_sort_servers(manager, collection, &servers->read_pref);
-	collection = mongo_select_nearest_servers(manager, collection, &servers->options, &servers->read_pref);
-	con = mongo_pick_server_from_set(manager, collection, &servers->read_pref);
 
-	/* Cleaning up */
-	mcon_collection_free(collection);	
 	return con;
 }
 
@@ -395,9 +762,9 @@ static mongo_connection *mongo_get_connection_multiple(mongo_con_manager *manage
 {
 	mongo_connection *con = NULL;
 	mongo_connection *tmp;
-	mcon_collection  *collection = NULL;
 	mongo_read_preference tmp_rp; /* We only support NEAREST for MULTIPLE right now */
 	int i;
+	int candidate_count;
 	int found_connected_server = 0;
 	mcon_str         *messages;
 	int found_supported_wire_version = 1;
@@ -429,11 +796,11 @@ static mongo_connection *mongo_get_connection_multiple(mongo_con_manager *manage
 					 * later on, but we should continue to aggregate the errors in case more
 					 * servers are unsupported */
 					if (ismaster_error == 4) {
-						mongo_manager_connection_deregister(manager, tmp);
 						found_supported_wire_version = 0;
-					} else {
-						mongo_connection_destroy(manager, tmp, MONGO_CLOSE_BROKEN);
 					}
+					/* The connection is registered, so it can only go away
+					 * once every thread using it has released it */
+					mongo_manager_connection_deregister(manager, tmp);
 					tmp = NULL;
 					found_connected_server--;
 			}
@@ -475,29 +842,19 @@ static mongo_connection *mongo_get_connection_multiple(mongo_con_manager *manage
 	tmp_rp.type = MONGO_RP_ANY;
 	tmp_rp.tagsets = NULL;
 	tmp_rp.tagset_count = 0;
-	collection = mongo_find_candidate_servers(manager, &tmp_rp, servers);
-	if (!collection || collection->count == 0) {
-		if (messages->l) {
+	con = mongo_select_server(manager, servers, &tmp_rp, &candidate_count);
+	if (!con) {
+		if (candidate_count) {
+			*error_message = strdup("No server near us");
+		} else if (messages->l) {
 			*error_message = strdup(messages->d);
 		} else {
 			*error_message = strdup("No candidate servers found");
 		}
-		goto bailout;
 	}
-	collection = mongo_sort_servers(manager, collection, &servers->read_pref);
-	collection = mongo_select_nearest_servers(manager, collection, &servers->options, &servers->read_pref);
-	if (!collection) {
-		*error_message = strdup("No server near us");
-		goto bailout;
-	}
-	con = mongo_pick_server_from_set(manager, collection, &servers->read_pref);
 
-bailout:
 	/* Cleaning up */
 	mcon_str_ptr_dtor(messages);
-	if (collection) {
-		mcon_collection_free(collection);	
-	}
 	return con;
 }
 
@@ -525,15 +882,8 @@ int mongo_deregister_callback_from_connection(mongo_connection *connection, void
 
 }
 
-/* API interface to fetch a connection */
-mongo_connection *mongo_get_read_write_connection(mongo_con_manager *manager, mongo_servers *servers, int connection_flags, char **error_message)
+static mongo_connection *mongo_get_read_write_connection_pinned(mongo_con_manager *manager, mongo_servers *servers, int connection_flags, char **error_message)
 {
-	/* In some cases we won't actually have a manager or servers initialized, for example when extending PHP objects without calling the constructor,
-	 * and then var_dump() it or access the properties, for example the "connected" property */
-	if (!manager || !servers) {
-		return NULL;
-	}
-
 	/* Which connection we return depends on the type of connection we want */
 	switch (servers->options.con_type) {
 		case MONGO_CON_TYPE_STANDALONE:
@@ -559,6 +909,34 @@ mongo_connection *mongo_get_read_write_connection(mongo_con_manager *manager, mo
 	return NULL;
 }
 
+/* API interface to fetch a connection. The returned connection holds a
+ * reference for the caller, which has to be given up with
+ * mongo_manager_connection_release() once it's done using it. */
+mongo_connection *mongo_get_read_write_connection(mongo_con_manager *manager, mongo_servers *servers, int connection_flags, char **error_message)
+{
+	mongo_connection *con;
+
+	/* In some cases we won't actually have a manager or servers initialized, for example when extending PHP objects without calling the constructor,
+	 * and then var_dump() it or access the properties, for example the "connected" property */
+	if (!manager || !servers) {
+		return NULL;
+	}
+
+	mongo_manager_pin_enter();
+	con = mongo_get_read_write_connection_pinned(manager, servers, connection_flags, error_message);
+	if (con) {
+		mongo_connection_addref(con);
+	}
+	mongo_manager_pin_leave(manager);
+
+	return con;
+}
+
+void mongo_manager_connection_release(mongo_con_manager *manager, mongo_connection *con)
+{
+	mongo_connection_release(manager, con, MONGO_CLOSE_BROKEN);
+}
+
 mongo_connection *mongo_manager_add_connection_callback(mongo_connection *connection, void *callback_data, mongo_cleanup_t cleanup_cb)
 {
 	mongo_connection_deregister_callback *cb;
@@ -598,97 +976,107 @@ mongo_connection *mongo_get_read_write_connection_with_callback(mongo_con_manage
 /* Connection management */
 
 /* - Helpers */
-static mongo_con_manager_item *create_new_manager_item(void)
+typedef struct _mongo_manager_destroy_context {
+	mongo_con_manager               *manager;
+	mongo_con_manager_item_destroy_t *cleanup_cb;
+} mongo_manager_destroy_context;
+
+static void destroy_manager_item(char *hash, void *data, void *context)
 {
-	mongo_con_manager_item *tmp = (mongo_con_manager_item *)malloc(sizeof(mongo_con_manager_item));
-	memset(tmp, 0, sizeof(mongo_con_manager_item));
+	mongo_manager_destroy_context *ctxt = (mongo_manager_destroy_context *)context;
 
-	return tmp;
+	ctxt->cleanup_cb(ctxt->manager, data, MONGO_CLOSE_SHUTDOWN);
+	mongo_manager_log(ctxt->manager, MLOG_CON, MLOG_INFO, "freeing connection %s", hash);
 }
 
-static void free_manager_item(mongo_con_manager *manager, mongo_con_manager_item *item)
+static void destroy_manager_registry(mongo_con_manager *manager, mcon_registry *registry, mongo_con_manager_item_destroy_t cleanup_cb)
 {
-	mongo_manager_log(manager, MLOG_CON, MLOG_INFO, "freeing connection %s", item->hash);
-	free(item->hash);
-	free(item);
-}
+	mongo_manager_destroy_context context;
 
-static void destroy_manager_item(mongo_con_manager *manager, mongo_con_manager_item *item, mongo_con_manager_item_destroy_t cleanup_cb)
-{
-	if (item->next) {
-		destroy_manager_item(manager, item->next, cleanup_cb);
-	}
-	cleanup_cb(manager, item->data, MONGO_CLOSE_SHUTDOWN);
-	free_manager_item(manager, item);
+	context.manager = manager;
+	context.cleanup_cb = cleanup_cb;
+
+	mcon_registry_apply(registry, destroy_manager_item, &context);
+	mcon_registry_free(registry);
 }
 
-void *mongo_manager_find_by_hash(mongo_con_manager *manager, mongo_con_manager_item *ptr, char *hash)
+void *mongo_manager_find_by_hash(mongo_con_manager *manager, mcon_registry *registry, uint64_t key, char *hash, mcon_registry_visit_t visit, void *context)
 {
-	while (ptr) {
-		if (strcmp(ptr->hash, hash) == 0) {
-			mongo_manager_log(manager, MLOG_CON, MLOG_FINE, "found connection %s (looking for %s)", ptr->hash, hash);
-			return ptr->data;
-		}
-		ptr = ptr->next;
+	void *data = mcon_registry_find(registry, key, hash, visit, context);
+
+	if (data) {
+		mongo_manager_log(manager, MLOG_CON, MLOG_FINE, "found connection %s", hash);
 	}
-	return NULL;
+	return data;
 }
 
+/* The connections returned by the find functions are only guaranteed to stay
+ * around while inside mongo_get_read_write_connection(), where they are
+ * pinned. Other callers have to make sure that no other thread can deregister
+ * them. */
 mongo_connection *mongo_manager_connection_find_by_server_definition(mongo_con_manager *manager, mongo_server_def *definition)
 {
-	char *hash = mongo_server_create_hash(definition);
-	mongo_connection *con = (mongo_connection *)mongo_manager_find_by_hash(manager, manager->connections, hash);
+	return mongo_manager_connection_find_by_id(manager, mongo_server_def_id(definition));
+}
 
-	free(hash);
-	return con;
+mongo_connection *mongo_manager_connection_find_by_id(mongo_con_manager *manager, mongo_server_id *id)
+{
+	return (mongo_connection *)mongo_manager_find_by_hash(manager, manager->connections, id->key, id->hash, mongo_manager_pin, NULL);
 }
 
 mongo_connection *mongo_manager_connection_find_by_hash_with_callback(mongo_con_manager *manager, char *hash, void *callback_data, mongo_cleanup_t cleanup_cb)
 {
 	mongo_connection *connection;
 
-	connection = (mongo_connection *)mongo_manager_find_by_hash(manager, manager->connections, hash);
+	connection = (mongo_connection *)mongo_manager_find_by_hash(manager, manager->connections, mongo_server_hash_key(hash), hash, mongo_manager_pin, NULL);
 	return mongo_manager_add_connection_callback(connection, callback_data, cleanup_cb);
 }
 mongo_connection *mongo_manager_connection_find_by_hash(mongo_con_manager *manager, char *hash)
 {
-	return (mongo_connection *)mongo_manager_find_by_hash(manager, manager->connections, hash);
+	return (mongo_connection *)mongo_manager_find_by_hash(manager, manager->connections, mongo_server_hash_key(hash), hash, mongo_manager_pin, NULL);
 }
 
-mongo_connection_blacklist *mongo_manager_blacklist_find_by_hash(mongo_con_manager *manager, char *hash)
+/* Returns a collection with all connections in the current topology
+ * snapshot, pinned as if each of them had been looked up by hash. This
+ * doesn't take any of the registry's locks. */
+mcon_collection *mongo_manager_connection_collect(mongo_con_manager *manager)
 {
-	return (mongo_connection_blacklist *)mongo_manager_find_by_hash(manager, manager->blacklist, hash);
+	mcon_collection *col = mcon_init_collection(sizeof(mongo_connection*));
+	mongo_topology  *topology;
+	int              i;
+
+	topology = mongo_topology_acquire(manager);
+	for (i = 0; i < topology->count; i++) {
+		mongo_manager_pin(NULL, topology->connections[i], NULL);
+		mcon_collection_add(col, topology->connections[i]);
+	}
+	mongo_topology_release(topology);
+
+	return col;
 }
 
-mongo_con_manager_item *mongo_manager_register(mongo_con_manager *manager, mongo_con_manager_item **ptr, void *con, char *hash)
+mongo_connection_blacklist *mongo_manager_blacklist_find_by_hash(mongo_con_manager *manager, char *hash)
 {
-	mongo_con_manager_item *neww;
+	return (mongo_connection_blacklist *)mongo_manager_find_by_hash(manager, manager->blacklist, mongo_server_hash_key(hash), hash, NULL, NULL);
+}
 
-	/* Setup new entry */
-	neww = create_new_manager_item();
-	neww->data = con;
-	neww->hash = strdup(hash);
-	neww->next = NULL;
+static void mongo_manager_copy_last_ping(char *hash, void *data, void *context)
+{
+	*(int *)context = ((mongo_connection_blacklist *)data)->last_ping;
+}
 
-	if (!*ptr) { /* No connections at all yet */
-		*ptr = neww;
-	} else {
-		mongo_con_manager_item *item = *ptr;
-		/* Existing connections, so find the last one */
-		do {
-			if (!item->next) {
-				item->next = neww;
-				break;
-			}
-			item = item->next;
-		} while (1);
-	}
-	return neww;
+/* Returns 1 and sets *last_ping if the server is blacklisted. Unlike the
+ * pointer returned by mongo_manager_blacklist_find_by_hash(), this is safe
+ * when another thread removes the blacklisting at the same time. */
+int mongo_manager_blacklist_last_ping(mongo_con_manager *manager, mongo_server_id *id, int *last_ping)
+{
+	return mongo_manager_find_by_hash(manager, manager->blacklist, id->key, id->hash, mongo_manager_copy_last_ping, last_ping) != NULL;
 }
 
 void mongo_manager_connection_register(mongo_con_manager *manager, mongo_connection *con)
 {
-	mongo_manager_register(manager, &manager->connections, con, con->hash);
+	mcon_registry_add(manager->connections, con->hash_key, con->hash, con);
+	mongo_topology_publish(manager);
 }
 
 void mongo_manager_blacklist_register(mongo_con_manager *manager, mongo_connection *data)
@@ -700,55 +1088,58 @@ void mongo_manager_blacklist_register(mongo_con_manager *manager, mongo_connecti
 	memset(blacklist, 0, sizeof(mongo_connection_blacklist));
 	gettimeofday(&start, NULL);
 	blacklist->last_ping = start.tv_sec;
-	mongo_manager_register(manager, &manager->blacklist, blacklist, data->hash);
+	mcon_registry_add(manager->blacklist, data->hash_key, data->hash, blacklist);
 }
 
-int mongo_manager_deregister(mongo_con_manager *manager, mongo_con_manager_item **ptr, char *hash, void *con, mongo_con_manager_item_destroy_t cleanup_cb)
+/* Removes the entry for hash, or if con is not NULL, exactly that entry. As
+ * two threads can race to deregister the same entry, only the one that
+ * actually removed it calls cleanup_cb. */
+int mongo_manager_deregister(mongo_con_manager *manager, mcon_registry *registry, uint64_t key, char *hash, void *con, mongo_con_manager_item_destroy_t cleanup_cb)
 {
-	mongo_con_manager_item *prev = NULL;
-	mongo_con_manager_item *item = *ptr;
-
 	/* Remove from manager */
-	/* - if there are no connections, simply return false */
-	if (!item) {
+	con = mcon_registry_remove(registry, key, hash, con);
+	if (!con) {
 		return 0;
 	}
-	/* Loop over existing connections and compare hashes */
-	do {
-		/* The connection is the one we're looking for */
-		if (strcmp((item)->hash, hash) == 0) {
-			if (prev == NULL) { /* It's the first one in the list... */
-				*ptr = item->next;
-			} else {
-				prev->next = item->next;
-			}
-			/* Free structures */
-			if (cleanup_cb) {
-				cleanup_cb(manager, con, MONGO_CLOSE_BROKEN);
-			}
-			free(item->hash);
-			free(item);
 
-			/* Woo! */
-			return 1;
-		}
-
-		/* Next iteration */
-		prev = item;
-		item = item->next;
-	} while (item);
+	/* Free structures */
+	if (cleanup_cb) {
+		cleanup_cb(manager, con, MONGO_CLOSE_BROKEN);
+	}
 
-	return 0;
+	/* Woo! */
+	return 1;
 }
 
+/* Drops the manager's reference; the connection is destroyed once the
+ * threads that still use it have released theirs too */
 int mongo_manager_connection_deregister(mongo_con_manager *manager, mongo_connection *con)
 {
-	return mongo_manager_deregister(manager, &manager->connections, con->hash, con, mongo_connection_destroy);
+	if (!mongo_manager_deregister(manager, manager->connections, con->hash_key, con->hash, con, mongo_connection_release)) {
+		return 0;
+	}
+
+	mongo_topology_publish(manager);
+	return 1;
+}
+
+/* Called by the IO callbacks when a read or write on any of a server's
+ * sockets fails. The server is removed right away, rather than at its next
+ * ping or heartbeat, so that no other request selects it in the meantime; it
+ * is connected to again when it is needed, or found by topology discovery. */
+void mongo_manager_server_failed(mongo_con_manager *manager, mongo_connection *con, char *error_message)
+{
+	if (!mongo_manager_deregister(manager, manager->connections, con->id->key, con->id->hash, NULL, mongo_connection_release)) {
+		return;
+	}
+
+	mongo_manager_log(manager, MLOG_CON, MLOG_WARN, "io: removing %s after an IO error: %s", con->id->hash, error_message);
+	mongo_topology_publish(manager);
 }
 
 int mongo_manager_blacklist_deregister(mongo_con_manager *manager, mongo_connection_blacklist *blacklist_item, char *hash)
 {
-	return mongo_manager_deregister(manager, &manager->blacklist, hash, blacklist_item, mongo_blacklist_destroy);
+	return mongo_manager_deregister(manager, manager->blacklist, mongo_server_hash_key(hash), hash, blacklist_item, mongo_blacklist_destroy);
 }
 
 /* Logging */
@@ -792,18 +1183,40 @@ mongo_con_manager *mongo_init(void)
 	tmp = (mongo_con_manager *)malloc(sizeof(mongo_con_manager));
 	memset(tmp, 0, sizeof(mongo_con_manager));
 
+	tmp->connections = mcon_registry_init();
+	tmp->blacklist = mcon_registry_init();
+	mongo_topology_init(tmp);
+	mongo_selection_init(tmp);
+	pthread_mutex_init(&tmp->discovery_lock, NULL);
+	pthread_cond_init(&tmp->discovery_done, NULL);
+
 	tmp->log_context = NULL;
 	tmp->log_function = mongo_log_null;
 
 	tmp->ping_interval = MONGO_MANAGER_DEFAULT_PING_INTERVAL;
 	tmp->ismaster_interval = MONGO_MANAGER_DEFAULT_MASTER_INTERVAL;
-
-	tmp->connect               = NULL;
-	tmp->recv_header           = NULL;
-	tmp->recv_data             = NULL;
-	tmp->send                  = NULL;
-	tmp->close                 = NULL;
-	tmp->forget                = NULL;
+	tmp->fast_handshake = 1;
+	tmp->memoize_selection = 1;
+	tmp->multiplex = 0;
+	tmp->validate_replies = BSON_VALIDATE_STRUCTURE | BSON_VALIDATE_UTF8;
+	tmp->async_threads = MONGO_ASYNC_DEFAULT_THREADS;
+	tmp->discovery_threads = MONGO_MANAGER_DEFAULT_DISCOVERY_THREADS;
+
+	tmp->pool_size = MONGO_POOL_DEFAULT_SIZE;
+	tmp->pool_min_size = MONGO_POOL_DEFAULT_MIN_SIZE;
+	tmp->pool_wait_timeout = MONGO_POOL_DEFAULT_WAIT_TIMEOUT;
+	tmp->pool_max_idle = MONGO_POOL_DEFAULT_MAX_IDLE;
+	tmp->pool_max_lifetime = MONGO_POOL_DEFAULT_MAX_LIFETIME;
+
+	/* The native transport, unless the user of the manager sets up its own */
+	tmp->connect               = mongo_io_connect;
+	tmp->recv_header           = mongo_io_recv_header;
+	tmp->recv_data             = mongo_io_recv_data;
+	tmp->send                  = mongo_io_send;
+	tmp->sendv                 = mongo_io_sendv;
+	tmp->close                 = mongo_io_close;
+	tmp->forget                = mongo_io_forget;
+	tmp->poll_fd               = mongo_io_poll_fd;
 	tmp->authenticate          = NULL;
 	tmp->supports_wire_version = NULL;
 
@@ -818,14 +1231,35 @@ static void mongo_blacklist_destroy(mongo_con_manager *manager, void *data, int
 
 void mongo_deinit(mongo_con_manager *manager)
 {
-	if (manager->connections) {
-		/* Does this iteratively for all connections */
-		destroy_manager_item(manager, manager->connections, mongo_connection_destroy);
-	}
-	if (manager->blacklist) {
-		/* Does this iteratively for all blacklist items */
-		destroy_manager_item(manager, manager->blacklist, mongo_blacklist_destroy);
+	mongo_monitor_stop(manager);
+
+	/* Operations that are still queued fail, running ones finish first */
+	mongo_async_stop(manager);
+
+	/* Discovery threads that a request stopped waiting for still use the
+	 * manager, and can register connections */
+	pthread_mutex_lock(&manager->discovery_lock);
+	while (manager->discovery_running > 0) {
+		pthread_cond_wait(&manager->discovery_done, &manager->discovery_lock);
 	}
+	pthread_mutex_unlock(&manager->discovery_lock);
+	pthread_cond_destroy(&manager->discovery_done);
+	pthread_mutex_destroy(&manager->discovery_lock);
+
+	/* Like the snapshots, the cached selections hold references on the
+	 * connections */
+	mongo_selection_deinit(manager);
+
+	/* The snapshots hold references on the connections that the registry
+	 * destroys below, so they have to go first */
+	mongo_topology_deinit(manager);
+
+	/* Does this iteratively for all connections and blacklist items. The
+	 * registry only lets go of its own reference on the connections, so that
+	 * ones that are still in use aren't freed under their users; they have
+	 * to be released before the manager is gone though. */
+	destroy_manager_registry(manager, manager->connections, mongo_connection_release);
+	destroy_manager_registry(manager, manager->blacklist, mongo_blacklist_destroy);
 
 	free(manager);
 }
@@ -36,16 +36,28 @@ void mongo_deinit(mongo_con_manager *manager);
 mongo_connection *mongo_get_read_write_connection(mongo_con_manager *manager, mongo_servers *servers, int connection_flags, char **error_message);
 mongo_connection *mongo_get_read_write_connection_with_callback(mongo_con_manager *manager, mongo_servers *servers, int connection_flags, void *callback_data, mongo_cleanup_t cleanup_cb, char **error_message);
 mongo_connection *mongo_manager_add_connection_callback(mongo_connection *connection, void *callback_data, mongo_cleanup_t cleanup_cb);
+void mongo_manager_connection_release(mongo_con_manager *manager, mongo_connection *con);
+
+/* Connections looked up between these two calls stay valid until the second
+ * one, even if another thread deregisters them. Scopes can be nested. */
+void mongo_manager_pin_enter(void);
+void mongo_manager_pin_leave(mongo_con_manager *manager);
+void mongo_manager_pin_connection(mongo_connection *con);
 
 /* Connection management */
 mongo_connection *mongo_manager_connection_find_by_server_definition(mongo_con_manager *manager, mongo_server_def *definition);
+mongo_connection *mongo_manager_connection_find_by_id(mongo_con_manager *manager, mongo_server_id *id);
 mongo_connection *mongo_manager_connection_find_by_hash(mongo_con_manager *manager, char *hash);
 mongo_connection *mongo_manager_connection_find_by_hash_with_callback(mongo_con_manager *manager, char *hash, void *callback_data, mongo_cleanup_t cleanup_cb);
+mongo_connection *mongo_manager_connection_connect(mongo_con_manager *manager, mongo_server_def *server, mongo_server_options *options, char **error_message);
 void mongo_manager_connection_register(mongo_con_manager *manager, mongo_connection *con);
 int mongo_manager_connection_deregister(mongo_con_manager *manager, mongo_connection *con);
+void mongo_manager_server_failed(mongo_con_manager *manager, mongo_connection *con, char *error_message);
+mcon_collection *mongo_manager_connection_collect(mongo_con_manager *manager);
 int mongo_deregister_callback_from_connection(mongo_connection *connection, void *cursor);
 /* Connection blacklisting */
 mongo_connection_blacklist *mongo_manager_blacklist_find_by_hash(mongo_con_manager *manager, char *hash);
+int mongo_manager_blacklist_last_ping(mongo_con_manager *manager, mongo_server_id *id, int *last_ping);
 void mongo_manager_blacklist_register(mongo_con_manager *manager, mongo_connection *con);
 int mongo_manager_blacklist_deregister(mongo_con_manager *manager, mongo_connection_blacklist *con, char *hash);
 
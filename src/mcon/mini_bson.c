@@ -13,6 +13,7 @@
  *  See the License for the specific language governing permissions and
  *  limitations under the License.
  */
+#include <assert.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
@@ -30,15 +31,15 @@
  *
  * The ns argument selects which namespace to use. If it's not set, we use
  * "admin.$cmd". */
-static mcon_str *create_simple_header(mongo_connection *con, char *ns)
+static mcon_str *create_header(int32_t request_id, char *ns)
 {
 	struct mcon_str *str;
 
-	mcon_str_ptr_init(str);
+	mcon_str_ptr_init_pooled(str);
 
 	mcon_serialize_int(str, 0); /* We need to fill this with the length */
 
-	mcon_serialize_int(str, mongo_connection_get_reqid(con));
+	mcon_serialize_int(str, request_id);
 	mcon_serialize_int(str, 0); /* Response to */
 	mcon_serialize_int(str, 2004); /* OP_QUERY */
 
@@ -50,6 +51,11 @@ static mcon_str *create_simple_header(mongo_connection *con, char *ns)
 	return str;
 }
 
+static mcon_str *create_simple_header(mongo_connection *con, char *ns)
+{
+	return create_header(mongo_connection_get_reqid(con), ns);
+}
+
 void bson_add_int32(mcon_str *str, char *fieldname, int32_t v)
 {
 	mcon_str_addl(str, "\x10", 1, 0);
@@ -78,89 +84,148 @@ void bson_add_string(mcon_str *str, char *fieldname, char *string)
 	bson_add_stringl(str, fieldname, string, strlen(string) + 1);
 }
 
-mcon_str *bson_create_ping_packet(mongo_connection *con)
+/* Document writing, for encoding documents in one pass: the length of a
+ * document is filled in when it ends, rather than worked out beforehand */
+int bson_begin_document(mcon_str *str)
 {
-	struct mcon_str *str = create_simple_header(con, NULL);
-	int    hdr;
+	int offset = str->l;
 
-	hdr = str->l;
 	mcon_serialize_int(str, 0); /* We need to fill this with the length */
-	bson_add_long(str, "ping", 1);
+	return offset;
+}
+
+void bson_end_document(mcon_str *str, int offset)
+{
+	int32_t length;
+
 	mcon_str_addl(str, "", 1, 0); /* Trailing 0x00 */
 
-	/* Set length */
-	((int*) (&(str->d[hdr])))[0] = str->l - hdr;
+	length = MONGO_32(str->l - offset);
+	memcpy(str->d + offset, &length, sizeof(int32_t));
+}
 
-	((int*) str->d)[0] = str->l;
-	return str;
+void bson_add_key(mcon_str *str, int type, char *key, int key_len)
+{
+	char t = type;
+
+	mcon_str_addl(str, &t, 1, 0);
+	mcon_str_addl(str, key, key_len, 0);
+	mcon_str_addl(str, "", 1, 0);
 }
 
-mcon_str *bson_create_ismaster_packet(mongo_connection *con)
+/* The keys of array elements are their indexes. The ones that most arrays
+ * use are made once, rather than with snprintf() for every element, and
+ * stored with room for the type byte in front and with their trailing 0x00,
+ * so that the element's header goes in with one copy. */
+static char           bson_index_keys[BSON_INDEX_KEYS][5];
+static pthread_once_t bson_index_keys_once = PTHREAD_ONCE_INIT;
+
+static void bson_index_keys_init(void)
 {
-	struct mcon_str *str = create_simple_header(con, NULL);
-	int    hdr;
+	int i;
 
-	hdr = str->l;
-	mcon_serialize_int(str, 0); /* We need to fill this with the length */
-	bson_add_long(str, "isMaster", 1);
-	mcon_str_addl(str, "", 1, 0); /* Trailing 0x00 */
+	for (i = 0; i < BSON_INDEX_KEYS; i++) {
+		snprintf(bson_index_keys[i] + 1, 4, "%d", i);
+	}
+}
 
-	/* Set length */
-	((int*) (&(str->d[hdr])))[0] = str->l - hdr;
+void bson_add_index_key(mcon_str *str, int type, int index)
+{
+	char buffer[12];
+	int  length;
 
-	((int*) str->d)[0] = str->l;
-	return str;
+	if (index >= 0 && index < BSON_INDEX_KEYS) {
+		pthread_once(&bson_index_keys_once, bson_index_keys_init);
+
+		memcpy(buffer, bson_index_keys[index], 5);
+		buffer[0] = type;
+		length = index < 10 ? 3 : (index < 100 ? 4 : 5);
+		mcon_str_addl(str, buffer, length, 0);
+		return;
+	}
+
+	length = snprintf(buffer, sizeof(buffer), "%d", index);
+	bson_add_key(str, type, buffer, length);
+}
+
+void bson_add_string_value(mcon_str *str, char *string, int len)
+{
+	mcon_serialize_int(str, len + 1);
+	mcon_str_addl(str, string, len, 0);
+	mcon_str_addl(str, "", 1, 0); /* Trailing 0x00 */
 }
 
-mcon_str *bson_create_buildinfo_packet(mongo_connection *con)
+/* The admin commands that don't take any arguments are the same every time
+ * apart from their request ID, so they are built once, and copied from
+ * these templates. See bson_admin_packet(). */
+typedef struct _mongo_admin_template
+{
+	char data[MONGO_ADMIN_PACKET_SIZE];
+	int  length;
+} mongo_admin_template;
+
+static char *mongo_admin_commands[MONGO_ADMIN_COMMANDS] = {
+	"ping",              /* MONGO_ADMIN_PING */
+	"isMaster",          /* MONGO_ADMIN_ISMASTER */
+	"buildInfo",         /* MONGO_ADMIN_BUILDINFO */
+	"replSetGetStatus",  /* MONGO_ADMIN_RS_STATUS */
+	"getnonce"           /* MONGO_ADMIN_GETNONCE */
+};
+
+static mongo_admin_template mongo_admin_templates[MONGO_ADMIN_COMMANDS];
+static pthread_once_t       mongo_admin_templates_once = PTHREAD_ONCE_INIT;
+
+mcon_str *bson_create_admin_packet(int command, int32_t request_id)
 {
-	struct mcon_str *str = create_simple_header(con, NULL);
-	int    hdr;
+	struct mcon_str *str;
+	int32_t          length;
+	int              hdr;
+
+	str = create_header(request_id, NULL);
 
 	hdr = str->l;
 	mcon_serialize_int(str, 0); /* We need to fill this with the length */
-	bson_add_long(str, "buildInfo", 1);
+	bson_add_long(str, mongo_admin_commands[command], 1);
 	mcon_str_addl(str, "", 1, 0); /* Trailing 0x00 */
 
-	/* Set length */
-	((int*) (&(str->d[hdr])))[0] = str->l - hdr;
+	/* Set lengths */
+	length = MONGO_32(str->l - hdr);
+	memcpy(str->d + hdr, &length, sizeof(int32_t));
+	length = MONGO_32(str->l);
+	memcpy(str->d, &length, sizeof(int32_t));
 
-	((int*) str->d)[0] = str->l;
 	return str;
 }
 
-mcon_str *bson_create_rs_status_packet(mongo_connection *con)
+static void mongo_admin_templates_init(void)
 {
-	struct mcon_str *str = create_simple_header(con, NULL);
-	int    hdr;
+	struct mcon_str *str;
+	int              i;
 
-	hdr = str->l;
-	mcon_serialize_int(str, 0); /* We need to fill this with the length */
-	bson_add_long(str, "replSetGetStatus", 1);
-	mcon_str_addl(str, "", 1, 0); /* Trailing 0x00 */
+	for (i = 0; i < MONGO_ADMIN_COMMANDS; i++) {
+		str = bson_create_admin_packet(i, 0);
 
-	/* Set length */
-	((int*) (&(str->d[hdr])))[0] = str->l - hdr;
+		/* MONGO_ADMIN_PACKET_SIZE has to grow with any longer command */
+		assert(str->l <= (int)sizeof(mongo_admin_templates[i].data));
 
-	((int*) str->d)[0] = str->l;
-	return str;
+		memcpy(mongo_admin_templates[i].data, str->d, str->l);
+		mongo_admin_templates[i].length = str->l;
+		mcon_str_ptr_dtor(str);
+	}
 }
 
-mcon_str *bson_create_getnonce_packet(mongo_connection *con)
+int bson_admin_packet(int command, int32_t request_id, char *buffer)
 {
-	struct mcon_str *str = create_simple_header(con, NULL);
-	int    hdr;
+	mongo_admin_template *admin;
+	int32_t               le_request_id = MONGO_32(request_id);
 
-	hdr = str->l;
-	mcon_serialize_int(str, 0); /* We need to fill this with the length */
-	bson_add_long(str, "getnonce", 1);
-	mcon_str_addl(str, "", 1, 0); /* Trailing 0x00 */
+	pthread_once(&mongo_admin_templates_once, mongo_admin_templates_init);
+	admin = &mongo_admin_templates[command];
 
-	/* Set length */
-	((int*) (&(str->d[hdr])))[0] = str->l - hdr;
+	memcpy(buffer, admin->data, admin->length);
+	memcpy(buffer + 4, &le_request_id, 4);
 
-	((int*) str->d)[0] = str->l;
-	return str;
+	return admin->length;
 }
 
 mcon_str *bson_create_authenticate_packet(mongo_connection *con, char *mechanism, char *database, char *username, char *nonce, char *key)
@@ -271,27 +336,8 @@ char *bson_skip_field_name(char *data)
 	return strchr(data, '\0') + 1;
 }
 
-#define BSON_DOUBLE          0x01
-#define BSON_STRING          0x02
-#define BSON_DOCUMENT        0x03
-#define BSON_ARRAY           0x04
-#define BSON_BINARY          0x05
-#define BSON_UNDEFINED       0x06
-#define BSON_OBJECT_ID       0x07
-#define BSON_BOOLEAN         0x08
-#define BSON_DATETIME        0x09
-#define BSON_NULL            0x0A
-#define BSON_REGEXP          0x0B
-#define BSON_DBPOINTER       0x0C
-#define BSON_JAVASCRIPT      0x0D
-#define BSON_SYMBOL          0x0E
-#define BSON_JAVASCRIPT_WITH_SCOPE 0x0F
-#define BSON_INT32           0x10
-#define BSON_TIMESTAMP       0x11
-#define BSON_INT64           0x12
-#define BSON_MIN_KEY         0xFF
-#define BSON_MAX_KEY         0x7F
-
+/* Trusts the lengths in data, so anything from the network has to have been
+ * through bson_validate_document() or bson_validate_documents() first */
 char *bson_next(char *data)
 {
 	unsigned char type = data[0];
@@ -354,12 +400,16 @@ element 	::= 	"\x01" e_name double 	Floating point
 		case BSON_INT64:
 			return data + sizeof(int64_t);
 		case BSON_REGEXP:
+			/* The pattern and the flags */
+			data = strchr(data, '\0') + 1;
 			return strchr(data, '\0') + 1;
 		case BSON_DBPOINTER:
 			length = MONGO_32(*(int*)data);
 			return data + sizeof(int32_t) + length + 12;
 		case BSON_JAVASCRIPT_WITH_SCOPE:
-			exit(-3); /* TODO */
+			/* The length covers the code and the scope */
+			length = MONGO_32(*(int*)data);
+			return data + length;
 		case BSON_INT32:
 			return data + sizeof(int32_t);
 	}
@@ -490,6 +540,71 @@ int bson_find_field_as_string(char *buffer, char *field, char **data)
 	return 0;
 }
 
+static void bson_store_field(bson_field *field, char *data)
+{
+	switch (field->type) {
+		case BSON_DOUBLE:
+			memcpy(field->out, data, sizeof(double));
+			break;
+		case BSON_STRING:
+		case BSON_DOCUMENT:
+		case BSON_ARRAY:
+			memcpy(&field->length, data, sizeof(int32_t));
+			*(char **) field->out = data + 4; /* int32 for length */
+			break;
+		case BSON_BOOLEAN:
+			*(unsigned char *) field->out = data[0];
+			break;
+		case BSON_INT32:
+			memcpy(field->out, data, sizeof(int32_t));
+			break;
+		case BSON_INT64:
+		case BSON_DATETIME:
+			memcpy(field->out, data, sizeof(int64_t));
+			break;
+	}
+}
+
+/* The name of every element is compared by length and first byte before
+ * anything else, and the scan stops once all of the fields are found */
+int bson_extract_fields(char *data, bson_field *fields, int count)
+{
+	char *name, *value;
+	int   type, name_len, i, found = 0;
+
+	for (i = 0; i < count; i++) {
+		fields[i].found = 0;
+	}
+
+	while (found < count && (value = bson_get_current(data, &name, &type))) {
+		name_len = value - name - 1;
+
+		for (i = 0; i < count; i++) {
+			bson_field *field = &fields[i];
+
+			if (
+				!field->found &&
+				field->name_len == name_len &&
+				field->name[0] == name[0] &&
+				field->type == type &&
+				memcmp(field->name, name, name_len) == 0
+			) {
+				bson_store_field(field, value);
+				field->found = 1;
+				found++;
+				break;
+			}
+		}
+
+		data = bson_next(data);
+		if (!data) {
+			break;
+		}
+	}
+
+	return found;
+}
+
 int bson_array_find_next_string(char **buffer, char **field, char **data)
 {
 	char *read_field;
@@ -17,20 +17,81 @@
 #define __MCON_MINI_BSON_H__
 
 #include "types.h"
+#include "str.h"
 
 #if defined(__cplusplus)
 extern "C" {
 #endif
 
-mcon_str *bson_create_ping_packet(mongo_connection *con);
-mcon_str *bson_create_ismaster_packet(mongo_connection *con);
-mcon_str *bson_create_buildinfo_packet(mongo_connection *con);
-mcon_str *bson_create_rs_status_packet(mongo_connection *con);
-mcon_str *bson_create_getnonce_packet(mongo_connection *con);
+/* Element types */
+#define BSON_DOUBLE          0x01
+#define BSON_STRING          0x02
+#define BSON_DOCUMENT        0x03
+#define BSON_ARRAY           0x04
+#define BSON_BINARY          0x05
+#define BSON_UNDEFINED       0x06
+#define BSON_OBJECT_ID       0x07
+#define BSON_BOOLEAN         0x08
+#define BSON_DATETIME        0x09
+#define BSON_NULL            0x0A
+#define BSON_REGEXP          0x0B
+#define BSON_DBPOINTER       0x0C
+#define BSON_JAVASCRIPT      0x0D
+#define BSON_SYMBOL          0x0E
+#define BSON_JAVASCRIPT_WITH_SCOPE 0x0F
+#define BSON_INT32           0x10
+#define BSON_TIMESTAMP       0x11
+#define BSON_INT64           0x12
+#define BSON_MIN_KEY         0xFF
+#define BSON_MAX_KEY         0x7F
+
+/* Admin commands without arguments, for bson_admin_packet() */
+#define MONGO_ADMIN_PING      0
+#define MONGO_ADMIN_ISMASTER  1
+#define MONGO_ADMIN_BUILDINFO 2
+#define MONGO_ADMIN_RS_STATUS 3
+#define MONGO_ADMIN_GETNONCE  4
+#define MONGO_ADMIN_COMMANDS  5
+
+/* The size of the largest of these packets: the message header, flags,
+ * "admin.$cmd", skip and limit, and { replSetGetStatus: 1 } as an int64 */
+#define MONGO_ADMIN_LONGEST_COMMAND "replSetGetStatus"
+#define MONGO_ADMIN_PACKET_SIZE (16 + 4 + sizeof("admin.$cmd") + 4 + 4 + \
+	4 + 1 + sizeof(MONGO_ADMIN_LONGEST_COMMAND) + 8 + 1)
+
+/* Copies the packet for command into buffer, which must have room for
+ * MONGO_ADMIN_PACKET_SIZE bytes, with request_id filled in. Returns the
+ * length of the packet. */
+int bson_admin_packet(int command, int32_t request_id, char *buffer);
+
+/* Builds the packet for command from scratch, which is what the templates
+ * that bson_admin_packet() copies are made with */
+mcon_str *bson_create_admin_packet(int command, int32_t request_id);
+
 mcon_str *bson_create_authenticate_packet(mongo_connection *con, char *mechanism, char *database, char *username, char *nonce, char *key);
 mcon_str *bson_create_saslstart_packet(mongo_connection *con, char *database, char *mechanism, char *payload, int payload_len);
 mcon_str *bson_create_saslcontinue_packet(mongo_connection *con, char *database, int32_t conversation_id, char *payload, int payload_len);
 
+/* The index keys of the first BSON_INDEX_KEYS array elements are made once */
+#define BSON_INDEX_KEYS 1000
+
+/* Writing a document in one pass: bson_begin_document() leaves room for the
+ * length and returns where it is, bson_end_document() adds the trailing 0x00
+ * and fills the length in. Elements go in between as a key, added with the
+ * element's type, followed by the value. */
+int bson_begin_document(mcon_str *str);
+void bson_end_document(mcon_str *str, int offset);
+void bson_add_key(mcon_str *str, int type, char *key, int key_len);
+void bson_add_index_key(mcon_str *str, int type, int index);
+void bson_add_string_value(mcon_str *str, char *string, int len);
+
+/* Walking the elements of a document: bson_get_current() returns the value
+ * of the element at data, with its name and type, or NULL at the end, and
+ * bson_next() returns the element after it. Neither checks the lengths in
+ * the document, see bson_validate.h. */
+void *bson_get_current(char *data, char **field_name, int *type);
+char *bson_next(char *data);
+
 char *bson_skip_field_name(char *data);
 int bson_find_field_as_array(char *buffer, char *field, char **data);
 int bson_find_field_as_document(char *buffer, char *field, char **data);
@@ -41,6 +102,45 @@ int bson_find_field_as_int64(char *buffer, char *field, int64_t *data);
 int bson_find_field_as_string(char *buffer, char *field, char **data);
 int bson_find_field_as_stringl(char *buffer, char *field, char **data, int32_t *length, int duplicate);
 
+/* Finding several fields in one pass over a document, rather than one
+ * bson_find_field_as_*() scan for each. Every field is looked for with the
+ * type it has to have, and found ones are stored in out the way the
+ * bson_find_field_as_*() functions store them:
+ *
+ * - BSON_DOUBLE: double
+ * - BSON_STRING: char *, pointing at the string in the document
+ * - BSON_DOCUMENT, BSON_ARRAY: char *, pointing past their length
+ * - BSON_BOOLEAN: unsigned char
+ * - BSON_INT32: int32_t
+ * - BSON_INT64, BSON_DATETIME: int64_t
+ *
+ * For strings, documents and arrays, the field's length is set to the
+ * length in the document as well, which for strings includes the trailing
+ * NUL.
+ *
+ * Declare them with BSON_FIELD(), so that their name lengths are worked out
+ * at compile time:
+ *
+ *     bson_field fields[] = {
+ *         BSON_FIELD("ok", BSON_DOUBLE, &ok),
+ *         BSON_FIELD("errmsg", BSON_STRING, &errmsg),
+ *     };
+ *     bson_extract_fields(ptr, fields, 2);
+ */
+typedef struct _bson_field {
+	char *name;
+	int   name_len;
+	int   type;
+	void *out;
+	int   found;
+	int   length;
+} bson_field;
+
+#define BSON_FIELD(name, type, out) { (name), sizeof(name) - 1, (type), (void *)(out), 0, 0 }
+
+/* Sets found on the fields, and returns how many of them were found */
+int bson_extract_fields(char *data, bson_field *fields, int count);
+
 int bson_array_find_next_string(char **buffer, char **field, char **data);
 int bson_array_find_next_int32(char **buffer, char **field, int32_t *data);
 
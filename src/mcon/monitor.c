@@ -0,0 +1,252 @@
+/**
+ *  Copyright 2009-2014 MongoDB, Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/time.h>
+
+#include "types.h"
+#include "monitor.h"
+#include "manager.h"
+#include "connections.h"
+#include "collection.h"
+#include "topology.h"
+#include "parse.h"
+#include "pool.h"
+#include "utils.h"
+#include "contrib/strndup.h"
+
+/* Connects to a host that a replica set member told us about, using the
+ * credentials of the member that reported it */
+static void mongo_monitor_add_host(mongo_con_manager *manager, mongo_connection *con, char *host)
+{
+	mongo_server_def *def;
+	mongo_connection *new_con;
+	char             *error_message = NULL;
+
+	def = (mongo_server_def *)calloc(1, sizeof(mongo_server_def));
+	mongo_server_def_copy(def, con->pool->server, MONGO_SERVER_COPY_CREDENTIALS);
+	free(def->host);
+	def->host = mcon_strndup(host, strchr(host, ':') - host);
+	def->port = atoi(strchr(host, ':') + 1);
+
+	if (!mongo_manager_connection_find_by_id(manager, mongo_server_def_id(def))) {
+		mongo_manager_log(manager, MLOG_CON, MLOG_INFO, "monitor: found new host: %s:%d", def->host, def->port);
+		new_con = mongo_manager_connection_connect(manager, def, &con->pool->options, &error_message);
+		if (!new_con) {
+			mongo_manager_log(manager, MLOG_CON, MLOG_WARN, "monitor: could not connect to new host: %s:%d: %s", def->host, def->port, error_message);
+			free(error_message);
+		}
+	}
+
+	mongo_server_def_dtor(def);
+}
+
+/* Returns 1 if the server's state changed */
+static int mongo_monitor_check_connection(mongo_con_manager *manager, mongo_connection *con)
+{
+	mongo_server_def *server = NULL;
+	char             *repl_set_name = NULL, *error_message = NULL;
+	char            **found_hosts = NULL;
+	int               nr_hosts = 0, i, res, changed = 0;
+	uint64_t          digest = con->ismaster_digest;
+
+	/* Only connections made by mongo_get_read_write_connection() have the
+	 * server definition and options that we need to talk to the server */
+	if (!con->pool) {
+		return 0;
+	}
+
+	if (con->pool->options.con_type == MONGO_CON_TYPE_REPLSET) {
+		server = (mongo_server_def *)calloc(1, sizeof(mongo_server_def));
+		mongo_server_def_copy(server, con->pool->server, MONGO_SERVER_COPY_CREDENTIALS);
+		if (con->pool->options.repl_set_name) {
+			repl_set_name = strdup(con->pool->options.repl_set_name);
+		}
+	}
+
+	res = mongo_connection_heartbeat(manager, con, &con->pool->options, &repl_set_name, &nr_hosts, &found_hosts, &error_message, server);
+	switch (res) {
+		case 0:
+		case 4:
+			mongo_manager_log(manager, MLOG_CON, MLOG_WARN, "monitor: ismaster failed for %s: %s", con->hash, error_message);
+			free(error_message);
+			mongo_manager_connection_deregister(manager, con);
+			changed = 1;
+			break;
+
+		case 3:
+			/* The server's name is not what we connected to it as. The next
+			 * topology discovery connects to it under its own name. */
+			mongo_manager_log(manager, MLOG_CON, MLOG_WARN, "monitor: %s is known as %s:%d, removing it", con->hash, server->host, server->port);
+			mongo_manager_connection_deregister(manager, con);
+			changed = 1;
+			break;
+
+		case 1:
+			if (con->ismaster_digest != digest) {
+				mongo_manager_log(manager, MLOG_CON, MLOG_INFO, "monitor: ismaster changed for %s", con->hash);
+				mongo_topology_publish(manager);
+				changed = 1;
+			}
+			for (i = 0; i < nr_hosts; i++) {
+				mongo_monitor_add_host(manager, con, found_hosts[i]);
+			}
+			break;
+	}
+
+	for (i = 0; i < nr_hosts; i++) {
+		free(found_hosts[i]);
+	}
+	free(found_hosts);
+	free(repl_set_name);
+	if (server) {
+		mongo_server_def_dtor(server);
+	}
+
+	return changed;
+}
+
+int mongo_monitor_check(mongo_con_manager *manager)
+{
+	mcon_collection  *col;
+	mongo_connection *con;
+	int               i, changed = 0;
+
+	mongo_manager_pin_enter();
+	col = mongo_manager_connection_collect(manager);
+	for (i = 0; i < col->count; i++) {
+		con = (mongo_connection *)col->data[i];
+
+		/* Idle sockets would otherwise only be closed when a request thread
+		 * happens to check one out */
+		if (con->pool) {
+			mongo_pool_reap(manager, con->pool);
+		}
+		changed |= mongo_monitor_check_connection(manager, con);
+	}
+	mcon_collection_free(col);
+	mongo_manager_pin_leave(manager);
+
+	mongo_topology_collect(manager);
+
+	return changed;
+}
+
+static void *mongo_monitor_run(void *arg)
+{
+	mongo_con_manager *manager = (mongo_con_manager *)arg;
+	mongo_monitor     *monitor = manager->monitor;
+	struct timeval     now;
+	struct timespec    deadline;
+	int                changed;
+
+	pthread_mutex_lock(&monitor->lock);
+	while (!monitor->stop) {
+		pthread_mutex_unlock(&monitor->lock);
+		changed = mongo_monitor_check(manager);
+		pthread_mutex_lock(&monitor->lock);
+
+		/* Check again soon when something changed, as that is when more
+		 * changes are likely (e.g. an election), and back off while the
+		 * cluster is stable */
+		if (changed) {
+			monitor->heartbeat_ms = monitor->min_heartbeat_ms;
+		} else if (monitor->heartbeat_ms < monitor->max_heartbeat_ms) {
+			monitor->heartbeat_ms *= 2;
+			if (monitor->heartbeat_ms > monitor->max_heartbeat_ms) {
+				monitor->heartbeat_ms = monitor->max_heartbeat_ms;
+			}
+		}
+		monitor->rounds++;
+		pthread_cond_broadcast(&monitor->wakeup);
+
+		gettimeofday(&now, NULL);
+		deadline.tv_sec = now.tv_sec + monitor->heartbeat_ms / 1000;
+		deadline.tv_nsec = now.tv_usec * 1000 + (long) (monitor->heartbeat_ms % 1000) * 1000000;
+		if (deadline.tv_nsec >= 1000000000) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000;
+		}
+		while (!monitor->stop) {
+			if (pthread_cond_timedwait(&monitor->wakeup, &monitor->lock, &deadline) == ETIMEDOUT) {
+				break;
+			}
+		}
+	}
+	pthread_mutex_unlock(&monitor->lock);
+
+	return NULL;
+}
+
+/* Returns 1 on success, and 0 if the thread couldn't be started, in which
+ * case request threads keep pinging servers themselves */
+int mongo_monitor_start(mongo_con_manager *manager, int min_heartbeat_ms, int max_heartbeat_ms)
+{
+	mongo_monitor *monitor;
+
+	if (manager->monitor) {
+		return 1;
+	}
+
+	monitor = (mongo_monitor *)calloc(1, sizeof(mongo_monitor));
+	pthread_mutex_init(&monitor->lock, NULL);
+	pthread_cond_init(&monitor->wakeup, NULL);
+	monitor->min_heartbeat_ms = min_heartbeat_ms > 0 ? min_heartbeat_ms : MONGO_MONITOR_DEFAULT_MIN_HEARTBEAT;
+	monitor->max_heartbeat_ms = max_heartbeat_ms > monitor->min_heartbeat_ms ? max_heartbeat_ms : monitor->min_heartbeat_ms;
+	monitor->heartbeat_ms = monitor->min_heartbeat_ms;
+
+	manager->monitor = monitor;
+	if (pthread_create(&monitor->thread, NULL, mongo_monitor_run, manager) != 0) {
+		mongo_manager_log(manager, MLOG_CON, MLOG_WARN, "monitor: couldn't start the monitor thread");
+		manager->monitor = NULL;
+		pthread_cond_destroy(&monitor->wakeup);
+		pthread_mutex_destroy(&monitor->lock);
+		free(monitor);
+		return 0;
+	}
+
+	return 1;
+}
+
+void mongo_monitor_stop(mongo_con_manager *manager)
+{
+	mongo_monitor *monitor = manager->monitor;
+
+	if (!monitor) {
+		return;
+	}
+
+	pthread_mutex_lock(&monitor->lock);
+	monitor->stop = 1;
+	pthread_cond_broadcast(&monitor->wakeup);
+	pthread_mutex_unlock(&monitor->lock);
+	pthread_join(monitor->thread, NULL);
+
+	manager->monitor = NULL;
+	pthread_cond_destroy(&monitor->wakeup);
+	pthread_mutex_destroy(&monitor->lock);
+	free(monitor);
+}
+
+/*
+ * Local variables:
+ * tab-width: 4
+ * c-basic-offset: 4
+ * End:
+ * vim600: fdm=marker
+ * vim: noet sw=4 ts=4
+ */
@@ -0,0 +1,61 @@
+/**
+ *  Copyright 2009-2014 MongoDB, Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+#ifndef __MCON_MONITOR_H__
+#define __MCON_MONITOR_H__
+
+#include "types.h"
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+#define MONGO_MONITOR_DEFAULT_MIN_HEARTBEAT  500
+#define MONGO_MONITOR_DEFAULT_MAX_HEARTBEAT 5000
+
+typedef struct _mongo_monitor
+{
+	pthread_t       thread;
+	pthread_mutex_t lock;
+	pthread_cond_t  wakeup;
+	int             stop;
+	int             min_heartbeat_ms; /* Interval after a failure or topology change */
+	int             max_heartbeat_ms; /* Interval the monitor backs off to while nothing changes */
+	int             heartbeat_ms;     /* Current interval */
+	int64_t         rounds;           /* Number of completed rounds */
+} mongo_monitor;
+
+/* Starts a thread that runs ismaster against every known server, so that
+ * request threads no longer have to ping or run ismaster themselves */
+int mongo_monitor_start(mongo_con_manager *manager, int min_heartbeat_ms, int max_heartbeat_ms);
+void mongo_monitor_stop(mongo_con_manager *manager);
+
+/* Checks every server once. Returns 1 if the topology changed. */
+int mongo_monitor_check(mongo_con_manager *manager);
+
+#if defined(__cplusplus)
+}
+#endif
+
+#endif
+
+/*
+ * Local variables:
+ * tab-width: 4
+ * c-basic-offset: 4
+ * End:
+ * vim600: fdm=marker
+ * vim: noet sw=4 ts=4
+ */
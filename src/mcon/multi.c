@@ -0,0 +1,264 @@
+/**
+ *  Copyright 2009-2014 MongoDB, Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+
+#include "types.h"
+#include "multi.h"
+#include "manager.h"
+#include "connections.h"
+#include "packet.h"
+#include "pool.h"
+#include "mux.h"
+#include "utils.h"
+
+#define MONGO_MULTI_NEW      0 /* Not sent yet */
+#define MONGO_MULTI_DEFERRED 1 /* To be sent once this round's sockets are back, see below */
+#define MONGO_MULTI_SENT     2 /* Waiting for the reply on op->pooled */
+#define MONGO_MULTI_MUX      3 /* Waiting for the reply through op->waiter */
+#define MONGO_MULTI_DONE     4
+
+static void mongo_multi_fail(mongo_multi_op *op, char *error_message)
+{
+	op->retval = 0;
+	op->error_message = error_message;
+	op->state = MONGO_MULTI_DONE;
+}
+
+/* Sends op's packet on op->pooled, or through op->con's multiplexer */
+static void mongo_multi_send(mongo_con_manager *manager, mongo_multi_op *op)
+{
+	mongo_server_options *options = &op->servers->options;
+	mongo_connection     *target = op->con->mux ? op->con : op->pooled;
+	struct iovec          stack_iov[MONGO_PACKET_STACK_IOVECS], *iov = stack_iov;
+	char                 *error_message = NULL;
+	int                   count;
+
+	if (op->packet->count > MONGO_PACKET_STACK_IOVECS) {
+		iov = malloc(op->packet->count * sizeof(struct iovec));
+	}
+	mongo_packet_finish(op->packet, mongo_connection_get_reqid(target));
+	count = mongo_packet_iovecs(op->packet, iov);
+
+	if (op->con->mux) {
+		if (mongo_mux_send(manager, op->con, options, iov, count, &op->waiter, &error_message)) {
+			op->state = MONGO_MULTI_MUX;
+		} else {
+			mongo_multi_fail(op, error_message);
+		}
+	} else {
+		op->deadline = mongo_connection_deadline(op->pooled, options->socketTimeoutMS);
+		if (manager->sendv(op->pooled, options, iov, count, &error_message) == -1) {
+			mongo_pool_checkin(manager, op->con, op->pooled, 1);
+			mongo_multi_fail(op, error_message);
+		} else {
+			op->state = MONGO_MULTI_SENT;
+		}
+	}
+
+	if (iov != stack_iov) {
+		free(iov);
+	}
+}
+
+/* Reads the reply to op, which has arrived, or is the next thing to wait for */
+static void mongo_multi_read(mongo_con_manager *manager, mongo_multi_op *op)
+{
+	int32_t response_to;
+	int     retval;
+
+	op->data_buffer = op->error_message = NULL;
+	retval = mongo_connection_read_reply(manager, op->pooled, &op->servers->options, op->deadline, &response_to, &op->data_buffer, &op->error_message);
+	mongo_pool_checkin(manager, op->con, op->pooled, retval < 0);
+	op->retval = retval == 1;
+	op->state = MONGO_MULTI_DONE;
+}
+
+/* Waits for the replies to the operations that were sent on sockets of
+ * their own, with one poll() for all of them */
+static void mongo_multi_poll(mongo_con_manager *manager, mongo_multi_op *ops, int count)
+{
+	struct pollfd *pfds;
+	int           *index;
+	int64_t        now, first_deadline;
+	int            i, n, fd, ready;
+
+	pfds = malloc(count * sizeof(struct pollfd));
+	index = malloc(count * sizeof(int));
+
+	while (1) {
+		now = mongo_now_ms();
+		first_deadline = -1;
+		n = 0;
+
+		for (i = 0; i < count; i++) {
+			if (ops[i].state != MONGO_MULTI_SENT) {
+				continue;
+			}
+
+			/* Transports that can't be polled are read in turn; by the time
+			 * the others are looked at, their replies have had as long to
+			 * arrive */
+			fd = manager->poll_fd ? manager->poll_fd(ops[i].pooled) : -1;
+			if (fd < 0) {
+				mongo_multi_read(manager, &ops[i]);
+				continue;
+			}
+
+			if (ops[i].deadline >= 0 && ops[i].deadline <= now) {
+				char *error_message = malloc(256);
+
+				snprintf(error_message, 256, "Read timed out waiting for the reply from %s", ops[i].con->hash);
+				mongo_pool_checkin(manager, ops[i].con, ops[i].pooled, 1);
+				mongo_multi_fail(&ops[i], error_message);
+				continue;
+			}
+			if (ops[i].deadline >= 0 && (first_deadline < 0 || ops[i].deadline < first_deadline)) {
+				first_deadline = ops[i].deadline;
+			}
+
+			pfds[n].fd = fd;
+			pfds[n].events = POLLIN;
+			pfds[n].revents = 0;
+			index[n] = i;
+			n++;
+		}
+
+		if (n == 0) {
+			break;
+		}
+
+		ready = poll(pfds, n, first_deadline < 0 ? -1 : (int)(first_deadline - now));
+		if (ready < 0 && errno != EINTR) {
+			/* Nothing to wait with, so read the replies in turn */
+			for (i = 0; i < n; i++) {
+				mongo_multi_read(manager, &ops[index[i]]);
+			}
+			break;
+		}
+
+		for (i = 0; i < n && ready > 0; i++) {
+			if (pfds[i].revents) {
+				mongo_multi_read(manager, &ops[index[i]]);
+			}
+		}
+	}
+
+	free(index);
+	free(pfds);
+}
+
+/* Checks out a socket for op. Only the first socket of a round may be
+ * waited for: the sockets that this thread already holds are only given
+ * back once the round's replies have been read, so waiting for one of
+ * those would only time out. Operations that can't get one right away are
+ * deferred to the next round. Returns whether op got a socket. */
+static int mongo_multi_checkout(mongo_con_manager *manager, mongo_multi_op *op, int held)
+{
+	char *error_message = NULL;
+
+	if (op->con->mux) {
+		return 1;
+	}
+
+	if (held) {
+		op->pooled = mongo_pool_checkout_wait(manager, op->con, &op->servers->options, 0, &error_message);
+		if (!op->pooled) {
+			free(error_message);
+			op->state = MONGO_MULTI_DEFERRED;
+			return 0;
+		}
+		return 1;
+	}
+
+	op->pooled = mongo_pool_checkout(manager, op->con, &op->servers->options, &error_message);
+	if (!op->pooled) {
+		mongo_multi_fail(op, error_message);
+		return 0;
+	}
+	return 1;
+}
+
+int mongo_multi_exec(mongo_con_manager *manager, mongo_multi_op *ops, int count)
+{
+	char *error_message;
+	int   i, held, remaining, worked = 0;
+
+	/* Select a server for every operation up front, so that the requests go
+	 * out back to back */
+	for (i = 0; i < count; i++) {
+		ops[i].retval = 0;
+		ops[i].data_buffer = ops[i].error_message = NULL;
+		ops[i].pooled = NULL;
+		ops[i].state = MONGO_MULTI_NEW;
+
+		error_message = NULL;
+		ops[i].con = mongo_get_read_write_connection(manager, ops[i].servers, ops[i].connection_flags, &error_message);
+		if (!ops[i].con) {
+			mongo_multi_fail(&ops[i], error_message ? error_message : strdup("Couldn't select a server for the operation"));
+		}
+	}
+
+	do {
+		held = 0;
+		for (i = 0; i < count; i++) {
+			if (ops[i].state != MONGO_MULTI_NEW && ops[i].state != MONGO_MULTI_DEFERRED) {
+				continue;
+			}
+			if (mongo_multi_checkout(manager, &ops[i], held)) {
+				mongo_multi_send(manager, &ops[i]);
+				held += ops[i].state == MONGO_MULTI_SENT;
+			}
+		}
+
+		mongo_multi_poll(manager, ops, count);
+
+		remaining = 0;
+		for (i = 0; i < count; i++) {
+			remaining += ops[i].state == MONGO_MULTI_DEFERRED;
+		}
+	} while (remaining);
+
+	/* Replies on multiplexed sockets have been arriving all along */
+	for (i = 0; i < count; i++) {
+		if (ops[i].state == MONGO_MULTI_MUX) {
+			ops[i].retval = mongo_mux_wait_reply(manager, ops[i].con, &ops[i].servers->options, &ops[i].waiter, &ops[i].data_buffer, &ops[i].error_message);
+			ops[i].state = MONGO_MULTI_DONE;
+		}
+	}
+
+	for (i = 0; i < count; i++) {
+		if (ops[i].con) {
+			mongo_manager_connection_release(manager, ops[i].con);
+			ops[i].con = NULL;
+		}
+		worked += ops[i].retval;
+	}
+
+	return worked;
+}
+
+/*
+ * Local variables:
+ * tab-width: 4
+ * c-basic-offset: 4
+ * End:
+ * vim600: fdm=marker
+ * vim: noet sw=4 ts=4
+ */
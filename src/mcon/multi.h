@@ -0,0 +1,68 @@
+/**
+ *  Copyright 2009-2014 MongoDB, Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+#ifndef __MCON_MULTI_H__
+#define __MCON_MULTI_H__
+
+#include "types.h"
+#include "packet.h"
+#include "mux.h"
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+/* One of the independent operations that mongo_multi_exec() runs together */
+typedef struct _mongo_multi_op
+{
+	/* Set by the caller */
+	mongo_servers    *servers;          /* Where the operation may go, and its read preference */
+	int               connection_flags; /* MONGO_CON_FLAG_READ or MONGO_CON_FLAG_WRITE */
+	mongo_packet     *packet;           /* Left for the caller to free */
+
+	/* Set by mongo_multi_exec() */
+	int               retval;           /* 1 if the operation worked, and 0 if it didn't */
+	char             *data_buffer;      /* The reply if it worked, to be freed with mongo_buffer_free() */
+	char             *error_message;    /* Why it didn't, to be free()d */
+
+	/* Used by mongo_multi_exec() */
+	mongo_connection *con;              /* The selected server */
+	mongo_connection *pooled;           /* The socket the request went out on */
+	mongo_mux_waiter  waiter;           /* Or the waiter, if con is multiplexed */
+	int64_t           deadline;
+	int               state;
+} mongo_multi_op;
+
+/* Sends every operation to the server that is selected for it, before any
+ * reply is read, and then waits for all of the replies at once, so that
+ * the operations take about as long as the slowest of them, rather than
+ * as long as all of them together. The results are stored in each op.
+ * Returns the number of operations that worked. */
+int mongo_multi_exec(mongo_con_manager *manager, mongo_multi_op *ops, int count);
+
+#if defined(__cplusplus)
+}
+#endif
+
+#endif
+
+/*
+ * Local variables:
+ * tab-width: 4
+ * c-basic-offset: 4
+ * End:
+ * vim600: fdm=marker
+ * vim: noet sw=4 ts=4
+ */
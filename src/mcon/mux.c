@@ -0,0 +1,311 @@
+/**
+ *  Copyright 2009-2014 MongoDB, Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <poll.h>
+
+#include "types.h"
+#include "mux.h"
+#include "manager.h"
+#include "connections.h"
+#include "bson_helpers.h"
+#include "buffer.h"
+#include "utils.h"
+
+/* How long the reader waits for a reply to arrive before it looks at the
+ * deadlines of the waiters again */
+#define MONGO_MUX_READ_SLICE_MS 50
+
+mongo_mux *mongo_mux_create(void)
+{
+	mongo_mux *mux;
+
+	mux = calloc(1, sizeof(mongo_mux));
+	pthread_mutex_init(&mux->lock, NULL);
+	pthread_cond_init(&mux->replied, NULL);
+
+	return mux;
+}
+
+/* Only called when the connection is destroyed, when nobody can be waiting
+ * any more */
+void mongo_mux_destroy(mongo_mux *mux)
+{
+	pthread_cond_destroy(&mux->replied);
+	pthread_mutex_destroy(&mux->lock);
+	free(mux->failure);
+	free(mux);
+}
+
+/* Must be called with mux->lock held */
+static void mongo_mux_unlink(mongo_mux *mux, mongo_mux_waiter *waiter)
+{
+	mongo_mux_waiter **ptr;
+
+	for (ptr = &mux->waiters; *ptr; ptr = &(*ptr)->next) {
+		if (*ptr == waiter) {
+			*ptr = waiter->next;
+			mux->in_flight--;
+			return;
+		}
+	}
+}
+
+/* Hands a reply to whoever waits for it, or drops it if they have given up.
+ * Must be called with mux->lock held. */
+static void mongo_mux_deliver(mongo_con_manager *manager, mongo_mux *mux, int32_t response_to, int retval, char *data_buffer, char *error_message)
+{
+	mongo_mux_waiter *waiter;
+
+	for (waiter = mux->waiters; waiter; waiter = waiter->next) {
+		if (waiter->request_id == response_to) {
+			mongo_mux_unlink(mux, waiter);
+			waiter->retval = retval;
+			waiter->data_buffer = data_buffer;
+			waiter->error_message = error_message;
+			waiter->done = 1;
+			return;
+		}
+	}
+
+	mongo_manager_log(manager, MLOG_CON, MLOG_FINE, "mux: dropping the reply to request %d, which nobody waits for any more", response_to);
+	mux->orphans++;
+	if (retval == 1) {
+		mongo_buffer_free(data_buffer);
+	} else {
+		free(error_message);
+	}
+}
+
+/* Fails every operation that is waiting, and every later one, as a read or
+ * write that went wrong leaves the socket in an unknown state. Takes over
+ * error_message. Must be called with mux->lock held. */
+static void mongo_mux_fail(mongo_mux *mux, char *error_message)
+{
+	mongo_mux_waiter *waiter;
+
+	for (waiter = mux->waiters; waiter; waiter = waiter->next) {
+		waiter->retval = 0;
+		waiter->error_message = strdup(error_message);
+		waiter->done = 1;
+	}
+	mux->waiters = NULL;
+	mux->in_flight = 0;
+
+	if (mux->failure) {
+		free(error_message);
+	} else {
+		mux->failure = error_message;
+	}
+}
+
+/* Returns the latest deadline of all waiters, or -1 if one of them has
+ * none. Must be called with mux->lock held. */
+static int64_t mongo_mux_read_deadline(mongo_mux *mux)
+{
+	mongo_mux_waiter *waiter;
+	int64_t           deadline = 0;
+
+	for (waiter = mux->waiters; waiter; waiter = waiter->next) {
+		if (waiter->deadline < 0) {
+			return -1;
+		}
+		if (waiter->deadline > deadline) {
+			deadline = waiter->deadline;
+		}
+	}
+	return deadline;
+}
+
+/* Waits for mux->replied, but not beyond deadline (in ms, or -1 for none) */
+static void mongo_mux_wait(mongo_mux *mux, int64_t deadline)
+{
+	struct timespec ts;
+
+	if (deadline < 0) {
+		pthread_cond_wait(&mux->replied, &mux->lock);
+		return;
+	}
+
+	ts.tv_sec = deadline / 1000;
+	ts.tv_nsec = (deadline % 1000) * 1000000;
+	pthread_cond_timedwait(&mux->replied, &mux->lock, &ts);
+}
+
+/* Waits, in slices, until the next reply starts to arrive on behalf of all
+ * waiters, so that a reply isn't read with the deadline of the waiters that
+ * were there when the wait started. Returns 1 once there is something to
+ * read, and 0 if the reader has to stop, without anything having been read:
+ * when its own deadline has passed, or it's done. Then another waiter takes
+ * over. Transports that can't be polled are read right away. Must be called
+ * with mux->lock held, which is released while waiting. */
+static int mongo_mux_wait_readable(mongo_con_manager *manager, mongo_connection *con, mongo_mux *mux, mongo_mux_waiter *waiter)
+{
+	struct pollfd pfd;
+	int64_t       now;
+	int           slice, fd;
+
+	fd = manager->poll_fd ? manager->poll_fd(con) : -1;
+	if (fd < 0) {
+		return 1;
+	}
+
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	while (!waiter->done) {
+		now = mongo_now_ms();
+		if (waiter->deadline >= 0 && now >= waiter->deadline) {
+			return 0;
+		}
+
+		slice = MONGO_MUX_READ_SLICE_MS;
+		if (waiter->deadline >= 0 && waiter->deadline - now < slice) {
+			slice = waiter->deadline - now;
+		}
+
+		pthread_mutex_unlock(&mux->lock);
+		pfd.revents = 0;
+		if (poll(&pfd, 1, slice) != 0) {
+			/* Errors are left to the read to report */
+			pthread_mutex_lock(&mux->lock);
+			return 1;
+		}
+		pthread_mutex_lock(&mux->lock);
+	}
+
+	return 0;
+}
+
+int mongo_mux_send(mongo_con_manager *manager, mongo_connection *con, mongo_server_options *options, struct iovec *iov, int count, mongo_mux_waiter *waiter, char **error_message)
+{
+	mongo_mux         *mux = con->mux;
+	mongo_mux_waiter **tail;
+	char              *send_error = NULL;
+	int                retval;
+
+	memset(waiter, 0, sizeof(mongo_mux_waiter));
+	memcpy(&waiter->request_id, (char *)iov[0].iov_base + 4, 4);
+	waiter->request_id = MONGO_32(waiter->request_id);
+	waiter->deadline = mongo_connection_deadline(con, options->socketTimeoutMS);
+
+	/* Wait for the reply before the request goes out, so that whoever reads
+	 * it knows where it goes */
+	pthread_mutex_lock(&mux->lock);
+	if (mux->failure) {
+		*error_message = strdup(mux->failure);
+		pthread_mutex_unlock(&mux->lock);
+		return 0;
+	}
+	for (tail = &mux->waiters; *tail; tail = &(*tail)->next);
+	*tail = waiter;
+	mux->in_flight++;
+	pthread_mutex_unlock(&mux->lock);
+
+	mongo_connection_checkout(con);
+	retval = manager->sendv(con, options, iov, count, &send_error);
+	mongo_connection_checkin(con);
+
+	/* The waiter gets the error, like every other one */
+	if (retval == -1) {
+		pthread_mutex_lock(&mux->lock);
+		mongo_mux_fail(mux, send_error);
+		pthread_cond_broadcast(&mux->replied);
+		pthread_mutex_unlock(&mux->lock);
+	}
+
+	return 1;
+}
+
+int mongo_mux_wait_reply(mongo_con_manager *manager, mongo_connection *con, mongo_server_options *options, mongo_mux_waiter *waiter, char **data_buffer, char **error_message)
+{
+	mongo_mux *mux = con->mux;
+	int64_t    read_deadline;
+	int32_t    response_to;
+	char      *reply_data = NULL, *reply_error = NULL;
+	int        retval;
+
+	pthread_mutex_lock(&mux->lock);
+	while (!waiter->done) {
+		if (waiter->deadline >= 0 && mongo_now_ms() >= waiter->deadline) {
+			/* The reply is dropped when it arrives */
+			mongo_mux_unlink(mux, waiter);
+			waiter->retval = 0;
+			waiter->error_message = malloc(256);
+			snprintf(waiter->error_message, 256, "Read timed out waiting for the reply to request %d", waiter->request_id);
+			break;
+		}
+
+		if (!mux->reading) {
+			/* Read the next reply, which may or may not be ours, once it
+			 * starts to arrive. A timeout in the middle of a reply breaks
+			 * the socket for everyone, so it only happens once all waiters,
+			 * including the ones that came in while we waited for it, have
+			 * given up. */
+			mux->reading = 1;
+			if (!mongo_mux_wait_readable(manager, con, mux, waiter)) {
+				mux->reading = 0;
+				pthread_cond_broadcast(&mux->replied);
+				continue;
+			}
+			read_deadline = mongo_mux_read_deadline(mux);
+			pthread_mutex_unlock(&mux->lock);
+
+			reply_data = reply_error = NULL;
+			retval = mongo_connection_read_reply(manager, con, options, read_deadline, &response_to, &reply_data, &reply_error);
+
+			pthread_mutex_lock(&mux->lock);
+			mux->reading = 0;
+			if (retval < 0) {
+				mongo_mux_fail(mux, reply_error);
+			} else {
+				mongo_mux_deliver(manager, mux, response_to, retval, reply_data, reply_error);
+			}
+			pthread_cond_broadcast(&mux->replied);
+			continue;
+		}
+
+		mongo_mux_wait(mux, waiter->deadline);
+	}
+	pthread_mutex_unlock(&mux->lock);
+
+	if (waiter->retval == 1) {
+		*data_buffer = waiter->data_buffer;
+	} else {
+		*error_message = waiter->error_message;
+	}
+	return waiter->retval == 1;
+}
+
+int mongo_mux_exchange(mongo_con_manager *manager, mongo_connection *con, mongo_server_options *options, struct iovec *iov, int count, char **data_buffer, char **error_message)
+{
+	mongo_mux_waiter waiter;
+
+	if (!mongo_mux_send(manager, con, options, iov, count, &waiter, error_message)) {
+		return 0;
+	}
+	return mongo_mux_wait_reply(manager, con, options, &waiter, data_buffer, error_message);
+}
+
+/*
+ * Local variables:
+ * tab-width: 4
+ * c-basic-offset: 4
+ * End:
+ * vim600: fdm=marker
+ * vim: noet sw=4 ts=4
+ */
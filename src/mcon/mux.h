@@ -0,0 +1,87 @@
+/**
+ *  Copyright 2009-2014 MongoDB, Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+#ifndef __MCON_MUX_H__
+#define __MCON_MUX_H__
+
+#include "types.h"
+#include <pthread.h>
+#include <sys/uio.h>
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+/* With the manager's multiplex option, the operations of every thread share
+ * a server's one socket, instead of checking out a socket of their own from
+ * the pool. Requests are written back to back, each under the connection's
+ * lock, and the replies are matched to them by their responseTo. Whichever
+ * waiting thread finds nobody reading reads the next reply for everyone,
+ * and the others sleep until theirs has arrived, or until their deadline
+ * has passed. */
+typedef struct _mongo_mux_waiter
+{
+	int32_t                   request_id;
+	int64_t                   deadline;      /* In ms, or -1 for none, see mongo_connection_deadline() */
+	int                       done;
+	int                       retval;
+	char                     *data_buffer;
+	char                     *error_message;
+	struct _mongo_mux_waiter *next;
+} mongo_mux_waiter;
+
+typedef struct _mongo_mux
+{
+	pthread_mutex_t   lock;
+	pthread_cond_t    replied;
+	mongo_mux_waiter *waiters;   /* Requests that were sent, oldest first */
+	int               reading;   /* Whether a thread is reading a reply */
+	char             *failure;   /* Why the socket can't be used any more, or NULL */
+	int               in_flight; /* Number of waiters */
+	int64_t           orphans;   /* Replies whose waiter had given up */
+} mongo_mux;
+
+mongo_mux *mongo_mux_create(void);
+void mongo_mux_destroy(mongo_mux *mux);
+
+/* The two halves of mongo_mux_exchange(), for callers that send several
+ * requests before they wait for any reply, see multi.c. mongo_mux_send()
+ * returns 0, and sets *error_message, if the socket has already failed.
+ * Otherwise it returns 1, and waiter has to be passed to
+ * mongo_mux_wait_reply(), which returns what mongo_mux_exchange() does. */
+int mongo_mux_send(mongo_con_manager *manager, mongo_connection *con, mongo_server_options *options, struct iovec *iov, int count, mongo_mux_waiter *waiter, char **error_message);
+int mongo_mux_wait_reply(mongo_con_manager *manager, mongo_connection *con, mongo_server_options *options, mongo_mux_waiter *waiter, char **data_buffer, char **error_message);
+
+/* Sends the request in iov (whose first segment holds the message header)
+ * on con's shared socket, and waits for the reply. Returns 1 if it worked,
+ * and 0 if it didn't. If 0 is returned, *error_message is set and must be
+ * free()d. On success *data_buffer is set and must be freed with
+ * mongo_buffer_free() */
+int mongo_mux_exchange(mongo_con_manager *manager, mongo_connection *con, mongo_server_options *options, struct iovec *iov, int count, char **data_buffer, char **error_message);
+
+#if defined(__cplusplus)
+}
+#endif
+
+#endif
+
+/*
+ * Local variables:
+ * tab-width: 4
+ * c-basic-offset: 4
+ * End:
+ * vim600: fdm=marker
+ * vim: noet sw=4 ts=4
+ */
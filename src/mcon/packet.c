@@ -0,0 +1,148 @@
+/**
+ *  Copyright 2009-2014 MongoDB, Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+#include <stdlib.h>
+#include <string.h>
+
+#include "packet.h"
+#include "bson_helpers.h"
+#include "str.h"
+
+#define MONGO_PACKET_INITIAL_SEGMENTS 4
+
+static void mongo_packet_add_segment(mongo_packet *packet, char *data, int offset, int size)
+{
+	if (packet->count == packet->space) {
+		packet->space *= 2;
+		packet->segments = realloc(packet->segments, packet->space * sizeof(mongo_packet_segment));
+	}
+
+	packet->segments[packet->count].data = data;
+	packet->segments[packet->count].offset = offset;
+	packet->segments[packet->count].size = size;
+	packet->count++;
+}
+
+/* Turns the bytes that have been appended to str since the last segment into
+ * a segment of their own */
+static void mongo_packet_close_run(mongo_packet *packet)
+{
+	if (packet->str->l > packet->run_start) {
+		mongo_packet_add_segment(packet, NULL, packet->run_start, packet->str->l - packet->run_start);
+		packet->run_start = packet->str->l;
+	}
+}
+
+static void mongo_packet_add_header(mongo_packet *packet, int opcode)
+{
+	mcon_serialize_int(packet->str, 0); /* Length, see mongo_packet_finish() */
+	mcon_serialize_int(packet->str, 0); /* Request ID, idem */
+	mcon_serialize_int(packet->str, 0); /* Response to */
+	mcon_serialize_int(packet->str, opcode);
+}
+
+mongo_packet *mongo_packet_create(int opcode)
+{
+	mongo_packet *packet;
+
+	packet = calloc(1, sizeof(mongo_packet));
+	mcon_str_ptr_init_pooled(packet->str);
+	packet->space = MONGO_PACKET_INITIAL_SEGMENTS;
+	packet->segments = malloc(packet->space * sizeof(mongo_packet_segment));
+
+	mongo_packet_add_header(packet, opcode);
+
+	return packet;
+}
+
+void mongo_packet_dtor(mongo_packet *packet)
+{
+	mcon_str_ptr_dtor(packet->str);
+	free(packet->segments);
+	free(packet->headers);
+	free(packet);
+}
+
+/* The length of every message but the last is known once the next one
+ * starts, and is filled in right away */
+void mongo_packet_next_message(mongo_packet *packet, int opcode)
+{
+	int offset = packet->nr_headers ? packet->headers[packet->nr_headers - 1] : 0;
+
+	mongo_packet_patch_int32(packet, offset, mongo_packet_length(packet) - packet->message_start);
+
+	packet->headers = realloc(packet->headers, (packet->nr_headers + 1) * sizeof(int));
+	packet->headers[packet->nr_headers] = packet->str->l;
+	packet->nr_headers++;
+	packet->message_start = mongo_packet_length(packet);
+
+	mongo_packet_add_header(packet, opcode);
+}
+
+void mongo_packet_add_data(mongo_packet *packet, char *data, int size)
+{
+	mongo_packet_close_run(packet);
+	mongo_packet_add_segment(packet, data, 0, size);
+	packet->external += size;
+}
+
+int mongo_packet_length(mongo_packet *packet)
+{
+	return packet->str->l + packet->external;
+}
+
+void mongo_packet_patch_int32(mongo_packet *packet, int offset, int32_t value)
+{
+	int32_t le = MONGO_32(value);
+
+	memcpy(packet->str->d + offset, &le, 4);
+}
+
+void mongo_packet_finish(mongo_packet *packet, int32_t request_id)
+{
+	int i;
+
+	if (!packet->finished) {
+		mongo_packet_close_run(packet);
+		mongo_packet_patch_int32(packet, packet->nr_headers ? packet->headers[packet->nr_headers - 1] : 0, mongo_packet_length(packet) - packet->message_start);
+		packet->finished = 1;
+	}
+	mongo_packet_patch_int32(packet, 4, request_id);
+	for (i = 0; i < packet->nr_headers; i++) {
+		mongo_packet_patch_int32(packet, packet->headers[i] + 4, request_id);
+	}
+}
+
+int mongo_packet_iovecs(mongo_packet *packet, struct iovec *iov)
+{
+	int i;
+
+	/* str may have been reallocated since the segments were added, so the
+	 * pointers into it are only made now */
+	for (i = 0; i < packet->count; i++) {
+		iov[i].iov_base = packet->segments[i].data ? packet->segments[i].data : packet->str->d + packet->segments[i].offset;
+		iov[i].iov_len = packet->segments[i].size;
+	}
+	return packet->count;
+}
+
+/*
+ * Local variables:
+ * tab-width: 4
+ * c-basic-offset: 4
+ * End:
+ * vim600: fdm=marker
+ * vim: noet sw=4 ts=4
+ */
@@ -0,0 +1,99 @@
+/**
+ *  Copyright 2009-2014 MongoDB, Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+#ifndef __MCON_PACKET_H__
+#define __MCON_PACKET_H__
+
+#include "types.h"
+#include "str.h"
+#include <stdint.h>
+#include <sys/uio.h>
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+/* A wire message that is sent with one sendmsg() from several segments,
+ * rather than from one contiguous buffer. The bytes that the packet builds
+ * itself (the header, namespaces, small documents) are appended to str, like
+ * with the mini_bson packets. Large payloads, such as inserted documents or
+ * GridFS chunks, are added with mongo_packet_add_data(), which only keeps a
+ * pointer to them, so they are never copied. */
+typedef struct _mongo_packet_segment
+{
+	char *data;   /* Not owned by the packet, or NULL for bytes in str */
+	int   offset; /* Where the bytes start in str, if data is NULL */
+	int   size;
+} mongo_packet_segment;
+
+typedef struct _mongo_packet
+{
+	mcon_str             *str;       /* Every byte that isn't added with mongo_packet_add_data() */
+	int                   run_start; /* Where the bytes of str that aren't in a segment yet start */
+	int                   external;  /* Number of bytes added with mongo_packet_add_data() */
+	int                   finished;  /* Whether all of str is in segments, see mongo_packet_finish() */
+	mongo_packet_segment *segments;
+	int                   count;
+	int                   space;
+	int                  *headers;       /* Where the headers of the messages after the first are in str */
+	int                   nr_headers;
+	int                   message_start; /* Where the last message starts, counted like mongo_packet_length() */
+} mongo_packet;
+
+/* Creates a packet, with a message header for opcode. The length and request
+ * ID are filled in by mongo_packet_finish(). */
+mongo_packet *mongo_packet_create(int opcode);
+void mongo_packet_dtor(mongo_packet *packet);
+
+/* Ends the message that is being built, and starts another one for opcode
+ * in the same packet, f.e. the getLastError query that follows a write.
+ * Only the last message of a packet may be one that gets a reply. */
+void mongo_packet_next_message(mongo_packet *packet, int opcode);
+
+/* Adds size bytes at data, which have to stay around until the packet has
+ * been sent */
+void mongo_packet_add_data(mongo_packet *packet, char *data, int size);
+
+/* The length of the packet so far, and what BSON document lengths should be
+ * calculated from, as str->l doesn't include the data that was added */
+int mongo_packet_length(mongo_packet *packet);
+
+/* Overwrites four bytes in str, at offset, f.e. a document length */
+void mongo_packet_patch_int32(mongo_packet *packet, int offset, int32_t value);
+
+/* Sets the message length and the request ID in the header. Nothing can be
+ * added afterwards, but the packet can be finished again with another
+ * request ID, and sent again. Every message of the packet gets the same
+ * request ID, so that the reply to the last one is matched to the packet. */
+void mongo_packet_finish(mongo_packet *packet, int32_t request_id);
+
+/* Fills iov, which has room for packet->count entries, and returns the
+ * number of them */
+int mongo_packet_iovecs(mongo_packet *packet, struct iovec *iov);
+
+#if defined(__cplusplus)
+}
+#endif
+
+#endif
+
+/*
+ * Local variables:
+ * tab-width: 4
+ * c-basic-offset: 4
+ * End:
+ * vim600: fdm=marker
+ * vim: noet sw=4 ts=4
+ */
@@ -717,10 +717,11 @@ void mongo_servers_dump(mongo_con_manager *manager, mongo_servers *servers)
 }
 
 /* Cloning */
-static void mongo_server_def_copy(mongo_server_def *to, mongo_server_def *from, int flags)
+void mongo_server_def_copy(mongo_server_def *to, mongo_server_def *from, int flags)
 {
 	to->host = to->repl_set_name = to->db = to->authdb = to->username = to->password = NULL;
 	to->mechanism = MONGO_AUTH_MECHANISM_MONGODB_CR;
+	to->id = NULL;
 	if (from->host) {
 		to->host = strdup(from->host);
 	}
@@ -746,49 +747,55 @@ static void mongo_server_def_copy(mongo_server_def *to, mongo_server_def *from,
 	}
 }
 
-void mongo_servers_copy(mongo_servers *to, mongo_servers *from, int flags)
+void mongo_server_options_copy(mongo_server_options *to, mongo_server_options *from)
 {
-	int i;
+	to->con_type = from->con_type;
 
-	to->count = from->count;
-	for (i = 0; i < from->count; i++) {
-		to->server[i] = calloc(1, sizeof(mongo_server_def));
-		mongo_server_def_copy(to->server[i], from->server[i], flags);
+	if (from->repl_set_name) {
+		to->repl_set_name = strdup(from->repl_set_name);
+	}
+	if (from->gssapiServiceName) {
+		to->gssapiServiceName = strdup(from->gssapiServiceName);
 	}
 
-	to->options.con_type = from->options.con_type;
+	to->connectTimeoutMS = from->connectTimeoutMS;
+	to->socketTimeoutMS = from->socketTimeoutMS;
+	to->secondaryAcceptableLatencyMS = from->secondaryAcceptableLatencyMS;
 
-	if (from->options.repl_set_name) {
-		to->options.repl_set_name = strdup(from->options.repl_set_name);
-	}
-	if (from->options.gssapiServiceName) {
-		to->options.gssapiServiceName = strdup(from->options.gssapiServiceName);
+	to->default_w = from->default_w;
+	to->default_wtimeout = from->default_wtimeout;
+	if (from->default_wstring) {
+		to->default_wstring = strdup(from->default_wstring);
 	}
+	to->default_fsync = from->default_fsync;
+	to->default_journal = from->default_journal;
 
-	to->options.connectTimeoutMS = from->options.connectTimeoutMS;
-	to->options.socketTimeoutMS = from->options.socketTimeoutMS;
-	to->options.secondaryAcceptableLatencyMS = from->options.secondaryAcceptableLatencyMS;
+	to->ssl = from->ssl;
 
-	to->options.default_w = from->options.default_w;
-	to->options.default_wtimeout = from->options.default_wtimeout;
-	if (from->options.default_wstring) {
-		to->options.default_wstring = strdup(from->options.default_wstring);
+	if (from->ctx) {
+		to->ctx = from->ctx;
 	}
-	to->options.default_fsync = from->options.default_fsync;
-	to->options.default_journal = from->options.default_journal;
+}
 
-	to->options.ssl = from->options.ssl;
+void mongo_servers_copy(mongo_servers *to, mongo_servers *from, int flags)
+{
+	int i;
 
-	if (from->options.ctx) {
-		to->options.ctx = from->options.ctx;
+	to->count = from->count;
+	for (i = 0; i < from->count; i++) {
+		to->server[i] = calloc(1, sizeof(mongo_server_def));
+		mongo_server_def_copy(to->server[i], from->server[i], flags);
 	}
 
+	mongo_server_options_copy(&to->options, &from->options);
+
 	mongo_read_preference_copy(&from->read_pref, &to->read_pref);
 }
 
 /* Cleanup */
 void mongo_server_def_dtor(mongo_server_def *server_def)
 {
+	mongo_server_def_reset_id(server_def);
 	if (server_def->host) {
 		free(server_def->host);
 	}
@@ -810,6 +817,20 @@ void mongo_server_def_dtor(mongo_server_def *server_def)
 	free(server_def);
 }
 
+/* Frees the strings in the options, but not the options themselves */
+void mongo_server_options_dtor(mongo_server_options *options)
+{
+	if (options->repl_set_name) {
+		free(options->repl_set_name);
+	}
+	if (options->gssapiServiceName) {
+		free(options->gssapiServiceName);
+	}
+	if (options->default_wstring) {
+		free(options->default_wstring);
+	}
+}
+
 void mongo_servers_dtor(mongo_servers *servers)
 {
 	int i;
@@ -817,15 +838,7 @@ void mongo_servers_dtor(mongo_servers *servers)
 	for (i = 0; i < servers->count; i++) {
 		mongo_server_def_dtor(servers->server[i]);
 	}
-	if (servers->options.repl_set_name) {
-		free(servers->options.repl_set_name);
-	}
-	if (servers->options.gssapiServiceName) {
-		free(servers->options.gssapiServiceName);
-	}
-	if (servers->options.default_wstring) {
-		free(servers->options.default_wstring);
-	}
+	mongo_server_options_dtor(&servers->options);
 	for (i = 0; i < servers->read_pref.tagset_count; i++) {
 		mongo_read_preference_tagset_dtor(servers->read_pref.tagsets[i]);
 	}
@@ -30,8 +30,11 @@ mongo_servers* mongo_parse_init(void);
 int mongo_parse_server_spec(mongo_con_manager *manager, mongo_servers *servers, const char *spec, char **error_message);
 int mongo_store_option(mongo_con_manager *manager, mongo_servers *servers, const char *option_name, const char *option_value, char **error_message);
 void mongo_servers_dump(mongo_con_manager *manager, mongo_servers *servers);
+void mongo_server_def_copy(mongo_server_def *to, mongo_server_def *from, int flags);
+void mongo_server_options_copy(mongo_server_options *to, mongo_server_options *from);
 void mongo_servers_copy(mongo_servers *to, mongo_servers *from, int flags);
 void mongo_server_def_dtor(mongo_server_def *server_def);
+void mongo_server_options_dtor(mongo_server_options *options);
 void mongo_servers_dtor(mongo_servers *servers);
 
 #if defined(__cplusplus)
@@ -0,0 +1,401 @@
+/**
+ *  Copyright 2009-2014 MongoDB, Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/time.h>
+
+#include "types.h"
+#include "pool.h"
+#include "manager.h"
+#include "connections.h"
+#include "parse.h"
+#include "table.h"
+
+/* Every server the manager knows about has a pool of extra sockets, which
+ * request threads check out for the duration of an operation. The pool never
+ * holds more than max_size sockets (idle and checked out); when they are all
+ * in use, threads wait for one to be checked in, up to wait_timeout ms. Idle
+ * sockets are closed after max_idle seconds, as long as that leaves min_size
+ * sockets, and sockets are not reused after max_lifetime seconds. */
+
+mongo_pool *mongo_pool_create(mongo_con_manager *manager, mongo_server_def *server, mongo_server_options *options)
+{
+	mongo_pool *pool;
+
+	pool = calloc(1, sizeof(mongo_pool));
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->available, NULL);
+
+	pool->server = calloc(1, sizeof(mongo_server_def));
+	mongo_server_def_copy(pool->server, server, MONGO_SERVER_COPY_CREDENTIALS);
+	mongo_server_options_copy(&pool->options, options);
+
+	pool->max_size = __atomic_load_n(&manager->pool_size, __ATOMIC_RELAXED);
+	pool->min_size = manager->pool_min_size;
+	pool->wait_timeout = manager->pool_wait_timeout;
+	pool->max_idle = manager->pool_max_idle;
+	pool->max_lifetime = manager->pool_max_lifetime;
+	pool->timeout = options->connectTimeoutMS;
+
+	return pool;
+}
+
+static void mongo_pool_close_items(mongo_con_manager *manager, mongo_pool_item *item)
+{
+	mongo_pool_item *next;
+
+	while (item) {
+		next = item->next;
+		mongo_connection_destroy(manager, item->con, MONGO_CLOSE_BROKEN);
+		free(item);
+		item = next;
+	}
+}
+
+/* Checked out sockets must have been checked in before the pool is destroyed;
+ * which is the case as the connection owning the pool is only destroyed once
+ * nobody holds a reference to it any more. */
+void mongo_pool_destroy(mongo_con_manager *manager, mongo_pool *pool)
+{
+	mongo_pool_close_items(manager, pool->idle);
+	mongo_server_def_dtor(pool->server);
+	mongo_server_options_dtor(&pool->options);
+	pthread_cond_destroy(&pool->available);
+	pthread_mutex_destroy(&pool->lock);
+	free(pool);
+}
+
+/* Unlinks the idle sockets that have expired, and returns them so that they
+ * can be closed once the pool's lock has been released. Must be called with
+ * the lock held. */
+static mongo_pool_item *mongo_pool_unlink_expired(mongo_pool *pool, time_t now)
+{
+	mongo_pool_item **ptr = &pool->idle;
+	mongo_pool_item  *expired = NULL, *item;
+
+	while ((item = *ptr)) {
+		int too_old = pool->max_lifetime > 0 && now - item->con->created >= pool->max_lifetime;
+		int too_idle = pool->max_idle > 0 && now - item->last_used >= pool->max_idle && pool->in_pool + pool->in_use > pool->min_size;
+
+		if (too_old || too_idle) {
+			*ptr = item->next;
+			item->next = expired;
+			expired = item;
+			pool->in_pool--;
+		} else {
+			ptr = &item->next;
+		}
+	}
+
+	return expired;
+}
+
+void mongo_pool_reap(mongo_con_manager *manager, mongo_pool *pool)
+{
+	struct timeval   now;
+	mongo_pool_item *expired;
+
+	gettimeofday(&now, NULL);
+
+	pthread_mutex_lock(&pool->lock);
+	expired = mongo_pool_unlink_expired(pool, now.tv_sec);
+	pthread_mutex_unlock(&pool->lock);
+
+	mongo_pool_close_items(manager, expired);
+}
+
+/* Opens a new socket for the pool. The server's properties are taken from the
+ * manager's connection, so only authentication needs to happen. */
+static mongo_connection *mongo_pool_connect(mongo_con_manager *manager, mongo_connection *con, mongo_server_options *options, char **error_message)
+{
+	mongo_connection *pooled;
+
+	pooled = mongo_connection_create(manager, con->id, con->pool->server, options, error_message);
+	if (!pooled) {
+		return NULL;
+	}
+
+	pooled->connection_type = con->connection_type;
+	pooled->version = con->version;
+	pooled->min_wire_version = con->min_wire_version;
+	pooled->max_wire_version = con->max_wire_version;
+	pooled->max_bson_size = con->max_bson_size;
+	pooled->max_message_size = con->max_message_size;
+	pooled->max_write_batch_size = con->max_write_batch_size;
+	pooled->ping_ms = con->ping_ms;
+	pooled->rtt_ewma_us = con->rtt_ewma_us;
+	pooled->last_ping = con->last_ping;
+
+	/* Note: Arbiters don't contain any data, including auth stuff, so you cannot authenticate on an arbiter */
+	if (pooled->connection_type != MONGO_NODE_ARBITER) {
+		if (!manager->authenticate(manager, pooled, options, con->pool->server, error_message)) {
+			mongo_connection_destroy(manager, pooled, MONGO_CLOSE_BROKEN);
+			return NULL;
+		}
+	}
+
+	pooled->connected = 1;
+	mongo_manager_log(manager, MLOG_CON, MLOG_INFO, "pool: opened new socket for %s:%d", con->pool->server->host, con->pool->server->port);
+
+	return pooled;
+}
+
+/* A checked out socket counts as an operation in flight against the server,
+ * which server selection takes into account. The round trip times that were
+ * measured on the socket while it was checked out are added to the server's
+ * average when it is checked in, and its replies save the server a ping. */
+static void mongo_pool_begin_operation(mongo_connection *con, mongo_connection *pooled)
+{
+	__sync_add_and_fetch(&con->in_flight, 1);
+	pooled->last_rtt_us = -1;
+}
+
+static void mongo_pool_end_operation(mongo_connection *con, mongo_connection *pooled)
+{
+	if (pooled->last_rtt_us >= 0) {
+		mongo_connection_rtt_add(con, pooled->last_rtt_us);
+	}
+	if (pooled->last_io > con->last_io) {
+		con->last_io = pooled->last_io;
+	}
+	__sync_sub_and_fetch(&con->in_flight, 1);
+}
+
+mongo_connection *mongo_pool_checkout(mongo_con_manager *manager, mongo_connection *con, mongo_server_options *options, char **error_message)
+{
+	return mongo_pool_checkout_wait(manager, con, options, con->pool->wait_timeout, error_message);
+}
+
+mongo_connection *mongo_pool_checkout_wait(mongo_con_manager *manager, mongo_connection *con, mongo_server_options *options, long wait_timeout, char **error_message)
+{
+	mongo_pool       *pool = con->pool;
+	mongo_pool_item  *item, *expired;
+	mongo_connection *pooled;
+	struct timeval    now, start;
+	struct timespec   deadline;
+	int               waited = 0, timed_out = 0;
+
+	/* Operations share a multiplexed connection's socket, see mux.c */
+	if (con->mux) {
+		mongo_connection_addref(con);
+		__sync_add_and_fetch(&con->in_flight, 1);
+		return con;
+	}
+
+	gettimeofday(&start, NULL);
+	deadline.tv_sec = start.tv_sec + wait_timeout / 1000;
+	deadline.tv_nsec = start.tv_usec * 1000 + (wait_timeout % 1000) * 1000000;
+	if (deadline.tv_nsec >= 1000000000) {
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000;
+	}
+
+	pthread_mutex_lock(&pool->lock);
+	while (1) {
+		gettimeofday(&now, NULL);
+		expired = mongo_pool_unlink_expired(pool, now.tv_sec);
+
+		if (pool->idle || pool->max_size < 0 || pool->in_use + pool->in_pool < pool->max_size || timed_out) {
+			break;
+		}
+
+		/* Don't wait while holding on to sockets that need closing */
+		if (expired) {
+			pthread_mutex_unlock(&pool->lock);
+			mongo_pool_close_items(manager, expired);
+			pthread_mutex_lock(&pool->lock);
+			continue;
+		}
+
+		if (wait_timeout == 0) {
+			timed_out = 1;
+			continue;
+		}
+
+		waited = 1;
+		pool->waiters++;
+		if (wait_timeout < 0) {
+			pthread_cond_wait(&pool->available, &pool->lock);
+		} else if (pthread_cond_timedwait(&pool->available, &pool->lock, &deadline) == ETIMEDOUT) {
+			timed_out = 1;
+		}
+		pool->waiters--;
+	}
+
+	if (waited) {
+		gettimeofday(&now, NULL);
+		pool->waiting_ms += (now.tv_sec - start.tv_sec) * 1000 + (now.tv_usec - start.tv_usec) / 1000;
+	}
+
+	/* Reuse the most recently used socket, so that the others can expire */
+	if (pool->idle) {
+		item = pool->idle;
+		pool->idle = item->next;
+		pool->in_pool--;
+		pool->in_use++;
+		pthread_mutex_unlock(&pool->lock);
+
+		mongo_pool_close_items(manager, expired);
+		pooled = item->con;
+		free(item);
+		mongo_pool_begin_operation(con, pooled);
+		return pooled;
+	}
+
+	if (pool->max_size >= 0 && pool->in_use + pool->in_pool >= pool->max_size) {
+		pthread_mutex_unlock(&pool->lock);
+
+		mongo_pool_close_items(manager, expired);
+		*error_message = malloc(256);
+		snprintf(*error_message, 256, "pool: no socket to %s:%d became available within %ldms; all %d are in use", pool->server->host, pool->server->port, wait_timeout, pool->max_size);
+		return NULL;
+	}
+
+	/* Reserve the slot while the socket is being opened */
+	pool->in_use++;
+	pthread_mutex_unlock(&pool->lock);
+
+	mongo_pool_close_items(manager, expired);
+	pooled = mongo_pool_connect(manager, con, options, error_message);
+	if (!pooled) {
+		pthread_mutex_lock(&pool->lock);
+		pool->in_use--;
+		pthread_cond_signal(&pool->available);
+		pthread_mutex_unlock(&pool->lock);
+		return NULL;
+	}
+
+	mongo_pool_begin_operation(con, pooled);
+	return pooled;
+}
+
+void mongo_pool_checkin(mongo_con_manager *manager, mongo_connection *con, mongo_connection *pooled, int broken)
+{
+	mongo_pool     *pool = con->pool;
+	mongo_pool_item *item = NULL;
+	struct timeval  now;
+
+	if (pooled == con) {
+		__sync_sub_and_fetch(&con->in_flight, 1);
+		mongo_connection_release(manager, con, MONGO_CLOSE_BROKEN);
+		return;
+	}
+
+	mongo_pool_end_operation(con, pooled);
+
+	gettimeofday(&now, NULL);
+	if (!broken && (pool->max_lifetime <= 0 || now.tv_sec - pooled->created < pool->max_lifetime)) {
+		item = malloc(sizeof(mongo_pool_item));
+		item->con = pooled;
+		item->last_used = now.tv_sec;
+	}
+
+	pthread_mutex_lock(&pool->lock);
+	pool->in_use--;
+	if (item) {
+		item->next = pool->idle;
+		pool->idle = item;
+		pool->in_pool++;
+	}
+	pthread_cond_signal(&pool->available);
+	pthread_mutex_unlock(&pool->lock);
+
+	if (!item) {
+		mongo_manager_log(manager, MLOG_CON, MLOG_INFO, "pool: closing %s socket to %s:%d", broken ? "broken" : "expired", pool->server->host, pool->server->port);
+		mongo_connection_destroy(manager, pooled, MONGO_CLOSE_BROKEN);
+	}
+}
+
+/* Opens sockets until the pool holds at least min_size of them */
+int mongo_pool_fill(mongo_con_manager *manager, mongo_connection *con, mongo_server_options *options, char **error_message)
+{
+	mongo_pool       *pool = con->pool;
+	mongo_connection *pooled;
+
+	while (1) {
+		pthread_mutex_lock(&pool->lock);
+		if (pool->in_use + pool->in_pool >= pool->min_size) {
+			pthread_mutex_unlock(&pool->lock);
+			return 1;
+		}
+		pool->in_use++;
+		pthread_mutex_unlock(&pool->lock);
+
+		pooled = mongo_pool_connect(manager, con, options, error_message);
+		if (!pooled) {
+			pthread_mutex_lock(&pool->lock);
+			pool->in_use--;
+			pthread_mutex_unlock(&pool->lock);
+			return 0;
+		}
+
+		/* Hand it in like a socket that was checked out */
+		mongo_pool_begin_operation(con, pooled);
+		mongo_pool_checkin(manager, con, pooled, 0);
+	}
+}
+
+void mongo_pool_get_info(mongo_pool *pool, mongo_pool_info *info)
+{
+	pthread_mutex_lock(&pool->lock);
+	info->in_use = pool->in_use;
+	info->in_pool = pool->in_pool;
+	info->total = pool->max_size;
+	info->remaining = pool->max_size < 0 ? -1 : pool->max_size - pool->in_use - pool->in_pool;
+	info->timeout = pool->timeout;
+	info->waiting = pool->waiting_ms;
+	pthread_mutex_unlock(&pool->lock);
+}
+
+typedef struct _mongo_pool_info_context
+{
+	mongo_pool_info_cb_t *cb;
+	void                 *context;
+} mongo_pool_info_context;
+
+static void mongo_pool_info_visit(char *hash, void *data, void *context)
+{
+	mongo_connection        *con = (mongo_connection *)data;
+	mongo_pool_info_context *ctxt = (mongo_pool_info_context *)context;
+	mongo_pool_info          info;
+
+	if (con->pool) {
+		mongo_pool_get_info(con->pool, &info);
+		ctxt->cb(hash, &info, ctxt->context);
+	}
+}
+
+/* Calls cb for the pool of every registered connection. The registry is
+ * locked while cb runs, so it must not call back into the manager. */
+void mongo_manager_pool_info(mongo_con_manager *manager, mongo_pool_info_cb_t cb, void *context)
+{
+	mongo_pool_info_context ctxt;
+
+	ctxt.cb = cb;
+	ctxt.context = context;
+	mcon_registry_apply(manager->connections, mongo_pool_info_visit, &ctxt);
+}
+
+/*
+ * Local variables:
+ * tab-width: 4
+ * c-basic-offset: 4
+ * End:
+ * vim600: fdm=marker
+ * vim: noet sw=4 ts=4
+ */
@@ -0,0 +1,71 @@
+/**
+ *  Copyright 2009-2014 MongoDB, Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+#ifndef __MCON_POOL_H__
+#define __MCON_POOL_H__
+
+#include "types.h"
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+/* The fields that MongoPool::info() reports for each pool */
+typedef struct _mongo_pool_info
+{
+	int     in_use;
+	int     in_pool;
+	int     remaining; /* Negative if the pool is unlimited */
+	int     total;     /* Negative if the pool is unlimited */
+	int     timeout;
+	int64_t waiting;
+} mongo_pool_info;
+
+typedef void (mongo_pool_info_cb_t)(char *hash, mongo_pool_info *info, void *context);
+
+mongo_pool *mongo_pool_create(mongo_con_manager *manager, mongo_server_def *server, mongo_server_options *options);
+void mongo_pool_destroy(mongo_con_manager *manager, mongo_pool *pool);
+
+/* Returns a socket to con's server for the exclusive use of the caller, which
+ * has to give it back with mongo_pool_checkin(). Pass broken = 1 if an I/O
+ * error occurred on it, so that it's closed instead of reused. A multiplexed
+ * connection returns itself, as its socket is shared, see mux.h. */
+mongo_connection *mongo_pool_checkout(mongo_con_manager *manager, mongo_connection *con, mongo_server_options *options, char **error_message);
+void mongo_pool_checkin(mongo_con_manager *manager, mongo_connection *con, mongo_connection *pooled, int broken);
+
+/* Like mongo_pool_checkout(), but waits at most wait_timeout ms for a socket
+ * when all of them are in use, instead of the pool's wait timeout: 0 not to
+ * wait at all, or -1 to wait for as long as it takes */
+mongo_connection *mongo_pool_checkout_wait(mongo_con_manager *manager, mongo_connection *con, mongo_server_options *options, long wait_timeout, char **error_message);
+
+int mongo_pool_fill(mongo_con_manager *manager, mongo_connection *con, mongo_server_options *options, char **error_message);
+void mongo_pool_reap(mongo_con_manager *manager, mongo_pool *pool);
+void mongo_pool_get_info(mongo_pool *pool, mongo_pool_info *info);
+void mongo_manager_pool_info(mongo_con_manager *manager, mongo_pool_info_cb_t cb, void *context);
+
+#if defined(__cplusplus)
+}
+#endif
+
+#endif
+
+/*
+ * Local variables:
+ * tab-width: 4
+ * c-basic-offset: 4
+ * End:
+ * vim600: fdm=marker
+ * vim: noet sw=4 ts=4
+ */
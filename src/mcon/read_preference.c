@@ -43,7 +43,8 @@ char *mongo_connection_type(int type)
 }
 static void mongo_print_connection_info(mongo_con_manager *manager, mongo_connection *con, int level)
 {
-	int i;
+	char **tags = con->tags;
+	int    i;
 
 	mongo_manager_log(manager, MLOG_RS, level,
 		"- connection: type: %s, socket: %d, ping: %d, hash: %s",
@@ -52,9 +53,9 @@ static void mongo_print_connection_info(mongo_con_manager *manager, mongo_connec
 		con->ping_ms,
 		con->hash
 	);
-	for (i = 0; i < con->tag_count; i++) {
+	for (i = 0; tags && tags[i]; i++) {
 		mongo_manager_log(manager, MLOG_RS, level,
-			"  - tag: %s", con->tags[i]
+			"  - tag: %s", tags[i]
 		);
 	}
 }
@@ -81,17 +82,21 @@ char *mongo_read_preference_type_to_name(int type)
 /* Collecting the correct servers */
 static mcon_collection *filter_connections(mongo_con_manager *manager, int types, mongo_read_preference *rp)
 {
-	mcon_collection *col;
-	mongo_con_manager_item *ptr = manager->connections;
+	mcon_collection *col, *all;
+	int i;
 	int current_pid, connection_pid;
 
-	current_pid = getpid();
+	current_pid = mongo_current_pid();
 	col = mcon_init_collection(sizeof(mongo_connection*));
 
+	/* Take a snapshot of the registry, so that we don't hold its locks while
+	 * filtering */
+	all = mongo_manager_connection_collect(manager);
+
 	mongo_manager_log(manager, MLOG_RS, MLOG_FINE, "filter_connections: adding connections:");
-	while (ptr) {
-		mongo_connection *con = (mongo_connection *) ptr->data;
-		connection_pid = mongo_server_hash_to_pid(con->hash);
+	for (i = 0; i < all->count; i++) {
+		mongo_connection *con = (mongo_connection *) all->data[i];
+		connection_pid = con->id->pid;
 
 		if (connection_pid != current_pid) {
 			mongo_manager_log(manager, MLOG_RS, MLOG_FINE, "filter_connections: skipping %s as it doesn't match the current pid (%d)", con->hash, current_pid);
@@ -100,8 +105,8 @@ static mcon_collection *filter_connections(mongo_con_manager *manager, int types
 			mongo_print_connection_info(manager, con, MLOG_FINE);
 			mcon_collection_add(col, con);
 		}
-		ptr = ptr->next;
 	}
+	mcon_collection_free(all);
 	mongo_manager_log(manager, MLOG_RS, MLOG_FINE, "filter_connections: done");
 
 	return col;
@@ -169,14 +174,17 @@ static mcon_collection* mongo_find_all_candidate_servers(mongo_con_manager *mana
 
 static int candidate_matches_tags(mongo_con_manager *manager, mongo_connection *con, mongo_read_preference_tagset *tagset)
 {
-	int i, j, found = 0;
+	/* The monitor thread may replace the connection's tags while we look at
+	 * them, so work on the array that was current when we started */
+	char **tags = con->tags;
+	int    i, j, found = 0;
 
 	mongo_manager_log(manager, MLOG_RS, MLOG_FINE, "candidate_matches_tags: checking tags on %s", con->hash);
 	for (i = 0; i < tagset->tag_count; i++) {
-		for (j = 0; j < con->tag_count; j++) {
-			if (strcmp(tagset->tags[i], con->tags[j]) == 0) {
+		for (j = 0; tags && tags[j]; j++) {
+			if (strcmp(tagset->tags[i], tags[j]) == 0) {
 				found++;
-				mongo_manager_log(manager, MLOG_RS, MLOG_FINE, "candidate_matches_tags: found %s", con->tags[j]);
+				mongo_manager_log(manager, MLOG_RS, MLOG_FINE, "candidate_matches_tags: found %s", tags[j]);
 			}
 		}
 	}
@@ -224,15 +232,13 @@ static mcon_collection *mongo_filter_candidates_by_replicaset_name(mongo_con_man
 {
 	int              i;
 	mcon_collection *filtered;
-	char            *candidate_hash;
 	char            *candidate_replsetname;
 
 	mongo_manager_log(manager, MLOG_RS, MLOG_FINE, "limiting to servers with same replicaset name");
 	filtered = mcon_init_collection(sizeof(mongo_connection*));
 
 	for (i = 0; i < candidates->count; i++) {
-		candidate_hash = ((mongo_connection *) candidates->data[i])->hash;
-		mongo_server_split_hash(candidate_hash, NULL, NULL, (char**) &candidate_replsetname, NULL, NULL, NULL, NULL);
+		candidate_replsetname = ((mongo_connection *) candidates->data[i])->id->repl_set_name;
 
 		/* Filter out all servers that don't have the replicaset name the same
 		 * as what we have in the server definition struct. But only when the
@@ -245,7 +251,6 @@ static mcon_collection *mongo_filter_candidates_by_replicaset_name(mongo_con_man
 				mongo_print_connection_info(manager, (mongo_connection *) candidates->data[i], MLOG_FINE);
 				mcon_collection_add(filtered, (mongo_connection *) candidates->data[i]);
 			}
-			free(candidate_replsetname);
 		}
 	}
 
@@ -258,20 +263,20 @@ static mcon_collection *mongo_filter_candidates_by_seed(mongo_con_manager *manag
 {
 	int              i, j;
 	mcon_collection *filtered;
-	char            *server_hash;
+	mongo_server_id *server_id;
 
 	mongo_manager_log(manager, MLOG_RS, MLOG_FINE, "limiting by seeded/discovered servers");
 	filtered = mcon_init_collection(sizeof(mongo_connection*));
 
 	for (j = 0; j < servers->count; j++) {
-		server_hash = mongo_server_create_hash(servers->server[j]);
+		/* Identities are interned, so the same server has the same one */
+		server_id = mongo_server_def_id(servers->server[j]);
 		for (i = 0; i < candidates->count; i++) {
-			if (strcmp(((mongo_connection *) candidates->data[i])->hash, server_hash) == 0) {
+			if (((mongo_connection *) candidates->data[i])->id == server_id) {
 				mongo_print_connection_info(manager, (mongo_connection *) candidates->data[i], MLOG_FINE);
 				mcon_collection_add(filtered, (mongo_connection *) candidates->data[i]);
 			}
 		}
-		free(server_hash);
 	}
 
 	mongo_manager_log(manager, MLOG_RS, MLOG_FINE, "limiting by seeded/discovered servers: done");
@@ -282,46 +287,37 @@ static mcon_collection *mongo_filter_candidates_by_seed(mongo_con_manager *manag
 static mcon_collection *mongo_filter_candidates_by_credentials(mongo_con_manager *manager, mcon_collection *candidates, mongo_servers *servers)
 {
 	int              i;
-	char            *db, *username, *auth_hash, *hashed = NULL;
+	mongo_server_id *id, *server_id = NULL;
 	mcon_collection *filtered;
 
 	mongo_manager_log(manager, MLOG_RS, MLOG_FINE, "limiting by credentials");
 	filtered = mcon_init_collection(sizeof(mongo_connection*));
 
+	/* The identity carries the hashed password, so it's only calculated once
+	 * and not for every candidate */
+	if (servers->server[0]->username && servers->server[0]->password && servers->server[0]->db) {
+		server_id = mongo_server_def_id(servers->server[0]);
+	}
+
 	for (i = 0; i < candidates->count; i++) {
-		db = username = auth_hash = hashed = NULL;
-		mongo_server_split_hash(((mongo_connection *) candidates->data[i])->hash, NULL, NULL, NULL, &db, &username, &auth_hash, NULL);
-		if (servers->server[0]->username && servers->server[0]->password && servers->server[0]->db) {
-			if (strcmp(db, servers->server[0]->db) != 0) {
-				mongo_manager_log(manager, MLOG_RS, MLOG_FINE, "- skipping '%s', database didn't match ('%s' vs '%s')", ((mongo_connection *) candidates->data[i])->hash, db, servers->server[0]->db);
-				goto skip;
+		id = ((mongo_connection *) candidates->data[i])->id;
+		if (server_id) {
+			if (!id->db || strcmp(id->db, server_id->db) != 0) {
+				mongo_manager_log(manager, MLOG_RS, MLOG_FINE, "- skipping '%s', database didn't match ('%s' vs '%s')", id->hash, id->db ? id->db : "", server_id->db);
+				continue;
 			}
-			if (strcmp(username, servers->server[0]->username) != 0) {
-				mongo_manager_log(manager, MLOG_RS, MLOG_FINE, "- skipping '%s', username didn't match ('%s' vs '%s')", ((mongo_connection *) candidates->data[i])->hash, username, servers->server[0]->username);
-				goto skip;
+			if (strcmp(id->username, server_id->username) != 0) {
+				mongo_manager_log(manager, MLOG_RS, MLOG_FINE, "- skipping '%s', username didn't match ('%s' vs '%s')", id->hash, id->username, server_id->username);
+				continue;
 			}
-			hashed = mongo_server_create_hashed_password(username, servers->server[0]->password);
-			if (strcmp(auth_hash, hashed) != 0) {
-				mongo_manager_log(manager, MLOG_RS, MLOG_FINE, "- skipping '%s', authentication hash didn't match ('%s' vs '%s')", ((mongo_connection *) candidates->data[i])->hash, auth_hash, hashed);
-				goto skip;
+			if (strcmp(id->auth_hash, server_id->auth_hash) != 0) {
+				mongo_manager_log(manager, MLOG_RS, MLOG_FINE, "- skipping '%s', authentication hash didn't match ('%s' vs '%s')", id->hash, id->auth_hash, server_id->auth_hash);
+				continue;
 			}
 		}
 
 		mcon_collection_add(filtered, (mongo_connection *) candidates->data[i]);
 		mongo_print_connection_info(manager, (mongo_connection *) candidates->data[i], MLOG_FINE);
-skip:
-		if (db) {
-			free(db);
-		}
-		if (username) {
-			free(username);
-		}
-		if (auth_hash) {
-			free(auth_hash);
-		}
-		if (hashed) {
-			free(hashed);
-		}
 	}
 	mongo_manager_log(manager, MLOG_RS, MLOG_FINE, "limiting by credentials: done");
 
@@ -510,6 +506,37 @@ mcon_collection *mongo_select_nearest_servers(mongo_con_manager *manager, mcon_c
 	return filtered;
 }
 
+/* What it costs to send an operation to a server: its round trip time
+ * average, scaled by the number of operations it is already busy with */
+static int64_t mongo_connection_cost(mongo_connection *con)
+{
+	return (con->rtt_ewma_us + 1) * (con->in_flight + 1);
+}
+
+/* Picks one of the first count elements with the "power of two choices": of
+ * two random servers, the one that costs the least. This steers away from a
+ * server that is slow or busy at the moment, without sending everything to
+ * whichever server is the fastest. */
+static int mongo_pick_two_choices(mcon_collection *col, int count)
+{
+	int first, second;
+
+	first = mongo_random() % count;
+	if (count == 1) {
+		return first;
+	}
+
+	second = mongo_random() % (count - 1);
+	if (second >= first) {
+		second++;
+	}
+
+	if (mongo_connection_cost((mongo_connection*)col->data[second]) < mongo_connection_cost((mongo_connection*)col->data[first])) {
+		return second;
+	}
+	return first;
+}
+
 /* The algorithm works as follows: In case we have a read preference of
  * primary, secondary or nearest the set will always contain a set of all nodes
  * that should always be considered to be returned. With primary, there is only
@@ -545,17 +572,17 @@ mongo_connection *mongo_pick_server_from_set(mongo_con_manager *manager, mcon_co
 			(col->count > 1) &&
 			(((mongo_connection*)col->data[col->count - 1])->connection_type == MONGO_NODE_PRIMARY)
 		) {
-			entry = rand() % (col->count - 1);
-			mongo_manager_log(manager, MLOG_RS, MLOG_INFO, "pick server: random element %d while ignoring the primary", entry);
+			entry = mongo_pick_two_choices(col, col->count - 1);
+			mongo_manager_log(manager, MLOG_RS, MLOG_INFO, "pick server: element %d while ignoring the primary", entry);
 			con = (mongo_connection*)col->data[entry];
 			mongo_print_connection_info(manager, con, MLOG_INFO);
 			return con;
 		}
 	}
 
-	/* For now, we just pick a random server from the set */
-	entry = rand() % col->count;
-	mongo_manager_log(manager, MLOG_RS, MLOG_INFO, "pick server: random element %d", entry);
+	/* Otherwise, any server from the set will do */
+	entry = mongo_pick_two_choices(col, col->count);
+	mongo_manager_log(manager, MLOG_RS, MLOG_INFO, "pick server: element %d", entry);
 	con = (mongo_connection*)col->data[entry];
 	mongo_print_connection_info(manager, con, MLOG_INFO);
 	return con;
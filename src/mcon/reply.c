@@ -0,0 +1,236 @@
+/**
+ *  Copyright 2009-2014 MongoDB, Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "types.h"
+#include "reply.h"
+#include "manager.h"
+#include "connections.h"
+#include "buffer.h"
+#include "bson_helpers.h"
+#include "bson_validate.h"
+
+static int mongo_reply_stream_fail(mongo_reply_stream *stream, char **error_message, char *message)
+{
+	stream->failed = 1;
+	*error_message = message;
+	return -1;
+}
+
+static void mongo_reply_chunk_alloc(mongo_reply_stream *stream, mongo_reply_chunk *chunk, int length)
+{
+	int size = MONGO_REPLY_CHUNK_SIZE;
+
+	/* Small replies don't need a whole chunk */
+	if (size > stream->remaining) {
+		size = stream->remaining;
+	}
+	if (size < length) {
+		size = length;
+	}
+
+	chunk->data = mongo_buffer_alloc(size);
+	chunk->size = mongo_buffer_size(chunk->data);
+	chunk->used = 0;
+
+	stream->held += chunk->size;
+	if (stream->held > stream->peak) {
+		stream->peak = stream->held;
+	}
+}
+
+/* Returns a chunk with room for a document of length bytes after what it
+ * holds already */
+static mongo_reply_chunk *mongo_reply_stream_chunk(mongo_reply_stream *stream, int length)
+{
+	mongo_reply_chunk *chunk = stream->last;
+
+	if (chunk && !stream->keep) {
+		/* The last document that was handed out isn't needed any more */
+		chunk->used = 0;
+	}
+	if (chunk && chunk->size - chunk->used >= length) {
+		return chunk;
+	}
+
+	if (chunk && !stream->keep) {
+		/* Only ever one chunk, which has to grow for this document */
+		stream->held -= chunk->size;
+		mongo_buffer_free(chunk->data);
+	} else {
+		chunk = calloc(1, sizeof(mongo_reply_chunk));
+		if (stream->last) {
+			stream->last->next = chunk;
+		} else {
+			stream->first = chunk;
+		}
+		stream->last = chunk;
+	}
+
+	mongo_reply_chunk_alloc(stream, chunk, length);
+	return chunk;
+}
+
+int mongo_reply_stream_open(mongo_con_manager *manager, mongo_connection *con, mongo_server_options *options, int64_t deadline, int keep, mongo_reply_stream **stream, char **error_message)
+{
+	mongo_reply_stream *tmp;
+	char                header[MONGO_REPLY_HEADER_SIZE];
+	char               *document;
+	int32_t             length;
+	int64_t             cursor_id;
+	int                 read, retval;
+
+	read = manager->recv_header(con, options, mongo_deadline_remaining(deadline), header, MONGO_REPLY_HEADER_SIZE, error_message);
+	if (read < 0) {
+		/* Error already populated */
+		return -1;
+	}
+	if (read < MONGO_REPLY_HEADER_SIZE) {
+		*error_message = malloc(256);
+		snprintf(*error_message, 256, "send_package: the amount of bytes read (%d) is less than the header size (%d)", read, MONGO_REPLY_HEADER_SIZE);
+		return -1;
+	}
+
+	memcpy(&length, header, sizeof(int32_t));
+	length = MONGO_32(length);
+	if (length < MONGO_REPLY_HEADER_SIZE) {
+		*error_message = malloc(256);
+		snprintf(*error_message, 256, "send_package: data corruption: the length of the reply (%d) is less than the header size (%d)", length, MONGO_REPLY_HEADER_SIZE);
+		return -1;
+	}
+
+	tmp = calloc(1, sizeof(mongo_reply_stream));
+	tmp->manager = manager;
+	tmp->con = con;
+	tmp->options = options;
+	tmp->deadline = deadline;
+	tmp->keep = keep;
+
+	tmp->response_to = MONGO_32(*(int*)(header + sizeof(int32_t) * 2));
+	tmp->flags = MONGO_32(*(int*)(header + sizeof(int32_t) * 4));
+	memcpy(&cursor_id, header + sizeof(int32_t) * 5, sizeof(int64_t));
+	tmp->cursor_id = MONGO_64(cursor_id);
+	tmp->starting_from = MONGO_32(*(int*)(header + sizeof(int32_t) * 7));
+	tmp->number_returned = MONGO_32(*(int*)(header + sizeof(int32_t) * 8));
+	tmp->remaining = length - MONGO_REPLY_HEADER_SIZE;
+
+	__sync_add_and_fetch(&manager->io_stats.replies, 1);
+	__sync_add_and_fetch(&manager->io_stats.bytes, MONGO_REPLY_HEADER_SIZE);
+	mongo_manager_log(manager, MLOG_CON, MLOG_FINE, "reply_stream: data_size: %d", tmp->remaining);
+
+	/* A failure comes with one document, that says what went wrong */
+	if (tmp->flags & MONGO_REPLY_FLAG_QUERY_FAILURE) {
+		retval = mongo_reply_stream_next(tmp, &document, error_message);
+		if (retval < 0) {
+			mongo_reply_stream_free(tmp);
+			return -1;
+		}
+		if (retval == 1) {
+			*error_message = mongo_connection_query_failure(document);
+		} else {
+			*error_message = strdup("send_package: the query returned an unknown error");
+		}
+		return mongo_reply_stream_free(tmp) ? 0 : -1;
+	}
+
+	*stream = tmp;
+	return 1;
+}
+
+int mongo_reply_stream_next(mongo_reply_stream *stream, char **document, char **error_message)
+{
+	mongo_con_manager *manager = stream->manager;
+	mongo_reply_chunk *chunk;
+	char              *invalid = NULL, *message;
+	int32_t            length, raw_length;
+
+	if (stream->failed) {
+		return mongo_reply_stream_fail(stream, error_message, strdup("send_package: the reply can't be read any more"));
+	}
+	if (stream->remaining == 0) {
+		return 0;
+	}
+	if (stream->remaining < 5) {
+		message = malloc(256);
+		snprintf(message, 256, "send_package: data corruption: the last %d bytes of the reply are too few for a document", stream->remaining);
+		return mongo_reply_stream_fail(stream, error_message, message);
+	}
+
+	/* The length decides where the document goes */
+	if (manager->recv_data(stream->con, stream->options, mongo_deadline_remaining(stream->deadline), &raw_length, sizeof(int32_t), error_message) <= 0) {
+		stream->failed = 1;
+		return -1;
+	}
+	length = MONGO_32(raw_length);
+	if (length < 5 || length > stream->remaining) {
+		message = malloc(256);
+		snprintf(message, 256, "send_package: data corruption: the length of a document (%d) doesn't fit in the rest of the reply (%d)", length, stream->remaining);
+		return mongo_reply_stream_fail(stream, error_message, message);
+	}
+	if (stream->con->max_bson_size && length > stream->con->max_bson_size) {
+		message = malloc(256);
+		snprintf(message, 256, "send_package: data corruption: the size of a document (%d) is larger than the maximum allowed size (%d)", length, stream->con->max_bson_size);
+		return mongo_reply_stream_fail(stream, error_message, message);
+	}
+
+	chunk = mongo_reply_stream_chunk(stream, length);
+	*document = chunk->data + chunk->used;
+	memcpy(*document, &raw_length, sizeof(int32_t));
+	if (manager->recv_data(stream->con, stream->options, mongo_deadline_remaining(stream->deadline), *document + sizeof(int32_t), length - sizeof(int32_t), error_message) <= 0) {
+		stream->failed = 1;
+		return -1;
+	}
+	chunk->used += length;
+	stream->remaining -= length;
+	__sync_add_and_fetch(&manager->io_stats.bytes, length);
+
+	/* Nothing reads a document before it has been checked */
+	if (manager->validate_replies && !bson_validate_document(*document, length, manager->validate_replies, &invalid)) {
+		message = malloc(256 + strlen(invalid));
+		snprintf(message, 256 + strlen(invalid), "send_package: data corruption: %s", invalid);
+		free(invalid);
+		return mongo_reply_stream_fail(stream, error_message, message);
+	}
+
+	stream->returned++;
+	return 1;
+}
+
+int mongo_reply_stream_free(mongo_reply_stream *stream)
+{
+	mongo_reply_chunk *chunk, *next;
+	int                complete = !stream->failed && stream->remaining == 0;
+
+	for (chunk = stream->first; chunk; chunk = next) {
+		next = chunk->next;
+		mongo_buffer_free(chunk->data);
+		free(chunk);
+	}
+	free(stream);
+
+	return complete;
+}
+
+/*
+ * Local variables:
+ * tab-width: 4
+ * c-basic-offset: 4
+ * End:
+ * vim600: fdm=marker
+ * vim: noet sw=4 ts=4
+ */
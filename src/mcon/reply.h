@@ -0,0 +1,107 @@
+/**
+ *  Copyright 2009-2014 MongoDB, Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+#ifndef __MCON_REPLY_H__
+#define __MCON_REPLY_H__
+
+#include "types.h"
+#include <stdint.h>
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+/* Where the documents of a streamed reply are read to: a chunk holds as many
+ * whole documents as fit, and a document that doesn't fit in what is left
+ * goes into a new one, at least as large as the document. */
+#define MONGO_REPLY_CHUNK_SIZE (256 * 1024)
+
+typedef struct _mongo_reply_chunk
+{
+	char                      *data; /* From mongo_buffer_alloc() */
+	int                        size;
+	int                        used;
+	struct _mongo_reply_chunk *next;
+} mongo_reply_chunk;
+
+/* A reply whose documents are handed out one by one as they arrive, rather
+ * than after the whole body has been read into one buffer as with
+ * mongo_connection_read_reply(). The caller decodes a document while the
+ * next ones are still on their way, and large batches never need one
+ * allocation of their size.
+ *
+ * Unless keep is set, a document is only good until the next call to
+ * mongo_reply_stream_next(), and its chunk is reused, so that a reply takes
+ * up no more memory than its largest document, or a chunk. With keep, the
+ * documents stay where they are until the stream is freed. */
+typedef struct _mongo_reply_stream
+{
+	mongo_con_manager    *manager;
+	mongo_connection     *con;
+	mongo_server_options *options;
+	int64_t               deadline;
+	int                   keep;
+
+	/* From the header */
+	int32_t               response_to;
+	int32_t               flags;
+	int64_t               cursor_id;
+	int32_t               starting_from;
+	int32_t               number_returned;
+
+	int                   remaining; /* Bytes of the body that haven't been read */
+	int                   returned;  /* Documents handed out */
+	int                   failed;    /* Whether the socket can't be used any more */
+
+	mongo_reply_chunk    *first;
+	mongo_reply_chunk    *last;
+	int                   held;      /* Bytes in chunks */
+	int                   peak;      /* The most bytes there were in chunks at once */
+} mongo_reply_stream;
+
+/* Reads the header of the next reply on con, whose socket the caller has to
+ * have to itself (not a multiplexed one), by deadline. Returns what
+ * mongo_connection_read_reply() does, and on success sets *stream, which has
+ * to be freed with mongo_reply_stream_free(). A reply that reports a query
+ * failure is read completely, and 0 returned, with its $err in
+ * *error_message. */
+int mongo_reply_stream_open(mongo_con_manager *manager, mongo_connection *con, mongo_server_options *options, int64_t deadline, int keep, mongo_reply_stream **stream, char **error_message);
+
+/* Waits for the next document, and sets *document to it once it has arrived
+ * completely. Returns 1 if there was one, 0 at the end of the reply, and -1
+ * if it couldn't be read, in which case *error_message is set and must be
+ * free()d. Documents are checked with the manager's validate_replies flags
+ * before they are handed out. */
+int mongo_reply_stream_next(mongo_reply_stream *stream, char **document, char **error_message);
+
+/* Frees the stream and its chunks. Returns 1 if the whole reply was read,
+ * and 0 if it wasn't, or reading it failed, in which case the socket must be
+ * checked in as broken, as the rest of the reply is still on it. */
+int mongo_reply_stream_free(mongo_reply_stream *stream);
+
+#if defined(__cplusplus)
+}
+#endif
+
+#endif
+
+/*
+ * Local variables:
+ * tab-width: 4
+ * c-basic-offset: 4
+ * End:
+ * vim600: fdm=marker
+ * vim: noet sw=4 ts=4
+ */
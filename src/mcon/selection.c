@@ -0,0 +1,291 @@
+/**
+ *  Copyright 2009-2014 MongoDB, Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "types.h"
+#include "selection.h"
+#include "manager.h"
+#include "connections.h"
+#include "collection.h"
+#include "read_preference.h"
+#include "utils.h"
+
+/* Selecting a server filters all known connections by type, replica set name
+ * or seed list, credentials and tags, sorts them, and cuts them off at the
+ * latency window, which allocates a new collection at every step. The outcome
+ * only changes when the topology does, or when the ping times that it is
+ * based on are refreshed. It is therefore cached for every combination of
+ * "servers" and read preference, so that most selections are a lookup and a
+ * random pick. Entries made for an older topology version, or that are older
+ * than the ping interval, are selected again. */
+
+static int mongo_selection_string_equal(const char *a, const char *b)
+{
+	if (!a || !b) {
+		return a == b;
+	}
+	return strcmp(a, b) == 0;
+}
+
+static int mongo_selection_rp_equal(mongo_read_preference *a, mongo_read_preference *b)
+{
+	int i, j;
+
+	if (a->type != b->type || a->tagset_count != b->tagset_count) {
+		return 0;
+	}
+	for (i = 0; i < a->tagset_count; i++) {
+		if (a->tagsets[i]->tag_count != b->tagsets[i]->tag_count) {
+			return 0;
+		}
+		for (j = 0; j < a->tagsets[i]->tag_count; j++) {
+			if (strcmp(a->tagsets[i]->tags[j], b->tagsets[i]->tags[j]) != 0) {
+				return 0;
+			}
+		}
+	}
+
+	return 1;
+}
+
+static uint64_t mongo_selection_digest_rp(uint64_t digest, mongo_read_preference *rp)
+{
+	int i, j;
+
+	digest = mongo_digest_update(digest, &rp->type, sizeof(rp->type));
+	for (i = 0; i < rp->tagset_count; i++) {
+		for (j = 0; j < rp->tagsets[i]->tag_count; j++) {
+			digest = mongo_digest_update(digest, rp->tagsets[i]->tags[j], strlen(rp->tagsets[i]->tags[j]) + 1);
+		}
+		digest = mongo_digest_update(digest, "|", 1);
+	}
+
+	return digest;
+}
+
+/* Fills in the fields that identify an entry. The key only borrows the
+ * strings and read preferences, so building one doesn't allocate. */
+static void mongo_selection_init_key(mongo_selection *key, mongo_servers *servers, mongo_read_preference *filter_rp)
+{
+	uint64_t digest = MONGO_DIGEST_INIT;
+	int      i;
+
+	memset(key, 0, sizeof(mongo_selection));
+	key->con_type = servers->options.con_type;
+	key->latency_ms = servers->options.secondaryAcceptableLatencyMS;
+	key->repl_set_name = servers->options.repl_set_name;
+	key->server_count = servers->count;
+	for (i = 0; i < servers->count; i++) {
+		key->servers[i] = mongo_server_def_id(servers->server[i]);
+	}
+	key->filter_rp = *filter_rp;
+	key->rp = servers->read_pref;
+
+	digest = mongo_digest_update(digest, &key->con_type, sizeof(key->con_type));
+	digest = mongo_digest_update(digest, &key->latency_ms, sizeof(key->latency_ms));
+	if (key->repl_set_name) {
+		digest = mongo_digest_update(digest, key->repl_set_name, strlen(key->repl_set_name) + 1);
+	}
+	digest = mongo_digest_update(digest, key->servers, key->server_count * sizeof(mongo_server_id*));
+	digest = mongo_selection_digest_rp(digest, &key->filter_rp);
+	digest = mongo_selection_digest_rp(digest, &key->rp);
+	key->key = digest;
+}
+
+static int mongo_selection_matches(mongo_selection *selection, mongo_selection *key)
+{
+	return
+		selection->key == key->key &&
+		selection->con_type == key->con_type &&
+		selection->latency_ms == key->latency_ms &&
+		selection->server_count == key->server_count &&
+		memcmp(selection->servers, key->servers, key->server_count * sizeof(mongo_server_id*)) == 0 &&
+		mongo_selection_string_equal(selection->repl_set_name, key->repl_set_name) &&
+		mongo_selection_rp_equal(&selection->filter_rp, &key->filter_rp) &&
+		mongo_selection_rp_equal(&selection->rp, &key->rp);
+}
+
+static void mongo_selection_free(mongo_con_manager *manager, mongo_selection *selection)
+{
+	int i;
+
+	for (i = 0; i < selection->count; i++) {
+		mongo_connection_release(manager, selection->nearest[i], MONGO_CLOSE_BROKEN);
+	}
+	free(selection->nearest);
+	free(selection->repl_set_name);
+	mongo_read_preference_dtor(&selection->filter_rp);
+	mongo_read_preference_dtor(&selection->rp);
+	free(selection);
+}
+
+/* Runs the full selection, see mongo_find_candidate_servers() and friends */
+static mongo_selection *mongo_selection_create(mongo_con_manager *manager, mongo_servers *servers, mongo_selection *key, int64_t topology_version, time_t now)
+{
+	mongo_selection *selection;
+	mcon_collection *col;
+	int              i;
+
+	selection = (mongo_selection *)malloc(sizeof(mongo_selection));
+	memcpy(selection, key, sizeof(mongo_selection));
+	selection->repl_set_name = key->repl_set_name ? strdup(key->repl_set_name) : NULL;
+	mongo_read_preference_copy(&key->filter_rp, &selection->filter_rp);
+	mongo_read_preference_copy(&key->rp, &selection->rp);
+	selection->topology_version = topology_version;
+	selection->expires = now + manager->ping_interval;
+
+	col = mongo_find_candidate_servers(manager, &key->filter_rp, servers);
+	if (col && col->count) {
+		selection->candidate_count = col->count;
+		if (mongo_sort_servers(manager, col, &servers->read_pref)) {
+			col = mongo_select_nearest_servers(manager, col, &servers->options, &servers->read_pref);
+		} else {
+			mcon_collection_free(col);
+			col = NULL;
+		}
+	}
+	if (col) {
+		selection->count = col->count;
+		selection->nearest = (mongo_connection **)malloc(col->count * sizeof(mongo_connection*));
+		for (i = 0; i < col->count; i++) {
+			selection->nearest[i] = (mongo_connection *)col->data[i];
+			mongo_connection_addref(selection->nearest[i]);
+		}
+		mcon_collection_free(col);
+	}
+
+	return selection;
+}
+
+static mongo_connection *mongo_selection_pick(mongo_con_manager *manager, mongo_selection *selection)
+{
+	mcon_collection   col;
+	mongo_connection *con;
+
+	if (!selection->count) {
+		return NULL;
+	}
+
+	/* Wraps the array without copying it */
+	col.count = col.space = selection->count;
+	col.data_size = sizeof(mongo_connection*);
+	col.data = (void **)selection->nearest;
+
+	con = mongo_pick_server_from_set(manager, &col, &selection->rp);
+	mongo_manager_pin_connection(con);
+
+	return con;
+}
+
+void mongo_selection_init(mongo_con_manager *manager)
+{
+	manager->selection_cache = (mongo_selection_cache *)calloc(1, sizeof(mongo_selection_cache));
+	pthread_rwlock_init(&manager->selection_cache->lock, NULL);
+}
+
+void mongo_selection_deinit(mongo_con_manager *manager)
+{
+	mongo_selection_cache *cache = manager->selection_cache;
+	int                    i;
+
+	for (i = 0; i < MONGO_SELECTION_CACHE_SIZE; i++) {
+		if (cache->entries[i]) {
+			mongo_selection_free(manager, cache->entries[i]);
+		}
+	}
+	pthread_rwlock_destroy(&cache->lock);
+	free(cache);
+	manager->selection_cache = NULL;
+}
+
+mongo_connection *mongo_select_server(mongo_con_manager *manager, mongo_servers *servers, mongo_read_preference *filter_rp, int *candidate_count)
+{
+	mongo_selection_cache *cache = manager->selection_cache;
+	mongo_selection        key, *selection, *replaced;
+	mongo_connection      *con = NULL;
+	int64_t                topology_version = manager->topology_version;
+	time_t                 now = time(NULL);
+	int                    i;
+
+	mongo_selection_init_key(&key, servers, filter_rp);
+
+	if (manager->memoize_selection) {
+		pthread_rwlock_rdlock(&cache->lock);
+		for (i = 0; i < MONGO_SELECTION_CACHE_SIZE; i++) {
+			selection = cache->entries[i];
+			if (
+				selection &&
+				selection->topology_version == topology_version &&
+				now < selection->expires &&
+				mongo_selection_matches(selection, &key)
+			) {
+				*candidate_count = selection->candidate_count;
+				con = mongo_selection_pick(manager, selection);
+				break;
+			}
+		}
+		pthread_rwlock_unlock(&cache->lock);
+
+		if (i < MONGO_SELECTION_CACHE_SIZE) {
+			return con;
+		}
+	}
+
+	/* The topology version is read before selecting, so that a change while
+	 * we select makes the entry stale rather than wrong */
+	selection = mongo_selection_create(manager, servers, &key, topology_version, now);
+	*candidate_count = selection->candidate_count;
+	con = mongo_selection_pick(manager, selection);
+
+	if (!manager->memoize_selection || selection->expires <= now) {
+		mongo_selection_free(manager, selection);
+		return con;
+	}
+
+	/* Replace the stale entry for the same key, if there is one, or else the
+	 * entries in turn */
+	pthread_rwlock_wrlock(&cache->lock);
+	for (i = 0; i < MONGO_SELECTION_CACHE_SIZE; i++) {
+		if (cache->entries[i] && mongo_selection_matches(cache->entries[i], &key)) {
+			break;
+		}
+	}
+	if (i == MONGO_SELECTION_CACHE_SIZE) {
+		i = cache->next;
+		cache->next = (cache->next + 1) % MONGO_SELECTION_CACHE_SIZE;
+	}
+	replaced = cache->entries[i];
+	cache->entries[i] = selection;
+	cache->misses++;
+	pthread_rwlock_unlock(&cache->lock);
+
+	if (replaced) {
+		mongo_selection_free(manager, replaced);
+	}
+
+	return con;
+}
+
+/*
+ * Local variables:
+ * tab-width: 4
+ * c-basic-offset: 4
+ * End:
+ * vim600: fdm=marker
+ * vim: noet sw=4 ts=4
+ */
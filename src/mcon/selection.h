@@ -0,0 +1,77 @@
+/**
+ *  Copyright 2009-2014 MongoDB, Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+#ifndef __MCON_SELECTION_H__
+#define __MCON_SELECTION_H__
+
+#include "types.h"
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+#define MONGO_SELECTION_CACHE_SIZE 16
+
+/* The servers that a connection can be picked from, for one combination of
+ * seed list, credentials, options and read preference */
+typedef struct _mongo_selection
+{
+	uint64_t               key;              /* Digest of the fields below, to skip entries quickly */
+	int                    con_type;
+	int                    latency_ms;       /* secondaryAcceptableLatencyMS */
+	char                  *repl_set_name;
+	int                    server_count;
+	mongo_server_id       *servers[MAX_SERVERS_LIMIT];
+	mongo_read_preference  filter_rp;        /* Which servers are candidates */
+	mongo_read_preference  rp;               /* How the candidates are sorted and picked from */
+
+	int64_t                topology_version; /* The topology the servers were selected from */
+	time_t                 expires;          /* The ping times that the selection is based on are refreshed every ping_interval */
+	int                    candidate_count;
+	int                    count;
+	mongo_connection     **nearest;          /* Each holds a reference */
+} mongo_selection;
+
+typedef struct _mongo_selection_cache
+{
+	pthread_rwlock_t  lock;
+	mongo_selection  *entries[MONGO_SELECTION_CACHE_SIZE];
+	int               next;                  /* The entry to replace next */
+	int64_t           misses;                /* Number of times the servers were selected again */
+} mongo_selection_cache;
+
+void mongo_selection_init(mongo_con_manager *manager);
+void mongo_selection_deinit(mongo_con_manager *manager);
+
+/* Picks a server for filter_rp (which decides on the candidates) and the
+ * read preference of "servers" (which decides how to pick from them). The
+ * connection is pinned. On failure, *candidate_count tells whether there
+ * were no candidates at all, or whether none of them was near enough. */
+mongo_connection *mongo_select_server(mongo_con_manager *manager, mongo_servers *servers, mongo_read_preference *filter_rp, int *candidate_count);
+
+#if defined(__cplusplus)
+}
+#endif
+
+#endif
+
+/*
+ * Local variables:
+ * tab-width: 4
+ * c-basic-offset: 4
+ * End:
+ * vim600: fdm=marker
+ * vim: noet sw=4 ts=4
+ */
@@ -19,8 +19,28 @@
 #include <string.h>
 
 #include "str.h"
+#include "buffer.h"
 #include "types.h"
 
+/* Grows geometrically, so that building a large string takes a logarithmic
+ * number of reallocations rather than one per MCON_STR_PREALLOC bytes */
+static void mcon_str_grow(mcon_str *xs, int size)
+{
+	int a = xs->a ? xs->a * 2 : MCON_STR_PREALLOC;
+
+	while (a < size) {
+		a *= 2;
+	}
+
+	if (xs->p) {
+		xs->d = mongo_buffer_realloc(xs->d, a);
+		xs->a = mongo_buffer_size(xs->d);
+	} else {
+		xs->d = realloc(xs->d, a);
+		xs->a = a;
+	}
+}
+
 void mcon_str_add(mcon_str *xs, char *str, int f)
 {
 	mcon_str_addl(xs, str, strlen(str), f);
@@ -29,8 +49,7 @@ void mcon_str_add(mcon_str *xs, char *str, int f)
 void mcon_str_addl(mcon_str *xs, char *str, int le, int f)
 {
 	if (xs->l + le > xs->a - 1) {
-		xs->d = realloc(xs->d, xs->a + le + MCON_STR_PREALLOC);
-		xs->a = xs->a + le + MCON_STR_PREALLOC;
+		mcon_str_grow(xs, xs->l + le + 1);
 	}
 	if (!xs->l) {
 		xs->d[0] = '\0';
@@ -54,7 +73,9 @@ void mcon_str_add_int(mcon_str *xs, int i)
 
 void mcon_str_free(mcon_str *s)
 {
-	if (s->d) {
+	if (s->p) {
+		mongo_buffer_free(s->d);
+	} else if (s->d) {
 		free(s->d);
 	}
 }
@@ -20,15 +20,19 @@
 extern "C" {
 #endif
 
+/* The smallest allocation; after that, strings double in size */
 #define MCON_STR_PREALLOC 1024
-#define mcon_str_ptr_init(str) str = (mcon_str *)malloc(sizeof(mcon_str)); str->l = 0; str->a = 0; str->d = NULL;
-#define mcon_str_ptr_dtor(str) free(str->d); free(str)
-#define mcon_str_dtor(str)     free(str.d)
+#define mcon_str_ptr_init(str) str = (mcon_str *)malloc(sizeof(mcon_str)); str->l = 0; str->a = 0; str->d = NULL; str->p = 0;
+/* For packets, whose buffers are recycled, see buffer.h */
+#define mcon_str_ptr_init_pooled(str) mcon_str_ptr_init(str); str->p = 1;
+#define mcon_str_ptr_dtor(str) mcon_str_free(str); free(str)
+#define mcon_str_dtor(str)     mcon_str_free(&str)
 
 typedef struct mcon_str {
 	int   l;
 	int   a;
 	char *d;
+	int   p;  /* Whether d comes from mongo_buffer_alloc() */
 } mcon_str;
 
 void mcon_str_add(mcon_str *xs, char *str, int f);
@@ -0,0 +1,258 @@
+/**
+ *  Copyright 2009-2014 MongoDB, Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+#include <stdlib.h>
+#include <string.h>
+
+#include "types.h"
+#include "table.h"
+
+#define MCON_TABLE_INITIAL_SPACE 16
+
+#define MCON_TABLE_EMPTY     0
+#define MCON_TABLE_USED      1
+#define MCON_TABLE_TOMBSTONE 2
+
+/* An open addressing (linear probing) table which maps the 64-bit server key
+ * onto the connection or blacklist item. The full hash string is kept next to
+ * the key, and only compared once the keys match, so that a collision on the
+ * 64-bit key can never return the wrong connection. Duplicate entries are
+ * allowed, just like they were with the linked list this replaces: lookups
+ * and removals act on the first entry in probe order. */
+mcon_table *mcon_table_init(void)
+{
+	mcon_table *t;
+
+	t = malloc(sizeof(mcon_table));
+	t->count = 0;
+	t->used = 0;
+	t->space = MCON_TABLE_INITIAL_SPACE;
+	t->items = calloc(t->space, sizeof(mongo_con_manager_item));
+
+	return t;
+}
+
+static void mcon_table_resize(mcon_table *t, int space)
+{
+	mongo_con_manager_item *old_items = t->items;
+	int                     old_space = t->space;
+	int                     i, j;
+
+	t->items = calloc(space, sizeof(mongo_con_manager_item));
+	t->space = space;
+	t->used = t->count;
+
+	for (i = 0; i < old_space; i++) {
+		if (old_items[i].state != MCON_TABLE_USED) {
+			continue;
+		}
+		j = old_items[i].key & (space - 1);
+		while (t->items[j].state != MCON_TABLE_EMPTY) {
+			j = (j + 1) & (space - 1);
+		}
+		t->items[j] = old_items[i];
+	}
+
+	free(old_items);
+}
+
+/* Finds the first entry for hash, or if data is not NULL, the entry for hash
+ * which points to exactly that data */
+static int mcon_table_find_position(mcon_table *t, uint64_t key, char *hash, void *data)
+{
+	int i = key & (t->space - 1);
+
+	while (t->items[i].state != MCON_TABLE_EMPTY) {
+		if (
+			t->items[i].state == MCON_TABLE_USED &&
+			t->items[i].key == key &&
+			(data == NULL || t->items[i].data == data) &&
+			strcmp(t->items[i].hash, hash) == 0
+		) {
+			return i;
+		}
+		i = (i + 1) & (t->space - 1);
+	}
+	return -1;
+}
+
+void *mcon_table_find(mcon_table *t, uint64_t key, char *hash)
+{
+	int i = mcon_table_find_position(t, key, hash, NULL);
+
+	return i == -1 ? NULL : t->items[i].data;
+}
+
+void mcon_table_add(mcon_table *t, uint64_t key, char *hash, void *data)
+{
+	int i;
+
+	/* Keep the load factor (including tombstones) under 3/4. If most of the
+	 * used slots are tombstones, rehashing at the same size is enough. */
+	if ((t->used + 1) * 4 > t->space * 3) {
+		mcon_table_resize(t, (t->count + 1) * 2 > t->space ? t->space * 2 : t->space);
+	}
+
+	i = key & (t->space - 1);
+	while (t->items[i].state == MCON_TABLE_USED) {
+		i = (i + 1) & (t->space - 1);
+	}
+	if (t->items[i].state == MCON_TABLE_EMPTY) {
+		t->used++;
+	}
+
+	t->items[i].state = MCON_TABLE_USED;
+	t->items[i].key = key;
+	t->items[i].hash = strdup(hash);
+	t->items[i].data = data;
+	t->count++;
+}
+
+/* Removes the first entry for hash, or the entry pointing to data if it is not
+ * NULL. Returns the data of the removed entry, or NULL if there was none. */
+void *mcon_table_remove(mcon_table *t, uint64_t key, char *hash, void *data)
+{
+	int i = mcon_table_find_position(t, key, hash, data);
+
+	if (i == -1) {
+		return NULL;
+	}
+
+	data = t->items[i].data;
+	free(t->items[i].hash);
+	t->items[i].hash = NULL;
+	t->items[i].data = NULL;
+	t->items[i].state = MCON_TABLE_TOMBSTONE;
+	t->count--;
+
+	return data;
+}
+
+/* Iterates over all the items. *position needs to be initialized to 0, and
+ * NULL is returned once all items have been returned. */
+mongo_con_manager_item *mcon_table_next(mcon_table *t, int *position)
+{
+	while (*position < t->space) {
+		mongo_con_manager_item *item = &t->items[*position];
+
+		(*position)++;
+		if (item->state == MCON_TABLE_USED) {
+			return item;
+		}
+	}
+	return NULL;
+}
+
+void mcon_table_free(mcon_table *t)
+{
+	int i;
+
+	for (i = 0; i < t->space; i++) {
+		if (t->items[i].state == MCON_TABLE_USED) {
+			free(t->items[i].hash);
+		}
+	}
+	free(t->items);
+	free(t);
+}
+
+/* The registry spreads the entries over MCON_REGISTRY_SHARDS tables, each
+ * protected by its own mutex. The shard is picked from the high bits of the
+ * key, as the low bits are used to find the slot within the shard's table. */
+#define MCON_REGISTRY_SHARD(r, key) (&(r)->shard[((key) >> 32) % MCON_REGISTRY_SHARDS])
+
+mcon_registry *mcon_registry_init(void)
+{
+	mcon_registry *r;
+	int            i;
+
+	r = malloc(sizeof(mcon_registry));
+	for (i = 0; i < MCON_REGISTRY_SHARDS; i++) {
+		pthread_mutex_init(&r->shard[i].lock, NULL);
+		r->shard[i].table = mcon_table_init();
+	}
+
+	return r;
+}
+
+/* Returns the data stored for hash. If visit is passed, it is called with the
+ * data while the shard is still locked, so that the caller can take a
+ * reference before another thread gets a chance to remove it. */
+void *mcon_registry_find(mcon_registry *r, uint64_t key, char *hash, mcon_registry_visit_t visit, void *context)
+{
+	void *data;
+
+	pthread_mutex_lock(&MCON_REGISTRY_SHARD(r, key)->lock);
+	data = mcon_table_find(MCON_REGISTRY_SHARD(r, key)->table, key, hash);
+	if (data && visit) {
+		visit(hash, data, context);
+	}
+	pthread_mutex_unlock(&MCON_REGISTRY_SHARD(r, key)->lock);
+
+	return data;
+}
+
+void mcon_registry_add(mcon_registry *r, uint64_t key, char *hash, void *data)
+{
+	pthread_mutex_lock(&MCON_REGISTRY_SHARD(r, key)->lock);
+	mcon_table_add(MCON_REGISTRY_SHARD(r, key)->table, key, hash, data);
+	pthread_mutex_unlock(&MCON_REGISTRY_SHARD(r, key)->lock);
+}
+
+void *mcon_registry_remove(mcon_registry *r, uint64_t key, char *hash, void *data)
+{
+	pthread_mutex_lock(&MCON_REGISTRY_SHARD(r, key)->lock);
+	data = mcon_table_remove(MCON_REGISTRY_SHARD(r, key)->table, key, hash, data);
+	pthread_mutex_unlock(&MCON_REGISTRY_SHARD(r, key)->lock);
+
+	return data;
+}
+
+/* Calls visit for every entry. Each shard is locked while its entries are
+ * visited, so visit must not call back into the registry. */
+void mcon_registry_apply(mcon_registry *r, mcon_registry_visit_t visit, void *context)
+{
+	mongo_con_manager_item *item;
+	int                     i, position;
+
+	for (i = 0; i < MCON_REGISTRY_SHARDS; i++) {
+		pthread_mutex_lock(&r->shard[i].lock);
+		position = 0;
+		while ((item = mcon_table_next(r->shard[i].table, &position))) {
+			visit(item->hash, item->data, context);
+		}
+		pthread_mutex_unlock(&r->shard[i].lock);
+	}
+}
+
+void mcon_registry_free(mcon_registry *r)
+{
+	int i;
+
+	for (i = 0; i < MCON_REGISTRY_SHARDS; i++) {
+		mcon_table_free(r->shard[i].table);
+		pthread_mutex_destroy(&r->shard[i].lock);
+	}
+	free(r);
+}
+
+/*
+ * Local variables:
+ * tab-width: 4
+ * c-basic-offset: 4
+ * End:
+ * vim600: fdm=marker
+ * vim: noet sw=4 ts=4
+ */
@@ -0,0 +1,54 @@
+/**
+ *  Copyright 2009-2014 MongoDB, Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+#ifndef __MCON_TABLE_H__
+#define __MCON_TABLE_H__
+
+#include "types.h"
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+mcon_table *mcon_table_init(void);
+void *mcon_table_find(mcon_table *t, uint64_t key, char *hash);
+void mcon_table_add(mcon_table *t, uint64_t key, char *hash, void *data);
+void *mcon_table_remove(mcon_table *t, uint64_t key, char *hash, void *data);
+mongo_con_manager_item *mcon_table_next(mcon_table *t, int *position);
+void mcon_table_free(mcon_table *t);
+
+typedef void (*mcon_registry_visit_t)(char *hash, void *data, void *context);
+
+mcon_registry *mcon_registry_init(void);
+void *mcon_registry_find(mcon_registry *r, uint64_t key, char *hash, mcon_registry_visit_t visit, void *context);
+void mcon_registry_add(mcon_registry *r, uint64_t key, char *hash, void *data);
+void *mcon_registry_remove(mcon_registry *r, uint64_t key, char *hash, void *data);
+void mcon_registry_apply(mcon_registry *r, mcon_registry_visit_t visit, void *context);
+void mcon_registry_free(mcon_registry *r);
+
+#if defined(__cplusplus)
+}
+#endif
+
+#endif
+
+/*
+ * Local variables:
+ * tab-width: 4
+ * c-basic-offset: 4
+ * End:
+ * vim600: fdm=marker
+ * vim: noet sw=4 ts=4
+ */
@@ -0,0 +1,182 @@
+#include "manager.h"
+#include "connections.h"
+#include "parse.h"
+#include "packet.h"
+#include "async.h"
+#include "buffer.h"
+#include "bson_helpers.h"
+#include "mini_bson.h"
+#include "types.h"
+#include "mock-server.h"
+#include "check.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/time.h>
+
+#define OPERATIONS 8
+#define RTT_MS     50
+
+/* Hands operations to the async threads, the way the wait handles of the
+ * gen* methods do, and checks that they overlap, that every callback is
+ * called once, and that queued operations fail when the manager goes. */
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  finished_cond = PTHREAD_COND_INITIALIZER;
+static int             finished = 0, succeeded = 0, called[OPERATIONS];
+
+static void wait_for_all(void)
+{
+	pthread_mutex_lock(&lock);
+	while (finished < OPERATIONS) {
+		pthread_cond_wait(&finished_cond, &lock);
+	}
+	pthread_mutex_unlock(&lock);
+}
+
+/* { buildinfo: 1 } in an OP_QUERY on admin.$cmd */
+static mongo_packet *create_packet(void)
+{
+	mongo_packet *packet;
+	int           doc_offset;
+
+	packet = mongo_packet_create(2004);
+	mcon_serialize_int(packet->str, 0); /* Flags */
+	mcon_str_addl(packet->str, "admin.$cmd", 11, 0);
+	mcon_serialize_int(packet->str, 0); /* Number to skip */
+	mcon_serialize_int(packet->str, -1); /* Number to return */
+
+	doc_offset = packet->str->l;
+	mcon_serialize_int(packet->str, 0);
+	mcon_str_addl(packet->str, "\x10" "buildinfo", 11, 0);
+	mcon_serialize_int32(packet->str, 1);
+	mcon_str_addl(packet->str, "\x00", 1, 0);
+	mongo_packet_patch_int32(packet, doc_offset, packet->str->l - doc_offset);
+
+	return packet;
+}
+
+static void callback(void *context, int retval, char *data_buffer, char *error_message)
+{
+	int i = (int)(long)context;
+
+	pthread_mutex_lock(&lock);
+	called[i]++;
+	finished++;
+	if (retval) {
+		succeeded++;
+		mongo_buffer_free(data_buffer);
+	} else {
+		free(error_message);
+	}
+	pthread_cond_signal(&finished_cond);
+	pthread_mutex_unlock(&lock);
+}
+
+/* Submits OPERATIONS operations with the given budget (or 0), and returns
+ * how many were queued */
+static int submit_all(mongo_con_manager *manager, mongo_connection *con, int budget_ms)
+{
+	mongo_packet *packet;
+	char         *error_message = NULL;
+	int           i, queued = 0;
+
+	finished = succeeded = 0;
+	memset(called, 0, sizeof(called));
+	for (i = 0; i < OPERATIONS; i++) {
+		packet = create_packet();
+		if (mongo_async_submit(manager, con, packet, budget_ms, callback, (void *)(long)i, &error_message)) {
+			queued++;
+		} else {
+			printf("submit failed: %s\n", error_message);
+			free(error_message);
+			mongo_packet_dtor(packet);
+		}
+	}
+	return queued;
+}
+
+int main(void)
+{
+	mongo_con_manager *manager;
+	mongo_servers     *servers;
+	mongo_connection  *con, *found;
+	mock_server        server;
+	struct timeval     start;
+	char              *error_message = NULL;
+	char               dsn[64];
+	long               elapsed;
+	int                i, once, failed = 0;
+
+	memset(&server, 0, sizeof(server));
+	if (!mock_server_start(&server)) {
+		printf("Couldn't start the mock server\n");
+		return 1;
+	}
+	snprintf(dsn, sizeof(dsn), "mongodb://127.0.0.1:%d", server.port);
+
+	manager = mongo_init();
+	manager->authenticate = mongo_connection_authenticate;
+	manager->supports_wire_version = mongo_mcon_supports_wire_version;
+
+	servers = mongo_parse_init();
+	mongo_parse_server_spec(manager, servers, dsn, &error_message);
+	con = mongo_get_read_write_connection(manager, servers, MONGO_CON_FLAG_READ, &error_message);
+	if (!con) {
+		printf("Couldn't connect: %s\n", error_message);
+		return 1;
+	}
+
+	/* The submitting thread goes on while the round trips overlap */
+	server.delay_us = RTT_MS * 1000;
+	gettimeofday(&start, NULL);
+	failed += check("every operation is queued", submit_all(manager, con, 0) == OPERATIONS);
+	failed += check("without waiting for a reply", elapsed_ms(&start) < RTT_MS);
+
+	wait_for_all();
+	elapsed = elapsed_ms(&start);
+	printf("%d operations took %ldms, %dms each\n", OPERATIONS, elapsed, RTT_MS);
+
+	once = 1;
+	for (i = 0; i < OPERATIONS; i++) {
+		once &= called[i] == 1;
+	}
+	failed += check("every operation works", succeeded == OPERATIONS);
+	failed += check("every callback is called once", once);
+	failed += check("their round trips overlap", elapsed < RTT_MS * OPERATIONS / 2);
+
+	/* Operations that run out of their budget fail, on their own */
+	server.delay_us = 200000;
+	gettimeofday(&start, NULL);
+	submit_all(manager, con, 50);
+	wait_for_all();
+	elapsed = elapsed_ms(&start);
+	failed += check("operations fail when they run out of their budget", succeeded == 0 && elapsed < 150);
+	found = mongo_get_read_write_connection(manager, servers, MONGO_CON_FLAG_READ, &error_message);
+	failed += check("the server isn't marked as failed", found == con);
+	if (found) {
+		mongo_manager_connection_release(manager, found);
+	}
+
+	/* With one thread, the operations after the first are still queued when
+	 * the manager goes, and fail */
+	mongo_async_stop(manager);
+	manager->async_threads = 1;
+	server.delay_us = 200000;
+	submit_all(manager, con, 0);
+	mongo_manager_connection_release(manager, con);
+	mongo_servers_dtor(servers);
+	mongo_deinit(manager);
+
+	once = 1;
+	for (i = 0; i < OPERATIONS; i++) {
+		once &= called[i] == 1;
+	}
+	failed += check("queued operations fail when the manager goes", finished == OPERATIONS && succeeded < OPERATIONS);
+	failed += check("and their callbacks are called once as well", once);
+
+	mock_server_stop(&server);
+
+	return failed;
+}
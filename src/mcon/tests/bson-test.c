@@ -0,0 +1,126 @@
+#include "mini_bson.h"
+#include "bson_helpers.h"
+#include "str.h"
+#include "check.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+/* Writes documents with the one pass document writer, and checks them
+ * against hand made BSON, and against the readers in mini_bson.c, and
+ * checks that bson_extract_fields() finds what those do. */
+
+/* { a: 1, b: "xy", c: [ true, null, 2.5 ], d: {} } */
+static const char expected[] =
+	"\x38\x00\x00\x00"
+	"\x10" "a\x00" "\x01\x00\x00\x00"
+	"\x02" "b\x00" "\x03\x00\x00\x00" "xy\x00"
+	"\x04" "c\x00" "\x17\x00\x00\x00"
+		"\x08" "0\x00" "\x01"
+		"\x0A" "1\x00"
+		"\x01" "2\x00" "\x00\x00\x00\x00\x00\x00\x04\x40"
+		"\x00"
+	"\x03" "d\x00" "\x05\x00\x00\x00" "\x00"
+	"\x00";
+
+int main(void)
+{
+	mcon_str     *str, *ref;
+	char         *doc, *data, key[12], *b = NULL, *c = NULL, *missing = NULL;
+	int32_t       n, a = 0;
+	double        d = 0;
+	unsigned char flag = 0;
+	int           doc_offset, offset, i, ok, failed = 0;
+	bson_field    fields[] = {
+		BSON_FIELD("a", BSON_INT32, &a),
+		BSON_FIELD("b", BSON_STRING, &b),
+		BSON_FIELD("c", BSON_ARRAY, &c),
+		BSON_FIELD("bb", BSON_STRING, &missing),
+		BSON_FIELD("d", BSON_STRING, &missing),
+	};
+	bson_field    array_fields[] = {
+		BSON_FIELD("2", BSON_DOUBLE, &d),
+		BSON_FIELD("0", BSON_BOOLEAN, &flag),
+	};
+
+	mcon_str_ptr_init(str);
+	doc_offset = bson_begin_document(str);
+	bson_add_key(str, BSON_INT32, "a", 1);
+	mcon_serialize_int32(str, 1);
+	bson_add_key(str, BSON_STRING, "b", 1);
+	bson_add_string_value(str, "xy", 2);
+	bson_add_key(str, BSON_ARRAY, "c", 1);
+	offset = bson_begin_document(str);
+	bson_add_index_key(str, BSON_BOOLEAN, 0);
+	mcon_str_addl(str, "\x01", 1, 0);
+	bson_add_index_key(str, BSON_NULL, 1);
+	bson_add_index_key(str, BSON_DOUBLE, 2);
+	mcon_serialize_double(str, 2.5);
+	bson_end_document(str, offset);
+	bson_add_key(str, BSON_DOCUMENT, "d", 1);
+	bson_end_document(str, bson_begin_document(str));
+	bson_end_document(str, doc_offset);
+
+	failed += check("a document is written as BSON", str->l == sizeof(expected) - 1 && memcmp(str->d, expected, str->l) == 0);
+	mcon_str_ptr_dtor(str);
+
+	/* "bb" has the length of no field, and "d" has the wrong type */
+	doc = (char *)expected + sizeof(int32_t);
+	ok = bson_extract_fields(doc, fields, 5) == 3;
+	ok = ok && a == 1 && strcmp(b, "xy") == 0 && fields[1].length == 3 && !missing;
+	ok = ok && fields[0].found && fields[1].found && fields[2].found && !fields[3].found && !fields[4].found;
+	failed += check("fields are extracted in one pass", ok);
+	ok = bson_extract_fields(c, array_fields, 2) == 2 && d == 2.5 && flag == 1;
+	failed += check("in any order", ok);
+
+	/* The admin packets are copies of what would be built for each of them,
+	 * and fit in MONGO_ADMIN_PACKET_SIZE */
+	ok = 1;
+	for (i = 0; i < MONGO_ADMIN_COMMANDS; i++) {
+		char packet[MONGO_ADMIN_PACKET_SIZE + 1];
+
+		packet[MONGO_ADMIN_PACKET_SIZE] = 0x55;
+		ref = bson_create_admin_packet(i, 12345 + i);
+		n = bson_admin_packet(i, 12345 + i, packet);
+		ok &= n == ref->l && n <= MONGO_ADMIN_PACKET_SIZE && memcmp(packet, ref->d, n) == 0;
+		ok &= packet[MONGO_ADMIN_PACKET_SIZE] == 0x55;
+		mcon_str_ptr_dtor(ref);
+	}
+	failed += check("admin packets are the same as built ones", ok);
+
+	/* Keys from the table, and past it, are what snprintf() makes */
+	mcon_str_ptr_init(str);
+	mcon_str_ptr_init(ref);
+	for (i = 0; i < BSON_INDEX_KEYS + 500; i++) {
+		bson_add_index_key(str, BSON_INT32, i);
+		bson_add_key(ref, BSON_INT32, key, snprintf(key, sizeof(key), "%d", i));
+	}
+	failed += check("index keys are the indexes", str->l == ref->l && memcmp(str->d, ref->d, str->l) == 0);
+	mcon_str_ptr_dtor(ref);
+	mcon_str_ptr_dtor(str);
+
+	/* A document that outgrows the pooled buffer several times over, with
+	 * a nested one at the end, reads back */
+	mcon_str_ptr_init_pooled(str);
+	doc_offset = bson_begin_document(str);
+	for (i = 0; i < 50000; i++) {
+		bson_add_index_key(str, BSON_INT32, i);
+		mcon_serialize_int32(str, i);
+	}
+	bson_add_key(str, BSON_DOCUMENT, "last", 4);
+	offset = bson_begin_document(str);
+	bson_add_key(str, BSON_INT32, "n", 1);
+	mcon_serialize_int32(str, 42);
+	bson_end_document(str, offset);
+	bson_end_document(str, doc_offset);
+
+	memcpy(&n, str->d, sizeof(int32_t));
+	failed += check("the length of a large document is filled in", n == str->l);
+	doc = str->d + sizeof(int32_t);
+	ok = bson_find_field_as_int32(doc, "49999", &n) && n == 49999;
+	ok = ok && bson_find_field_as_document(doc, "last", &data) && bson_find_field_as_int32(data, "n", &n) && n == 42;
+	failed += check("and its fields read back", ok);
+	mcon_str_ptr_dtor(str);
+
+	return failed;
+}
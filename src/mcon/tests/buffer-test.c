@@ -0,0 +1,60 @@
+#include "buffer.h"
+#include "str.h"
+#include "check.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+/* Checks that strings grow geometrically, and that the buffers that packets
+ * and replies use are recycled within the limits of the pool. */
+
+int main(void)
+{
+	mcon_str *str;
+	char      chunk[100];
+	char     *buffer, *again;
+	int64_t   allocated, reused, allocated_before, reused_before;
+	int       i, grown = 0, last_a = 0, failed = 0;
+
+	/* Building a 1MB string */
+	memset(chunk, 'x', sizeof(chunk));
+	mcon_str_ptr_init(str);
+	for (i = 0; i < 10486; i++) {
+		mcon_str_addl(str, chunk, sizeof(chunk), 0);
+		if (str->a != last_a) {
+			grown++;
+			last_a = str->a;
+		}
+	}
+	printf("grew %d times to %d bytes\n", grown, str->a);
+	failed += check("a 1MB string is grown a dozen times, not a thousand", grown <= 12);
+	failed += check("the string is intact", str->l == 1048600 && str->d[str->l - 1] == 'x' && str->d[str->l] == '\0');
+	mcon_str_ptr_dtor(str);
+
+	/* A freed buffer is handed out again */
+	buffer = mongo_buffer_alloc(3000);
+	failed += check("buffer sizes are rounded up to a power of two", mongo_buffer_size(buffer) == 4096);
+	mongo_buffer_free(buffer);
+	mongo_buffer_stats(&allocated_before, &reused_before);
+	again = mongo_buffer_alloc(4000);
+	mongo_buffer_stats(&allocated, &reused);
+	failed += check("a pooled buffer that is large enough is reused", again == buffer && allocated == allocated_before && reused == reused_before + 1);
+	mongo_buffer_free(again);
+
+	/* Pooled strings give their buffer back */
+	mcon_str_ptr_init_pooled(str);
+	mcon_str_addl(str, chunk, sizeof(chunk), 0);
+	failed += check("a packet takes its buffer from the pool", str->d == buffer);
+	mcon_str_ptr_dtor(str);
+
+	/* But the pool doesn't keep more than it should */
+	buffer = mongo_buffer_alloc(MONGO_BUFFER_POOL_RETAIN + 1);
+	mongo_buffer_free(buffer);
+	mongo_buffer_stats(&allocated_before, &reused_before);
+	buffer = mongo_buffer_alloc(MONGO_BUFFER_POOL_RETAIN + 1);
+	mongo_buffer_stats(&allocated, &reused);
+	failed += check("a buffer larger than the pool's limit isn't kept", allocated == allocated_before + 1);
+	mongo_buffer_free(buffer);
+
+	return failed;
+}
@@ -0,0 +1,23 @@
+#ifndef __MCON_TESTS_CHECK_H__
+#define __MCON_TESTS_CHECK_H__
+
+#include <stdio.h>
+#include <sys/time.h>
+
+/* Prints the outcome of a check, and returns 1 if it failed, so that main()
+ * can add them up into its exit code */
+static inline int check(const char *what, int ok)
+{
+	printf("%-60s %s\n", what, ok ? "OK" : "FAILED");
+	return ok ? 0 : 1;
+}
+
+static inline long elapsed_ms(struct timeval *start)
+{
+	struct timeval end;
+
+	gettimeofday(&end, NULL);
+	return (end.tv_sec - start->tv_sec) * 1000 + (end.tv_usec - start->tv_usec) / 1000;
+}
+
+#endif
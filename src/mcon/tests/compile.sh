@@ -1,7 +1,7 @@
 #!/bin/bash
 
-FLAGS="-Wall -ggdb3 -O0 -I.."
-FILES="../bson_helpers.c ../collection.c ../connections.c ../manager.c ../mini_bson.c ../parse.c ../read_preference.c ../str.c ../utils.c ../io.c"
+FLAGS="-Wall -ggdb3 -O0 -pthread -I.."
+FILES="../bson_helpers.c ../buffer.c ../packet.c ../mux.c ../async.c ../multi.c ../collection.c ../connections.c ../manager.c ../mini_bson.c ../intern.c ../bson_validate.c ../parse.c ../pool.c ../read_preference.c ../reply.c ../str.c ../table.c ../topology.c ../monitor.c ../selection.c ../io.c ../utils.c ../contrib/md5.c ../contrib/strndup.c"
 
 gcc $FLAGS -o sc-test1 simplecon-test.c $FILES
 gcc $FLAGS -o rc-test1 replicacon-test.c $FILES
@@ -12,3 +12,28 @@ gcc $FLAGS -o parse-test1 parse-test.c $FILES
 gcc $FLAGS -o parse-test2 parse-test2.c $FILES
 gcc $FLAGS -o shc-test1 shardcon-test.c $FILES
 gcc $FLAGS -o auth-test1 authcon-test.c $FILES
+gcc $FLAGS -O2 -o manager-lookup-bench manager-lookup-bench.c $FILES
+gcc $FLAGS -O2 -o manager-stress-test manager-stress-test.c mock-server.c $FILES
+gcc $FLAGS -o pool-test pool-test.c mock-server.c $FILES
+gcc $FLAGS -o monitor-test monitor-test.c mock-server.c $FILES
+gcc $FLAGS -o discovery-test discovery-test.c mock-server.c $FILES
+gcc $FLAGS -o handshake-test handshake-test.c mock-server.c $FILES
+gcc $FLAGS -o health-test health-test.c mock-server.c $FILES
+gcc $FLAGS -o io-test io-test.c mock-server.c $FILES
+gcc $FLAGS -o buffer-test buffer-test.c $FILES
+gcc $FLAGS -o packet-test packet-test.c mock-server.c $FILES
+gcc $FLAGS -o mux-test mux-test.c mock-server.c $FILES
+gcc $FLAGS -o async-test async-test.c mock-server.c $FILES
+gcc $FLAGS -o multi-test multi-test.c mock-server.c $FILES
+gcc $FLAGS -o bson-test bson-test.c $FILES
+gcc $FLAGS -o validate-test validate-test.c $FILES
+gcc $FLAGS -o stream-test stream-test.c $FILES
+gcc $FLAGS -o intern-test intern-test.c $FILES
+gcc $FLAGS -O2 -o selection-bench selection-bench.c $FILES
+gcc $FLAGS -O2 -o io-bench io-bench.c mock-server.c $FILES -ldl
+gcc $FLAGS -O2 -o multi-bench multi-bench.c mock-server.c $FILES
+gcc $FLAGS -O2 -o encode-bench encode-bench.c $FILES
+gcc $FLAGS -O2 -o extract-bench extract-bench.c $FILES
+gcc $FLAGS -O2 -o validate-bench validate-bench.c $FILES
+gcc $FLAGS -O2 -o stream-bench stream-bench.c $FILES
+gcc $FLAGS -O2 -o intern-bench intern-bench.c $FILES
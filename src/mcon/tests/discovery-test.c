@@ -0,0 +1,172 @@
+#include "manager.h"
+#include "parse.h"
+#include "types.h"
+#include "str.h"
+#include "bson_helpers.h"
+#include "mock-server.h"
+#include "check.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/time.h>
+
+#define MEMBERS 5
+#define RTT_MS  50
+
+/* Cold-start discovery of a replica set whose members each take RTT_MS to
+ * answer. Every new connection costs two round trips (the handshake, and the
+ * ismaster that validates the member), so discovering the members one after
+ * the other would take (MEMBERS * 2) round trips. With the members that the
+ * seed reports checked in parallel, it takes four. */
+
+static mock_server servers[MEMBERS];
+
+static void add_element(mcon_str *str, char type, const char *name)
+{
+	mcon_str_addl(str, &type, 1, 0);
+	mcon_str_addl(str, (char *)name, strlen(name) + 1, 0);
+}
+
+static char *create_ismaster_doc(int primary)
+{
+	mcon_str *str, *hosts;
+	char      host[32], key[8], *doc;
+	double    ok = 1.0;
+	int       i;
+
+	mcon_str_ptr_init(hosts);
+	mcon_serialize_int(hosts, 0);
+	for (i = 0; i < MEMBERS; i++) {
+		snprintf(key, sizeof(key), "%d", i);
+		snprintf(host, sizeof(host), "127.0.0.1:%d", servers[i].port);
+		add_element(hosts, 0x02, key);
+		mcon_serialize_int(hosts, strlen(host) + 1);
+		mcon_str_addl(hosts, host, strlen(host) + 1, 0);
+	}
+	mcon_str_addl(hosts, "", 1, 0);
+	memcpy(hosts->d, &hosts->l, 4);
+
+	mcon_str_ptr_init(str);
+	mcon_serialize_int(str, 0);
+	add_element(str, 0x08, "ismaster");
+	mcon_str_addl(str, primary ? "\x01" : "\x00", 1, 0);
+	add_element(str, 0x08, "secondary");
+	mcon_str_addl(str, primary ? "\x00" : "\x01", 1, 0);
+	add_element(str, 0x02, "setName");
+	mcon_serialize_int(str, 4);
+	mcon_str_addl(str, "rs0", 4, 0);
+	add_element(str, 0x04, "hosts");
+	mcon_str_addl(str, hosts->d, hosts->l, 0);
+	add_element(str, 0x10, "maxWireVersion");
+	mcon_serialize_int(str, 2);
+	add_element(str, 0x10, "minWireVersion");
+	mcon_serialize_int(str, 0);
+	add_element(str, 0x01, "ok");
+	mcon_str_addl(str, (char *)&ok, 8, 0);
+	mcon_str_addl(str, "", 1, 0);
+	memcpy(str->d, &str->l, 4);
+
+	doc = str->d;
+	free(str);
+	mcon_str_ptr_dtor(hosts);
+	return doc;
+}
+
+static long discover(const char *options, int threads, int slow_seed, int *registered)
+{
+	mongo_con_manager *manager;
+	mongo_servers     *parsed;
+	mongo_connection  *con;
+	mcon_collection   *col;
+	char              *error_message = NULL;
+	char               dsn[128];
+	struct timeval     start, end;
+
+	if (slow_seed) {
+		snprintf(dsn, sizeof(dsn), "mongodb://127.0.0.1:%d,127.0.0.1:%d/?replicaSet=rs0%s", servers[0].port, servers[MEMBERS - 1].port, options);
+	} else {
+		snprintf(dsn, sizeof(dsn), "mongodb://127.0.0.1:%d/?replicaSet=rs0%s", servers[0].port, options);
+	}
+
+	manager = mongo_init();
+	mock_server_setup_manager(manager);
+	if (threads) {
+		manager->discovery_threads = threads;
+	}
+	parsed = mongo_parse_init();
+	mongo_parse_server_spec(manager, parsed, dsn, &error_message);
+
+	gettimeofday(&start, NULL);
+	con = mongo_get_read_write_connection(manager, parsed, MONGO_CON_FLAG_WRITE, &error_message);
+	gettimeofday(&end, NULL);
+
+	if (con) {
+		mongo_manager_connection_release(manager, con);
+	} else {
+		printf("Couldn't connect: %s\n", error_message);
+		free(error_message);
+	}
+
+	col = mongo_manager_connection_collect(manager);
+	*registered = col->count;
+	mcon_collection_free(col);
+
+	/* Threads that missed the deadline still use the manager, until
+	 * mongo_deinit() has waited for them */
+	mongo_servers_dtor(parsed);
+	mongo_deinit(manager);
+
+	return (end.tv_sec - start.tv_sec) * 1000 + (end.tv_usec - start.tv_usec) / 1000;
+}
+
+int main(void)
+{
+	char *docs[MEMBERS];
+	long  elapsed;
+	int   i, registered, failed = 0;
+
+	for (i = 0; i < MEMBERS; i++) {
+		memset(&servers[i], 0, sizeof(mock_server));
+		if (!mock_server_start(&servers[i])) {
+			printf("Couldn't start the mock server\n");
+			return 1;
+		}
+		servers[i].delay_us = RTT_MS * 1000;
+	}
+	for (i = 0; i < MEMBERS; i++) {
+		docs[i] = create_ismaster_doc(i == 0);
+		servers[i].document = docs[i];
+	}
+
+	elapsed = discover("", 0, 0, &registered);
+	printf("discovered %d members in %ldms; one after the other: %dms\n", registered, elapsed, MEMBERS * 2 * RTT_MS);
+	failed += check("all members are discovered", registered == MEMBERS);
+	failed += check("members are discovered in parallel", elapsed < 7 * RTT_MS);
+
+	/* The seed, and then two waves of two members each */
+	elapsed = discover("", 2, 0, &registered);
+	printf("discovered %d members in %ldms with two threads\n", registered, elapsed);
+	failed += check("no more than discovery_threads connect at once", registered == MEMBERS && elapsed >= 6 * RTT_MS);
+
+	/* One member is much slower than connectTimeoutMS */
+	servers[MEMBERS - 1].delay_us = 600000;
+	elapsed = discover("&connectTimeoutMS=700", 0, 0, &registered);
+	printf("discovered %d members in %ldms with a 700ms connectTimeoutMS\n", registered, elapsed);
+	failed += check("connectTimeoutMS applies to the whole discovery", elapsed >= 650 && elapsed < 900);
+	failed += check("the members that answered in time are used", registered == MEMBERS - 1);
+
+	/* The slow member is a seed, so the first wave misses the deadline while
+	 * the other seed reports members that aren't in the seed list. Those are
+	 * not checked anymore, and the thread of the slow seed, which is still
+	 * running, frees its own job and no other. */
+	elapsed = discover("&connectTimeoutMS=300", 0, 1, &registered);
+	printf("discovered %d members in %ldms with a slow seed and a 300ms connectTimeoutMS\n", registered, elapsed);
+	failed += check("no wave starts after one missed the deadline", elapsed >= 250 && elapsed < 500 && registered == 1);
+
+	for (i = 0; i < MEMBERS; i++) {
+		mock_server_stop(&servers[i]);
+		free(docs[i]);
+	}
+
+	return failed;
+}
@@ -0,0 +1,303 @@
+#include "mini_bson.h"
+#include "bson_helpers.h"
+#include "buffer.h"
+#include "str.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/time.h>
+
+#define DOCUMENTS 1000
+#define ROUNDS    50
+
+/* Encodes a corpus of user profile documents, with the one pass writer that
+ * bson_encode() uses, and with what encoders do without it: work out the
+ * length of every document before writing it, make array keys with
+ * snprintf(), and start every document in a new buffer. PHP arrays can't be
+ * made outside HHVM, so the documents are a tree that stands in for them,
+ * and both encoders walk it the way php_mongo_bson_encode() walks arrays. */
+
+typedef struct _value value;
+
+struct _value {
+	int   type;
+	char *key; /* NULL for the elements of arrays */
+	union {
+		int32_t i;
+		int64_t l;
+		double  d;
+		char   *s;
+		struct {
+			value *items;
+			int    count;
+		} doc;
+	} v;
+};
+
+static char *words[] = {
+	"mongodb", "hhvm", "driver", "profile", "report", "analytics", "premium",
+	"beta", "mobile", "desktop", "europe", "newsletter", "sports", "music",
+	"travel", "photography", "cooking", "gaming", "finance", "books"
+};
+#define WORDS (sizeof(words) / sizeof(words[0]))
+
+static char *actions[] = { "login", "logout", "purchase", "refund", "view", "search", "share" };
+
+static value *fill(value *item, int type, char *key)
+{
+	item->type = type;
+	item->key = key;
+	return item;
+}
+
+static value *document(value *item, int type, char *key, int count)
+{
+	fill(item, type, key);
+	item->v.doc.items = calloc(count, sizeof(value));
+	item->v.doc.count = count;
+	return item->v.doc.items;
+}
+
+static char *text(int length)
+{
+	char *s = malloc(length + 1);
+	int   i;
+
+	for (i = 0; i < length; i++) {
+		s[i] = 'a' + rand() % 26;
+	}
+	s[length] = '\0';
+	return s;
+}
+
+/* A user profile with some 30 top level fields, tags, an address, settings
+ * and the history of the last few dozen actions */
+static void create_profile(value *profile)
+{
+	value *f, *sub, *geo, *event;
+	int    i, tags = 5 + rand() % 10, events = 20 + rand() % 40;
+
+	f = document(profile, BSON_DOCUMENT, NULL, 13);
+	fill(f, BSON_STRING, "_id")->v.s = text(24); f++;
+	fill(f, BSON_STRING, "username")->v.s = text(6 + rand() % 10); f++;
+	fill(f, BSON_STRING, "email")->v.s = text(12 + rand() % 20); f++;
+	fill(f, BSON_INT64, "created_at")->v.l = 1400000000000LL + rand(); f++;
+	fill(f, BSON_INT32, "age")->v.i = 18 + rand() % 60; f++;
+	fill(f, BSON_DOUBLE, "score")->v.d = rand() / 1000.0; f++;
+	fill(f, BSON_BOOLEAN, "active")->v.i = rand() % 2; f++;
+	fill(f, BSON_NULL, "nickname"); f++;
+	fill(f, BSON_STRING, "bio")->v.s = text(50 + rand() % 200); f++;
+
+	sub = document(f++, BSON_ARRAY, "tags", tags);
+	for (i = 0; i < tags; i++) {
+		fill(&sub[i], BSON_STRING, NULL)->v.s = words[rand() % WORDS];
+	}
+
+	sub = document(f++, BSON_DOCUMENT, "address", 5);
+	fill(&sub[0], BSON_STRING, "street")->v.s = text(20);
+	fill(&sub[1], BSON_STRING, "city")->v.s = text(10);
+	fill(&sub[2], BSON_STRING, "zip")->v.s = text(5);
+	fill(&sub[3], BSON_STRING, "country")->v.s = text(2);
+	geo = document(&sub[4], BSON_ARRAY, "geo", 2);
+	fill(&geo[0], BSON_DOUBLE, NULL)->v.d = rand() / 10000000.0;
+	fill(&geo[1], BSON_DOUBLE, NULL)->v.d = rand() / 10000000.0;
+
+	sub = document(f++, BSON_DOCUMENT, "settings", 10);
+	for (i = 0; i < 10; i++) {
+		fill(&sub[i], i % 2 ? BSON_BOOLEAN : BSON_INT32, words[i])->v.i = rand() % 2;
+	}
+
+	sub = document(f++, BSON_ARRAY, "history", events);
+	for (i = 0; i < events; i++) {
+		event = document(&sub[i], BSON_DOCUMENT, NULL, 4);
+		fill(&event[0], BSON_INT64, "ts")->v.l = 1400000000000LL + rand();
+		fill(&event[1], BSON_STRING, "action")->v.s = actions[rand() % 7];
+		fill(&event[2], BSON_DOUBLE, "amount")->v.d = rand() / 100.0;
+		fill(&event[3], BSON_INT32, "item_id")->v.i = rand();
+	}
+}
+
+/* The one pass writer */
+static void encode_value(mcon_str *str, value *item);
+
+static void encode_document(mcon_str *str, value *doc)
+{
+	int offset, i;
+
+	offset = bson_begin_document(str);
+	for (i = 0; i < doc->v.doc.count; i++) {
+		value *item = &doc->v.doc.items[i];
+
+		if (doc->type == BSON_ARRAY) {
+			bson_add_index_key(str, item->type, i);
+		} else {
+			bson_add_key(str, item->type, item->key, strlen(item->key));
+		}
+		encode_value(str, item);
+	}
+	bson_end_document(str, offset);
+}
+
+static void encode_value(mcon_str *str, value *item)
+{
+	char b;
+
+	switch (item->type) {
+		case BSON_STRING:
+			bson_add_string_value(str, item->v.s, strlen(item->v.s));
+			break;
+		case BSON_INT32:
+			mcon_serialize_int32(str, item->v.i);
+			break;
+		case BSON_INT64:
+			mcon_serialize_int64(str, item->v.l);
+			break;
+		case BSON_DOUBLE:
+			mcon_serialize_double(str, item->v.d);
+			break;
+		case BSON_BOOLEAN:
+			b = item->v.i;
+			mcon_str_addl(str, &b, 1, 0);
+			break;
+		case BSON_DOCUMENT:
+		case BSON_ARRAY:
+			encode_document(str, item);
+			break;
+	}
+}
+
+/* Without it: the length of every document is worked out first, which walks
+ * nested documents once for every level above them */
+static int key_length(value *doc, int i, char *buffer)
+{
+	if (doc->type == BSON_ARRAY) {
+		return snprintf(buffer, 12, "%d", i);
+	}
+	strcpy(buffer, doc->v.doc.items[i].key);
+	return strlen(buffer);
+}
+
+static int document_length(value *doc);
+
+static int value_length(value *item)
+{
+	switch (item->type) {
+		case BSON_STRING:
+			return 4 + strlen(item->v.s) + 1;
+		case BSON_INT32:
+			return 4;
+		case BSON_INT64:
+		case BSON_DOUBLE:
+			return 8;
+		case BSON_BOOLEAN:
+			return 1;
+		case BSON_DOCUMENT:
+		case BSON_ARRAY:
+			return document_length(item);
+	}
+	return 0;
+}
+
+static int document_length(value *doc)
+{
+	char buffer[64];
+	int  length = 4 + 1, i;
+
+	for (i = 0; i < doc->v.doc.count; i++) {
+		length += 1 + key_length(doc, i, buffer) + 1 + value_length(&doc->v.doc.items[i]);
+	}
+	return length;
+}
+
+static void naive_value(mcon_str *str, value *item);
+
+static void naive_document(mcon_str *str, value *doc)
+{
+	char buffer[64], t;
+	int  i, length;
+
+	mcon_serialize_int(str, document_length(doc));
+	for (i = 0; i < doc->v.doc.count; i++) {
+		t = doc->v.doc.items[i].type;
+		mcon_str_addl(str, &t, 1, 0);
+		length = key_length(doc, i, buffer);
+		mcon_str_addl(str, buffer, length + 1, 0);
+		naive_value(str, &doc->v.doc.items[i]);
+	}
+	mcon_str_addl(str, "", 1, 0);
+}
+
+static void naive_value(mcon_str *str, value *item)
+{
+	if (item->type == BSON_DOCUMENT || item->type == BSON_ARRAY) {
+		naive_document(str, item);
+	} else {
+		encode_value(str, item);
+	}
+}
+
+static double now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static void run(value *corpus, int one_pass, const char *what)
+{
+	mcon_str *str;
+	double    start, elapsed;
+	long      bytes = 0;
+	int       i, r;
+
+	start = now();
+	for (r = 0; r < ROUNDS; r++) {
+		for (i = 0; i < DOCUMENTS; i++) {
+			if (one_pass) {
+				mcon_str_ptr_init_pooled(str);
+				encode_document(str, &corpus[i]);
+			} else {
+				mcon_str_ptr_init(str);
+				naive_document(str, &corpus[i]);
+			}
+			bytes += str->l;
+			mcon_str_ptr_dtor(str);
+		}
+	}
+	elapsed = now() - start;
+
+	printf("%-40s %8.1f MB/s %8.2fus/doc\n", what, bytes / elapsed / (1024 * 1024), elapsed * 1000000 / (ROUNDS * DOCUMENTS));
+}
+
+int main(void)
+{
+	value    *corpus;
+	mcon_str *a, *b;
+	long      size = 0;
+	int       i, same = 1;
+
+	srand(42);
+	corpus = calloc(DOCUMENTS, sizeof(value));
+	for (i = 0; i < DOCUMENTS; i++) {
+		create_profile(&corpus[i]);
+
+		mcon_str_ptr_init(a);
+		mcon_str_ptr_init(b);
+		encode_document(a, &corpus[i]);
+		naive_document(b, &corpus[i]);
+		same &= a->l == b->l && memcmp(a->d, b->d, a->l) == 0;
+		size += a->l;
+		mcon_str_ptr_dtor(a);
+		mcon_str_ptr_dtor(b);
+	}
+	printf("%d documents of %ld bytes on average, the same with both: %s\n", DOCUMENTS, size / DOCUMENTS, same ? "yes" : "NO");
+
+	/* Once to warm up */
+	run(corpus, 0, "two pass, snprintf keys, new buffers:");
+	run(corpus, 1, "one pass, index key table, pooled:");
+	run(corpus, 0, "two pass, snprintf keys, new buffers:");
+	run(corpus, 1, "one pass, index key table, pooled:");
+
+	return same ? 0 : 1;
+}
@@ -0,0 +1,155 @@
+#include "mini_bson.h"
+#include "bson_helpers.h"
+#include "str.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/time.h>
+
+#define ROUNDS 1000000
+
+/* Finds the fields that mongo_connection_ismaster_process() needs in the
+ * ismaster reply of a replica set member, with a bson_find_field_as_*() scan
+ * for each of them, as it used to, and with one bson_extract_fields() pass. */
+
+static void add_string(mcon_str *str, char *name, char *value)
+{
+	bson_add_key(str, BSON_STRING, name, strlen(name));
+	bson_add_string_value(str, value, strlen(value));
+}
+
+static void add_int32(mcon_str *str, char *name, int32_t value)
+{
+	bson_add_key(str, BSON_INT32, name, strlen(name));
+	mcon_serialize_int32(str, value);
+}
+
+static void add_bool(mcon_str *str, char *name, char value)
+{
+	bson_add_key(str, BSON_BOOLEAN, name, strlen(name));
+	mcon_str_addl(str, &value, 1, 0);
+}
+
+static void add_hosts(mcon_str *str, char *name, int count)
+{
+	char host[32];
+	int  offset, i;
+
+	bson_add_key(str, BSON_ARRAY, name, strlen(name));
+	offset = bson_begin_document(str);
+	for (i = 0; i < count; i++) {
+		snprintf(host, sizeof(host), "db%d.example.com:27017", i);
+		bson_add_index_key(str, BSON_STRING, i);
+		bson_add_string_value(str, host, strlen(host));
+	}
+	bson_end_document(str, offset);
+}
+
+/* What a secondary of a three member set with a passive member says */
+static mcon_str *create_reply(void)
+{
+	mcon_str *str;
+	int       doc, tags;
+
+	mcon_str_ptr_init(str);
+	doc = bson_begin_document(str);
+	add_string(str, "setName", "rs0");
+	add_int32(str, "setVersion", 3);
+	add_bool(str, "ismaster", 0);
+	add_bool(str, "secondary", 1);
+	add_hosts(str, "hosts", 3);
+	add_hosts(str, "passives", 1);
+	add_string(str, "primary", "db0.example.com:27017");
+	bson_add_key(str, BSON_DOCUMENT, "tags", 4);
+	tags = bson_begin_document(str);
+	add_string(str, "dc", "east");
+	add_string(str, "rack", "r12");
+	bson_end_document(str, tags);
+	add_string(str, "me", "db1.example.com:27017");
+	add_int32(str, "maxBsonObjectSize", 16777216);
+	add_int32(str, "maxMessageSizeBytes", 48000000);
+	add_int32(str, "maxWriteBatchSize", 1000);
+	bson_add_key(str, BSON_DATETIME, "localTime", 9);
+	mcon_serialize_int64(str, 1400000000000LL);
+	add_int32(str, "maxWireVersion", 2);
+	add_int32(str, "minWireVersion", 0);
+	bson_add_key(str, BSON_DOUBLE, "ok", 2);
+	mcon_serialize_double(str, 1.0);
+	bson_end_document(str, doc);
+
+	return str;
+}
+
+static double now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+int main(void)
+{
+	mcon_str     *reply = create_reply();
+	char         *ptr = reply->d + sizeof(int32_t);
+	int32_t       min_wire_version, max_wire_version, max_bson_size, max_message_size, max_write_batch_size;
+	unsigned char ismaster, secondary, arbiter;
+	char         *set, *msg, *tags, *me, *errmsg, *primary, *hosts, *passives, *arbiters;
+	double        start, scans, one_pass;
+	long          found = 0;
+	int           i;
+	bson_field    fields[] = {
+		BSON_FIELD("minWireVersion", BSON_INT32, &min_wire_version),
+		BSON_FIELD("maxWireVersion", BSON_INT32, &max_wire_version),
+		BSON_FIELD("maxBsonObjectSize", BSON_INT32, &max_bson_size),
+		BSON_FIELD("maxMessageSizeBytes", BSON_INT32, &max_message_size),
+		BSON_FIELD("maxWriteBatchSize", BSON_INT32, &max_write_batch_size),
+		BSON_FIELD("ismaster", BSON_BOOLEAN, &ismaster),
+		BSON_FIELD("secondary", BSON_BOOLEAN, &secondary),
+		BSON_FIELD("arbiterOnly", BSON_BOOLEAN, &arbiter),
+		BSON_FIELD("setName", BSON_STRING, &set),
+		BSON_FIELD("msg", BSON_STRING, &msg),
+		BSON_FIELD("tags", BSON_DOCUMENT, &tags),
+		BSON_FIELD("me", BSON_STRING, &me),
+		BSON_FIELD("errmsg", BSON_STRING, &errmsg),
+		BSON_FIELD("primary", BSON_STRING, &primary),
+		BSON_FIELD("hosts", BSON_ARRAY, &hosts),
+		BSON_FIELD("passives", BSON_ARRAY, &passives),
+		BSON_FIELD("arbiters", BSON_ARRAY, &arbiters),
+	};
+
+	start = now();
+	for (i = 0; i < ROUNDS; i++) {
+		found += bson_find_field_as_int32(ptr, "minWireVersion", &min_wire_version);
+		found += bson_find_field_as_int32(ptr, "maxWireVersion", &max_wire_version);
+		found += bson_find_field_as_int32(ptr, "maxBsonObjectSize", &max_bson_size);
+		found += bson_find_field_as_int32(ptr, "maxMessageSizeBytes", &max_message_size);
+		found += bson_find_field_as_int32(ptr, "maxWriteBatchSize", &max_write_batch_size);
+		found += bson_find_field_as_bool(ptr, "ismaster", &ismaster);
+		found += bson_find_field_as_bool(ptr, "secondary", &secondary);
+		found += bson_find_field_as_bool(ptr, "arbiterOnly", &arbiter);
+		found += bson_find_field_as_string(ptr, "setName", &set);
+		found += bson_find_field_as_string(ptr, "msg", &msg);
+		found += bson_find_field_as_document(ptr, "tags", &tags);
+		found += bson_find_field_as_string(ptr, "me", &me);
+		found += bson_find_field_as_string(ptr, "errmsg", &errmsg);
+		found += bson_find_field_as_string(ptr, "primary", &primary);
+		found += bson_find_field_as_array(ptr, "hosts", &hosts);
+		found += bson_find_field_as_array(ptr, "passives", &passives);
+		found += bson_find_field_as_array(ptr, "arbiters", &arbiters);
+	}
+	scans = now() - start;
+	printf("%-30s %8.1fns/reply, %ld fields found\n", "one scan per field:", scans * 1e9 / ROUNDS, found / ROUNDS);
+
+	found = 0;
+	start = now();
+	for (i = 0; i < ROUNDS; i++) {
+		found += bson_extract_fields(ptr, fields, sizeof(fields) / sizeof(fields[0]));
+	}
+	one_pass = now() - start;
+	printf("%-30s %8.1fns/reply, %ld fields found\n", "bson_extract_fields():", one_pass * 1e9 / ROUNDS, found / ROUNDS);
+
+	mcon_str_ptr_dtor(reply);
+
+	return 0;
+}
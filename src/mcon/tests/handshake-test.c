@@ -0,0 +1,99 @@
+#include "manager.h"
+#include "connections.h"
+#include "parse.h"
+#include "types.h"
+#include "mock-server.h"
+#include "check.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/time.h>
+
+#define RTT_MS 50
+
+/* Connects to a server that takes RTT_MS to answer, with and without the
+ * fast handshake, and with and without MongoDB-CR credentials. */
+
+/* { ismaster: true, maxWireVersion: 2, minWireVersion: 0, nonce: "2375531c32080ae8", ok: 1.0 } */
+static const char reply_doc[] =
+	"\x60\x00\x00\x00"
+	"\x08ismaster\x00\x01"
+	"\x10maxWireVersion\x00\x02\x00\x00\x00"
+	"\x10minWireVersion\x00\x00\x00\x00\x00"
+	"\x02nonce\x00\x11\x00\x00\x00" "2375531c32080ae8\x00"
+	"\x01ok\x00\x00\x00\x00\x00\x00\x00\xf0\x3f"
+	"\x00";
+
+static mock_server server;
+
+static int connect_once(int fast_handshake, const char *credentials, long *elapsed, int *requests, mongo_connection *copy)
+{
+	mongo_con_manager *manager;
+	mongo_servers     *servers;
+	mongo_connection  *con;
+	char              *error_message = NULL;
+	char               dsn[128];
+	struct timeval     start, end;
+
+	snprintf(dsn, sizeof(dsn), "mongodb://%s127.0.0.1:%d/admin", credentials, server.port);
+
+	manager = mongo_init();
+	mock_server_setup_manager(manager);
+	manager->authenticate = mongo_connection_authenticate;
+	manager->fast_handshake = fast_handshake;
+
+	servers = mongo_parse_init();
+	mongo_parse_server_spec(manager, servers, dsn, &error_message);
+
+	*requests = server.requests;
+	gettimeofday(&start, NULL);
+	con = mongo_get_read_write_connection(manager, servers, MONGO_CON_FLAG_READ, &error_message);
+	gettimeofday(&end, NULL);
+	*requests = server.requests - *requests;
+	*elapsed = (end.tv_sec - start.tv_sec) * 1000 + (end.tv_usec - start.tv_usec) / 1000;
+
+	if (con) {
+		memcpy(copy, con, sizeof(mongo_connection));
+		mongo_manager_connection_release(manager, con);
+	} else {
+		printf("Couldn't connect: %s\n", error_message);
+		free(error_message);
+	}
+
+	mongo_servers_dtor(servers);
+	mongo_deinit(manager);
+
+	return con != NULL;
+}
+
+int main(void)
+{
+	mongo_connection con;
+	long             slow, fast;
+	int              slow_requests, fast_requests, failed = 0;
+
+	memset(&server, 0, sizeof(server));
+	if (!mock_server_start(&server)) {
+		printf("Couldn't start the mock server\n");
+		return 1;
+	}
+	server.delay_us = RTT_MS * 1000;
+	server.document = reply_doc;
+
+	connect_once(0, "", &slow, &slow_requests, &con);
+	connect_once(1, "", &fast, &fast_requests, &con);
+	printf("without credentials: %ldms (%d requests) -> %ldms (%d requests)\n", slow, slow_requests, fast, fast_requests);
+	failed += check("the handshake is a single round trip", fast_requests == 1 && fast < 2 * RTT_MS);
+	failed += check("the ping time comes from the handshake", con.ping_ms >= RTT_MS - 5 && con.last_ping > 0);
+	failed += check("the server version comes from the wire version", con.version.major == 2 && con.version.minor == 6);
+
+	connect_once(0, "user:pass@", &slow, &slow_requests, &con);
+	connect_once(1, "user:pass@", &fast, &fast_requests, &con);
+	printf("with credentials:    %ldms (%d requests) -> %ldms (%d requests)\n", slow, slow_requests, fast, fast_requests);
+	failed += check("getnonce is pipelined with ismaster", fast_requests == 3 && fast < 3 * RTT_MS);
+	failed += check("the pipelined nonce is used up by authentication", con.nonce == NULL);
+
+	mock_server_stop(&server);
+
+	return failed;
+}
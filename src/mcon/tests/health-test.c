@@ -0,0 +1,117 @@
+#include "manager.h"
+#include "connections.h"
+#include "parse.h"
+#include "pool.h"
+#include "types.h"
+#include "mock-server.h"
+#include "check.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#define RTT_MS 20
+
+/* Runs operations on a server's pooled sockets, and checks that they replace
+ * the pings that request threads would otherwise send, and that a failing
+ * operation takes the server out of the topology right away. */
+
+static mongo_con_manager *manager;
+static mongo_servers     *servers;
+static mock_server        server;
+
+/* Runs buildinfo on one of con's pooled sockets, which stands in for any
+ * query or command. Returns whether it worked. */
+static int run_operation(mongo_connection *con)
+{
+	mongo_connection *pooled;
+	char             *error_message = NULL;
+	int               ok;
+
+	pooled = mongo_pool_checkout(manager, con, &servers->options, &error_message);
+	if (!pooled) {
+		printf("checkout failed: %s\n", error_message);
+		free(error_message);
+		return 0;
+	}
+	ok = mongo_connection_get_server_version(manager, pooled, &servers->options, &error_message);
+	if (!ok) {
+		free(error_message);
+	}
+	mongo_pool_checkin(manager, con, pooled, !ok);
+
+	return ok;
+}
+
+/* Returns the number of requests that getting a connection sent */
+static int get_connection(void)
+{
+	mongo_connection *con;
+	char             *error_message = NULL;
+	int               requests = server.requests;
+
+	con = mongo_get_read_write_connection(manager, servers, MONGO_CON_FLAG_READ, &error_message);
+	if (!con) {
+		printf("Couldn't connect: %s\n", error_message);
+		free(error_message);
+		return -1;
+	}
+	mongo_manager_connection_release(manager, con);
+
+	return server.requests - requests;
+}
+
+int main(void)
+{
+	mongo_connection *con;
+	char             *error_message = NULL;
+	char              dsn[64];
+	int               failed = 0;
+
+	memset(&server, 0, sizeof(server));
+	if (!mock_server_start(&server)) {
+		printf("Couldn't start the mock server\n");
+		return 1;
+	}
+	snprintf(dsn, sizeof(dsn), "mongodb://127.0.0.1:%d", server.port);
+
+	manager = mongo_init();
+	mock_server_setup_manager(manager);
+	manager->ping_interval = 1;
+	manager->pool_min_size = 0;
+
+	servers = mongo_parse_init();
+	mongo_parse_server_spec(manager, servers, dsn, &error_message);
+	con = mongo_get_read_write_connection(manager, servers, MONGO_CON_FLAG_READ, &error_message);
+	if (!con) {
+		printf("Couldn't connect: %s\n", error_message);
+		return 1;
+	}
+	/* Keep our own reference, as the pool goes with the connection */
+	mongo_connection_addref(con);
+	mongo_manager_connection_release(manager, con);
+
+	/* A busy server isn't pinged */
+	sleep(2);
+	server.delay_us = RTT_MS * 1000;
+	failed += check("an operation works", run_operation(con));
+	server.delay_us = 0;
+	failed += check("its round trip time is recorded on the server", con->last_rtt_us >= RTT_MS * 1000);
+	failed += check("a server that was just used isn't pinged", get_connection() == 0);
+
+	/* An idle one is */
+	sleep(2);
+	failed += check("an idle server is pinged", get_connection() == 1);
+
+	/* A failing operation removes the server, without waiting for a ping */
+	server.down = 1;
+	failed += check("an operation on a server that is down fails", !run_operation(con));
+	failed += check("the server is removed from the topology at once", manager->topology->count == 0);
+
+	mongo_connection_release(manager, con, MONGO_CLOSE_BROKEN);
+	mongo_servers_dtor(servers);
+	mongo_deinit(manager);
+	mock_server_stop(&server);
+
+	return failed;
+}
@@ -0,0 +1,141 @@
+#include "intern.h"
+#include "mini_bson.h"
+#include "bson_helpers.h"
+#include "str.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/time.h>
+
+#define DOCUMENTS 100000
+#define KEYS      12
+
+/* Turns the field names of a 100k document report into strings, once with a
+ * new string for every name, like String(name, CopyString) makes, and once
+ * through the intern table, as php_mongo_bson_key() does. A string is a
+ * header followed by the characters, like HHVM's StringData, and the ones
+ * of a document are freed when the next document is decoded, like the
+ * arrays of a report that is written out as it's read. */
+
+typedef struct _string {
+	int  refcount;
+	int  length;
+	char data[1];
+} string;
+
+static char *keys[KEYS] = {
+	"_id", "created_at", "user_id", "account_id", "country", "currency",
+	"amount", "tax", "status", "channel", "campaign", "updated_at"
+};
+
+static long allocations;
+
+static string *string_create(const char *name, int length)
+{
+	string *s = malloc(sizeof(string) + length);
+
+	allocations++;
+	s->refcount = 1;
+	s->length = length;
+	memcpy(s->data, name, length);
+	s->data[length] = '\0';
+	return s;
+}
+
+static void string_release(string *s)
+{
+	/* Interned ones live as long as the process */
+	if (s->refcount > 0 && --s->refcount == 0) {
+		free(s);
+	}
+}
+
+static string *intern_key(const char *name, int length)
+{
+	mongo_intern_slot *slot = mongo_intern_lookup(name, length);
+	string            *s;
+
+	if (!slot) {
+		return string_create(name, length);
+	}
+	s = mongo_intern_value(slot);
+	if (!s) {
+		s = string_create(name, length);
+		s->refcount = -1;
+		s = mongo_intern_set_value(slot, s);
+	}
+	return s;
+}
+
+static mcon_str *create_document(int i)
+{
+	mcon_str *str;
+	int       doc, k;
+
+	mcon_str_ptr_init(str);
+	doc = bson_begin_document(str);
+	for (k = 0; k < KEYS; k++) {
+		bson_add_key(str, BSON_INT32, keys[k], strlen(keys[k]));
+		mcon_serialize_int32(str, i + k);
+	}
+	bson_end_document(str, doc);
+	return str;
+}
+
+static double run(mcon_str **documents, int interned)
+{
+	string  *names[KEYS];
+	char    *element, *name, *value;
+	double   start;
+	int      i, k, type;
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	start = tv.tv_sec + tv.tv_usec / 1000000.0;
+	memset(names, 0, sizeof(names));
+
+	for (i = 0; i < DOCUMENTS; i++) {
+		element = documents[i]->d + sizeof(int32_t);
+		for (k = 0; (value = bson_get_current(element, &name, &type)); k++) {
+			if (names[k]) {
+				string_release(names[k]);
+			}
+			names[k] = interned ? intern_key(name, value - name - 1) : string_create(name, value - name - 1);
+			element = bson_next(element);
+		}
+	}
+	for (k = 0; k < KEYS; k++) {
+		string_release(names[k]);
+	}
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1000000.0 - start;
+}
+
+int main(void)
+{
+	mcon_str **documents = malloc(DOCUMENTS * sizeof(mcon_str *));
+	double     elapsed;
+	int        i;
+
+	for (i = 0; i < DOCUMENTS; i++) {
+		documents[i] = create_document(i);
+	}
+
+	/* Once to warm up */
+	run(documents, 0);
+	allocations = 0;
+	elapsed = run(documents, 0);
+	printf("%-30s %8.1fns/name %10ld allocations\n", "a new string for every name:", elapsed * 1e9 / (DOCUMENTS * KEYS), allocations);
+
+	allocations = 0;
+	elapsed = run(documents, 1);
+	printf("%-30s %8.1fns/name %10ld allocations, %d names interned\n", "intern table:", elapsed * 1e9 / (DOCUMENTS * KEYS), allocations, mongo_intern_count());
+
+	for (i = 0; i < DOCUMENTS; i++) {
+		mcon_str_ptr_dtor(documents[i]);
+	}
+	free(documents);
+
+	return 0;
+}
@@ -0,0 +1,96 @@
+#include "intern.h"
+#include "check.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+
+/* Checks that field names get a slot in the intern table once they come up
+ * again, that map-like keys which don't come back don't fill it up, and
+ * that threads that look the same names up at once agree on their slots and
+ * values. */
+
+static mongo_intern_slot *lookup(const char *name)
+{
+	return mongo_intern_lookup(name, strlen(name));
+}
+
+static char *names[] = { "_id", "created_at", "user_id", "amount", "status", "tags", "address", "email" };
+#define NAMES (sizeof(names) / sizeof(names[0]))
+
+static void *lookup_names(void *arg)
+{
+	mongo_intern_slot **slots = (mongo_intern_slot **)arg;
+	int                 i, j;
+
+	for (i = 0; i < 100000; i++) {
+		for (j = 0; j < (int)NAMES; j++) {
+			mongo_intern_slot *slot = lookup(names[j]);
+
+			if (slot) {
+				slots[j] = slot;
+				mongo_intern_set_value(slot, slots + j);
+			}
+		}
+	}
+	return NULL;
+}
+
+int main(void)
+{
+	mongo_intern_slot *slot, *slots[4][NAMES];
+	pthread_t          threads[4];
+	char               name[64];
+	int                i, j, ok, value, other, failed = 0;
+
+	failed += check("a name doesn't get a slot the first time", lookup("first_name") == NULL);
+	slot = lookup("first_name");
+	failed += check("but does the second time", slot != NULL && slot->length == 10 && memcmp(slot->name, "first_name", 10) == 0);
+	failed += check("and keeps it", lookup("first_name") == slot);
+	failed += check("a name that only starts the same has none", lookup("first") == NULL);
+
+	memset(name, 'x', sizeof(name));
+	mongo_intern_lookup(name, MONGO_INTERN_MAX_LENGTH + 1);
+	failed += check("long names never get one", mongo_intern_lookup(name, MONGO_INTERN_MAX_LENGTH + 1) == NULL);
+
+	failed += check("a new slot has no value", mongo_intern_value(slot) == NULL);
+	failed += check("the first value set is kept", mongo_intern_set_value(slot, &value) == &value);
+	failed += check("and returned to the ones that come later", mongo_intern_set_value(slot, &other) == &value && mongo_intern_value(slot) == &value);
+
+	/* Keys that are seen once each, like those of a map of user IDs */
+	for (i = 0; i < 100000; i++) {
+		snprintf(name, sizeof(name), "user%d", i);
+		lookup(name);
+	}
+	failed += check("keys that don't come back don't take slots", mongo_intern_count() == 1);
+
+	/* Threads that see the same names at once */
+	for (i = 0; i < 4; i++) {
+		memset(slots[i], 0, sizeof(slots[i]));
+		pthread_create(&threads[i], NULL, lookup_names, slots[i]);
+	}
+	for (i = 0; i < 4; i++) {
+		pthread_join(threads[i], NULL);
+	}
+	ok = mongo_intern_count() == 1 + NAMES;
+	for (j = 0; j < (int)NAMES; j++) {
+		for (i = 0; i < 4; i++) {
+			ok &= slots[i][j] == slots[0][j];
+			ok &= slots[i][j] && mongo_intern_value(slots[i][j]) == mongo_intern_value(slots[0][j]);
+		}
+	}
+	failed += check("threads agree on slots and values", ok);
+
+	/* Every name that comes back gets a slot, until there are no more */
+	for (i = 0; i < 10 * MONGO_INTERN_SLOTS; i++) {
+		snprintf(name, sizeof(name), "field%d", i);
+		lookup(name);
+		lookup(name);
+	}
+	printf("%d names have a slot\n", mongo_intern_count());
+	failed += check("the table doesn't take more than its slots", mongo_intern_count() <= MONGO_INTERN_SLOTS && mongo_intern_count() > MONGO_INTERN_SLOTS / 2);
+	failed += check("and names that had one keep it", lookup("first_name") == slot);
+
+
+	return failed;
+}
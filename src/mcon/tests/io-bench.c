@@ -0,0 +1,248 @@
+#define _GNU_SOURCE
+#include "manager.h"
+#include "connections.h"
+#include "parse.h"
+#include "io.h"
+#include "types.h"
+#include "mock-server.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <dlfcn.h>
+#include <poll.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#define OPERATIONS 2000
+#define LARGE_SIZE (4 * 1024 * 1024 - 1024) /* Within the default maximum BSON size */
+
+/* Runs buildinfo round trips against the mock server with the native
+ * transport, and with a model of the PHP streams transport, and reports the
+ * latency, and the number of system calls and allocations that each
+ * operation takes. PHP
+ * streams can't be used outside HHVM, so the model does what
+ * php_mongo_io_stream_read() and php_sockop_read() do: it reads in 4096 byte
+ * slices, and polls before every recv(). */
+
+/* System calls made by the current thread, counted by wrapping libc's */
+static __thread long syscalls = 0;
+
+#define WRAP(ret, name, args, call) \
+	ret name args \
+	{ \
+		static ret (*real) args = NULL; \
+		if (!real) { \
+			real = dlsym(RTLD_NEXT, #name); \
+		} \
+		syscalls++; \
+		return real call; \
+	}
+
+WRAP(ssize_t, recv, (int fd, void *buf, size_t len, int flags), (fd, buf, len, flags))
+WRAP(ssize_t, send, (int fd, const void *buf, size_t len, int flags), (fd, buf, len, flags))
+WRAP(ssize_t, sendmsg, (int fd, const struct msghdr *msg, int flags), (fd, msg, flags))
+WRAP(int, poll, (struct pollfd *fds, nfds_t nfds, int timeout), (fds, nfds, timeout))
+
+/* Allocations made by the current thread, counted by wrapping glibc's
+ * allocator, which dlsym() can't be used for as it allocates itself */
+static __thread long allocations = 0;
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t count, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+void *malloc(size_t size)
+{
+	allocations++;
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size)
+{
+	allocations++;
+	return __libc_calloc(count, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+	allocations++;
+	return __libc_realloc(ptr, size);
+}
+
+/* The PHP streams model */
+static void *stream_connect(mongo_con_manager *manager, mongo_server_def *server, mongo_server_options *options, char **error_message)
+{
+	struct sockaddr_in addr;
+	int               *fd, flag = 1;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(server->port);
+	inet_pton(AF_INET, server->host, &addr.sin_addr);
+
+	fd = malloc(sizeof(int));
+	*fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (connect(*fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+		*error_message = strdup(strerror(errno));
+		close(*fd);
+		free(fd);
+		return NULL;
+	}
+	setsockopt(*fd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+
+	return fd;
+}
+
+static int stream_read(mongo_connection *con, mongo_server_options *options, int timeout, void *data, int size, char **error_message)
+{
+	struct pollfd pfd;
+	int           received = 0, num;
+
+	pfd.fd = *(int *)con->socket;
+	pfd.events = POLLIN;
+
+	while (received < size) {
+		int len = 4096 < (size - received) ? 4096 : size - received;
+
+		if (poll(&pfd, 1, 60000) <= 0) {
+			*error_message = strdup("stream_read: timed out");
+			return -80;
+		}
+		num = recv(pfd.fd, (char *)data + received, len, MSG_DONTWAIT);
+		if (num <= 0) {
+			*error_message = strdup("stream_read: short read");
+			return -32;
+		}
+		received += num;
+	}
+
+	return received;
+}
+
+static int stream_send(mongo_connection *con, mongo_server_options *options, void *data, int size, char **error_message)
+{
+	if (send(*(int *)con->socket, data, size, MSG_NOSIGNAL) != size) {
+		*error_message = strdup("stream_send: short write");
+		return -1;
+	}
+	return size;
+}
+
+static void stream_close(mongo_connection *con, int why)
+{
+	close(*(int *)con->socket);
+	free(con->socket);
+}
+
+/* { data: BinData(0, <size bytes>), ok: 1.0 } */
+static char *create_large_doc(int size)
+{
+	char   *doc, *ptr;
+	double  ok = 1.0;
+	int32_t length = 4 + 1 + 5 + 4 + 1 + size + 1 + 3 + 8 + 1;
+
+	doc = calloc(1, length);
+	ptr = doc;
+	memcpy(ptr, &length, 4); ptr += 4;
+	*ptr++ = 0x05;
+	memcpy(ptr, "data", 5); ptr += 5;
+	memcpy(ptr, &size, 4); ptr += 4;
+	*ptr++ = 0x00;
+	ptr += size;
+	*ptr++ = 0x01;
+	memcpy(ptr, "ok", 3); ptr += 3;
+	memcpy(ptr, &ok, 8);
+
+	return doc;
+}
+
+static double now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static void run(mock_server *server, int native, const char *what)
+{
+	mongo_con_manager *manager;
+	mongo_servers     *servers;
+	mongo_connection  *con;
+	char              *error_message = NULL;
+	char               dsn[64];
+	double             start;
+	long               calls, allocs;
+	int                i;
+
+	snprintf(dsn, sizeof(dsn), "mongodb://127.0.0.1:%d", server->port);
+
+	manager = mongo_init();
+	manager->authenticate = mongo_connection_authenticate;
+	manager->supports_wire_version = mongo_mcon_supports_wire_version;
+	if (!native) {
+		manager->connect = stream_connect;
+		manager->recv_header = stream_read;
+		manager->recv_data = stream_read;
+		manager->send = stream_send;
+		manager->close = stream_close;
+	}
+
+	servers = mongo_parse_init();
+	mongo_parse_server_spec(manager, servers, dsn, &error_message);
+	con = mongo_get_read_write_connection(manager, servers, MONGO_CON_FLAG_READ, &error_message);
+	if (!con) {
+		printf("Couldn't connect: %s\n", error_message);
+		exit(1);
+	}
+
+	calls = syscalls;
+	allocs = allocations;
+	start = now();
+	for (i = 0; i < OPERATIONS; i++) {
+		if (!mongo_connection_get_server_version(manager, con, &servers->options, &error_message)) {
+			printf("Operation failed: %s\n", error_message);
+			exit(1);
+		}
+	}
+	printf("%-30s %8.1fus/op %8.1f syscalls/op %6.1f allocs/op", what, (now() - start) * 1000000 / OPERATIONS, (double)(syscalls - calls) / OPERATIONS, (double)(allocations - allocs) / OPERATIONS);
+	if (native) {
+		/* What the driver's own stats say */
+		printf(" %8.1f reads/reply", (double)manager->io_stats.reads / manager->io_stats.replies);
+	}
+	printf("\n");
+
+	mongo_manager_connection_release(manager, con);
+	mongo_servers_dtor(servers);
+	mongo_deinit(manager);
+}
+
+int main(void)
+{
+	mock_server server;
+	char       *large;
+
+	memset(&server, 0, sizeof(server));
+	if (!mock_server_start(&server)) {
+		printf("Couldn't start the mock server\n");
+		return 1;
+	}
+
+	run(&server, 0, "small reply, streams:");
+	run(&server, 1, "small reply, native:");
+
+	large = create_large_doc(LARGE_SIZE);
+	server.document = large;
+	run(&server, 0, "4MB reply, streams:");
+	run(&server, 1, "4MB reply, native:");
+
+	mock_server_stop(&server);
+	free(large);
+
+	return 0;
+}
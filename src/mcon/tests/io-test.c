@@ -0,0 +1,139 @@
+#include "manager.h"
+#include "connections.h"
+#include "parse.h"
+#include "io.h"
+#include "pool.h"
+#include "types.h"
+#include "mock-server.h"
+#include "check.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/time.h>
+
+/* Runs operations over the native transport against a mock server that
+ * answers slowly, or not at all, and checks that every operation finishes
+ * by its deadline. */
+
+static mongo_con_manager *manager;
+static mongo_servers     *servers;
+static mock_server        server;
+
+/* Connects, and runs buildinfo with the given budget (or 0), on a socket
+ * from the pool if there is a budget. Returns whether it worked, and the
+ * operation's error message and duration. */
+static int run_operation(int budget_ms, char **error_message, long *elapsed)
+{
+	mongo_connection *con, *pooled;
+	struct timeval    start;
+	int               ok;
+
+	con = mongo_get_read_write_connection(manager, servers, MONGO_CON_FLAG_READ, error_message);
+	if (!con) {
+		printf("Couldn't connect: %s\n", *error_message);
+		exit(1);
+	}
+
+	gettimeofday(&start, NULL);
+	if (budget_ms) {
+		pooled = mongo_pool_checkout(manager, con, &servers->options, error_message);
+		if (!pooled) {
+			printf("Couldn't check a socket out: %s\n", *error_message);
+			exit(1);
+		}
+		mongo_connection_set_budget(pooled, budget_ms);
+		ok = mongo_connection_get_server_version(manager, pooled, &servers->options, error_message);
+		mongo_pool_checkin(manager, con, pooled, !ok);
+	} else {
+		ok = mongo_connection_get_server_version(manager, con, &servers->options, error_message);
+	}
+	*elapsed = elapsed_ms(&start);
+	mongo_manager_connection_release(manager, con);
+
+	return ok;
+}
+
+int main(void)
+{
+	mongo_io_stats   stats;
+	mongo_server_def def;
+	char            *error_message = NULL;
+	char             dsn[64];
+	long             elapsed;
+	int              ok, failed = 0, connections;
+
+	memset(&def, 0, sizeof(def));
+	memset(&server, 0, sizeof(server));
+	if (!mock_server_start(&server)) {
+		printf("Couldn't start the mock server\n");
+		return 1;
+	}
+	snprintf(dsn, sizeof(dsn), "mongodb://127.0.0.1:%d/?socketTimeoutMS=300", server.port);
+
+	manager = mongo_init();
+	manager->authenticate = mongo_connection_authenticate;
+	manager->supports_wire_version = mongo_mcon_supports_wire_version;
+
+	servers = mongo_parse_init();
+	mongo_parse_server_spec(manager, servers, dsn, &error_message);
+
+	server.delay_us = 100000;
+	ok = run_operation(0, &error_message, &elapsed);
+	failed += check("a reply within socketTimeoutMS is read", ok);
+
+	server.delay_us = 500000;
+	ok = run_operation(0, &error_message, &elapsed);
+	printf("timed out after %ldms: %s\n", elapsed, ok ? "" : error_message);
+	failed += check("a slower reply times out at socketTimeoutMS", !ok && elapsed >= 290 && elapsed < 400);
+	failed += check("the error says how much was read", !ok && strcmp(error_message, "Read timed out after reading 0 of 36 bytes") == 0);
+	if (!ok) {
+		free(error_message);
+	}
+
+	server.delay_us = 200000;
+	run_operation(0, &error_message, &elapsed);
+	connections = server.connections;
+	ok = run_operation(50, &error_message, &elapsed);
+	printf("timed out after %ldms: %s\n", elapsed, ok ? "" : error_message);
+	failed += check("a budget shortens the deadline", !ok && elapsed >= 45 && elapsed < 150);
+	if (!ok) {
+		free(error_message);
+	}
+
+	server.delay_us = 0;
+	stats = manager->io_stats;
+	ok = run_operation(0, &error_message, &elapsed);
+	failed += check("a budget only applies to one operation", ok);
+	failed += check("running out of it doesn't fail the server", server.connections == connections + 1);
+	/* Reads that come back empty are followed by a wait, every other one
+	 * should have brought a whole reply in */
+	failed += check("small replies are read with one recv() each",
+		manager->io_stats.replies > stats.replies &&
+		(manager->io_stats.reads - manager->io_stats.waits) - (stats.reads - stats.waits) == manager->io_stats.replies - stats.replies);
+
+	server.down = 1;
+	ok = run_operation(0, &error_message, &elapsed);
+	failed += check("a closed connection is reported", !ok && strcmp(error_message, "Remote server has closed the connection") == 0);
+	if (!ok) {
+		free(error_message);
+	}
+
+	/* The caller's error_message doesn't have to be initialised */
+	def.host = "host.invalid";
+	def.port = 27017;
+	error_message = (char *)&def;
+	failed += check("an unknown host is reported", !mongo_io_connect(manager, &def, &servers->options, &error_message) && strncmp(error_message, "Can't resolve", 13) == 0);
+	free(error_message);
+
+	def.host = "127.0.0.1";
+	def.port = 1;
+	error_message = (char *)&def;
+	failed += check("a refused connection is reported", !mongo_io_connect(manager, &def, &servers->options, &error_message) && strncmp(error_message, "Can't connect", 13) == 0);
+	free(error_message);
+
+	mongo_servers_dtor(servers);
+	mongo_deinit(manager);
+	mock_server_stop(&server);
+
+	return failed;
+}
@@ -0,0 +1,111 @@
+#include "manager.h"
+#include "types.h"
+#include "utils.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/time.h>
+
+#define LOOKUPS 1000000
+
+static void close_noop(mongo_connection *con, int why)
+{
+}
+
+static void init_def(mongo_server_def *def, char *host, int i)
+{
+	memset(def, 0, sizeof(mongo_server_def));
+	snprintf(host, 64, "mongos-%04d.dc1.example.com", i);
+	def->host = host;
+	def->port = 27017;
+	def->repl_set_name = "rs0";
+	def->db = "admin";
+	def->username = "application";
+	def->password = "secret";
+}
+
+static mongo_connection *create_con(mongo_con_manager *manager, int i)
+{
+	mongo_connection *con;
+	mongo_server_def def;
+	char host[64];
+
+	init_def(&def, host, i);
+
+	con = calloc(1, sizeof(mongo_connection));
+	con->socket = (void*) 1;
+	con->id = mongo_server_def_id(&def);
+	con->hash = strdup(con->id->hash);
+	con->hash_key = con->id->key;
+	con->refcount = 1; /* The manager's reference */
+	mongo_manager_connection_register(manager, con);
+
+	return con;
+}
+
+static double now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+int main(void)
+{
+	int sizes[] = { 1, 10, 100, 1000 };
+	int s, i, found;
+	mongo_con_manager *manager;
+	mongo_connection **cons;
+	mongo_server_def def;
+	char host[64];
+	double start, elapsed;
+
+	for (s = 0; s < (int) (sizeof(sizes) / sizeof(sizes[0])); s++) {
+		manager = mongo_init();
+		manager->close = close_noop;
+		cons = malloc(sizes[s] * sizeof(mongo_connection*));
+
+		for (i = 0; i < sizes[s]; i++) {
+			cons[i] = create_con(manager, i);
+		}
+
+		found = 0;
+		start = now();
+		for (i = 0; i < LOOKUPS; i++) {
+			if (mongo_manager_connection_find_by_hash(manager, cons[((unsigned int) i * 7919u) % sizes[s]]->hash)) {
+				found++;
+			}
+		}
+		elapsed = now() - start;
+
+		printf("connections: %4d; lookups: %d; found: %d; %.1f ns/lookup\n", sizes[s], LOOKUPS, found, elapsed * 1e9 / LOOKUPS);
+
+		free(cons);
+		mongo_deinit(manager);
+	}
+
+	/* Server identities: the first lookup for a definition goes to the
+	 * intern table, after that it is cached in the definition */
+	found = 0;
+	start = now();
+	for (i = 0; i < LOOKUPS; i++) {
+		init_def(&def, host, i % 1000);
+		if (mongo_server_def_id(&def)) {
+			found++;
+		}
+	}
+	elapsed = now() - start;
+	printf("identity from the intern table: %.1f ns/lookup\n", elapsed * 1e9 / LOOKUPS);
+
+	start = now();
+	for (i = 0; i < LOOKUPS; i++) {
+		if (mongo_server_def_id(&def)) {
+			found++;
+		}
+	}
+	elapsed = now() - start;
+	printf("identity cached in the definition: %.1f ns/lookup\n", elapsed * 1e9 / LOOKUPS);
+
+	return 0;
+}
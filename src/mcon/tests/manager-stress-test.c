@@ -0,0 +1,111 @@
+#include "manager.h"
+#include "parse.h"
+#include "types.h"
+#include "mock-server.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/time.h>
+
+#define ITERATIONS 20000
+#define MAX_THREADS 16
+
+/* Many threads fetch connections from one manager at the same time. In the
+ * "cached" run nothing needs to go over the wire, so this measures the
+ * registry's lock contention. In the "pinging" run every fetch pings the
+ * server, and one thread regularly deregisters the connection that everybody
+ * else is using, so that they have to reconnect. Replies whose responseTo
+ * doesn't match the request that was sent on the socket, or malformed
+ * messages arriving at the server, mean that two threads wrote to the same
+ * socket at the same time. Build with -fsanitize=address to also catch
+ * connections being freed while another thread still uses them. */
+
+static mongo_con_manager *manager;
+static char               dsn[64];
+static int                lost_races = 0;
+
+static void *worker(void *arg)
+{
+	long               id = (long) arg;
+	mongo_servers     *servers;
+	mongo_connection  *con;
+	char              *error_message;
+	int                i;
+
+	servers = mongo_parse_init();
+	mongo_parse_server_spec(manager, servers, dsn, &error_message);
+
+	for (i = 0; i < ITERATIONS; i++) {
+		error_message = NULL;
+		con = mongo_get_read_write_connection(manager, servers, MONGO_CON_FLAG_READ, &error_message);
+		if (!con) {
+			/* Expected when selection raced with the deregistration below */
+			__sync_add_and_fetch(&lost_races, 1);
+			free(error_message);
+			continue;
+		}
+		if (id == 0 && i % 500 == 499) {
+			mongo_manager_connection_deregister(manager, con);
+		}
+		mongo_manager_connection_release(manager, con);
+	}
+
+	mongo_servers_dtor(servers);
+	return NULL;
+}
+
+static double now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static void run(const char *name, int ping_interval, mock_server *server)
+{
+	int       threads[] = { 1, 2, 4, 8, MAX_THREADS };
+	pthread_t tids[MAX_THREADS];
+	int       t;
+	long      i;
+	double    start, elapsed;
+
+	for (t = 0; t < (int) (sizeof(threads) / sizeof(threads[0])); t++) {
+		manager = mongo_init();
+		mock_server_setup_manager(manager);
+		manager->ping_interval = ping_interval;
+
+		start = now();
+		for (i = 0; i < threads[t]; i++) {
+			pthread_create(&tids[i], NULL, worker, (void *) i);
+		}
+		for (i = 0; i < threads[t]; i++) {
+			pthread_join(tids[i], NULL);
+		}
+		elapsed = now() - start;
+
+		printf("%-8s %2d threads: %8.0f fetches/s\n", name, threads[t], threads[t] * ITERATIONS / elapsed);
+		mongo_deinit(manager);
+	}
+}
+
+int main(void)
+{
+	mock_server server;
+
+	memset(&server, 0, sizeof(server));
+	if (!mock_server_start(&server)) {
+		printf("Couldn't start the mock server\n");
+		return 1;
+	}
+	snprintf(dsn, sizeof(dsn), "mongodb://127.0.0.1:%d", server.port);
+
+	run("cached", 3600, &server);
+	run("pinging", 0, &server);
+
+	printf("requests: %d, lost races: %d, mismatched replies: %d, protocol errors: %d\n", server.requests, lost_races, mock_io_mismatches, server.protocol_errors);
+	mock_server_stop(&server);
+
+	return mock_io_mismatches || server.protocol_errors;
+}
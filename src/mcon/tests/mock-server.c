@@ -0,0 +1,333 @@
+#include "mock-server.h"
+#include "manager.h"
+#include "connections.h"
+#include "utils.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/ioctl.h>
+
+#define MOCK_OP_REPLY  1
+#define MOCK_OP_INSERT 2002
+#define MOCK_OP_QUERY  2004
+
+int mock_io_mismatches = 0;
+
+static int read_all(int fd, char *buffer, int size)
+{
+	int done = 0, r;
+
+	while (done < size) {
+		r = recv(fd, buffer + done, size - done, 0);
+		if (r <= 0) {
+			if (r < 0 && errno == EINTR) {
+				continue;
+			}
+			return -1;
+		}
+		done += r;
+	}
+	return done;
+}
+
+static int write_all(int fd, char *buffer, int size)
+{
+	int done = 0, r;
+
+	while (done < size) {
+		r = send(fd, buffer + done, size - done, MSG_NOSIGNAL);
+		if (r <= 0) {
+			if (r < 0 && errno == EINTR) {
+				continue;
+			}
+			return -1;
+		}
+		done += r;
+	}
+	return done;
+}
+
+/* Server side */
+static const char mock_reply_doc[] =
+	"\x44\x00\x00\x00"
+	"\x08ismaster\x00\x01"
+	"\x10maxWireVersion\x00\x02\x00\x00\x00"
+	"\x10minWireVersion\x00\x00\x00\x00\x00"
+	"\x01ok\x00\x00\x00\x00\x00\x00\x00\xf0\x3f"
+	"\x00";
+
+typedef struct _mock_client
+{
+	mock_server *server;
+	int          fd;
+} mock_client;
+
+static int mock_server_has_pending(int fd)
+{
+	int pending = 0;
+
+	ioctl(fd, FIONREAD, &pending);
+	return pending > 0;
+}
+
+static void *mock_server_client(void *arg)
+{
+	mock_client *client = (mock_client *)arg;
+	mock_server *server = client->server;
+	char         header[16], *reply;
+	char        *body;
+	const char  *document;
+	int32_t      length, request_id, opcode, tmp, doc_length;
+
+	while (read_all(client->fd, header, 16) == 16) {
+		memcpy(&length, header, 4);
+		memcpy(&request_id, header + 4, 4);
+		memcpy(&opcode, header + 12, 4);
+
+		if ((opcode != MOCK_OP_QUERY && opcode != MOCK_OP_INSERT) || length < 16 || length > 16 * 1024 * 1024) {
+			__sync_add_and_fetch(&server->protocol_errors, 1);
+			break;
+		}
+		body = malloc(length - 16);
+		if (read_all(client->fd, body, length - 16) != length - 16) {
+			free(body);
+			break;
+		}
+		server->last_length = length;
+		server->last_digest = mongo_digest_update(mongo_digest_update(MONGO_DIGEST_INIT, header, 16), body, length - 16);
+		free(body);
+
+		if (opcode == MOCK_OP_INSERT) {
+			__sync_add_and_fetch(&server->inserts, 1);
+			continue;
+		}
+		if (server->down) {
+			break;
+		}
+		/* Pipelined requests arrive in the same round trip, so only the
+		 * last one of them waits */
+		if (server->delay_us && !mock_server_has_pending(client->fd)) {
+			usleep(server->delay_us);
+		}
+
+		document = server->document ? server->document : mock_reply_doc;
+		memcpy(&doc_length, document, 4);
+		reply = malloc(36 + doc_length);
+
+		memset(reply, 0, 36);
+		tmp = 36 + doc_length;
+		memcpy(reply, &tmp, 4);
+		tmp = request_id + 1000000;
+		memcpy(reply + 4, &tmp, 4);
+		memcpy(reply + 8, &request_id, 4);
+		tmp = MOCK_OP_REPLY;
+		memcpy(reply + 12, &tmp, 4);
+		tmp = 1;
+		memcpy(reply + 32, &tmp, 4);
+		memcpy(reply + 36, document, doc_length);
+
+		/* Counted before the reply goes out, so clients never see an
+		 * answer that isn't counted yet */
+		__sync_add_and_fetch(&server->requests, 1);
+		if (write_all(client->fd, reply, 36 + doc_length) < 0) {
+			free(reply);
+			break;
+		}
+		free(reply);
+	}
+
+	close(client->fd);
+	free(client);
+	return NULL;
+}
+
+static void *mock_server_listen(void *arg)
+{
+	mock_server *server = (mock_server *)arg;
+	mock_client *client;
+	pthread_t    thread;
+	int          fd;
+
+	while ((fd = accept(server->fd, NULL, NULL)) >= 0) {
+		__sync_add_and_fetch(&server->connections, 1);
+		client = malloc(sizeof(mock_client));
+		client->server = server;
+		client->fd = fd;
+		pthread_create(&thread, NULL, mock_server_client, client);
+		pthread_detach(thread);
+	}
+	return NULL;
+}
+
+int mock_server_start(mock_server *server)
+{
+	struct sockaddr_in addr;
+	socklen_t          len = sizeof(addr);
+
+	server->requests = 0;
+	server->inserts = 0;
+	server->connections = 0;
+	server->protocol_errors = 0;
+	server->fd = socket(AF_INET, SOCK_STREAM, 0);
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = 0;
+
+	if (bind(server->fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(server->fd, 128) != 0) {
+		close(server->fd);
+		return 0;
+	}
+	getsockname(server->fd, (struct sockaddr *)&addr, &len);
+	server->port = ntohs(addr.sin_port);
+
+	pthread_create(&server->thread, NULL, mock_server_listen, server);
+	return 1;
+}
+
+void mock_server_stop(mock_server *server)
+{
+	shutdown(server->fd, SHUT_RDWR);
+	close(server->fd);
+	pthread_join(server->thread, NULL);
+}
+
+/* Client side */
+typedef struct _mock_socket
+{
+	int                fd;
+	int32_t            last_request_id;
+	mongo_con_manager *manager;
+} mock_socket;
+
+static void *mock_io_connect(mongo_con_manager *manager, mongo_server_def *server, mongo_server_options *options, char **error_message)
+{
+	struct sockaddr_in addr;
+	mock_socket       *sock;
+	int                fd, flag = 1;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(server->port);
+	inet_pton(AF_INET, server->host, &addr.sin_addr);
+
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+		*error_message = strdup(strerror(errno));
+		close(fd);
+		return NULL;
+	}
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+
+	sock = malloc(sizeof(mock_socket));
+	sock->fd = fd;
+	sock->last_request_id = 0;
+	sock->manager = manager;
+	return sock;
+}
+
+static int mock_io_recv_header(mongo_connection *con, mongo_server_options *options, int timeout, void *data, int size, char **error_message)
+{
+	mock_socket *sock = (mock_socket *)con->socket;
+	int32_t      response_to;
+
+	if (read_all(sock->fd, data, size) != size) {
+		*error_message = strdup("mock_io_recv_header: short read");
+		mongo_manager_server_failed(sock->manager, con, *error_message);
+		return -1;
+	}
+	memcpy(&response_to, (char *)data + 8, 4);
+	if (response_to != sock->last_request_id) {
+		__sync_add_and_fetch(&mock_io_mismatches, 1);
+	}
+	mongo_connection_io_received(con);
+	return size;
+}
+
+static int mock_io_recv_data(mongo_connection *con, mongo_server_options *options, int timeout, void *data, int size, char **error_message)
+{
+	mock_socket *sock = (mock_socket *)con->socket;
+
+	if (read_all(sock->fd, data, size) != size) {
+		*error_message = strdup("mock_io_recv_data: short read");
+		mongo_manager_server_failed(sock->manager, con, *error_message);
+		return -1;
+	}
+	mongo_connection_io_received(con);
+	return size;
+}
+
+static int mock_io_send(mongo_connection *con, mongo_server_options *options, void *data, int size, char **error_message)
+{
+	mock_socket *sock = (mock_socket *)con->socket;
+
+	memcpy(&sock->last_request_id, (char *)data + 4, 4);
+	mongo_connection_io_sent(con);
+	if (write_all(sock->fd, data, size) != size) {
+		*error_message = strdup("mock_io_send: short write");
+		mongo_manager_server_failed(sock->manager, con, *error_message);
+		return -1;
+	}
+	return size;
+}
+
+static int mock_io_sendv(mongo_connection *con, mongo_server_options *options, struct iovec *iov, int count, char **error_message)
+{
+	mock_socket *sock = (mock_socket *)con->socket;
+	int          i, sent = 0;
+
+	memcpy(&sock->last_request_id, (char *)iov[0].iov_base + 4, 4);
+	mongo_connection_io_sent(con);
+	for (i = 0; i < count; i++) {
+		if (write_all(sock->fd, iov[i].iov_base, iov[i].iov_len) != (int)iov[i].iov_len) {
+			*error_message = strdup("mock_io_sendv: short write");
+			mongo_manager_server_failed(sock->manager, con, *error_message);
+			return -1;
+		}
+		sent += iov[i].iov_len;
+	}
+	return sent;
+}
+
+static void mock_io_close(mongo_connection *con, int why)
+{
+	mock_socket *sock = (mock_socket *)con->socket;
+
+	close(sock->fd);
+	free(sock);
+}
+
+static void mock_io_forget(mongo_con_manager *manager, mongo_connection *con)
+{
+}
+
+static int mock_io_poll_fd(mongo_connection *con)
+{
+	return ((mock_socket *)con->socket)->fd;
+}
+
+static int mock_io_authenticate(mongo_con_manager *manager, mongo_connection *con, mongo_server_options *options, mongo_server_def *server_def, char **error_message)
+{
+	return 1;
+}
+
+void mock_server_setup_manager(mongo_con_manager *manager)
+{
+	manager->connect               = mock_io_connect;
+	manager->recv_header           = mock_io_recv_header;
+	manager->recv_data             = mock_io_recv_data;
+	manager->send                  = mock_io_send;
+	manager->sendv                 = mock_io_sendv;
+	manager->close                 = mock_io_close;
+	manager->forget                = mock_io_forget;
+	manager->authenticate          = mock_io_authenticate;
+	manager->poll_fd               = mock_io_poll_fd;
+	manager->supports_wire_version = mongo_mcon_supports_wire_version;
+}
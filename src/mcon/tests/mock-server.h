@@ -0,0 +1,38 @@
+#ifndef __MCON_TESTS_MOCK_SERVER_H__
+#define __MCON_TESTS_MOCK_SERVER_H__
+
+#include "types.h"
+#include <pthread.h>
+
+/* A stand-in for mongod, listening on an ephemeral port on 127.0.0.1. It
+ * answers every OP_QUERY with a single document that is good enough for
+ * ismaster, buildinfo and ping:
+ * { ismaster: true, maxWireVersion: 2, minWireVersion: 0, ok: 1.0 }
+ * OP_INSERTs are only counted, as mongod doesn't answer them either. */
+typedef struct _mock_server
+{
+	int       fd;
+	int       port;
+	pthread_t thread;
+	int       requests;        /* Number of queries answered */
+	int       inserts;         /* Number of OP_INSERTs received */
+	int       connections;     /* Number of connections accepted */
+	int       protocol_errors; /* Malformed (f.e. interleaved) messages received */
+	int       delay_us;        /* Delay before replying to every (batch of pipelined) request(s), to simulate latency */
+	const char *document;      /* BSON document to reply with instead of the default one */
+	int       down;            /* Close connections instead of replying */
+	int       last_length;     /* Length of the last message received */
+	uint64_t  last_digest;     /* mongo_digest_update() of the last message received */
+} mock_server;
+
+int mock_server_start(mock_server *server);
+void mock_server_stop(mock_server *server);
+
+/* Sets up the manager's I/O callbacks with plain blocking sockets, which
+ * report round trips and failures to the manager like the PHP stream ones.
+ * Every reply's responseTo is checked against the requestID of the last
+ * message sent on that socket; mismatches are counted in mock_io_mismatches. */
+extern int mock_io_mismatches;
+void mock_server_setup_manager(mongo_con_manager *manager);
+
+#endif
@@ -0,0 +1,139 @@
+#include "manager.h"
+#include "monitor.h"
+#include "parse.h"
+#include "pool.h"
+#include "topology.h"
+#include "types.h"
+#include "mock-server.h"
+#include "check.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+/* { ismaster: false, secondary: true, maxWireVersion: 2, minWireVersion: 0, ok: 1.0 } */
+static const char secondary_doc[] =
+	"\x50\x00\x00\x00"
+	"\x08ismaster\x00\x00"
+	"\x08secondary\x00\x01"
+	"\x10maxWireVersion\x00\x02\x00\x00\x00"
+	"\x10minWireVersion\x00\x00\x00\x00\x00"
+	"\x01ok\x00\x00\x00\x00\x00\x00\x00\xf0\x3f"
+	"\x00";
+
+static mongo_con_manager *manager;
+
+/* Waits until the monitor has completed another count rounds */
+static void wait_rounds(int count)
+{
+	int64_t target;
+
+	pthread_mutex_lock(&manager->monitor->lock);
+	target = manager->monitor->rounds + count;
+	while (manager->monitor->rounds < target) {
+		pthread_cond_wait(&manager->monitor->wakeup, &manager->monitor->lock);
+	}
+	pthread_mutex_unlock(&manager->monitor->lock);
+}
+
+int main(void)
+{
+	mock_server       server;
+	mongo_servers    *servers;
+	mongo_connection *con, *pooled;
+	mongo_topology   *topology;
+	mongo_pool_info   info;
+	char             *error_message = NULL;
+	char              dsn[64];
+	struct timeval    start;
+	int64_t           version;
+	long              elapsed;
+	int               failed = 0;
+
+	memset(&server, 0, sizeof(server));
+	if (!mock_server_start(&server)) {
+		printf("Couldn't start the mock server\n");
+		return 1;
+	}
+	snprintf(dsn, sizeof(dsn), "mongodb://127.0.0.1:%d", server.port);
+
+	manager = mongo_init();
+	mock_server_setup_manager(manager);
+	manager->ping_interval = 0;
+	manager->ismaster_interval = 0;
+
+	servers = mongo_parse_init();
+	mongo_parse_server_spec(manager, servers, dsn, &error_message);
+	con = mongo_get_read_write_connection(manager, servers, MONGO_CON_FLAG_READ, &error_message);
+	if (!con) {
+		printf("Couldn't connect: %s\n", error_message);
+		return 1;
+	}
+	mongo_manager_connection_release(manager, con);
+
+	mongo_monitor_start(manager, 20, 160);
+	wait_rounds(1);
+	version = manager->topology_version;
+
+	/* An unchanged reply doesn't rebuild the topology, and the monitor backs off */
+	wait_rounds(5);
+	failed += check("an unchanged ismaster reply keeps the topology version", manager->topology_version == version);
+	failed += check("heartbeat backs off while nothing changes", manager->monitor->heartbeat_ms == 160);
+
+	/* Even with both intervals at zero, requests no longer wait for round trips */
+	server.delay_us = 100000;
+	gettimeofday(&start, NULL);
+	con = mongo_get_read_write_connection(manager, servers, MONGO_CON_FLAG_READ, &error_message);
+	elapsed = elapsed_ms(&start);
+	failed += check("requests don't ping or run ismaster themselves", con && elapsed < 50);
+	if (con) {
+		mongo_manager_connection_release(manager, con);
+	}
+	server.delay_us = 0;
+
+	/* Idle sockets are closed by the monitor, without waiting for a checkout */
+	con = mongo_get_read_write_connection(manager, servers, MONGO_CON_FLAG_READ, &error_message);
+	pooled = mongo_pool_checkout(manager, con, &servers->options, &error_message);
+	pthread_mutex_lock(&con->pool->lock);
+	con->pool->max_idle = 1;
+	con->pool->min_size = 0;
+	pthread_mutex_unlock(&con->pool->lock);
+	mongo_pool_checkin(manager, con, pooled, 0);
+	sleep(2);
+	wait_rounds(1);
+	mongo_pool_get_info(con->pool, &info);
+	failed += check("the monitor reaps idle sockets", info.in_pool == 0);
+	mongo_manager_connection_release(manager, con);
+
+	/* A changed reply is picked up, and published as a new version */
+	server.document = secondary_doc;
+	wait_rounds(2);
+	failed += check("a changed ismaster reply publishes a new topology", manager->topology_version > version);
+	failed += check("the new topology has the server's new state", manager->topology->count == 1 && manager->topology->connections[0]->connection_type == MONGO_NODE_SECONDARY);
+	failed += check("heartbeat speeds up after a change", manager->monitor->heartbeat_ms < 160);
+
+	/* A failing server is removed */
+	wait_rounds(5);
+	version = manager->topology_version;
+	server.down = 1;
+	wait_rounds(2);
+	failed += check("a failing server is removed from the topology", manager->topology_version > version && manager->topology->count == 0);
+
+	mongo_monitor_stop(manager);
+	failed += check("the monitor stops", manager->monitor == NULL);
+
+	/* A replaced snapshot stays around while it's in use, and no longer */
+	topology = mongo_topology_acquire(manager);
+	mongo_topology_publish(manager);
+	failed += check("a retired snapshot in use is kept", manager->retired_topologies == topology);
+	mongo_topology_release(topology);
+	mongo_topology_collect(manager);
+	failed += check("an unused retired snapshot is freed", manager->retired_topologies == NULL);
+
+	mongo_servers_dtor(servers);
+	mongo_deinit(manager);
+	mock_server_stop(&server);
+
+	return failed;
+}
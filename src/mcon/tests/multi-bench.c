@@ -0,0 +1,150 @@
+#include "manager.h"
+#include "connections.h"
+#include "parse.h"
+#include "packet.h"
+#include "multi.h"
+#include "buffer.h"
+#include "bson_helpers.h"
+#include "types.h"
+#include "mock-server.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/time.h>
+
+#define SERVERS    2
+#define OPERATIONS 8
+#define BATCHES    200
+
+/* Runs batches of independent operations against two local servers, which
+ * stand in for two clusters with different latencies, one after the other,
+ * and with mongo_multi_exec(), and reports how long a batch takes */
+
+static mongo_con_manager *manager;
+static mongo_servers     *servers[SERVERS];
+
+static double now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+/* { buildinfo: 1 } in an OP_QUERY on admin.$cmd */
+static mongo_packet *create_packet(void)
+{
+	mongo_packet *packet;
+	int           doc_offset;
+
+	packet = mongo_packet_create(2004);
+	mcon_serialize_int(packet->str, 0); /* Flags */
+	mcon_str_addl(packet->str, "admin.$cmd", 11, 0);
+	mcon_serialize_int(packet->str, 0); /* Number to skip */
+	mcon_serialize_int(packet->str, -1); /* Number to return */
+
+	doc_offset = packet->str->l;
+	mcon_serialize_int(packet->str, 0);
+	mcon_str_addl(packet->str, "\x10" "buildinfo", 11, 0);
+	mcon_serialize_int32(packet->str, 1);
+	mcon_str_addl(packet->str, "\x00", 1, 0);
+	mongo_packet_patch_int32(packet, doc_offset, packet->str->l - doc_offset);
+
+	return packet;
+}
+
+static void run_serial(mongo_multi_op *ops)
+{
+	mongo_connection *con;
+	char             *data_buffer, *error_message = NULL;
+	int               i;
+
+	for (i = 0; i < OPERATIONS; i++) {
+		con = mongo_get_read_write_connection(manager, ops[i].servers, MONGO_CON_FLAG_READ, &error_message);
+		if (!con || !mongo_connection_send_packet(manager, con, &ops[i].servers->options, ops[i].packet, &data_buffer, &error_message)) {
+			printf("Operation failed: %s\n", error_message);
+			exit(1);
+		}
+		mongo_buffer_free(data_buffer);
+		mongo_manager_connection_release(manager, con);
+	}
+}
+
+static void run_multi(mongo_multi_op *ops)
+{
+	int i;
+
+	if (mongo_multi_exec(manager, ops, OPERATIONS) != OPERATIONS) {
+		printf("Operation failed\n");
+		exit(1);
+	}
+	for (i = 0; i < OPERATIONS; i++) {
+		mongo_buffer_free(ops[i].data_buffer);
+	}
+}
+
+static void run(mongo_multi_op *ops, void (*batch)(mongo_multi_op *), const char *what)
+{
+	double start = now();
+	int    i;
+
+	for (i = 0; i < BATCHES; i++) {
+		batch(ops);
+	}
+	printf("%-30s %8.1fus/batch\n", what, (now() - start) * 1000000 / BATCHES);
+}
+
+int main(void)
+{
+	mongo_multi_op ops[OPERATIONS];
+	mock_server    server[SERVERS];
+	char          *error_message = NULL;
+	char           dsn[64];
+	int            i;
+
+	manager = mongo_init();
+	manager->authenticate = mongo_connection_authenticate;
+	manager->supports_wire_version = mongo_mcon_supports_wire_version;
+
+	for (i = 0; i < SERVERS; i++) {
+		memset(&server[i], 0, sizeof(mock_server));
+		if (!mock_server_start(&server[i])) {
+			printf("Couldn't start the mock server\n");
+			return 1;
+		}
+		snprintf(dsn, sizeof(dsn), "mongodb://127.0.0.1:%d", server[i].port);
+		servers[i] = mongo_parse_init();
+		mongo_parse_server_spec(manager, servers[i], dsn, &error_message);
+	}
+
+	memset(ops, 0, sizeof(ops));
+	for (i = 0; i < OPERATIONS; i++) {
+		ops[i].servers = servers[i % SERVERS];
+		ops[i].connection_flags = MONGO_CON_FLAG_READ;
+		ops[i].packet = create_packet();
+	}
+
+	/* Open the sockets that the batches need before timing anything */
+	run_multi(ops);
+
+	run(ops, run_serial, "no latency, serial:");
+	run(ops, run_multi, "no latency, multi:");
+
+	server[0].delay_us = 500;
+	server[1].delay_us = 2000;
+	run(ops, run_serial, "0.5ms and 2ms, serial:");
+	run(ops, run_multi, "0.5ms and 2ms, multi:");
+
+	for (i = 0; i < OPERATIONS; i++) {
+		mongo_packet_dtor(ops[i].packet);
+	}
+	for (i = 0; i < SERVERS; i++) {
+		mongo_servers_dtor(servers[i]);
+	}
+	mongo_deinit(manager);
+	for (i = 0; i < SERVERS; i++) {
+		mock_server_stop(&server[i]);
+	}
+
+	return 0;
+}
@@ -0,0 +1,174 @@
+#include "manager.h"
+#include "connections.h"
+#include "parse.h"
+#include "packet.h"
+#include "multi.h"
+#include "buffer.h"
+#include "bson_helpers.h"
+#include "mini_bson.h"
+#include "types.h"
+#include "mock-server.h"
+#include "check.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/time.h>
+
+#define OPERATIONS 6
+
+/* Runs operations against two servers, which stand in for two clusters,
+ * with mongo_multi_exec() over the native transport, and checks that every
+ * result goes to its own operation, that the operations take as long as
+ * the slowest one, and that a failing server only fails its own. */
+
+static mongo_con_manager *manager;
+static mongo_servers     *servers[2];
+static mock_server        server[2];
+static char               document[2][24];
+
+/* { ok: 1.0, n: <n> }, so that the replies of the servers can be told apart */
+static void create_document(char *doc, int32_t n)
+{
+	double  ok = 1.0;
+	int32_t length = 24;
+
+	memcpy(doc, &length, 4);
+	memcpy(doc + 4, "\x01" "ok", 4);
+	memcpy(doc + 8, &ok, 8);
+	memcpy(doc + 16, "\x10" "n", 3);
+	memcpy(doc + 19, &n, 4);
+	doc[23] = 0;
+}
+
+/* { buildinfo: 1 } in an OP_QUERY on admin.$cmd */
+static mongo_packet *create_packet(void)
+{
+	mongo_packet *packet;
+	int           doc_offset;
+
+	packet = mongo_packet_create(2004);
+	mcon_serialize_int(packet->str, 0); /* Flags */
+	mcon_str_addl(packet->str, "admin.$cmd", 11, 0);
+	mcon_serialize_int(packet->str, 0); /* Number to skip */
+	mcon_serialize_int(packet->str, -1); /* Number to return */
+
+	doc_offset = packet->str->l;
+	mcon_serialize_int(packet->str, 0);
+	mcon_str_addl(packet->str, "\x10" "buildinfo", 11, 0);
+	mcon_serialize_int32(packet->str, 1);
+	mcon_str_addl(packet->str, "\x00", 1, 0);
+	mongo_packet_patch_int32(packet, doc_offset, packet->str->l - doc_offset);
+
+	return packet;
+}
+
+/* Operation i goes to server i % 2. Returns the number that worked, and
+ * how long they took. Replies that didn't come from the right server are
+ * counted in *mixed_up. */
+static int run(mongo_multi_op *ops, long *elapsed, int *mixed_up)
+{
+	struct timeval start;
+	int32_t        n;
+	int            i, worked;
+
+	memset(ops, 0, OPERATIONS * sizeof(mongo_multi_op));
+	for (i = 0; i < OPERATIONS; i++) {
+		ops[i].servers = servers[i % 2];
+		ops[i].connection_flags = MONGO_CON_FLAG_READ;
+		ops[i].packet = create_packet();
+	}
+
+	gettimeofday(&start, NULL);
+	worked = mongo_multi_exec(manager, ops, OPERATIONS);
+	*elapsed = elapsed_ms(&start);
+
+	*mixed_up = 0;
+	for (i = 0; i < OPERATIONS; i++) {
+		if (ops[i].retval) {
+			if (!bson_find_field_as_int32(ops[i].data_buffer + sizeof(int32_t), "n", &n) || n != i % 2) {
+				(*mixed_up)++;
+			}
+			mongo_buffer_free(ops[i].data_buffer);
+		} else {
+			free(ops[i].error_message);
+		}
+		mongo_packet_dtor(ops[i].packet);
+	}
+
+	return worked;
+}
+
+int main(void)
+{
+	mongo_multi_op    ops[OPERATIONS];
+	mongo_connection *con;
+	char             *error_message = NULL;
+	char              dsn[64];
+	long              elapsed;
+	int               i, worked, mixed_up, failed = 0;
+
+	manager = mongo_init();
+	manager->authenticate = mongo_connection_authenticate;
+	manager->supports_wire_version = mongo_mcon_supports_wire_version;
+	manager->pool_size = 1;
+
+	for (i = 0; i < 2; i++) {
+		memset(&server[i], 0, sizeof(mock_server));
+		if (!mock_server_start(&server[i])) {
+			printf("Couldn't start the mock server\n");
+			return 1;
+		}
+		create_document(document[i], i);
+		server[i].document = document[i];
+
+		snprintf(dsn, sizeof(dsn), "mongodb://127.0.0.1:%d/?socketTimeoutMS=500", server[i].port);
+		servers[i] = mongo_parse_init();
+		mongo_parse_server_spec(manager, servers[i], dsn, &error_message);
+
+		/* Connect before timing anything */
+		con = mongo_get_read_write_connection(manager, servers[i], MONGO_CON_FLAG_READ, &error_message);
+		if (!con) {
+			printf("Couldn't connect: %s\n", error_message);
+			return 1;
+		}
+		mongo_manager_connection_release(manager, con);
+	}
+
+	/* With one socket per pool, the three operations on each server go out
+	 * in three rounds, each of which waits for the slower server */
+	server[0].delay_us = 50000;
+	server[1].delay_us = 100000;
+	worked = run(ops, &elapsed, &mixed_up);
+	printf("%d operations took %ldms\n", OPERATIONS, elapsed);
+	failed += check("every operation works", worked == OPERATIONS);
+	failed += check("every result goes to its own operation", mixed_up == 0);
+	failed += check("operations that can't get a socket wait for the next round", elapsed >= 300 && elapsed < 450);
+
+	/* With a socket for each, they take as long as the slowest one */
+	manager->pool_size = -1;
+	for (i = 0; i < 2; i++) {
+		con = mongo_get_read_write_connection(manager, servers[i], MONGO_CON_FLAG_READ, &error_message);
+		con->pool->max_size = -1;
+		mongo_manager_connection_release(manager, con);
+	}
+	worked = run(ops, &elapsed, &mixed_up);
+	printf("%d operations took %ldms\n", OPERATIONS, elapsed);
+	failed += check("every operation works", worked == OPERATIONS && mixed_up == 0);
+	failed += check("they take as long as the slowest one", elapsed >= 100 && elapsed < 150);
+
+	/* A server that is too slow only fails its own operations */
+	server[1].delay_us = 1000000;
+	worked = run(ops, &elapsed, &mixed_up);
+	failed += check("a slow server only times its own operations out", worked == OPERATIONS / 2 && mixed_up == 0);
+	failed += check("at its socket timeout", elapsed >= 490 && elapsed < 700);
+
+	for (i = 0; i < 2; i++) {
+		mongo_servers_dtor(servers[i]);
+	}
+	mongo_deinit(manager);
+	for (i = 0; i < 2; i++) {
+		mock_server_stop(&server[i]);
+	}
+
+	return failed;
+}
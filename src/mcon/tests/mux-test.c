@@ -0,0 +1,183 @@
+#include "manager.h"
+#include "connections.h"
+#include "parse.h"
+#include "pool.h"
+#include "mux.h"
+#include "types.h"
+#include "mock-server.h"
+#include "check.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/time.h>
+
+#define THREADS 16
+#define ROUNDS  20
+#define RTT_MS  10
+
+/* Runs operations from many threads on a multiplexed connection over the
+ * native transport, and checks that they share one socket, that their round
+ * trips overlap, and that every one of them is told when the socket fails. */
+
+static mongo_con_manager *manager;
+static mongo_servers     *servers;
+static mongo_connection  *con;
+static mock_server        server;
+static int                errors = 0;
+
+static void *worker(void *arg)
+{
+	mongo_connection *pooled;
+	char             *error_message = NULL;
+	int               i, ok;
+
+	for (i = 0; i < ROUNDS; i++) {
+		pooled = mongo_pool_checkout(manager, con, &servers->options, &error_message);
+		if (!pooled) {
+			free(error_message);
+			__sync_add_and_fetch(&errors, 1);
+			continue;
+		}
+		ok = mongo_connection_get_server_version(manager, pooled, &servers->options, &error_message);
+		if (!ok) {
+			free(error_message);
+			__sync_add_and_fetch(&errors, 1);
+		}
+		mongo_pool_checkin(manager, con, pooled, !ok);
+	}
+	return NULL;
+}
+
+static void *slow_operation(void *arg)
+{
+	char *error_message = NULL;
+
+	if (!mongo_connection_get_server_version(manager, con, &servers->options, &error_message)) {
+		free(error_message);
+		__sync_add_and_fetch(&errors, 1);
+	}
+	return NULL;
+}
+
+static void *later_slow_operation(void *arg)
+{
+	usleep(10000);
+	return slow_operation(arg);
+}
+
+/* Runs ROUNDS operations in each of THREADS threads, and returns how long
+ * that took */
+static long run_threads(void)
+{
+	pthread_t      tids[THREADS];
+	struct timeval start;
+	long           i;
+
+	errors = 0;
+	gettimeofday(&start, NULL);
+	for (i = 0; i < THREADS; i++) {
+		pthread_create(&tids[i], NULL, worker, NULL);
+	}
+	for (i = 0; i < THREADS; i++) {
+		pthread_join(tids[i], NULL);
+	}
+	return elapsed_ms(&start);
+}
+
+int main(void)
+{
+	pthread_t      tid;
+	struct timeval start;
+	char          *error_message = NULL;
+	char           dsn[64];
+	long           elapsed;
+	int            ok, failed = 0, connections, orphans;
+
+	memset(&server, 0, sizeof(server));
+	if (!mock_server_start(&server)) {
+		printf("Couldn't start the mock server\n");
+		return 1;
+	}
+	snprintf(dsn, sizeof(dsn), "mongodb://127.0.0.1:%d/?socketTimeoutMS=2000", server.port);
+
+	manager = mongo_init();
+	manager->authenticate = mongo_connection_authenticate;
+	manager->supports_wire_version = mongo_mcon_supports_wire_version;
+	manager->multiplex = 1;
+	manager->ping_interval = 3600;
+
+	servers = mongo_parse_init();
+	mongo_parse_server_spec(manager, servers, dsn, &error_message);
+	con = mongo_get_read_write_connection(manager, servers, MONGO_CON_FLAG_READ, &error_message);
+	if (!con) {
+		printf("Couldn't connect: %s\n", error_message);
+		return 1;
+	}
+	/* Keep our own reference, as the registry's goes when the server fails */
+	mongo_connection_addref(con);
+	mongo_manager_connection_release(manager, con);
+	failed += check("the connection is multiplexed", con->mux != NULL);
+
+	server.delay_us = RTT_MS * 1000;
+	connections = server.connections;
+	elapsed = run_threads();
+	printf("%d operations took %ldms, %ldms each if they were serial\n", THREADS * ROUNDS, elapsed, (long)RTT_MS * THREADS * ROUNDS);
+	failed += check("every operation works", errors == 0);
+	failed += check("they share the one socket", server.connections == connections);
+	failed += check("their round trips overlap", elapsed < RTT_MS * THREADS * ROUNDS / 4);
+	failed += check("nobody is left waiting", con->mux->waiters == NULL && con->mux->in_flight == 0);
+
+	/* An operation that gives up while another one reads leaves its reply
+	 * to be dropped, and the socket stays usable */
+	errors = 0;
+	server.delay_us = 100000;
+	pthread_create(&tid, NULL, slow_operation, NULL);
+	usleep(20000);
+	gettimeofday(&start, NULL);
+	mongo_connection_set_budget(con, 20);
+	ok = mongo_connection_get_server_version(manager, con, &servers->options, &error_message);
+	failed += check("an operation that runs out of time fails", !ok && elapsed_ms(&start) < 100);
+	if (!ok) {
+		free(error_message);
+	}
+	pthread_join(tid, NULL);
+	failed += check("the one that kept waiting gets its reply", errors == 0);
+	server.delay_us = 0;
+	failed += check("the next one gets its own reply", mongo_connection_get_server_version(manager, con, &servers->options, &error_message));
+	failed += check("the late reply is dropped", con->mux->orphans == 1);
+
+	/* A reader that runs out of time stops without reading, and leaves the
+	 * reply to an operation that came in later with more time */
+	errors = 0;
+	server.delay_us = 150000;
+	orphans = con->mux->orphans;
+	pthread_create(&tid, NULL, later_slow_operation, NULL);
+	mongo_connection_set_budget(con, 50);
+	ok = mongo_connection_get_server_version(manager, con, &servers->options, &error_message);
+	failed += check("the reader fails when it runs out of time", !ok);
+	if (!ok) {
+		free(error_message);
+	}
+	pthread_join(tid, NULL);
+	failed += check("a later operation with more time gets its reply", errors == 0);
+	failed += check("the socket isn't marked as failed", con->mux->failure == NULL);
+	server.delay_us = 0;
+	failed += check("the next one gets its own reply", mongo_connection_get_server_version(manager, con, &servers->options, &error_message));
+	failed += check("the reader's reply is dropped", con->mux->orphans == orphans + 1);
+
+	/* A closed socket fails every operation, none hangs */
+	server.down = 1;
+	elapsed = run_threads();
+	failed += check("every operation fails when the server goes down", errors == THREADS * ROUNDS);
+	failed += check("without waiting for its deadline", elapsed < 1000);
+	failed += check("the socket is marked as failed", con->mux->failure != NULL);
+
+	mongo_connection_release(manager, con, MONGO_CLOSE_BROKEN);
+	mongo_servers_dtor(servers);
+	mongo_deinit(manager);
+	mock_server_stop(&server);
+
+	return failed;
+}
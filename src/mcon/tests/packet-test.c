@@ -0,0 +1,167 @@
+#include "manager.h"
+#include "connections.h"
+#include "parse.h"
+#include "packet.h"
+#include "buffer.h"
+#include "bson_helpers.h"
+#include "utils.h"
+#include "types.h"
+#include "mock-server.h"
+#include "check.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#define PAYLOAD_SIZE (4 * 1024 * 1024 - 1024)
+
+/* Sends a command with a large payload as a packet of segments over the
+ * native transport, and checks that the payload isn't copied, and that the
+ * server receives the same bytes as if the message had been contiguous. */
+
+/* { buildinfo: 1, payload: BinData(0, <payload>) } in an OP_QUERY on
+ * admin.$cmd, with the payload as a segment of its own */
+static mongo_packet *create_packet(char *payload, int size)
+{
+	mongo_packet *packet;
+	int           doc_offset, doc_start;
+
+	packet = mongo_packet_create(2004);
+	mcon_serialize_int(packet->str, 0); /* Flags */
+	mcon_str_addl(packet->str, "admin.$cmd", 11, 0);
+	mcon_serialize_int(packet->str, 0); /* Number to skip */
+	mcon_serialize_int(packet->str, -1); /* Number to return */
+
+	doc_offset = packet->str->l;
+	doc_start = mongo_packet_length(packet);
+	mcon_serialize_int(packet->str, 0);
+	mcon_str_addl(packet->str, "\x10" "buildinfo", 11, 0);
+	mcon_serialize_int32(packet->str, 1);
+	mcon_str_addl(packet->str, "\x05" "payload", 9, 0);
+	mcon_serialize_int32(packet->str, size);
+	mcon_str_addl(packet->str, "\x00", 1, 0);
+	mongo_packet_add_data(packet, payload, size);
+	mcon_str_addl(packet->str, "\x00", 1, 0);
+	mongo_packet_patch_int32(packet, doc_offset, mongo_packet_length(packet) - doc_start);
+
+	return packet;
+}
+
+/* { a: 1 } inserted into test.c, followed by its getLastError in the same
+ * packet */
+static mongo_packet *create_insert_packet(void)
+{
+	mongo_packet *packet;
+
+	packet = mongo_packet_create(2002);
+	mcon_serialize_int(packet->str, 0); /* Flags */
+	mcon_str_addl(packet->str, "test.c", 7, 0);
+	mcon_serialize_int(packet->str, 12);
+	mcon_str_addl(packet->str, "\x10" "a", 3, 0);
+	mcon_serialize_int32(packet->str, 1);
+	mcon_str_addl(packet->str, "\x00", 1, 0);
+
+	mongo_packet_next_message(packet, 2004);
+	mcon_serialize_int(packet->str, 0); /* Flags */
+	mcon_str_addl(packet->str, "test.$cmd", 10, 0);
+	mcon_serialize_int(packet->str, 0); /* Number to skip */
+	mcon_serialize_int(packet->str, -1); /* Number to return */
+	mcon_serialize_int(packet->str, 23);
+	mcon_str_addl(packet->str, "\x10" "getlasterror", 14, 0);
+	mcon_serialize_int32(packet->str, 1);
+	mcon_str_addl(packet->str, "\x00", 1, 0);
+
+	return packet;
+}
+
+/* What the message looks like when it is put together */
+static uint64_t packet_digest(mongo_packet *packet)
+{
+	struct iovec *iov = malloc(packet->count * sizeof(struct iovec));
+	uint64_t      digest = MONGO_DIGEST_INIT;
+	int           i, count;
+
+	count = mongo_packet_iovecs(packet, iov);
+	for (i = 0; i < count; i++) {
+		digest = mongo_digest_update(digest, iov[i].iov_base, iov[i].iov_len);
+	}
+	free(iov);
+
+	return digest;
+}
+
+int main(void)
+{
+	mongo_con_manager *manager;
+	mongo_servers     *servers;
+	mongo_connection  *con;
+	mongo_packet      *packet;
+	mock_server        server;
+	char              *error_message = NULL, *data_buffer, *payload;
+	char               dsn[64];
+	int32_t            first_id, length, request_id;
+	int                ok, failed = 0;
+
+	memset(&server, 0, sizeof(server));
+	if (!mock_server_start(&server)) {
+		printf("Couldn't start the mock server\n");
+		return 1;
+	}
+	snprintf(dsn, sizeof(dsn), "mongodb://127.0.0.1:%d", server.port);
+
+	manager = mongo_init();
+	manager->authenticate = mongo_connection_authenticate;
+	manager->supports_wire_version = mongo_mcon_supports_wire_version;
+
+	servers = mongo_parse_init();
+	mongo_parse_server_spec(manager, servers, dsn, &error_message);
+	con = mongo_get_read_write_connection(manager, servers, MONGO_CON_FLAG_WRITE, &error_message);
+	if (!con) {
+		printf("Couldn't connect: %s\n", error_message);
+		return 1;
+	}
+
+	payload = malloc(PAYLOAD_SIZE);
+	memset(payload, 'p', PAYLOAD_SIZE);
+	packet = create_packet(payload, PAYLOAD_SIZE);
+	failed += check("the payload isn't copied into the packet", packet->str->l < 100 && packet->count == 2);
+
+	ok = mongo_connection_send_packet(manager, con, &servers->options, packet, &data_buffer, &error_message);
+	failed += check("the packet is sent, and the reply read", ok);
+	if (ok) {
+		mongo_buffer_free(data_buffer);
+	}
+	failed += check("the message length covers every segment", server.last_length == mongo_packet_length(packet) && server.last_length > PAYLOAD_SIZE);
+	failed += check("the server receives the segments in order", server.last_digest == packet_digest(packet));
+	memcpy(&first_id, packet->str->d + 4, 4);
+
+	/* A packet can be sent again */
+	ok = mongo_connection_send_packet(manager, con, &servers->options, packet, &data_buffer, &error_message);
+	failed += check("a packet can be sent again", ok && server.requests == 3);
+	if (ok) {
+		mongo_buffer_free(data_buffer);
+	}
+	failed += check("with a new request ID", memcmp(packet->str->d + 4, &first_id, 4) != 0 && server.last_digest == packet_digest(packet));
+
+	mongo_packet_dtor(packet);
+
+	/* A write and its getLastError go out as one packet, and get one reply */
+	packet = create_insert_packet();
+	ok = mongo_connection_send_packet(manager, con, &servers->options, packet, &data_buffer, &error_message);
+	failed += check("a packet of two messages gets the reply to the last", ok && server.inserts == 1 && server.requests == 4);
+	if (ok) {
+		mongo_buffer_free(data_buffer);
+	}
+	memcpy(&length, packet->str->d, 4);
+	memcpy(&first_id, packet->str->d + 4, 4);
+	memcpy(&request_id, packet->str->d + length + 4, 4);
+	failed += check("every message has its own length, and the same request ID", length == 39 && server.last_length == 61 && request_id == first_id);
+	mongo_packet_dtor(packet);
+
+	free(payload);
+	mongo_manager_connection_release(manager, con);
+	mongo_servers_dtor(servers);
+	mongo_deinit(manager);
+	mock_server_stop(&server);
+
+	return failed;
+}
@@ -0,0 +1,140 @@
+#include "manager.h"
+#include "parse.h"
+#include "pool.h"
+#include "types.h"
+#include "mock-server.h"
+#include "check.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <time.h>
+
+#define THREADS 8
+#define ROUNDS  50
+
+static mongo_con_manager *manager;
+static mongo_servers     *servers;
+static mongo_connection  *con;
+static int                concurrent = 0, max_concurrent = 0;
+static int                errors = 0;
+
+static void *worker(void *arg)
+{
+	mongo_connection *pooled;
+	char             *error_message;
+	int               i, now;
+
+	for (i = 0; i < ROUNDS; i++) {
+		pooled = mongo_pool_checkout(manager, con, &servers->options, &error_message);
+		if (!pooled) {
+			printf("checkout failed: %s\n", error_message);
+			free(error_message);
+			__sync_add_and_fetch(&errors, 1);
+			continue;
+		}
+		now = __sync_add_and_fetch(&concurrent, 1);
+		if (now > max_concurrent) {
+			max_concurrent = now;
+		}
+		usleep(2000);
+		__sync_sub_and_fetch(&concurrent, 1);
+		mongo_pool_checkin(manager, con, pooled, 0);
+	}
+	return NULL;
+}
+
+int main(void)
+{
+	mock_server       server;
+	mongo_pool_info   info;
+	mongo_connection *a, *b, *c;
+	pthread_t         tids[THREADS];
+	char             *error_message = NULL;
+	char              dsn[64];
+	struct timeval    start, end;
+	long              i, elapsed;
+	int               failed = 0;
+
+	memset(&server, 0, sizeof(server));
+	if (!mock_server_start(&server)) {
+		printf("Couldn't start the mock server\n");
+		return 1;
+	}
+	snprintf(dsn, sizeof(dsn), "mongodb://127.0.0.1:%d", server.port);
+
+	manager = mongo_init();
+	mock_server_setup_manager(manager);
+	manager->pool_size = 2;
+	manager->pool_min_size = 1;
+	manager->pool_wait_timeout = 200;
+	manager->pool_max_idle = 1;
+
+	servers = mongo_parse_init();
+	mongo_parse_server_spec(manager, servers, dsn, &error_message);
+	con = mongo_get_read_write_connection(manager, servers, MONGO_CON_FLAG_READ, &error_message);
+	if (!con) {
+		printf("Couldn't connect: %s\n", error_message);
+		return 1;
+	}
+
+	mongo_pool_get_info(con->pool, &info);
+	failed += check("min_size sockets are opened with the connection", info.in_pool == 1 && info.in_use == 0);
+
+	/* Many threads sharing two sockets */
+	for (i = 0; i < THREADS; i++) {
+		pthread_create(&tids[i], NULL, worker, NULL);
+	}
+	for (i = 0; i < THREADS; i++) {
+		pthread_join(tids[i], NULL);
+	}
+	mongo_pool_get_info(con->pool, &info);
+	failed += check("threads wait instead of failing", errors == 0);
+	failed += check("never more than max_size sockets in use", max_concurrent <= 2);
+	failed += check("pool holds max_size sockets", info.in_pool == 2 && info.total == 2 && info.remaining == 0);
+	failed += check("waiting time is recorded", info.waiting > 0);
+
+	/* Exhaustion */
+	a = mongo_pool_checkout(manager, con, &servers->options, &error_message);
+	b = mongo_pool_checkout(manager, con, &servers->options, &error_message);
+	gettimeofday(&start, NULL);
+	c = mongo_pool_checkout(manager, con, &servers->options, &error_message);
+	gettimeofday(&end, NULL);
+	elapsed = (end.tv_sec - start.tv_sec) * 1000 + (end.tv_usec - start.tv_usec) / 1000;
+	failed += check("checkout times out when the pool is exhausted", a && b && !c && elapsed >= 190);
+	if (!c) {
+		printf("  %s\n", error_message);
+		free(error_message);
+	}
+
+	/* Broken sockets are closed, idle ones reaped down to min_size */
+	mongo_pool_checkin(manager, con, a, 1);
+	mongo_pool_checkin(manager, con, b, 0);
+	mongo_pool_get_info(con->pool, &info);
+	failed += check("broken sockets are not returned to the pool", info.in_pool == 1 && info.remaining == 1);
+
+	a = mongo_pool_checkout(manager, con, &servers->options, &error_message);
+	b = mongo_pool_checkout(manager, con, &servers->options, &error_message);
+	mongo_pool_checkin(manager, con, a, 0);
+	mongo_pool_checkin(manager, con, b, 0);
+	sleep(2);
+	mongo_pool_reap(manager, con->pool);
+	mongo_pool_get_info(con->pool, &info);
+	failed += check("idle sockets are reaped down to min_size", info.in_pool == 1);
+
+	/* The idle socket is older than two seconds by now */
+	con->pool->max_lifetime = 1;
+	a = mongo_pool_checkout(manager, con, &servers->options, &error_message);
+	mongo_pool_get_info(con->pool, &info);
+	failed += check("sockets past their lifetime are not reused", a && time(NULL) - a->created < 1 && info.in_pool == 0);
+	mongo_pool_checkin(manager, con, a, 0);
+
+	mongo_manager_connection_release(manager, con);
+	mongo_servers_dtor(servers);
+	mongo_deinit(manager);
+	mock_server_stop(&server);
+
+	return failed;
+}
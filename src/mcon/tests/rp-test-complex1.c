@@ -1,4 +1,5 @@
 #include "manager.h"
+#include "utils.h"
 #include "collection.h"
 #include "types.h"
 #include "read_preference.h"
@@ -11,14 +12,22 @@ int last_socket = 4;
 mongo_connection *create_con(mongo_con_manager *manager, int type, int ping_ms, char *hash)
 {
 	mongo_connection *con;
+	mongo_server_def def;
+
+	memset(&def, 0, sizeof(mongo_server_def));
+	def.host = "whisky";
+	def.port = atoi(strchr(hash, ':') + 1);
 
 	con = malloc(sizeof(mongo_connection));
 	con->connection_type = type;
 	con->socket = ++last_socket;
 	con->ping_ms = ping_ms;
-	con->hash = strdup(hash);
+	con->id = mongo_server_def_id(&def);
+	con->hash = strdup(con->id->hash);
+	con->hash_key = con->id->key;
 	con->tag_count = 0;
 	con->tags = NULL;
+	con->refcount = 1; /* The manager's reference */
 	mongo_manager_connection_register(manager, con);
 
 	return con;
@@ -26,9 +35,10 @@ mongo_connection *create_con(mongo_con_manager *manager, int type, int ping_ms,
 
 void add_tag(mongo_connection *con, char *tag)
 {
-	con->tags = realloc(con->tags, (con->tag_count + 1) * sizeof(char*));     
+	con->tags = realloc(con->tags, (con->tag_count + 2) * sizeof(char*));     
 	con->tags[con->tag_count] = strdup(tag);
 	con->tag_count++; 
+	con->tags[con->tag_count] = NULL;
 }
 
 void add_rp_tag0(mongo_read_preference *rp)
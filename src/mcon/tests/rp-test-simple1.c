@@ -1,4 +1,5 @@
 #include "manager.h"
+#include "utils.h"
 #include "collection.h"
 #include <stdlib.h>
 #include <stdio.h>
@@ -9,12 +10,19 @@ int last_socket = 4;
 mongo_connection *create_con(mongo_con_manager *manager, int type, int ping_ms, char *hash)
 {
 	mongo_connection *con;
+	mongo_server_def def;
+
+	memset(&def, 0, sizeof(mongo_server_def));
+	def.host = "whisky";
+	def.port = atoi(strchr(hash, ':') + 1);
 
 	con = malloc(sizeof(mongo_connection));
 	con->connection_type = type;
 	con->socket = ++last_socket;
 	con->ping_ms = ping_ms;
-	con->hash = strdup(hash);
+	con->id = mongo_server_def_id(&def);
+	con->hash = strdup(con->id->hash);
+	con->hash_key = con->id->key;
 	mongo_manager_connection_register(manager, con);
 
 	return con;
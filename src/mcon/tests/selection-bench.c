@@ -0,0 +1,155 @@
+#include "manager.h"
+#include "connections.h"
+#include "parse.h"
+#include "selection.h"
+#include "types.h"
+#include "utils.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/time.h>
+
+#define MEMBERS    7
+#define SELECTIONS 1000000
+
+/* Selects a secondary with tags from a replica set of MEMBERS, with and
+ * without memoizing the selection, and checks how the picks are spread over
+ * the secondaries when one of them is slow or busy */
+
+static void close_noop(mongo_connection *con, int why)
+{
+}
+
+static mongo_connection *create_con(mongo_con_manager *manager, int i)
+{
+	mongo_connection *con;
+	mongo_server_def  def;
+	char              host[32];
+
+	memset(&def, 0, sizeof(mongo_server_def));
+	snprintf(host, sizeof(host), "node-%d.example.com", i);
+	def.host = host;
+	def.port = 27017;
+	def.repl_set_name = "rs0";
+
+	con = calloc(1, sizeof(mongo_connection));
+	con->socket = (void*) 1;
+	con->connection_type = i == 0 ? MONGO_NODE_PRIMARY : MONGO_NODE_SECONDARY;
+	con->ping_ms = 2 + i;
+	con->id = mongo_server_def_id(&def);
+	con->hash = strdup(con->id->hash);
+	con->hash_key = con->id->key;
+	con->tags = calloc(2, sizeof(char*));
+	con->tags[0] = strdup(i % 2 ? "dc:east" : "dc:west");
+	con->tag_count = 1;
+	con->refcount = 1; /* The manager's reference */
+	mongo_connection_init_lock(con);
+	mongo_manager_connection_register(manager, con);
+
+	return con;
+}
+
+static double now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static mongo_connection *select_server(mongo_con_manager *manager, mongo_servers *servers)
+{
+	mongo_connection *con;
+	int               candidate_count;
+
+	mongo_manager_pin_enter();
+	con = mongo_select_server(manager, servers, &servers->read_pref, &candidate_count);
+	mongo_manager_pin_leave(manager);
+
+	return con;
+}
+
+static double bench(mongo_con_manager *manager, mongo_servers *servers, int *east)
+{
+	mongo_connection *con;
+	double            start;
+	int               i;
+
+	*east = 0;
+	start = now();
+	for (i = 0; i < SELECTIONS; i++) {
+		con = select_server(manager, servers);
+		if (con && strcmp(con->tags[0], "dc:east") == 0) {
+			(*east)++;
+		}
+	}
+
+	return SELECTIONS / (now() - start);
+}
+
+static double share(mongo_con_manager *manager, mongo_servers *servers, mongo_connection *con)
+{
+	int i, picked = 0;
+
+	for (i = 0; i < SELECTIONS; i++) {
+		if (select_server(manager, servers) == con) {
+			picked++;
+		}
+	}
+
+	return picked * 100.0 / SELECTIONS;
+}
+
+int main(void)
+{
+	mongo_con_manager *manager;
+	mongo_servers     *servers;
+	mongo_connection  *cons[MEMBERS];
+	char              *error_message = NULL;
+	double             rate;
+	int                i, east;
+	int64_t            misses;
+
+	manager = mongo_init();
+	manager->close = close_noop;
+	for (i = 0; i < MEMBERS; i++) {
+		cons[i] = create_con(manager, i);
+	}
+
+	servers = mongo_parse_init();
+	mongo_parse_server_spec(manager, servers, "mongodb://node-0.example.com:27017/?replicaSet=rs0&readPreference=secondaryPreferred&readPreferenceTags=dc:east&secondaryAcceptableLatencyMS=100", &error_message);
+
+	manager->memoize_selection = 0;
+	rate = bench(manager, servers, &east);
+	printf("full selection:     %9.0f selections/s (%d of %d tagged dc:east)\n", rate, east, SELECTIONS);
+
+	manager->memoize_selection = 1;
+	rate = bench(manager, servers, &east);
+	printf("memoized selection: %9.0f selections/s (%d of %d tagged dc:east)\n", rate, east, SELECTIONS);
+
+	/* A momentarily slow secondary, or a busy one, gets fewer reads */
+	for (i = 0; i < MEMBERS; i++) {
+		mongo_connection_rtt_add(cons[i], 2000);
+	}
+	cons[3]->rtt_ewma_us = 200000;
+	printf("slow secondary: %.1f%% of reads; uniform would be 33.3%%\n", share(manager, servers, cons[3]));
+	cons[3]->rtt_ewma_us = 2000;
+	cons[5]->in_flight = 4;
+	printf("busy secondary: %.1f%% of reads; uniform would be 33.3%%\n", share(manager, servers, cons[5]));
+	cons[5]->in_flight = 0;
+
+	/* A topology change invalidates the memoized selection */
+	misses = manager->selection_cache->misses;
+	mongo_manager_connection_deregister(manager, cons[1]);
+	for (i = 0; i < 1000; i++) {
+		if (select_server(manager, servers) == cons[1]) {
+			break;
+		}
+	}
+	printf("after a topology change: %s, selected again %d time(s)\n", i == 1000 ? "removed server is no longer picked" : "REMOVED SERVER STILL PICKED", (int) (manager->selection_cache->misses - misses));
+
+	mongo_servers_dtor(servers);
+	mongo_deinit(manager);
+
+	return i == 1000 ? 0 : 1;
+}
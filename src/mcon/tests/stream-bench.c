@@ -0,0 +1,199 @@
+#include "manager.h"
+#include "connections.h"
+#include "reply.h"
+#include "buffer.h"
+#include "mini_bson.h"
+#include "bson_helpers.h"
+#include "str.h"
+#include "types.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#define DOCUMENTS 16000 /* Of about 1KB, for a 16MB batch */
+#define PIECE     65536 /* Written every PIECE_US, some 300MB/s */
+#define PIECE_US  200
+#define ROUNDS    5
+
+/* Reads a 16MB batch that arrives over a socket pair at network speed, and
+ * decodes its documents, once by reading the whole reply with
+ * mongo_connection_read_reply() first, and once with a reply stream, which
+ * decodes documents while the rest are still arriving. Decoding copies
+ * every name and string, as bson_decode() does when it makes PHP values. */
+
+static int test_recv(mongo_connection *con, mongo_server_options *options, int timeout, void *data, int size, char **error_message)
+{
+	int fd = *(int *)con->socket, received = 0, num;
+
+	while (received < size) {
+		num = read(fd, (char *)data + received, size - received);
+		if (num <= 0) {
+			*error_message = strdup("Remote server has closed the connection");
+			return -32;
+		}
+		received += num;
+	}
+	return received;
+}
+
+typedef struct _writer {
+	int        fd;
+	mcon_str  *reply;
+	pthread_t  thread;
+} writer;
+
+static void *write_reply(void *arg)
+{
+	writer *w = (writer *)arg;
+	int     offset, num;
+
+	for (offset = 0; offset < w->reply->l; offset += num) {
+		num = w->reply->l - offset < PIECE ? w->reply->l - offset : PIECE;
+		if (write(w->fd, w->reply->d + offset, num) != num) {
+			break;
+		}
+		usleep(PIECE_US);
+	}
+	return NULL;
+}
+
+static mcon_str *create_reply(void)
+{
+	mcon_str *str;
+	char      text[801];
+	int       i, doc, length;
+
+	memset(text, 'x', 800);
+	text[800] = '\0';
+
+	mcon_str_ptr_init(str);
+	mcon_serialize_int32(str, 0);
+	mcon_serialize_int32(str, 1);
+	mcon_serialize_int32(str, 42);
+	mcon_serialize_int32(str, 1);
+	mcon_serialize_int32(str, 0);
+	mcon_serialize_int64(str, 1234567890123LL);
+	mcon_serialize_int32(str, 0);
+	mcon_serialize_int32(str, DOCUMENTS);
+	for (i = 0; i < DOCUMENTS; i++) {
+		doc = bson_begin_document(str);
+		bson_add_key(str, BSON_INT32, "_id", 3);
+		mcon_serialize_int32(str, i);
+		bson_add_key(str, BSON_DATETIME, "created_at", 10);
+		mcon_serialize_int64(str, 1400000000000LL + i);
+		bson_add_key(str, BSON_STRING, "user_id", 7);
+		bson_add_string_value(str, "5400e1a2f0a1b2c3d4e5f6a7", 24);
+		bson_add_key(str, BSON_STRING, "body", 4);
+		bson_add_string_value(str, text, 800);
+		bson_end_document(str, doc);
+	}
+	length = MONGO_32(str->l);
+	memcpy(str->d, &length, sizeof(int32_t));
+
+	return str;
+}
+
+static long decode_document(char *data)
+{
+	char   *name, *value, *copy;
+	int     type;
+	int32_t length;
+	long    sum = 0;
+
+	data += sizeof(int32_t);
+	while ((value = bson_get_current(data, &name, &type))) {
+		copy = strdup(name);
+		sum += copy[0];
+		free(copy);
+
+		if (type == BSON_STRING) {
+			memcpy(&length, value, sizeof(int32_t));
+			copy = malloc(length);
+			memcpy(copy, value + sizeof(int32_t), length);
+			sum += copy[0];
+			free(copy);
+		}
+		data = bson_next(data);
+	}
+
+	return sum;
+}
+
+static double now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+int main(void)
+{
+	mongo_con_manager  *manager;
+	mongo_connection    con;
+	mongo_reply_stream *stream;
+	mcon_str           *reply;
+	writer              w;
+	char               *data_buffer, *document, *ptr, *error_message = NULL;
+	double              start, first[2] = { 0, 0 }, total[2] = { 0, 0 };
+	int32_t             response_to, length;
+	long                sum = 0, peak[2] = { 0, 0 };
+	int                 fds[2], r, n[2];
+
+	manager = mongo_init();
+	manager->recv_header = test_recv;
+	manager->recv_data = test_recv;
+	memset(&con, 0, sizeof(con));
+	con.socket = &fds[0];
+	socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+	w.fd = fds[1];
+	w.reply = reply = create_reply();
+
+	for (r = 0; r < ROUNDS; r++) {
+		/* The whole reply first */
+		start = now();
+		pthread_create(&w.thread, NULL, write_reply, &w);
+		mongo_connection_read_reply(manager, &con, NULL, -1, &response_to, &data_buffer, &error_message);
+		first[0] += now() - start;
+		n[0] = 0;
+		for (ptr = data_buffer; memcpy(&length, ptr, sizeof(int32_t)), length; ptr += length) {
+			sum += decode_document(ptr);
+			n[0]++;
+		}
+		total[0] += now() - start;
+		peak[0] = mongo_buffer_size(data_buffer);
+		mongo_buffer_free(data_buffer);
+		pthread_join(w.thread, NULL);
+
+		/* As documents arrive */
+		start = now();
+		pthread_create(&w.thread, NULL, write_reply, &w);
+		mongo_reply_stream_open(manager, &con, NULL, -1, 0, &stream, &error_message);
+		for (n[1] = 0; mongo_reply_stream_next(stream, &document, &error_message) == 1; n[1]++) {
+			if (n[1] == 0) {
+				first[1] += now() - start;
+			}
+			sum += decode_document(document);
+		}
+		total[1] += now() - start;
+		peak[1] = stream->peak;
+		mongo_reply_stream_free(stream);
+		pthread_join(w.thread, NULL);
+	}
+
+	printf("a batch of %d documents, %d bytes, at %.0fMB/s\n", DOCUMENTS, reply->l, PIECE / (PIECE_US / 1000000.0) / (1024 * 1024));
+	printf("%-30s %10s %10s %12s\n", "", "first doc", "all docs", "peak buffer");
+	printf("%-30s %8.2fms %8.2fms %10ldKB (%d documents)\n", "whole reply, then decode:", first[0] * 1000 / ROUNDS, total[0] * 1000 / ROUNDS, peak[0] / 1024, n[0]);
+	printf("%-30s %8.2fms %8.2fms %10ldKB (%d documents, %ld)\n", "reply stream:", first[1] * 1000 / ROUNDS, total[1] * 1000 / ROUNDS, peak[1] / 1024, n[1], sum % 10);
+
+	mcon_str_ptr_dtor(reply);
+	close(fds[0]);
+	close(fds[1]);
+	mongo_deinit(manager);
+
+	return n[0] == DOCUMENTS && n[1] == DOCUMENTS ? 0 : 1;
+}
@@ -0,0 +1,270 @@
+#include "manager.h"
+#include "connections.h"
+#include "reply.h"
+#include "mini_bson.h"
+#include "bson_helpers.h"
+#include "str.h"
+#include "types.h"
+#include "check.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+/* Reads replies with mongo_reply_stream_*() from one end of a socket pair,
+ * while a thread writes them into the other end in pieces, and checks that
+ * documents are handed out as they arrive, in as little memory as the
+ * stream promises, and that broken replies are noticed. */
+
+/* The test's transport: the connection's socket is a file descriptor */
+static int test_recv(mongo_connection *con, mongo_server_options *options, int timeout, void *data, int size, char **error_message)
+{
+	int fd = *(int *)con->socket, received = 0, num;
+
+	while (received < size) {
+		num = read(fd, (char *)data + received, size - received);
+		if (num <= 0) {
+			*error_message = strdup("Remote server has closed the connection");
+			return -32;
+		}
+		received += num;
+	}
+	return received;
+}
+
+typedef struct _writer {
+	int        fd;
+	mcon_str  *reply;
+	int        piece;
+	int        delay_us;
+	int        written; /* Bytes sent, or being sent */
+	int        close;   /* Whether to close the socket afterwards */
+	pthread_t  thread;
+} writer;
+
+static void *write_reply(void *arg)
+{
+	writer *w = (writer *)arg;
+	int     offset = 0, num;
+
+	while (offset < w->reply->l) {
+		num = w->reply->l - offset < w->piece ? w->reply->l - offset : w->piece;
+		/* Counted first, so that the reader never sees less than it got */
+		__sync_add_and_fetch(&w->written, num);
+		if (write(w->fd, w->reply->d + offset, num) != num) {
+			break;
+		}
+		offset += num;
+		usleep(w->delay_us);
+	}
+	if (w->close) {
+		shutdown(w->fd, SHUT_WR);
+	}
+	return NULL;
+}
+
+static void start_writer(writer *w, int fd, mcon_str *reply, int piece, int delay_us, int close)
+{
+	memset(w, 0, sizeof(writer));
+	w->fd = fd;
+	w->reply = reply;
+	w->piece = piece;
+	w->delay_us = delay_us;
+	w->close = close;
+	pthread_create(&w->thread, NULL, write_reply, w);
+}
+
+/* An OP_REPLY with count documents of { i: <n>, s: <size bytes> } */
+static mcon_str *create_reply(int flags, int count, int size)
+{
+	mcon_str *str;
+	char     *s = malloc(size + 1);
+	int       i, doc, length;
+
+	memset(s, 'x', size);
+	s[size] = '\0';
+
+	mcon_str_ptr_init(str);
+	mcon_serialize_int32(str, 0); /* Length, filled in below */
+	mcon_serialize_int32(str, 1);
+	mcon_serialize_int32(str, 42); /* responseTo */
+	mcon_serialize_int32(str, 1);  /* OP_REPLY */
+	mcon_serialize_int32(str, flags);
+	mcon_serialize_int64(str, 1234567890123LL);
+	mcon_serialize_int32(str, 0);
+	mcon_serialize_int32(str, count);
+	for (i = 0; i < count; i++) {
+		doc = bson_begin_document(str);
+		bson_add_key(str, BSON_INT32, "i", 1);
+		mcon_serialize_int32(str, i);
+		bson_add_key(str, BSON_STRING, "s", 1);
+		bson_add_string_value(str, s, size);
+		bson_end_document(str, doc);
+	}
+	length = MONGO_32(str->l);
+	memcpy(str->d, &length, sizeof(int32_t));
+
+	free(s);
+	return str;
+}
+
+static int document_i(char *document)
+{
+	int32_t i = -1;
+
+	bson_find_field_as_int32(document + sizeof(int32_t), "i", &i);
+	return i;
+}
+
+int main(void)
+{
+	mongo_con_manager  *manager;
+	mongo_connection    con;
+	mongo_reply_stream *stream;
+	mcon_str           *reply;
+	writer              w;
+	char               *document, *error_message = NULL, **documents;
+	int                 fds[2], i, n, ok, retval, first_at, failed = 0;
+
+	manager = mongo_init();
+	manager->recv_header = test_recv;
+	manager->recv_data = test_recv;
+
+	memset(&con, 0, sizeof(con));
+	con.socket = &fds[0];
+	socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+
+	/* 400 documents of 10KB, written 16KB at a time */
+	reply = create_reply(0, 400, 10000);
+	start_writer(&w, fds[1], reply, 16384, 1000, 0);
+	retval = mongo_reply_stream_open(manager, &con, NULL, -1, 0, &stream, &error_message);
+	failed += check("the header is read", retval == 1 && stream->response_to == 42 && stream->number_returned == 400 && stream->cursor_id == 1234567890123LL);
+
+	ok = 1;
+	first_at = -1;
+	for (n = 0; (retval = mongo_reply_stream_next(stream, &document, &error_message)) == 1; n++) {
+		if (first_at < 0) {
+			first_at = w.written;
+		}
+		ok &= document_i(document) == n;
+	}
+	printf("the first document was handed out after %d of %d bytes had been sent\n", first_at, reply->l);
+	failed += check("every document is handed out, in order", retval == 0 && n == 400 && ok);
+	failed += check("the first before the rest of the reply had been sent", first_at < reply->l / 4);
+	failed += check("in no more than one chunk", stream->peak <= MONGO_REPLY_CHUNK_SIZE);
+	failed += check("and the whole reply was read", mongo_reply_stream_free(stream));
+	pthread_join(w.thread, NULL);
+	mcon_str_ptr_dtor(reply);
+
+	/* Kept documents stay where they are */
+	reply = create_reply(0, 100, 10000);
+	documents = malloc(100 * sizeof(char *));
+	start_writer(&w, fds[1], reply, 65536, 0, 0);
+	mongo_reply_stream_open(manager, &con, NULL, -1, 1, &stream, &error_message);
+	for (n = 0; mongo_reply_stream_next(stream, &documents[n], &error_message) == 1; n++) {
+	}
+	ok = n == 100;
+	for (i = 0; i < n; i++) {
+		ok &= document_i(documents[i]) == i;
+	}
+	failed += check("kept documents are all there at the end", ok);
+	failed += check("in several chunks", stream->first && stream->first->next && stream->peak >= 100 * 10000);
+	mongo_reply_stream_free(stream);
+	free(documents);
+	pthread_join(w.thread, NULL);
+	mcon_str_ptr_dtor(reply);
+
+	/* Documents larger than a chunk */
+	reply = create_reply(0, 3, MONGO_REPLY_CHUNK_SIZE + 1000);
+	start_writer(&w, fds[1], reply, 65536, 0, 0);
+	mongo_reply_stream_open(manager, &con, NULL, -1, 0, &stream, &error_message);
+	for (n = 0; mongo_reply_stream_next(stream, &document, &error_message) == 1; n++) {
+	}
+	failed += check("documents larger than a chunk", n == 3 && mongo_reply_stream_free(stream));
+	pthread_join(w.thread, NULL);
+	mcon_str_ptr_dtor(reply);
+
+	/* A query failure */
+	mcon_str_ptr_init(reply);
+	{
+		mcon_str *doc;
+		int       offset, length;
+
+		mcon_str_ptr_init(doc);
+		offset = bson_begin_document(doc);
+		bson_add_key(doc, BSON_STRING, "$err", 4);
+		bson_add_string_value(doc, "not authorized", 14);
+		bson_add_key(doc, BSON_INT32, "code", 4);
+		mcon_serialize_int32(doc, 13);
+		bson_end_document(doc, offset);
+
+		length = MONGO_REPLY_HEADER_SIZE + doc->l;
+		mcon_serialize_int32(reply, length);
+		mcon_serialize_int32(reply, 1);
+		mcon_serialize_int32(reply, 42);
+		mcon_serialize_int32(reply, 1);
+		mcon_serialize_int32(reply, MONGO_REPLY_FLAG_QUERY_FAILURE);
+		mcon_serialize_int64(reply, 0);
+		mcon_serialize_int32(reply, 0);
+		mcon_serialize_int32(reply, 1);
+		mcon_str_addl(reply, doc->d, doc->l, 0);
+		mcon_str_ptr_dtor(doc);
+	}
+	start_writer(&w, fds[1], reply, 65536, 0, 0);
+	retval = mongo_reply_stream_open(manager, &con, NULL, -1, 0, &stream, &error_message);
+	ok = retval == 0 && strcmp(error_message, "send_package: the query returned a failure: not authorized (code: 13)") == 0;
+	failed += check("a query failure is reported", ok);
+	free(error_message);
+	pthread_join(w.thread, NULL);
+	mcon_str_ptr_dtor(reply);
+
+	/* A document whose length runs past the reply */
+	reply = create_reply(0, 2, 100);
+	i = MONGO_32(100000);
+	memcpy(reply->d + MONGO_REPLY_HEADER_SIZE, &i, sizeof(int32_t));
+	start_writer(&w, fds[1], reply, 65536, 0, 0);
+	mongo_reply_stream_open(manager, &con, NULL, -1, 0, &stream, &error_message);
+	retval = mongo_reply_stream_next(stream, &document, &error_message);
+	failed += check("a document that runs past the reply is caught", retval == -1 && strstr(error_message, "data corruption"));
+	free(error_message);
+	failed += check("and the socket can't be used any more", !mongo_reply_stream_free(stream));
+	pthread_join(w.thread, NULL);
+	mcon_str_ptr_dtor(reply);
+
+	/* The rest of that reply is still on the socket */
+	close(fds[0]);
+	close(fds[1]);
+	socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+
+	/* A reply that stops early, and one that isn't read to the end */
+	reply = create_reply(0, 10, 100);
+	reply->l -= 50;
+	start_writer(&w, fds[1], reply, 65536, 0, 1);
+	mongo_reply_stream_open(manager, &con, NULL, -1, 0, &stream, &error_message);
+	for (n = 0; (retval = mongo_reply_stream_next(stream, &document, &error_message)) == 1; n++) {
+	}
+	failed += check("a reply that was cut short", retval == -1 && n == 9);
+	free(error_message);
+	mongo_reply_stream_free(stream);
+	pthread_join(w.thread, NULL);
+	mcon_str_ptr_dtor(reply);
+	close(fds[0]);
+	close(fds[1]);
+	socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+
+	reply = create_reply(0, 10, 100);
+	start_writer(&w, fds[1], reply, 65536, 0, 0);
+	mongo_reply_stream_open(manager, &con, NULL, -1, 0, &stream, &error_message);
+	mongo_reply_stream_next(stream, &document, &error_message);
+	failed += check("a reply that wasn't read to the end", !mongo_reply_stream_free(stream));
+	pthread_join(w.thread, NULL);
+	mcon_str_ptr_dtor(reply);
+
+	close(fds[0]);
+	close(fds[1]);
+	mongo_deinit(manager);
+
+	return failed;
+}
@@ -0,0 +1,241 @@
+#include "mini_bson.h"
+#include "bson_helpers.h"
+#include "bson_validate.h"
+#include "str.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/time.h>
+
+#define DOCUMENTS 1000
+#define ROUNDS    200
+
+/* Checks a reply of user profile documents with bson_validate_documents(),
+ * and compares that with walking them the way bson_decode() does, which
+ * copies every name and string out of the reply, as HHVM does when it makes
+ * a String of them. Also shows how fast UTF-8 is checked on its own, with
+ * the scalar check and with the one that was picked for this CPU. */
+
+static char *words[] = {
+	"mongodb", "hhvm", "driver", "profile", "report", "analytics", "premium",
+	"beta", "mobile", "desktop", "europe", "newsletter", "sports", "music",
+	"travel", "photography", "cooking", "gaming", "finance", "books",
+	"caf\xc3\xa9", "na\xc3\xafve", "\xe6\x9d\xb1\xe4\xba\xac", "m\xc3\xbcnchen"
+};
+#define WORDS (sizeof(words) / sizeof(words[0]))
+
+static char *actions[] = { "login", "logout", "purchase", "refund", "view", "search", "share" };
+
+static void add_string(mcon_str *str, char *name, char *value)
+{
+	bson_add_key(str, BSON_STRING, name, strlen(name));
+	bson_add_string_value(str, value, strlen(value));
+}
+
+static char *create_text(int length);
+
+static void add_text(mcon_str *str, char *name, int length)
+{
+	char *text = create_text(length);
+
+	add_string(str, name, text);
+	free(text);
+}
+
+static void add_int32(mcon_str *str, char *name, int32_t value)
+{
+	bson_add_key(str, BSON_INT32, name, strlen(name));
+	mcon_serialize_int32(str, value);
+}
+
+static void add_int64(mcon_str *str, int type, char *name, int64_t value)
+{
+	bson_add_key(str, type, name, strlen(name));
+	mcon_serialize_int64(str, value);
+}
+
+static void add_double(mcon_str *str, char *name, double value)
+{
+	bson_add_key(str, BSON_DOUBLE, name, strlen(name));
+	mcon_serialize_double(str, value);
+}
+
+static void add_profile(mcon_str *str)
+{
+	char *word;
+	int   doc, sub, event, i, events = 20 + rand() % 40;
+
+	doc = bson_begin_document(str);
+	bson_add_key(str, BSON_OBJECT_ID, "_id", 3);
+	mcon_str_addl(str, "0123456789ab", 12, 0);
+	add_text(str, "username", 6 + rand() % 10);
+	add_text(str, "email", 12 + rand() % 20);
+	add_int64(str, BSON_DATETIME, "created_at", 1400000000000LL + rand());
+	add_int32(str, "age", 18 + rand() % 60);
+	add_double(str, "score", rand() / 1000.0);
+	bson_add_key(str, BSON_BOOLEAN, "active", 6);
+	mcon_str_addl(str, rand() % 2 ? "\x01" : "\x00", 1, 0);
+	bson_add_key(str, BSON_NULL, "nickname", 8);
+	add_text(str, "bio", 50 + rand() % 200);
+
+	bson_add_key(str, BSON_ARRAY, "tags", 4);
+	sub = bson_begin_document(str);
+	for (i = 0; i < 5 + rand() % 10; i++) {
+		word = words[rand() % WORDS];
+		bson_add_index_key(str, BSON_STRING, i);
+		bson_add_string_value(str, word, strlen(word));
+	}
+	bson_end_document(str, sub);
+
+	bson_add_key(str, BSON_DOCUMENT, "address", 7);
+	sub = bson_begin_document(str);
+	add_text(str, "street", 20);
+	add_text(str, "city", 14);
+	add_string(str, "country", "de");
+	bson_end_document(str, sub);
+
+	bson_add_key(str, BSON_ARRAY, "history", 7);
+	sub = bson_begin_document(str);
+	for (i = 0; i < events; i++) {
+		bson_add_index_key(str, BSON_DOCUMENT, i);
+		event = bson_begin_document(str);
+		add_int64(str, BSON_DATETIME, "ts", 1400000000000LL + rand());
+		add_string(str, "action", actions[rand() % 7]);
+		add_double(str, "amount", rand() / 100.0);
+		add_int32(str, "item_id", rand());
+		bson_end_document(str, event);
+	}
+	bson_end_document(str, sub);
+
+	bson_end_document(str, doc);
+}
+
+/* What bson_decode() does with each document, short of making PHP values */
+static long decode_document(char *data)
+{
+	char   *name, *value, *copy;
+	int     type;
+	int32_t length;
+	long    sum = 0;
+
+	data += sizeof(int32_t);
+	while ((value = bson_get_current(data, &name, &type))) {
+		copy = strdup(name);
+		sum += copy[0];
+		free(copy);
+
+		switch (type) {
+			case BSON_STRING:
+				memcpy(&length, value, sizeof(int32_t));
+				copy = malloc(length);
+				memcpy(copy, value + sizeof(int32_t), length);
+				sum += copy[0];
+				free(copy);
+				break;
+			case BSON_DOCUMENT:
+			case BSON_ARRAY:
+				sum += decode_document(value);
+				break;
+			default:
+				sum += value[0];
+		}
+		data = bson_next(data);
+	}
+
+	return sum;
+}
+
+/* Mostly ASCII, with the odd word of something else */
+static char *create_text(int length)
+{
+	char *text = malloc(length + 1);
+	int   i;
+
+	for (i = 0; i + 12 < length; i += strlen(text + i)) {
+		snprintf(text + i, length + 1 - i, "%s ", rand() % 8 ? words[rand() % 20] : words[20 + rand() % 4]);
+	}
+	memset(text + i, 'x', length - i);
+	text[length] = '\0';
+	return text;
+}
+
+static double now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static void report(const char *what, double elapsed, long bytes)
+{
+	printf("%-40s %8.1f MB/s %8.2fus/reply\n", what, bytes / elapsed / (1024 * 1024), elapsed * 1000000 / ROUNDS);
+}
+
+int main(void)
+{
+	mcon_str *reply;
+	char     *error_message = NULL, *ptr, *text;
+	double    start, decode, validate, structure, scalar, picked;
+	long      sum = 0;
+	int32_t   length;
+	int       i, r, valid = 1;
+
+	srand(42);
+	mcon_str_ptr_init(reply);
+	for (i = 0; i < DOCUMENTS; i++) {
+		add_profile(reply);
+	}
+	printf("a reply of %d documents, %d bytes, UTF-8 checked with: %s\n", DOCUMENTS, reply->l, bson_utf8_implementation());
+
+	/* Once to warm up */
+	for (r = 0; r < 2; r++) {
+		start = now();
+		for (i = 0; i < ROUNDS; i++) {
+			for (ptr = reply->d; ptr < reply->d + reply->l; ptr += length) {
+				memcpy(&length, ptr, sizeof(int32_t));
+				sum += decode_document(ptr);
+			}
+		}
+		decode = now() - start;
+
+		start = now();
+		for (i = 0; i < ROUNDS; i++) {
+			valid &= bson_validate_documents(reply->d, reply->l, BSON_VALIDATE_STRUCTURE, &error_message);
+		}
+		structure = now() - start;
+
+		start = now();
+		for (i = 0; i < ROUNDS; i++) {
+			valid &= bson_validate_documents(reply->d, reply->l, BSON_VALIDATE_STRUCTURE | BSON_VALIDATE_UTF8, &error_message);
+		}
+		validate = now() - start;
+	}
+
+	report("decode:", decode, (long)reply->l * ROUNDS);
+	report("validate structure:", structure, (long)reply->l * ROUNDS);
+	report("validate structure and UTF-8:", validate, (long)reply->l * ROUNDS);
+	printf("validating costs %.0f%% of decoding, valid: %s (%ld)\n", validate * 100 / decode, valid ? "yes" : "NO", sum % 10);
+
+	text = create_text(reply->l);
+	for (r = 0; r < 2; r++) {
+		start = now();
+		for (i = 0; i < ROUNDS; i++) {
+			valid &= bson_utf8_valid_scalar(text, reply->l);
+		}
+		scalar = now() - start;
+
+		start = now();
+		for (i = 0; i < ROUNDS; i++) {
+			valid &= bson_utf8_valid(text, reply->l);
+		}
+		picked = now() - start;
+	}
+	report("UTF-8 only, scalar:", scalar, (long)reply->l * ROUNDS);
+	report(bson_utf8_implementation(), picked, (long)reply->l * ROUNDS);
+	free(text);
+
+	mcon_str_ptr_dtor(reply);
+
+	return valid ? 0 : 1;
+}
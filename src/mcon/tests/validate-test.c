@@ -0,0 +1,224 @@
+#include "mini_bson.h"
+#include "bson_helpers.h"
+#include "bson_validate.h"
+#include "str.h"
+#include "check.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+/* Checks that bson_validate_document() takes well formed documents and turns
+ * down broken ones without reading past them, and that the vectorised UTF-8
+ * check says the same as the scalar one. */
+
+/* Copies the document into a buffer of its own size, so that reading past
+ * it shows up under a memory checker */
+static int validate(const char *data, int size, int flags)
+{
+	char *copy = malloc(size), *error_message = NULL;
+	int   length;
+
+	memcpy(copy, data, size);
+	length = bson_validate_document(copy, size, flags, &error_message);
+	free(error_message);
+	free(copy);
+	return length;
+}
+
+#define VALID(doc)   (validate((doc), sizeof(doc) - 1, BSON_VALIDATE_STRUCTURE | BSON_VALIDATE_UTF8) == sizeof(doc) - 1)
+#define INVALID(doc) (validate((doc), sizeof(doc) - 1, BSON_VALIDATE_STRUCTURE | BSON_VALIDATE_UTF8) == 0)
+
+/* { a: 1, b: "xy", c: [ true, null, 2.5 ], d: {} } */
+static const char simple[] =
+	"\x38\x00\x00\x00"
+	"\x10" "a\x00" "\x01\x00\x00\x00"
+	"\x02" "b\x00" "\x03\x00\x00\x00" "xy\x00"
+	"\x04" "c\x00" "\x17\x00\x00\x00"
+		"\x08" "0\x00" "\x01"
+		"\x0A" "1\x00"
+		"\x01" "2\x00" "\x00\x00\x00\x00\x00\x00\x04\x40"
+		"\x00"
+	"\x03" "d\x00" "\x05\x00\x00\x00" "\x00"
+	"\x00";
+
+/* { r: /ab/i, c: code("x", { y: 1 }), p: dbpointer("n", ...), o: "é" } */
+static const char special[] =
+	"\x4f\x00\x00\x00"
+	"\x0B" "r\x00" "ab\x00" "i\x00"
+	"\x0F" "c\x00" "\x16\x00\x00\x00" "\x02\x00\x00\x00" "x\x00" "\x0c\x00\x00\x00" "\x10" "y\x00" "\x01\x00\x00\x00" "\x00"
+	"\x0C" "p\x00" "\x02\x00\x00\x00" "n\x00" "\x01\x02\x03\x04\x05\x06\x07\x08\x09\x0a\x0b\x0c"
+	"\x02" "o\x00" "\x03\x00\x00\x00" "\xc3\xa9\x00"
+	"\x05" "b\x00" "\x02\x00\x00\x00" "\x00" "hi"
+	"\x00";
+
+/* A string whose length points far past the document */
+static const char long_string[] =
+	"\x0f\x00\x00\x00"
+	"\x02" "b\x00" "\xff\xff\xff\x00" "xy\x00"
+	"\x00";
+
+/* A nested document that claims to be larger than the one holding it */
+static const char long_nested[] =
+	"\x0d\x00\x00\x00"
+	"\x03" "d\x00" "\x40\x00\x00\x00" "\x00"
+	"\x00";
+
+/* A name that never ends */
+static const char long_name[] =
+	"\x08\x00\x00\x00"
+	"\x10" "abc";
+
+static const char overlong[] =
+	"\x0f\x00\x00\x00"
+	"\x02" "b\x00" "\x03\x00\x00\x00" "\xc0\xaf\x00"
+	"\x00";
+
+static const char surrogate[] =
+	"\x10\x00\x00\x00"
+	"\x02" "b\x00" "\x04\x00\x00\x00" "\xed\xa0\x80\x00"
+	"\x00";
+
+static const char bad_name[] =
+	"\x0c\x00\x00\x00"
+	"\x10" "\xff\x00" "\x01\x00\x00\x00"
+	"\x00";
+
+/* Code with scope whose length doesn't add up */
+static const char bad_scope[] =
+	"\x1f\x00\x00\x00"
+	"\x0F" "c\x00" "\x17\x00\x00\x00" "\x02\x00\x00\x00" "x\x00" "\x0c\x00\x00\x00" "\x10" "y\x00" "\x01\x00\x00\x00" "\x00" "\x00"
+	"\x00";
+
+static const char bad_bool[] =
+	"\x09\x00\x00\x00"
+	"\x08" "a\x00" "\x02"
+	"\x00";
+
+static const char bad_type[] =
+	"\x0c\x00\x00\x00"
+	"\x42" "a\x00" "\x01\x00\x00\x00"
+	"\x00";
+
+/* Documents nested deeper than BSON_VALIDATE_MAX_DEPTH */
+static mcon_str *create_deep(int depth)
+{
+	mcon_str *str;
+	int      *offsets = malloc(depth * sizeof(int)), i;
+
+	mcon_str_ptr_init(str);
+	offsets[0] = bson_begin_document(str);
+	for (i = 1; i < depth; i++) {
+		bson_add_key(str, BSON_DOCUMENT, "d", 1);
+		offsets[i] = bson_begin_document(str);
+	}
+	for (i = depth - 1; i >= 0; i--) {
+		bson_end_document(str, offsets[i]);
+	}
+	free(offsets);
+	return str;
+}
+
+/* Mostly ASCII and well formed text, with a few changes to some of it */
+static void random_text(unsigned char *s, int length)
+{
+	static const char *pieces[] = { "a", "hello ", "\xc3\xa9", "\xe2\x82\xac", "\xf0\x9f\x98\x80", "\xed\x9f\xbf", "\xef\xbf\xbd" };
+	int i = 0, n, p;
+
+	while (i < length) {
+		p = rand() % 7;
+		n = strlen(pieces[p]);
+		if (i + n > length) {
+			s[i++] = 'z';
+			continue;
+		}
+		memcpy(s + i, pieces[p], n);
+		i += n;
+	}
+
+	n = rand() % 3;
+	while (n--) {
+		s[rand() % length] = rand();
+	}
+}
+
+int main(void)
+{
+	unsigned char text[300];
+	mcon_str     *str;
+	char         *error_message = NULL;
+	int           i, length, same = 1, valid = 0, ok, failed = 0;
+
+	printf("UTF-8 is checked with: %s\n", bson_utf8_implementation());
+
+	failed += check("a simple document is valid", VALID(simple));
+	failed += check("regular expressions, code with scope and binary data", VALID(special));
+	failed += check("without UTF-8 checks, bad strings are fine", validate(overlong, sizeof(overlong) - 1, BSON_VALIDATE_STRUCTURE) == sizeof(overlong) - 1);
+
+	failed += check("a string's length past the document", INVALID(long_string));
+	failed += check("a nested document's length past the document", INVALID(long_nested));
+	failed += check("a name past the document", INVALID(long_name));
+	failed += check("a document that is cut short", validate(simple, 30, BSON_VALIDATE_STRUCTURE) == 0);
+	failed += check("an overlong UTF-8 sequence", INVALID(overlong));
+	failed += check("a UTF-16 surrogate", INVALID(surrogate));
+	failed += check("a name that isn't UTF-8", INVALID(bad_name));
+	failed += check("code with scope whose parts don't add up", INVALID(bad_scope));
+	failed += check("a boolean that is neither 0 nor 1", INVALID(bad_bool));
+	failed += check("an unknown type", INVALID(bad_type));
+
+	ok = bson_validate_document((char *)long_string, sizeof(long_string) - 1, BSON_VALIDATE_STRUCTURE, &error_message) == 0;
+	ok = ok && error_message && strstr(error_message, "offset 7");
+	failed += check("the error says where", ok);
+	free(error_message);
+
+	str = create_deep(BSON_VALIDATE_MAX_DEPTH);
+	failed += check("documents nested up to the limit", validate(str->d, str->l, BSON_VALIDATE_STRUCTURE) == str->l);
+	mcon_str_ptr_dtor(str);
+	str = create_deep(BSON_VALIDATE_MAX_DEPTH + 2);
+	failed += check("and past it", validate(str->d, str->l, BSON_VALIDATE_STRUCTURE) == 0);
+	mcon_str_ptr_dtor(str);
+
+	/* Two documents back to back, as in a reply, and one of them cut short */
+	mcon_str_ptr_init(str);
+	mcon_str_addl(str, (char *)simple, sizeof(simple) - 1, 0);
+	mcon_str_addl(str, (char *)special, sizeof(special) - 1, 0);
+	failed += check("the documents of a reply", bson_validate_documents(str->d, str->l, BSON_VALIDATE_UTF8, &error_message));
+	ok = !bson_validate_documents(str->d, str->l - 1, BSON_VALIDATE_UTF8, &error_message);
+	failed += check("and a reply with its last document cut short", ok);
+	free(error_message);
+	mcon_str_ptr_dtor(str);
+
+	/* Every truncation of a valid document is turned down */
+	ok = 1;
+	for (i = 0; i < (int)sizeof(special) - 1; i++) {
+		ok &= validate(special, i, BSON_VALIDATE_STRUCTURE | BSON_VALIDATE_UTF8) == 0;
+	}
+	failed += check("every truncation of a document", ok);
+
+	/* Any byte changed in a valid document, and nothing is read past it */
+	for (i = 0; i < 20000; i++) {
+		char copy[sizeof(special) - 1];
+
+		memcpy(copy, special, sizeof(copy));
+		copy[rand() % sizeof(copy)] = rand();
+		validate(copy, sizeof(copy), BSON_VALIDATE_STRUCTURE | BSON_VALIDATE_UTF8);
+	}
+	failed += check("corrupted documents are walked safely", 1);
+
+	/* Cut short sequences at the end of a block, and in the padding */
+	failed += check("a sequence cut short at the end", !bson_utf8_valid("0123456789abcdefghijklmnopqrstu\xe2\x82", 33));
+	failed += check("a sequence over a block boundary", bson_utf8_valid("0123456789abcdefghijklmnopqrstu\xe2\x82\xac", 34));
+	failed += check("a four byte sequence past U+10FFFF", !bson_utf8_valid("0123456789abcdef\xf4\x90\x80\x80", 20));
+
+	srand(42);
+	for (i = 0; i < 200000; i++) {
+		length = 1 + rand() % (sizeof(text) - 1);
+		random_text(text, length);
+		ok = bson_utf8_valid_scalar((char *)text, length);
+		valid += ok;
+		same &= ok == bson_utf8_valid((char *)text, length);
+	}
+	printf("%d of 200000 random strings are valid UTF-8\n", valid);
+	failed += check("the vectorised UTF-8 check agrees with the scalar one", same);
+
+	return failed;
+}
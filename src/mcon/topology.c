@@ -0,0 +1,187 @@
+/**
+ *  Copyright 2009-2014 MongoDB, Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+#include <stdlib.h>
+#include <string.h>
+
+#include "types.h"
+#include "topology.h"
+#include "table.h"
+#include "manager.h"
+#include "connections.h"
+
+/* Readers load the current snapshot and take a reference on it under the
+ * read side of topology_swap, so they only wait for each other while a new
+ * snapshot is swapped in. Publishing swaps the pointer under the write side,
+ * and puts the old snapshot on the retired list. After the swap nobody can
+ * take a new reference on a retired snapshot, so it's freed as soon as its
+ * reference count drops to 0. */
+
+static mongo_topology *mongo_topology_create(int64_t version)
+{
+	mongo_topology *topology;
+
+	topology = calloc(1, sizeof(mongo_topology));
+	topology->version = version;
+
+	return topology;
+}
+
+static void mongo_topology_free(mongo_con_manager *manager, mongo_topology *topology)
+{
+	int i;
+
+	for (i = 0; i < topology->count; i++) {
+		mongo_connection_release(manager, topology->connections[i], MONGO_CLOSE_BROKEN);
+	}
+	free(topology->connections);
+	free(topology);
+}
+
+void mongo_topology_init(mongo_con_manager *manager)
+{
+	pthread_mutex_init(&manager->topology_lock, NULL);
+	pthread_rwlock_init(&manager->topology_swap, NULL);
+	manager->topology_version = 0;
+	manager->topology = mongo_topology_create(0);
+	manager->retired_topologies = NULL;
+}
+
+/* Only to be called when no other thread uses the manager any more */
+void mongo_topology_deinit(mongo_con_manager *manager)
+{
+	mongo_topology *topology, *next;
+
+	for (topology = manager->retired_topologies; topology; topology = next) {
+		next = topology->next;
+		mongo_topology_free(manager, topology);
+	}
+	mongo_topology_free(manager, manager->topology);
+	pthread_mutex_destroy(&manager->topology_lock);
+	pthread_rwlock_destroy(&manager->topology_swap);
+}
+
+static void mongo_topology_add_connection(char *hash, void *data, void *context)
+{
+	mongo_topology *topology = (mongo_topology *)context;
+
+	topology->connections = realloc(topology->connections, (topology->count + 1) * sizeof(mongo_connection *));
+	topology->connections[topology->count] = (mongo_connection *)data;
+	topology->count++;
+	mongo_connection_addref((mongo_connection *)data);
+}
+
+/* Unlinks the retired snapshots that nobody uses any more. Must be called
+ * with the topology lock held. */
+static mongo_topology *mongo_topology_unlink_retired(mongo_con_manager *manager)
+{
+	mongo_topology **ptr = &manager->retired_topologies;
+	mongo_topology  *topology, *unused = NULL;
+
+	while ((topology = *ptr)) {
+		if (__sync_add_and_fetch(&topology->refcount, 0) == 0) {
+			*ptr = topology->next;
+			topology->next = unused;
+			unused = topology;
+		} else {
+			ptr = &topology->next;
+		}
+	}
+
+	return unused;
+}
+
+static void mongo_topology_free_list(mongo_con_manager *manager, mongo_topology *topology)
+{
+	mongo_topology *next;
+
+	for (; topology; topology = next) {
+		next = topology->next;
+		mongo_topology_free(manager, topology);
+	}
+}
+
+/* Builds a new snapshot from the connections that are registered right now,
+ * and makes it the current one */
+void mongo_topology_publish(mongo_con_manager *manager)
+{
+	mongo_topology *topology, *old, *unused;
+	int64_t         version;
+	int             count;
+
+	pthread_mutex_lock(&manager->topology_lock);
+
+	topology = mongo_topology_create(manager->topology_version + 1);
+	mcon_registry_apply(manager->connections, mongo_topology_add_connection, topology);
+	version = topology->version;
+	count = topology->count;
+
+	pthread_rwlock_wrlock(&manager->topology_swap);
+	old = manager->topology;
+	manager->topology = topology;
+	manager->topology_version = topology->version;
+	pthread_rwlock_unlock(&manager->topology_swap);
+
+	old->next = manager->retired_topologies;
+	manager->retired_topologies = old;
+	unused = mongo_topology_unlink_retired(manager);
+
+	pthread_mutex_unlock(&manager->topology_lock);
+
+	/* Releasing the connections can close sockets, so do it unlocked */
+	mongo_topology_free_list(manager, unused);
+
+	/* Once the lock is released, a next publish can retire and free the new
+	 * snapshot as well, so it's not touched any more */
+	mongo_manager_log(manager, MLOG_CON, MLOG_FINE, "topology: published version %ld with %d connections", (long) version, count);
+}
+
+/* Frees the retired snapshots that nobody uses any more */
+void mongo_topology_collect(mongo_con_manager *manager)
+{
+	mongo_topology *unused;
+
+	pthread_mutex_lock(&manager->topology_lock);
+	unused = mongo_topology_unlink_retired(manager);
+	pthread_mutex_unlock(&manager->topology_lock);
+
+	mongo_topology_free_list(manager, unused);
+}
+
+mongo_topology *mongo_topology_acquire(mongo_con_manager *manager)
+{
+	mongo_topology *topology;
+
+	pthread_rwlock_rdlock(&manager->topology_swap);
+	topology = manager->topology;
+	__sync_add_and_fetch(&topology->refcount, 1);
+	pthread_rwlock_unlock(&manager->topology_swap);
+
+	return topology;
+}
+
+void mongo_topology_release(mongo_topology *topology)
+{
+	__sync_sub_and_fetch(&topology->refcount, 1);
+}
+
+/*
+ * Local variables:
+ * tab-width: 4
+ * c-basic-offset: 4
+ * End:
+ * vim600: fdm=marker
+ * vim: noet sw=4 ts=4
+ */
@@ -0,0 +1,46 @@
+/**
+ *  Copyright 2009-2014 MongoDB, Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+#ifndef __MCON_TOPOLOGY_H__
+#define __MCON_TOPOLOGY_H__
+
+#include "types.h"
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+void mongo_topology_init(mongo_con_manager *manager);
+void mongo_topology_deinit(mongo_con_manager *manager);
+void mongo_topology_publish(mongo_con_manager *manager);
+void mongo_topology_collect(mongo_con_manager *manager);
+
+mongo_topology *mongo_topology_acquire(mongo_con_manager *manager);
+void mongo_topology_release(mongo_topology *topology);
+
+#if defined(__cplusplus)
+}
+#endif
+
+#endif
+
+/*
+ * Local variables:
+ * tab-width: 4
+ * c-basic-offset: 4
+ * End:
+ * vim600: fdm=marker
+ * vim: noet sw=4 ts=4
+ */
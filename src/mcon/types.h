@@ -44,8 +44,10 @@ typedef unsigned __int64 uint64_t;
 # include <netdb.h>
 # include <sys/un.h>
 # include <sys/socket.h>
+# include <sys/uio.h>
 # include <unistd.h>
 # include <sys/time.h>
+# include <pthread.h>
 #endif
 
 #define MONGO_CON_TYPE_STANDALONE 1
@@ -130,12 +132,44 @@ typedef struct _mongo_connection_deregister_callback
 	struct _mongo_connection_deregister_callback *next;
 } mongo_connection_deregister_callback;
 
+struct _mongo_pool;
+struct _mongo_mux;
+
+/* The identity of a server and the credentials used to talk to it, interned
+ * by mongo_server_def_id() so that there is only one for every combination.
+ * Identities are never changed, and can be compared by pointer. They are
+ * freed when the last server definition or connection using them lets go. */
+typedef struct _mongo_server_id
+{
+	char     *host;
+	int       port;
+	char     *repl_set_name;  /* NULL if not set */
+	char     *db;             /* db, username and auth_hash are all NULL, unless the definition had credentials */
+	char     *username;
+	int       pid;
+	char     *auth_hash;      /* md5(PID,PASSWORD,USERNAME), or NULL without credentials */
+	char     *address;        /* HOST:PORT, for logging and for comparing with ismaster's "me" */
+	char     *hash;           /* See mongo_server_create_hash() */
+	uint64_t  key;            /* mongo_server_hash_key() of the hash */
+	uint64_t  digest;         /* Digest of the fields above, to find the identity in the intern table */
+	int       refcount;       /* Protected by the intern table's lock */
+	struct _mongo_server_id *next;
+} mongo_server_id;
+
 /* Stores all the information about the connection. The hash is a group of
  * parameters to identify a unique connection. */
 typedef struct _mongo_connection
 {
 	time_t last_ping;        /* The timestamp when ping was called last */
-	int    ping_ms;
+	time_t last_io;          /* The timestamp when a reply was read last, by any operation; see mongo_connection_io_received() */
+	int64_t sent_us;         /* When the request that awaits its reply was sent, in µs, or 0 */
+	int64_t deadline;        /* When the current operation times out, in ms, or -1 for never; see mongo_connection_deadline_start() */
+	int    budget_ms;        /* A shorter time limit for the next operation, or 0; see mongo_connection_set_budget() */
+	int    deadline_budget;  /* Whether the deadline is the budget's, rather than the socket timeout's */
+	int    ping_ms;          /* The round trip time average, in ms */
+	int64_t rtt_ewma_us;     /* Moving average of the round trip times of heartbeats and operations, see mongo_connection_rtt_add() */
+	int64_t last_rtt_us;     /* The most recent round trip time, or -1 if there is none */
+	int    in_flight;        /* Operations currently using the server's sockets, see mongo_pool_checkout() */
 	int    connected;        /* Whether the connection is connected. Used for establishing which timeout to use */
 	int    last_ismaster;    /* The timestamp when ismaster/get_server_flags was called last */
 	int    last_replcheck;   /* The timestamp when ismaster/replicaset test was called last */
@@ -154,9 +188,19 @@ typedef struct _mongo_connection
 	int    max_message_size; /* Maximum size of each data packet. Store per connection, as it can actually differ. */
 	int    max_write_batch_size; /* Maximum operations in a batch */
 	int    tag_count;
-	char **tags;
+	char **tags;             /* NULL terminated, and only replaced (never changed) when the server's tags change */
+	void  *retired_tags;     /* mcon_collection of replaced tag arrays, freed with the connection */
+	uint64_t ismaster_digest; /* Digest of the ismaster fields that make up the topology */
+	char  *nonce;            /* Fetched along with the handshake, for the first MongoDB-CR authentication */
+	mongo_server_id *id;     /* The server this connection is for */
 	char  *hash;             /* Duplicate of the hash that the manager knows this connection as */
+	uint64_t hash_key;       /* 64-bit key of the hash, used to index the manager's connection table */
 	mongo_connection_deregister_callback *cleanup_list;
+	int    refcount;         /* Owned by the manager, plus every thread that holds on to the connection */
+	pthread_mutex_t lock;    /* Held (recursively) by the thread that has the socket checked out */
+	time_t created;          /* When the socket was opened, to recycle pooled sockets */
+	struct _mongo_pool *pool; /* Extra sockets to the same server, see pool.c */
+	struct _mongo_mux  *mux;  /* Set if operations from several threads share the socket, see mux.c */
 } mongo_connection;
 
 /* MongoDB pre-1.8; Spec says default to 4 MB */
@@ -180,17 +224,39 @@ typedef struct _mongo_connection_blacklist
 
 typedef struct _mongo_con_manager_item
 {
-	char                           *hash;
-	void                           *data;
-	struct _mongo_con_manager_item *next;
+	int       state;   /* MCON_TABLE_EMPTY, MCON_TABLE_USED or MCON_TABLE_TOMBSTONE */
+	uint64_t  key;     /* Precomputed 64-bit key of the hash, see mongo_server_hash_key() */
+	char     *hash;
+	void     *data;
 } mongo_con_manager_item;
 
+typedef struct _mcon_table
+{
+	int                     count; /* Number of items in the table */
+	int                     used;  /* Number of items plus tombstones */
+	int                     space; /* Always a power of two */
+	mongo_con_manager_item *items;
+} mcon_table;
+
+/* The registry stripes the tables over a number of shards, each with its own
+ * lock, so that HHVM's request threads don't all contend on a single lock */
+#define MCON_REGISTRY_SHARDS 16
+
+typedef struct _mcon_registry
+{
+	struct {
+		pthread_mutex_t lock;
+		mcon_table     *table;
+	} shard[MCON_REGISTRY_SHARDS];
+} mcon_registry;
+
 typedef void (mongo_log_callback_t)(int module, int level, void *context, char *format, va_list arg);
 
 #define MONGO_MANAGER_DEFAULT_PING_INTERVAL     5
 #define MONGO_MANAGER_DEFAULT_PING_INTERVAL_S   "5"
 #define MONGO_MANAGER_DEFAULT_MASTER_INTERVAL   15
 #define MONGO_MANAGER_DEFAULT_MASTER_INTERVAL_S "15"
+#define MONGO_MANAGER_DEFAULT_DISCOVERY_THREADS 4
 
 typedef struct _mongo_read_preference_tagset
 {
@@ -221,9 +287,10 @@ typedef struct _mongo_server_def
 	char *username;
 	char *password;
 	int   mechanism;
+	mongo_server_id *id; /* Cached by mongo_server_def_id(); reset with mongo_server_def_reset_id() when changing any of the fields above */
 } mongo_server_def;
 
-/* NOTE: when making changes, update mongo_parse_init, mongo_servers_copy and mongo_servers_dtor */
+/* NOTE: when making changes, update mongo_parse_init, mongo_server_options_copy and mongo_server_options_dtor */
 typedef struct _mongo_server_options
 {
 	int   con_type;         /* One of MONGO_CON_TYPE_STANDALONE, MONGO_CON_TYPE_MULTIPLE or MONGO_CON_TYPE_REPLSET */
@@ -252,10 +319,103 @@ typedef struct _mongo_servers
 } mongo_servers;
 
 struct _mongo_con_manager;
+/* Default pool settings. A negative size means that the pool will open as
+ * many sockets as are asked for. */
+#define MONGO_POOL_DEFAULT_SIZE         -1
+#define MONGO_POOL_DEFAULT_MIN_SIZE      0
+#define MONGO_POOL_DEFAULT_WAIT_TIMEOUT  5000L  /* ms */
+#define MONGO_POOL_DEFAULT_MAX_IDLE      60     /* s */
+#define MONGO_POOL_DEFAULT_MAX_LIFETIME  3600   /* s */
+
+typedef struct _mongo_pool_item
+{
+	mongo_connection        *con;
+	time_t                   last_used;
+	struct _mongo_pool_item *next;
+} mongo_pool_item;
+
+/* The sockets of a pool share the server, credentials and properties of the
+ * connection the manager knows the server as; the manager's own socket is
+ * used for monitoring (ping, ismaster) only and is not part of the pool. */
+typedef struct _mongo_pool
+{
+	pthread_mutex_t   lock;
+	pthread_cond_t    available;
+	mongo_server_def *server;       /* Copy, including credentials, to open new sockets with */
+	mongo_server_options options;   /* Copy of the options the connection was created with */
+	mongo_pool_item  *idle;         /* Most recently used first */
+	int               in_use;       /* Checked out, or being opened */
+	int               in_pool;      /* Idle */
+	int               max_size;     /* Fixed once the pool is created; negative means unlimited */
+	int               min_size;     /* Idle sockets are not reaped below this */
+	long              wait_timeout; /* ms to wait for a socket when all max_size are in use */
+	int               max_idle;     /* s before an idle socket is closed */
+	int               max_lifetime; /* s before a socket is closed instead of returned to the pool */
+	int               timeout;      /* connectTimeoutMS of the pool's sockets */
+	int               waiters;
+	int64_t           waiting_ms;   /* Total time threads have been waiting for a socket */
+} mongo_pool;
+
+/* An immutable list of the connections the manager knows about. A new
+ * snapshot, with a new version, is published whenever a connection is
+ * (de)registered, or the monitor sees a server's ismaster reply change.
+ * Request threads only share a read lock for as long as it takes to take a
+ * reference on the current snapshot. */
+typedef struct _mongo_topology
+{
+	int64_t                 version;
+	int                     count;
+	mongo_connection      **connections; /* Each holds a reference */
+	int                     refcount;    /* Readers currently using the snapshot */
+	struct _mongo_topology *next;        /* Next on the manager's retired list */
+} mongo_topology;
+
+struct _mongo_monitor;
+struct _mongo_selection_cache;
+struct _mongo_async;
+
+/* Counters for the replies that have been read, so that the number of system
+ * calls per reply (reads / replies) can be watched. The IO callbacks count
+ * their reads and waits, mongo_connection_recv_reply_locked() the replies. */
+typedef struct _mongo_io_stats
+{
+	int64_t replies;
+	int64_t bytes;   /* Reply bytes, including the headers */
+	int64_t reads;   /* recv() calls, or reads from a PHP stream */
+	int64_t waits;   /* poll() calls for data that hadn't arrived yet */
+} mongo_io_stats;
+
 typedef struct _mongo_con_manager
 {
-	mongo_con_manager_item *connections;
-	mongo_con_manager_item *blacklist;
+	mcon_registry          *connections;
+	mcon_registry          *blacklist;
+
+	/* The current topology snapshot, and the ones that have been replaced
+	 * but might still be in use. See topology.c */
+	mongo_topology         *topology;
+	mongo_topology         *retired_topologies;
+	int64_t                 topology_version;
+	pthread_mutex_t         topology_lock;
+	pthread_rwlock_t        topology_swap; /* Read locked to take a reference, write locked to replace the snapshot */
+
+	/* The background monitor, if it is running. See monitor.c */
+	struct _mongo_monitor  *monitor;
+
+	/* Recently selected servers. See selection.c */
+	struct _mongo_selection_cache *selection_cache;
+
+	/* The threads that run operations for mongo_async_submit(), once one
+	 * has been submitted. See async.c */
+	struct _mongo_async    *async;
+
+	/* Topology discovery threads that are still running, which can outlive
+	 * the request that started them. mongo_deinit() waits for them. */
+	int                     discovery_running;
+	pthread_mutex_t         discovery_lock;
+	pthread_cond_t          discovery_done;
+
+	/* Updated atomically by the threads that read replies */
+	mongo_io_stats          io_stats;
 
 	/* context and callback function that is used to send logging information
 	 * through */
@@ -267,16 +427,39 @@ typedef struct _mongo_con_manager
 	 * interval is also used for the get_server_flags function. */
 	long                    ping_interval;      /* default:  5 seconds */
 	long                    ismaster_interval;  /* default: 15 seconds */
-
-	/* IO callbacks, either using the 'native mcon' or external hooks (i.e. PHP Streams) */
+	int                     fast_handshake;     /* default: 1; new connections only run ismaster, see mongo_connection_handshake() */
+	int                     memoize_selection;  /* default: 1; cache which servers match a read preference, see selection.c */
+	int                     multiplex;          /* default: 0; share one socket per server between concurrent operations, see mux.c */
+	int                     validate_replies;   /* default: BSON_VALIDATE_STRUCTURE | BSON_VALIDATE_UTF8; check replies before reading them, see bson_validate.c */
+	int                     async_threads;      /* default: 8; most operations that run in the background at once, see async.c */
+	int                     discovery_threads;  /* default: 4; most threads that connect to new servers at once during topology discovery */
+
+	/* Settings for the per server socket pools, which are only read when a
+	 * pool is created. See the MONGO_POOL_DEFAULT_ constants. */
+	int                     pool_size;          /* Changed at runtime by Mongo::setPoolSize(), so accessed with __atomic builtins */
+	int                     pool_min_size;
+	long                    pool_wait_timeout;
+	int                     pool_max_idle;
+	int                     pool_max_lifetime;
+
+	/* IO callbacks, either using the 'native mcon' or external hooks (i.e. PHP Streams).
+	 * They report to mongo_connection_io_sent(), mongo_connection_io_received()
+	 * and mongo_manager_server_failed(), which is where the connection's
+	 * round trip times and health come from. */
 	void* (*connect)     (struct _mongo_con_manager *manager, mongo_server_def *server, mongo_server_options *options, char **error_message);
 	int   (*recv_header) (mongo_connection *con, mongo_server_options *options, int timeout, void *data, int size, char **error_message);
 	int   (*recv_data)   (mongo_connection *con, mongo_server_options *options, int timeout, void *data, int size, char **error_message);
 	int   (*send)        (mongo_connection *con, mongo_server_options *options, void *data, int size, char **error_message);
+	int   (*sendv)       (mongo_connection *con, mongo_server_options *options, struct iovec *iov, int count, char **error_message);
 	void  (*close)       (mongo_connection *con, int why);
 	void  (*forget)      (struct _mongo_con_manager *manager, mongo_connection *con);
 	int   (*authenticate)(struct _mongo_con_manager *manager, mongo_connection *con, mongo_server_options *options, mongo_server_def *server_def, char **error_message);
 
+	/* The descriptor to poll() for a reply on con, or -1 if the transport
+	 * can't be waited on that way, or already has data, see multi.c. May be
+	 * NULL. */
+	int   (*poll_fd)     (mongo_connection *con);
+
 	/* Check if a wire version supported */
 	int (*supports_wire_version) (int min_wire_version, int max_wire_version, char **error_message);
 } mongo_con_manager;
@@ -17,8 +17,10 @@
 #include <stdio.h>
 #include <string.h>
 #include <sys/types.h>
+#include <sys/time.h>
 #ifndef WIN32
 #include <unistd.h>
+#include <pthread.h>
 #endif
 #include "types.h"
 #include "utils.h"
@@ -42,54 +44,318 @@ char *mongo_server_create_hashed_password(char *username, char *password)
 	return hash;
 }
 
+/* Returns the process ID, without a system call. The cached value is updated
+ * in the child after a fork(). */
+static pthread_once_t mongo_pid_once = PTHREAD_ONCE_INIT;
+static volatile int   mongo_pid = 0;
+
+static void mongo_pid_update(void)
+{
+	mongo_pid = getpid();
+}
+
+static void mongo_pid_init(void)
+{
+	mongo_pid_update();
+	pthread_atfork(NULL, NULL, mongo_pid_update);
+}
+
+int mongo_current_pid(void)
+{
+	pthread_once(&mongo_pid_once, mongo_pid_init);
+	return mongo_pid;
+}
+
+int64_t mongo_now_ms(void)
+{
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	return now.tv_sec * 1000LL + now.tv_usec / 1000;
+}
+
+/* A xorshift64* generator for every thread, so that picking servers doesn't
+ * contend on the lock that libc's rand() takes */
+static __thread uint64_t mongo_random_state = 0;
+
+uint32_t mongo_random(void)
+{
+	uint64_t x = mongo_random_state;
+
+	if (!x) {
+		struct timeval tv;
+		void          *self = &mongo_random_state;
+
+		gettimeofday(&tv, NULL);
+		x = mongo_digest_update(MONGO_DIGEST_INIT, &tv, sizeof(tv));
+		x = mongo_digest_update(x, &self, sizeof(self));
+		if (!x) {
+			x = 1;
+		}
+	}
+
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	mongo_random_state = x;
+
+	return (uint32_t)((x * 2685821657736338717ULL) >> 32);
+}
+
 /* Hash format is:
  * - HOST:PORT;-;.;PID (with the - being the replica set name and the . a placeholder for credentials)
  * or:
  * - HOST:PORT;REPLSETNAME;DB/USERNAME/md5(PID,PASSWORD,USERNAME);PID */
-
-/* Creates a unique hash for a server def with some info from the server config,
- * but also with the PID to make sure forking works */
-char *mongo_server_create_hash(mongo_server_def *server_def)
+static char *mongo_server_id_create_hash(mongo_server_id *id)
 {
-	char *tmp, *hash;
+	char *tmp;
 	int   size = 0;
 
 	/* Host (string) and port (max 5 digits) + 2 separators */
-	size += strlen(server_def->host) + 1 + 5 + 1;
+	size += strlen(id->host) + 1 + 5 + 1;
 
 	/* Replica set name */
-	if (server_def->repl_set_name) {
-		size += strlen(server_def->repl_set_name) + 1;
+	if (id->repl_set_name) {
+		size += strlen(id->repl_set_name) + 1;
 	}
 
 	/* Database, username and hashed password */
-	if (server_def->db && server_def->username && server_def->password) {
-		hash = mongo_server_create_hashed_password(server_def->username, server_def->password);
-		size += strlen(server_def->db) + 1 + strlen(server_def->username) + 1 + strlen(hash) + 1;
+	if (id->auth_hash) {
+		size += strlen(id->db) + 1 + strlen(id->username) + 1 + strlen(id->auth_hash) + 1;
 	}
 
-	/* PID (assume max size, a signed 32bit int) */
-	size += 10;
+	/* PID (assume max size, a signed 32bit int) + placeholders */
+	size += 10 + 4;
 
 	/* Allocate and fill */
 	tmp = malloc(size);
-	sprintf(tmp, "%s:%d;", server_def->host, server_def->port);
-	if (server_def->repl_set_name) {
-		sprintf(tmp + strlen(tmp), "%s;", server_def->repl_set_name);
+	sprintf(tmp, "%s:%d;", id->host, id->port);
+	if (id->repl_set_name) {
+		sprintf(tmp + strlen(tmp), "%s;", id->repl_set_name);
 	} else {
 		sprintf(tmp + strlen(tmp), "-;");
 	}
-	if (server_def->db && server_def->username && server_def->password) {
-		sprintf(tmp + strlen(tmp), "%s/%s/%s;", server_def->db, server_def->username, hash);
-		free(hash);
+	if (id->auth_hash) {
+		sprintf(tmp + strlen(tmp), "%s/%s/%s;", id->db, id->username, id->auth_hash);
 	} else {
 		sprintf(tmp + strlen(tmp), ".;");
 	}
-	sprintf(tmp + strlen(tmp), "%d", getpid());
+	sprintf(tmp + strlen(tmp), "%d", id->pid);
 
 	return tmp;
 }
 
+/* Server identities are interned in a process wide table. There is one for
+ * every server and set of credentials that the process uses, which the
+ * server definitions and connections that use it hold a reference on; it's
+ * removed from the table and freed with the last one, so the table never
+ * holds more than what is in use. Only the salted hash of the password is
+ * kept. */
+#define MONGO_SERVER_ID_BUCKETS 256
+
+static mongo_server_id *mongo_server_ids[MONGO_SERVER_ID_BUCKETS];
+static pthread_mutex_t  mongo_server_ids_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t mongo_digest_string(uint64_t digest, const char *str)
+{
+	/* Include the terminating NUL, so that "ab","c" and "a","bc" differ */
+	if (!str) {
+		return mongo_digest_update(digest, "\xff", 1);
+	}
+	return mongo_digest_update(digest, str, strlen(str) + 1);
+}
+
+static int mongo_string_equal(const char *a, const char *b)
+{
+	if (!a || !b) {
+		return a == b;
+	}
+	return strcmp(a, b) == 0;
+}
+
+/* The credentials are only part of the identity when all of them are set */
+static int mongo_server_def_has_credentials(mongo_server_def *server_def)
+{
+	return server_def->db && server_def->username && server_def->password;
+}
+
+/* The password is left out, as the digest is kept in the identity */
+static uint64_t mongo_server_def_digest(mongo_server_def *server_def, int pid)
+{
+	uint64_t digest = MONGO_DIGEST_INIT;
+
+	digest = mongo_digest_string(digest, server_def->host);
+	digest = mongo_digest_update(digest, &server_def->port, sizeof(server_def->port));
+	digest = mongo_digest_string(digest, server_def->repl_set_name);
+	if (mongo_server_def_has_credentials(server_def)) {
+		digest = mongo_digest_string(digest, server_def->db);
+		digest = mongo_digest_string(digest, server_def->username);
+	}
+	digest = mongo_digest_update(digest, &pid, sizeof(pid));
+
+	return digest;
+}
+
+/* Compares all fields, and not just the digest, so that a digest collision
+ * can't hand out a connection that authenticated with other credentials. The
+ * password is hashed into auth_hash when there is an identity to compare it
+ * with, and is kept for the caller. Must be called with the lock held. */
+static mongo_server_id *mongo_server_id_find(mongo_server_id *id, mongo_server_def *server_def, int pid, uint64_t digest, char **auth_hash)
+{
+	int with_credentials = mongo_server_def_has_credentials(server_def);
+
+	for (; id; id = id->next) {
+		if (
+			id->digest != digest ||
+			id->pid != pid ||
+			id->port != server_def->port ||
+			!mongo_string_equal(id->host, server_def->host) ||
+			!mongo_string_equal(id->repl_set_name, server_def->repl_set_name)
+		) {
+			continue;
+		}
+
+		if (!with_credentials) {
+			if (id->auth_hash == NULL) {
+				return id;
+			}
+			continue;
+		}
+
+		if (!id->auth_hash || !mongo_string_equal(id->db, server_def->db) || !mongo_string_equal(id->username, server_def->username)) {
+			continue;
+		}
+		if (!*auth_hash) {
+			*auth_hash = mongo_server_create_hashed_password(server_def->username, server_def->password);
+		}
+		if (strcmp(id->auth_hash, *auth_hash) == 0) {
+			return id;
+		}
+	}
+
+	return NULL;
+}
+
+/* Takes over auth_hash */
+static mongo_server_id *mongo_server_id_create(mongo_server_def *server_def, int pid, uint64_t digest, char *auth_hash)
+{
+	mongo_server_id *id;
+
+	id = (mongo_server_id *)calloc(1, sizeof(mongo_server_id));
+	id->host = strdup(server_def->host);
+	id->port = server_def->port;
+	id->repl_set_name = server_def->repl_set_name ? strdup(server_def->repl_set_name) : NULL;
+	if (mongo_server_def_has_credentials(server_def)) {
+		id->db = strdup(server_def->db);
+		id->username = strdup(server_def->username);
+		id->auth_hash = auth_hash ? auth_hash : mongo_server_create_hashed_password(server_def->username, server_def->password);
+	}
+	id->pid = pid;
+	id->digest = digest;
+
+	id->address = malloc(strlen(id->host) + 1 + 11 + 1);
+	sprintf(id->address, "%s:%d", id->host, id->port);
+	id->hash = mongo_server_id_create_hash(id);
+	id->key = mongo_server_hash_key(id->hash);
+
+	return id;
+}
+
+static void mongo_server_id_free(mongo_server_id *id)
+{
+	free(id->host);
+	free(id->repl_set_name);
+	free(id->db);
+	free(id->username);
+	free(id->auth_hash);
+	free(id->address);
+	free(id->hash);
+	free(id);
+}
+
+void mongo_server_id_addref(mongo_server_id *id)
+{
+	pthread_mutex_lock(&mongo_server_ids_lock);
+	id->refcount++;
+	pthread_mutex_unlock(&mongo_server_ids_lock);
+}
+
+void mongo_server_id_release(mongo_server_id *id)
+{
+	mongo_server_id **ptr;
+
+	pthread_mutex_lock(&mongo_server_ids_lock);
+	if (--id->refcount > 0) {
+		pthread_mutex_unlock(&mongo_server_ids_lock);
+		return;
+	}
+
+	for (ptr = &mongo_server_ids[id->digest % MONGO_SERVER_ID_BUCKETS]; *ptr; ptr = &(*ptr)->next) {
+		if (*ptr == id) {
+			*ptr = id->next;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&mongo_server_ids_lock);
+
+	mongo_server_id_free(id);
+}
+
+/* Returns the interned identity for the server definition, which holds a
+ * reference on it. Only the first lookup for a definition (in each process)
+ * computes anything; the identity is cached in the definition, and only
+ * needs to be looked up again if its fields change, see
+ * mongo_server_def_reset_id(). */
+mongo_server_id *mongo_server_def_id(mongo_server_def *server_def)
+{
+	mongo_server_id *id = server_def->id;
+	uint64_t         digest;
+	char            *auth_hash = NULL;
+	int              pid = mongo_current_pid();
+	int              bucket;
+
+	if (id && id->pid == pid) {
+		return id;
+	}
+	mongo_server_def_reset_id(server_def);
+
+	digest = mongo_server_def_digest(server_def, pid);
+	bucket = digest % MONGO_SERVER_ID_BUCKETS;
+
+	pthread_mutex_lock(&mongo_server_ids_lock);
+	id = mongo_server_id_find(mongo_server_ids[bucket], server_def, pid, digest, &auth_hash);
+	if (!id) {
+		id = mongo_server_id_create(server_def, pid, digest, auth_hash);
+		auth_hash = NULL;
+		id->next = mongo_server_ids[bucket];
+		mongo_server_ids[bucket] = id;
+	}
+	id->refcount++;
+	pthread_mutex_unlock(&mongo_server_ids_lock);
+
+	free(auth_hash);
+	server_def->id = id;
+	return id;
+}
+
+/* Drops the definition's cached identity, which has to happen whenever the
+ * fields it is made from change */
+void mongo_server_def_reset_id(mongo_server_def *server_def)
+{
+	if (server_def->id) {
+		mongo_server_id_release(server_def->id);
+		server_def->id = NULL;
+	}
+}
+
+/* Creates a unique hash for a server def with some info from the server config,
+ * but also with the PID to make sure forking works. The caller has to free it;
+ * use mongo_server_def_id() to get to it without a copy. */
+char *mongo_server_create_hash(mongo_server_def *server_def)
+{
+	return strdup(mongo_server_def_id(server_def)->hash);
+}
+
 /* Split a hash back into its constituent parts */
 int mongo_server_split_hash(char *hash, char **host, int *port, char **repl_set_name, char **database, char **username, char **auth_hash, int *pid)
 {
@@ -174,6 +440,36 @@ int mongo_server_hash_to_pid(char *hash)
 	return atoi(ptr+1);
 }
 
+/* Returns the 64-bit key (FNV-1a) that the manager uses to index the hash in
+ * its connection and blacklist tables */
+uint64_t mongo_server_hash_key(char *hash)
+{
+	uint64_t key = 14695981039346656037ULL;
+
+	while (*hash) {
+		key ^= (unsigned char) *hash;
+		key *= 1099511628211ULL;
+		hash++;
+	}
+
+	return key;
+}
+
+/* Adds length bytes of data to a 64-bit FNV-1a digest, which has to start
+ * out as MONGO_DIGEST_INIT */
+uint64_t mongo_digest_update(uint64_t digest, const void *data, int length)
+{
+	const unsigned char *ptr = (const unsigned char *)data;
+	int                  i;
+
+	for (i = 0; i < length; i++) {
+		digest ^= ptr[i];
+		digest *= 1099511628211ULL;
+	}
+
+	return digest;
+}
+
 
 /*
  * Local variables:
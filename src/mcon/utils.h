@@ -24,9 +24,20 @@ extern "C" {
 
 char *mongo_server_create_hashed_password(char *username, char *password);
 char *mongo_server_create_hash(mongo_server_def *server_def);
+mongo_server_id *mongo_server_def_id(mongo_server_def *server_def);
+void mongo_server_def_reset_id(mongo_server_def *server_def);
+void mongo_server_id_addref(mongo_server_id *id);
+void mongo_server_id_release(mongo_server_id *id);
+int mongo_current_pid(void);
+uint32_t mongo_random(void);
+int64_t mongo_now_ms(void);
 int mongo_server_split_hash(char *hash, char **host, int *port, char **repl_set_name, char **database, char **username, char **auth_hash, int *pid);
 char *mongo_server_hash_to_server(char *hash);
 int mongo_server_hash_to_pid(char *hash);
+uint64_t mongo_server_hash_key(char *hash);
+
+#define MONGO_DIGEST_INIT 14695981039346656037ULL
+uint64_t mongo_digest_update(uint64_t digest, const void *data, int length);
 
 #if defined(__cplusplus)
 }
@@ -5,3 +5,47 @@
 
 $mongo = new MongoClient('');
 var_dump($mongo);
+
+async function gen_ping(MongoDB $db) {
+    return await $db->genCommand(array('ping' => 1));
+}
+
+$db = new MongoDB($mongo, 'test');
+var_dump(gen_ping($db)->join());
+var_dump((new MongoCollection($db, 'test'))->genFindOne()->join());
+
+async function gen_insert_and_find(MongoCollection $collection) {
+    $inserted = await $collection->genInsert(array('x' => 1));
+    $found = await $collection->genFind(array('x' => 1), array(), array('batchSize' => 10, 'maxTimeMS' => 1000));
+    return array($inserted['ok'], count($found) > 0);
+}
+
+$collection = new MongoCollection($db, 'test');
+var_dump(gen_insert_and_find($collection)->join());
+try {
+    $db->genCommand(array('ping' => 1), array('timeout' => 100));
+} catch (MongoException $e) {
+    var_dump($e->getMessage());
+}
+
+// Objects whose constructor never ran throw instead of crashing
+$uninitialized = (new ReflectionClass('MongoDB'))->newInstanceWithoutConstructor();
+try {
+    $uninitialized->genCommand(array('ping' => 1));
+} catch (MongoException $e) {
+    var_dump($e->getMessage());
+}
+
+// Pool sizes that don't fit in the manager's are rejected
+try {
+    MongoPool::setSize(PHP_INT_MAX);
+} catch (MongoException $e) {
+    var_dump($e->getMessage());
+}
+
+// Every BSON type that isn't deprecated, decoded and encoded again
+$bson = hex2bin('4801000001646f75626c6500000000000000f83f02737472696e67000700000068c3a96c6c6f0003646f63756d656e74000c0000001061000100000000046172726179001500000002300002000000780010310002000000000562696e617279000300000000616263056f6c642062696e6172790007000000020300000061626307696400507f1f77bcf86cd79943901108626f6f6c00010964617465007b38202149010000096f6c6420646174650024faffffffffffff0a6e756c6c000b7265676578005e612e2a00696d000d636f6465000a00000072657475726e20313b000f636f646520776974682073636f7065001e0000000a00000072657475726e20783b000c000000107800010000000010696e74333200f9ffffff1174696d657374616d70000300000000d3415412696e743634000000000000010000ff6d696e007f6d61780000');
+var_dump(bson_encode(bson_decode($bson)) === $bson);
+var_dump(bson_encode(bson_decode($bson, true)) === $bson);
+$lazy = bson_decode($bson, true);
+var_dump(bson_encode(array('array' => $lazy['array'])) === bson_encode(array('array' => array('x', 2))));